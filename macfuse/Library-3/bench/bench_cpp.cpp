@@ -0,0 +1,185 @@
+/*
+ * C operations table against the C++ binding
+ *
+ * The same trivial filesystem is written twice: as free functions in a
+ * struct fuse3_operations that find their state through
+ * fuse3_get_context()->private_data, and as a fuse3cpp::Filesystem<> whose
+ * members the binding calls directly. Both are called through the v2
+ * wrappers that fuse3_new() would install. Nothing is mounted: the benchmark
+ * provides its own fuse_get_context().
+ *
+ * Usage: bench_cpp [iterations]
+ */
+
+extern "C" {
+#include "../fuse3_i.h"
+}
+#include "../fuse3.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+static struct fuse_context bench_context;
+
+/* Stands in for the libfuse per-request context */
+extern "C" struct fuse_context *fuse_get_context(void)
+{
+    return &bench_context;
+}
+
+struct null_state {
+    uint64_t fh;
+    unsigned long calls;
+};
+
+static struct null_state *c_state(void)
+{
+    return static_cast<struct null_state *>(fuse3_get_context()->private_data);
+}
+
+static int c_open(const char *, struct fuse3_file_info *fi)
+{
+    fi->fh = c_state()->fh;
+    return 0;
+}
+
+static int c_read(const char *, char *, size_t size, off_t, struct fuse3_file_info *fi)
+{
+    struct null_state *state = c_state();
+    state->calls++;
+    return fi->fh == state->fh ? (int)size : -EBADF;
+}
+
+static int c_write(const char *, const char *, size_t size, off_t, struct fuse3_file_info *fi)
+{
+    struct null_state *state = c_state();
+    state->calls++;
+    return fi->fh == state->fh ? (int)size : -EBADF;
+}
+
+static int c_release(const char *, struct fuse3_file_info *)
+{
+    return 0;
+}
+
+static struct fuse3_operations c_oper;
+
+class NullFs : public fuse3cpp::Filesystem<NullFs> {
+public:
+    struct null_state state = { 42, 0 };
+
+    int open(const char *, struct fuse3_file_info *fi)
+    {
+        fi->fh = state.fh;
+        return 0;
+    }
+
+    int read(const char *, char *, size_t size, off_t, struct fuse3_file_info *fi)
+    {
+        state.calls++;
+        return fi->fh == state.fh ? (int)size : -EBADF;
+    }
+
+    int write(const char *, const char *, size_t size, off_t, struct fuse3_file_info *fi)
+    {
+        state.calls++;
+        return fi->fh == state.fh ? (int)size : -EBADF;
+    }
+
+    static int release(const char *, struct fuse3_file_info *)
+    {
+        return 0;
+    }
+};
+
+static double now_ns(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+/* Times read and write through the wrappers for one table; 0 on success */
+static int run(const char *name, const struct fuse3_operations *oper, void *user_data,
+               unsigned long iterations, double *read_ns, double *write_ns)
+{
+    static char buf[4096];
+    struct fuse3_internal internal;
+    struct fuse_operations ops2;
+    struct fuse_file_info fi2;
+    double start;
+    long sum = 0;
+    unsigned long i;
+
+    memset(&internal, 0, sizeof(internal));
+    internal.ops3 = oper;
+    internal.user_data = user_data;
+    if (fuse3_stats_init(&internal) != 0) {
+        fprintf(stderr, "failed to allocate statistics\n");
+        return -1;
+    }
+    fuse3_stats_thread_enter(&internal);
+    bench_context.private_data = &internal;
+    fuse3_fill_operations(oper, &ops2);
+
+    memset(&fi2, 0, sizeof(fi2));
+    if (ops2.open("/file", &fi2) != 0) {
+        fprintf(stderr, "%s: open through the wrappers failed\n", name);
+        return -1;
+    }
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        sum += ops2.read("/file", buf, sizeof(buf), i * sizeof(buf), &fi2);
+    *read_ns = (now_ns() - start) / iterations;
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        sum += ops2.write("/file", buf, sizeof(buf), i * sizeof(buf), &fi2);
+    *write_ns = (now_ns() - start) / iterations;
+    ops2.release("/file", &fi2);
+
+    fuse3_stats_thread_leave(&internal);
+    fuse3_stats_destroy(&internal);
+    if (sum != (long)(2 * iterations * sizeof(buf))) {
+        fprintf(stderr, "%s: file handle did not round-trip\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 10000000;
+    struct null_state c_data = { 42, 0 };
+    NullFs fs;
+    const struct fuse3_operations &cpp_oper = NullFs::operations();
+    double c_read_ns, c_write_ns, cpp_read_ns, cpp_write_ns;
+
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 10);
+
+    c_oper.open = c_open;
+    c_oper.read = c_read;
+    c_oper.write = c_write;
+    c_oper.release = c_release;
+
+    /* Only what NullFs defines is registered */
+    if (!cpp_oper.open || !cpp_oper.read || !cpp_oper.write || !cpp_oper.release ||
+        cpp_oper.getattr || cpp_oper.read_buf || cpp_oper.init || cpp_oper.destroy) {
+        fprintf(stderr, "operations table does not match the members of NullFs\n");
+        return 1;
+    }
+
+    if (run("C", &c_oper, &c_data, iterations, &c_read_ns, &c_write_ns) != 0 ||
+        run("C++", &cpp_oper, &fs, iterations, &cpp_read_ns, &cpp_write_ns) != 0)
+        return 1;
+    if (c_data.calls != 2 * iterations || fs.state.calls != 2 * iterations) {
+        fprintf(stderr, "calls did not reach the filesystem\n");
+        return 1;
+    }
+
+    printf("%-8s %12s %12s %12s\n", "op", "C table ns", "C++ ns", "saved ns");
+    printf("%-8s %12.2f %12.2f %12.2f\n", "read", c_read_ns, cpp_read_ns, c_read_ns - cpp_read_ns);
+    printf("%-8s %12.2f %12.2f %12.2f\n", "write", c_write_ns, cpp_write_ns, c_write_ns - cpp_write_ns);
+    return 0;
+}
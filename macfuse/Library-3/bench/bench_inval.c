@@ -0,0 +1,199 @@
+/*
+ * Invalidation benchmark for the FUSE v3 compatibility layer
+ *
+ * Mounts a filesystem holding one file whose size a background thread
+ * bumps every few milliseconds, and stat()s the file as fast as possible
+ * from the main thread. Reports stats/sec, getattr upcalls/sec (from
+ * fuse3_get_stats()) and the share of stats that saw an outdated size, for:
+ *
+ *   short      attr_timeout=0, every stat is an upcall
+ *   long       attr_timeout=3600, no invalidation: cheap but stale
+ *   long+inval attr_timeout=3600, fuse3_invalidate_path() on every change
+ *
+ * Usage: bench_inval <mountpoint> [seconds-per-run] [change-interval-ms]
+ */
+
+#include "../fuse3.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mount.h>
+
+static const char *bench_path = "/file";
+
+static struct {
+    struct fuse3 *fuse;
+    volatile int stop;
+    int invalidate;
+    unsigned int interval_ms;
+    off_t version;
+    unsigned long changes;
+    unsigned long inval_errors;
+} bench;
+
+static double now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int bench_getattr(const char *path, struct stat *stbuf, struct fuse3_file_info *fi)
+{
+    (void) fi;
+    memset(stbuf, 0, sizeof(struct stat));
+    if (strcmp(path, "/") == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else if (strcmp(path, bench_path) == 0) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = __atomic_load_n(&bench.version, __ATOMIC_ACQUIRE);
+    } else {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+static const struct fuse3_operations bench_oper = {
+    .getattr = bench_getattr,
+};
+
+static void *bench_loop_main(void *data)
+{
+    (void) data;
+    fuse3_loop_mt(bench.fuse, NULL);
+    return NULL;
+}
+
+/* Changes the file behind the kernel's back */
+static void *bench_mutator_main(void *data)
+{
+    (void) data;
+    while (!bench.stop) {
+        usleep(bench.interval_ms * 1000);
+        __atomic_add_fetch(&bench.version, 1, __ATOMIC_RELEASE);
+        bench.changes++;
+        if (bench.invalidate) {
+            int res = fuse3_invalidate_path(bench.fuse, bench_path);
+            if (res < 0 && res != -ENOENT)
+                bench.inval_errors++;
+        }
+    }
+    return NULL;
+}
+
+static int bench_unmount(const char *mountpoint)
+{
+#ifdef __APPLE__
+    return unmount(mountpoint, 0);
+#else
+    return umount(mountpoint);
+#endif
+}
+
+static int bench_run(const char *label, const char *mountpoint, const char *timeout,
+                     int invalidate, unsigned int interval_ms, double seconds)
+{
+    char opts[128];
+    char *argv[] = { "bench_inval", "-o", opts };
+    struct fuse3_args args = { 3, argv, 0 };
+    struct fuse3_stats stats;
+    pthread_t loop_id, mutator_id;
+    char file[4096];
+    unsigned long ops = 0, stale = 0;
+    uint64_t getattrs;
+    double start, elapsed;
+    struct stat st;
+
+    snprintf(opts, sizeof(opts), "attr_timeout=%s,entry_timeout=%s", timeout, timeout);
+    snprintf(file, sizeof(file), "%s%s", mountpoint, bench_path);
+
+    memset(&bench, 0, sizeof(bench));
+    bench.interval_ms = interval_ms;
+    bench.invalidate = invalidate;
+    bench.fuse = fuse3_new(&args, &bench_oper, sizeof(bench_oper), NULL);
+    if (!bench.fuse)
+        return -EIO;
+    if (fuse3_mount(bench.fuse, mountpoint) != 0) {
+        fuse3_destroy(bench.fuse);
+        return -EIO;
+    }
+    if (pthread_create(&loop_id, NULL, bench_loop_main, NULL) != 0) {
+        fuse3_destroy(bench.fuse);
+        return -EAGAIN;
+    }
+
+    /* Wait for the mount to come up */
+    while (stat(file, &st) == -1)
+        usleep(10000);
+    fuse3_get_stats(bench.fuse, &stats);
+    getattrs = stats.ops[FUSE3_OP_GETATTR].calls;
+
+    pthread_create(&mutator_id, NULL, bench_mutator_main, NULL);
+    start = now_sec();
+    while ((elapsed = now_sec() - start) < seconds) {
+        off_t version = __atomic_load_n(&bench.version, __ATOMIC_ACQUIRE);
+        if (stat(file, &st) == -1)
+            break;
+        /* A change that landed before the stat began should be visible */
+        if (st.st_size < version)
+            stale++;
+        ops++;
+    }
+    bench.stop = 1;
+    pthread_join(mutator_id, NULL);
+
+    fuse3_get_stats(bench.fuse, &stats);
+    getattrs = stats.ops[FUSE3_OP_GETATTR].calls - getattrs;
+    printf("%-12s %12.0f %14.0f %10.0f %8.2f%%\n", label, ops / elapsed, getattrs / elapsed,
+           bench.changes / elapsed, ops ? 100.0 * stale / ops : 0.0);
+    if (bench.inval_errors)
+        fprintf(stderr, "%s: %lu invalidations failed\n", label, bench.inval_errors);
+
+    bench_unmount(mountpoint);
+    pthread_join(loop_id, NULL);
+    fuse3_destroy(bench.fuse);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 5.0;
+    unsigned int interval_ms = 10;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <mountpoint> [seconds-per-run] [change-interval-ms]\n",
+                argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        seconds = atof(argv[2]);
+    if (argc > 3)
+        interval_ms = (unsigned int)atoi(argv[3]);
+
+    printf("%-12s %12s %14s %10s %9s\n", "mode", "stats/sec", "getattrs/sec", "changes/s", "stale");
+    struct {
+        const char *label;
+        const char *timeout;
+        int invalidate;
+    } runs[] = {
+        { "short", "0", 0 },
+        { "long", "3600", 0 },
+        { "long+inval", "3600", 1 },
+    };
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        int res = bench_run(runs[i].label, argv[1], runs[i].timeout, runs[i].invalidate,
+                            interval_ms, seconds);
+        if (res < 0) {
+            fprintf(stderr, "%s: %s\n", runs[i].label, strerror(-res));
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Thread-scaling benchmark for a mounted FUSE filesystem
+ *
+ * Runs 1, 2, 4, 8 and 16 concurrent clients against a file inside the mount
+ * and reports the aggregate ops/sec for each. One op is open + pread + close,
+ * each of which is an upcall into the filesystem (open and release always
+ * are, reads as long as the file is mounted with direct_io or the page cache
+ * is cold).
+ *
+ * Usage: bench_mt <file-in-mount> [seconds-per-step] [max-clients]
+ *
+ * Compare a mount running with -s against the default multithreaded loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+struct bench_client {
+    pthread_t thread_id;
+    const char *path;
+    volatile int *stop;
+    unsigned long ops;
+    int error;
+};
+
+static double now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *bench_client_main(void *data)
+{
+    struct bench_client *c = data;
+    char buf[4096];
+
+    while (!*c->stop) {
+        int fd = open(c->path, O_RDONLY);
+        if (fd == -1) {
+            c->error = errno;
+            break;
+        }
+        if (pread(fd, buf, sizeof(buf), 0) == -1) {
+            c->error = errno;
+            close(fd);
+            break;
+        }
+        close(fd);
+        c->ops++;
+    }
+    return NULL;
+}
+
+static int bench_run(const char *path, int nclients, double seconds)
+{
+    struct bench_client *clients = calloc(nclients, sizeof(struct bench_client));
+    volatile int stop = 0;
+    unsigned long total = 0;
+    double start, elapsed;
+    int i, res = 0;
+
+    if (!clients)
+        return -ENOMEM;
+
+    start = now_sec();
+    for (i = 0; i < nclients; i++) {
+        clients[i].path = path;
+        clients[i].stop = &stop;
+        if (pthread_create(&clients[i].thread_id, NULL, bench_client_main,
+                           &clients[i]) != 0) {
+            nclients = i;
+            res = -EAGAIN;
+            break;
+        }
+    }
+
+    usleep((useconds_t)(seconds * 1e6));
+    stop = 1;
+
+    for (i = 0; i < nclients; i++) {
+        pthread_join(clients[i].thread_id, NULL);
+        total += clients[i].ops;
+        if (clients[i].error && !res)
+            res = -clients[i].error;
+    }
+    elapsed = now_sec() - start;
+
+    if (res == 0)
+        printf("%8d %14.0f\n", nclients, total / elapsed);
+    free(clients);
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 5.0;
+    int max_clients = 16;
+    int n;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file-in-mount> [seconds-per-step] [max-clients]\n",
+                argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        seconds = atof(argv[2]);
+    if (argc > 3)
+        max_clients = atoi(argv[3]);
+
+    printf("%8s %14s\n", "clients", "ops/sec");
+    for (n = 1; n <= max_clients; n *= 2) {
+        int res = bench_run(argv[1], n, seconds);
+        if (res < 0) {
+            fprintf(stderr, "%d clients: %s\n", n, strerror(-res));
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Native disk throughput against the same directory through the
+# compatibility layer: runs bench/passthrough.fio on <source>, then mounts
+# <source> at <mountpoint> with passthrough_fuse3 and runs it again there.
+# PASSTHROUGH lists the binaries to mount in turn, by default
+# ./passthrough_fuse3.
+#
+# Usage: bench/bench_passthrough.sh <source> <mountpoint> [passthrough options]
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <source> <mountpoint> [passthrough options]" >&2
+    exit 1
+fi
+source=$(cd "$1" && pwd -P)
+mountpoint=$(cd "$2" && pwd -P)
+shift 2
+jobs=$(dirname "$0")/passthrough.fio
+
+run() {
+    echo "== $1"
+    DIR=$2 fio "$jobs" | grep -E '^[a-z0-9-]+: \(groupid|IOPS='
+}
+
+run native "$source"
+
+pid=
+unmount() {
+    umount "$mountpoint" 2>/dev/null || fusermount -u "$mountpoint" 2>/dev/null ||
+        fusermount3 -u "$mountpoint"
+    wait $pid
+    pid=
+}
+trap '[ -z "$pid" ] || unmount' EXIT
+
+for fs in ${PASSTHROUGH:-./passthrough_fuse3}; do
+    "$fs" "$@" "$source" "$mountpoint" &
+    pid=$!
+    tries=0
+    until mount | grep -q " $mountpoint "; do
+        tries=$((tries + 1))
+        if [ $tries -gt 50 ] || ! kill -0 $pid 2>/dev/null; then
+            echo "$mountpoint did not come up" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+
+    run "$(basename "$fs")" "$mountpoint"
+    unmount
+done
+rm -f "$source/fio.data"
@@ -0,0 +1,721 @@
+/*
+ * Trace replay benchmark for the FUSE v3 compatibility layer
+ *
+ * Replays an operation trace, recorded on a live mount with
+ * -o trace_record=FILE or generated here, against a fuse3_operations table
+ * twice: calling the operations directly, then through the v2 wrappers that
+ * fuse3_new() would install. Reports the cost of each kind of operation
+ * both ways and the difference, which is what the compatibility layer
+ * adds. Nothing is mounted: the benchmark provides its own
+ * fuse_get_context(), so it runs on any machine the library builds on.
+ *
+ * The operations replayed are those of a do-nothing filesystem. To replay
+ * against a real one, link an object that defines
+ * bench_replay_operations() returning its table (make bench REPLAY_FS=fs.o).
+ *
+ * Usage: bench_replay [-t] [-n] <trace>
+ *        bench_replay -g <trace> [operations]
+ *
+ *   -t  keep the recorded inter-arrival times instead of replaying flat out
+ *   -n  replay the wrappers with -o no_readdirplus
+ *   -g  write a synthetic trace of a small tree being browsed, read and written
+ */
+
+#include "../fuse3_i.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static struct fuse_context bench_context;
+
+/* Stands in for the libfuse per-request context */
+struct fuse_context *fuse_get_context(void)
+{
+    return &bench_context;
+}
+
+/* Do-nothing filesystem: a directory of 1 MiB files that accepts everything */
+
+static int null_getattr(const char *path, struct stat *stbuf, struct fuse3_file_info *fi)
+{
+    (void) fi;
+    memset(stbuf, 0, sizeof(struct stat));
+    if (strcmp(path, "/") == 0 || strncmp(path, "/dir", 4) == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 1 << 20;
+    }
+    return 0;
+}
+
+static int null_readlink(const char *path, char *buf, size_t size)
+{
+    (void) path;
+    if (size)
+        buf[0] = '\0';
+    return 0;
+}
+
+static int null_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    (void) path;
+    (void) mode;
+    (void) rdev;
+    return 0;
+}
+
+static int null_mkdir(const char *path, mode_t mode)
+{
+    (void) path;
+    (void) mode;
+    return 0;
+}
+
+static int null_unlink(const char *path)
+{
+    (void) path;
+    return 0;
+}
+
+static int null_truncate(const char *path, off_t size, struct fuse3_file_info *fi)
+{
+    (void) path;
+    (void) size;
+    (void) fi;
+    return 0;
+}
+
+static int null_open(const char *path, struct fuse3_file_info *fi)
+{
+    (void) path;
+    fi->fh = 42;
+    return 0;
+}
+
+static int null_create(const char *path, mode_t mode, struct fuse3_file_info *fi)
+{
+    (void) path;
+    (void) mode;
+    fi->fh = 42;
+    return 0;
+}
+
+static int null_read(const char *path, char *buf, size_t size, off_t offset,
+                     struct fuse3_file_info *fi)
+{
+    (void) path;
+    (void) buf;
+    (void) offset;
+    return fi->fh == 42 ? (int)size : -EBADF;
+}
+
+static int null_write(const char *path, const char *buf, size_t size,
+                      off_t offset, struct fuse3_file_info *fi)
+{
+    (void) path;
+    (void) buf;
+    (void) offset;
+    return fi->fh == 42 ? (int)size : -EBADF;
+}
+
+static int null_release(const char *path, struct fuse3_file_info *fi)
+{
+    (void) path;
+    (void) fi;
+    return 0;
+}
+
+static int null_readdir(const char *path, void *buf, fuse3_fill_dir_t filler,
+                        off_t offset, struct fuse3_file_info *fi,
+                        enum fuse3_readdir_flags flags)
+{
+    static const char *const names[] = { ".", "..", "a", "b", "c", "d", "e", "f" };
+    struct stat st;
+    size_t i;
+
+    (void) path;
+    (void) fi;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    for (i = (size_t)offset; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (filler(buf, names[i], (flags & FUSE3_READDIR_PLUS) ? &st : NULL, i + 1,
+                   (flags & FUSE3_READDIR_PLUS) ? FUSE3_FILL_DIR_PLUS : 0))
+            break;
+    }
+    return 0;
+}
+
+static const struct fuse3_operations null_oper = {
+    .getattr    = null_getattr,
+    .readlink   = null_readlink,
+    .mknod      = null_mknod,
+    .mkdir      = null_mkdir,
+    .unlink     = null_unlink,
+    .rmdir      = null_unlink,
+    .truncate   = null_truncate,
+    .open       = null_open,
+    .create     = null_create,
+    .read       = null_read,
+    .write      = null_write,
+    .release    = null_release,
+    .readdir    = null_readdir,
+};
+
+__attribute__((weak)) const struct fuse3_operations *bench_replay_operations(void)
+{
+    return &null_oper;
+}
+
+/* Trace loading */
+
+struct replay_op {
+    struct fuse3_trace_record rec;
+    const char *path;
+    int handle;             /* index into the replay's handle table, -1 if none */
+};
+
+struct replay_trace {
+    struct replay_op *ops;
+    size_t count;
+    char *paths;
+    int handles;
+    size_t max_size;
+    unsigned long orphans;  /* records for handles opened before recording started */
+};
+
+#define REPLAY_HANDLE_BUCKETS 4096
+
+struct replay_handle_map {
+    uint64_t key;
+    int handle;
+    struct replay_handle_map *next;
+};
+
+static int replay_opens(uint32_t op)
+{
+    return op == FUSE3_OP_OPEN || op == FUSE3_OP_CREATE || op == FUSE3_OP_OPENDIR;
+}
+
+static int replay_closes(uint32_t op)
+{
+    return op == FUSE3_OP_RELEASE || op == FUSE3_OP_RELEASEDIR;
+}
+
+/*
+ * Recorded handles are the v2 fh values, which get reused once released;
+ * number each open anew so the replay can keep its own file_info per open.
+ */
+static void replay_number_handles(struct replay_trace *t)
+{
+    struct replay_handle_map *buckets[REPLAY_HANDLE_BUCKETS] = { NULL };
+    struct replay_handle_map *m, **mp;
+    size_t i;
+
+    for (i = 0; i < t->count; i++) {
+        struct replay_op *o = &t->ops[i];
+        uint64_t key = o->rec.handle;
+
+        o->handle = -1;
+        if (!key)
+            continue;
+        mp = &buckets[(key >> 4) % REPLAY_HANDLE_BUCKETS];
+        if (replay_opens(o->rec.op)) {
+            m = malloc(sizeof(*m));
+            if (!m)
+                continue;
+            m->key = key;
+            m->handle = o->handle = t->handles++;
+            m->next = *mp;
+            *mp = m;
+            continue;
+        }
+        while (*mp && (*mp)->key != key)
+            mp = &(*mp)->next;
+        if (!*mp) {
+            t->orphans++;
+            continue;
+        }
+        o->handle = (*mp)->handle;
+        if (replay_closes(o->rec.op)) {
+            m = *mp;
+            *mp = m->next;
+            free(m);
+        }
+    }
+    for (i = 0; i < REPLAY_HANDLE_BUCKETS; i++) {
+        while (buckets[i]) {
+            m = buckets[i];
+            buckets[i] = m->next;
+            free(m);
+        }
+    }
+}
+
+static int replay_load(const char *name, struct replay_trace *t)
+{
+    FILE *file = fopen(name, "rb");
+    struct fuse3_trace_record rec;
+    size_t ops_cap = 0, paths_len = 0, paths_cap = 0, i;
+    char magic[8];
+    int res = 0;
+
+    memset(t, 0, sizeof(*t));
+    if (!file)
+        return -errno;
+    if (fread(magic, sizeof(magic), 1, file) != 1 ||
+        memcmp(magic, FUSE3_TRACE_MAGIC, sizeof(magic)) != 0) {
+        fclose(file);
+        return -EINVAL;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, file) == 1) {
+        if (rec.op >= FUSE3_OP_COUNT) {
+            res = -EINVAL;
+            break;
+        }
+        if (t->count == ops_cap) {
+            ops_cap = ops_cap ? ops_cap * 2 : 4096;
+            struct replay_op *ops = realloc(t->ops, ops_cap * sizeof(*ops));
+            if (!ops) {
+                res = -ENOMEM;
+                break;
+            }
+            t->ops = ops;
+        }
+        if (paths_len + rec.path_len + 1 > paths_cap) {
+            paths_cap = (paths_len + rec.path_len + 1) * 2;
+            char *paths = realloc(t->paths, paths_cap);
+            if (!paths) {
+                res = -ENOMEM;
+                break;
+            }
+            t->paths = paths;
+        }
+        if (rec.path_len && fread(t->paths + paths_len, rec.path_len, 1, file) != 1) {
+            res = -EINVAL;
+            break;
+        }
+        t->paths[paths_len + rec.path_len] = '\0';
+        t->ops[t->count].rec = rec;
+        /* Offsets for now, the buffer may still move */
+        t->ops[t->count].path = (const char *)(uintptr_t)paths_len;
+        t->count++;
+        paths_len += rec.path_len + 1;
+        if (rec.size > t->max_size)
+            t->max_size = rec.size;
+    }
+    fclose(file);
+    if (res < 0)
+        return res;
+
+    for (i = 0; i < t->count; i++)
+        t->ops[i].path = t->paths + (uintptr_t)t->ops[i].path;
+    replay_number_handles(t);
+    return 0;
+}
+
+/* Replay */
+
+struct replay_cost {
+    unsigned long count;
+    double ns;
+};
+
+struct replay_state {
+    const struct fuse3_operations *op;
+    struct fuse_operations ops2;
+    struct fuse3_file_info *fi3;
+    struct fuse_file_info *fi2;
+    char *buf;
+    int wrapped;
+    unsigned long skipped;
+};
+
+static int direct_filler(void *buf, const char *name, const struct stat *stbuf,
+                         off_t off, enum fuse3_fill_dir_flags flags)
+{
+    (void) name;
+    (void) stbuf;
+    (void) off;
+    (void) flags;
+    (*(unsigned long *)buf)++;
+    return 0;
+}
+
+static int wrapped_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    (void) name;
+    (void) stbuf;
+    (void) off;
+    (*(unsigned long *)buf)++;
+    return 0;
+}
+
+/* Calls one recorded operation; returns -ENOSYS if it can't be replayed */
+static int replay_direct(struct replay_state *s, const struct replay_op *o)
+{
+    const struct fuse3_operations *op = s->op;
+    struct fuse3_file_info *fi = o->handle >= 0 ? &s->fi3[o->handle] : NULL;
+    struct stat st;
+    unsigned long entries = 0;
+
+    switch (o->rec.op) {
+    case FUSE3_OP_GETATTR:
+        return op->getattr ? op->getattr(o->path, &st, fi) : -ENOSYS;
+    case FUSE3_OP_READLINK:
+        return op->readlink ? op->readlink(o->path, s->buf, o->rec.size) : -ENOSYS;
+    case FUSE3_OP_MKNOD:
+        return op->mknod ? op->mknod(o->path, o->rec.mode, 0) : -ENOSYS;
+    case FUSE3_OP_MKDIR:
+        return op->mkdir ? op->mkdir(o->path, o->rec.mode) : -ENOSYS;
+    case FUSE3_OP_UNLINK:
+        return op->unlink ? op->unlink(o->path) : -ENOSYS;
+    case FUSE3_OP_RMDIR:
+        return op->rmdir ? op->rmdir(o->path) : -ENOSYS;
+    case FUSE3_OP_TRUNCATE:
+        return op->truncate ? op->truncate(o->path, o->rec.offset, fi) : -ENOSYS;
+    case FUSE3_OP_OPEN:
+    case FUSE3_OP_OPENDIR:
+        if (!fi)
+            return -ENOSYS;
+        memset(fi, 0, sizeof(*fi));
+        fi->flags = o->rec.flags;
+        if (o->rec.op == FUSE3_OP_OPEN)
+            return op->open ? op->open(o->path, fi) : 0;
+        return op->opendir ? op->opendir(o->path, fi) : 0;
+    case FUSE3_OP_CREATE:
+        if (!fi || !op->create)
+            return -ENOSYS;
+        memset(fi, 0, sizeof(*fi));
+        fi->flags = o->rec.flags;
+        return op->create(o->path, o->rec.mode, fi);
+    case FUSE3_OP_READ:
+        return fi && op->read ? op->read(o->path, s->buf, o->rec.size, o->rec.offset, fi) : -ENOSYS;
+    case FUSE3_OP_WRITE:
+        return fi && op->write ? op->write(o->path, s->buf, o->rec.size, o->rec.offset, fi) : -ENOSYS;
+    case FUSE3_OP_RELEASE:
+        if (!fi)
+            return -ENOSYS;
+        return op->release ? op->release(o->path, fi) : 0;
+    case FUSE3_OP_READDIR:
+        return fi && op->readdir ? op->readdir(o->path, &entries, direct_filler, o->rec.offset, fi, 0) : -ENOSYS;
+    case FUSE3_OP_RELEASEDIR:
+        if (!fi)
+            return -ENOSYS;
+        return op->releasedir ? op->releasedir(o->path, fi) : 0;
+    default:
+        return -ENOSYS;
+    }
+}
+
+static int replay_wrapped(struct replay_state *s, const struct replay_op *o)
+{
+    const struct fuse_operations *ops2 = &s->ops2;
+    struct fuse_file_info *fi = o->handle >= 0 ? &s->fi2[o->handle] : NULL;
+    struct stat st;
+    unsigned long entries = 0;
+
+    switch (o->rec.op) {
+    case FUSE3_OP_GETATTR:
+        if (fi)
+            return ops2->fgetattr ? ops2->fgetattr(o->path, &st, fi) : -ENOSYS;
+        return ops2->getattr ? ops2->getattr(o->path, &st) : -ENOSYS;
+    case FUSE3_OP_READLINK:
+        return ops2->readlink ? ops2->readlink(o->path, s->buf, o->rec.size) : -ENOSYS;
+    case FUSE3_OP_MKNOD:
+        return ops2->mknod ? ops2->mknod(o->path, o->rec.mode, 0) : -ENOSYS;
+    case FUSE3_OP_MKDIR:
+        return ops2->mkdir ? ops2->mkdir(o->path, o->rec.mode) : -ENOSYS;
+    case FUSE3_OP_UNLINK:
+        return ops2->unlink ? ops2->unlink(o->path) : -ENOSYS;
+    case FUSE3_OP_RMDIR:
+        return ops2->rmdir ? ops2->rmdir(o->path) : -ENOSYS;
+    case FUSE3_OP_TRUNCATE:
+        if (fi)
+            return ops2->ftruncate ? ops2->ftruncate(o->path, o->rec.offset, fi) : -ENOSYS;
+        return ops2->truncate ? ops2->truncate(o->path, o->rec.offset) : -ENOSYS;
+    case FUSE3_OP_OPEN:
+    case FUSE3_OP_OPENDIR:
+        if (!fi)
+            return -ENOSYS;
+        memset(fi, 0, sizeof(*fi));
+        fi->flags = o->rec.flags;
+        if (o->rec.op == FUSE3_OP_OPEN)
+            return ops2->open(o->path, fi);
+        return ops2->opendir(o->path, fi);
+    case FUSE3_OP_CREATE:
+        if (!fi || !ops2->create)
+            return -ENOSYS;
+        memset(fi, 0, sizeof(*fi));
+        fi->flags = o->rec.flags;
+        return ops2->create(o->path, o->rec.mode, fi);
+    case FUSE3_OP_READ:
+        return fi && ops2->read ? ops2->read(o->path, s->buf, o->rec.size, o->rec.offset, fi) : -ENOSYS;
+    case FUSE3_OP_WRITE:
+        return fi && ops2->write ? ops2->write(o->path, s->buf, o->rec.size, o->rec.offset, fi) : -ENOSYS;
+    case FUSE3_OP_RELEASE:
+        return fi ? ops2->release(o->path, fi) : -ENOSYS;
+    case FUSE3_OP_READDIR:
+        return fi && ops2->readdir ? ops2->readdir(o->path, &entries, wrapped_filler, o->rec.offset, fi) : -ENOSYS;
+    case FUSE3_OP_RELEASEDIR:
+        return fi ? ops2->releasedir(o->path, fi) : -ENOSYS;
+    default:
+        return -ENOSYS;
+    }
+}
+
+static void replay_sleep_until(uint64_t deadline)
+{
+    uint64_t now = fuse3_stats_now();
+    if (deadline > now) {
+        struct timespec ts = {
+            .tv_sec = (deadline - now) / 1000000000,
+            .tv_nsec = (deadline - now) % 1000000000,
+        };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Returns the wall time of the whole replay in ns */
+static double replay_run(struct replay_state *s, const struct replay_trace *t, int timed,
+                         struct replay_cost cost[FUSE3_OP_COUNT])
+{
+    uint64_t begin = fuse3_stats_now();
+    size_t i;
+
+    memset(cost, 0, FUSE3_OP_COUNT * sizeof(struct replay_cost));
+    s->skipped = 0;
+    for (i = 0; i < t->count; i++) {
+        const struct replay_op *o = &t->ops[i];
+        if (timed)
+            replay_sleep_until(begin + o->rec.time_ns);
+
+        uint64_t start = fuse3_stats_now();
+        int res = s->wrapped ? replay_wrapped(s, o) : replay_direct(s, o);
+        uint64_t end = fuse3_stats_now();
+        if (res == -ENOSYS) {
+            s->skipped++;
+            continue;
+        }
+        cost[o->rec.op].count++;
+        cost[o->rec.op].ns += end - start;
+    }
+    return fuse3_stats_now() - begin;
+}
+
+/* Synthetic trace: a small tree being listed, stat'ed, read and written */
+
+static uint64_t gen_state = 88172645463325252ULL;
+
+static uint64_t gen_random(void)
+{
+    gen_state ^= gen_state << 13;
+    gen_state ^= gen_state >> 7;
+    gen_state ^= gen_state << 17;
+    return gen_state;
+}
+
+static void gen_record(FILE *file, uint64_t *time_ns, uint32_t op, const char *path,
+                       uint64_t handle, uint64_t size, int64_t offset, uint32_t flags,
+                       uint32_t mode)
+{
+    struct fuse3_trace_record rec = {
+        .handle = handle,
+        .size = size,
+        .offset = offset,
+        .op = op,
+        .flags = flags,
+        .mode = mode,
+        .path_len = (uint32_t)strlen(path),
+    };
+
+    /* About 20us between requests, like a busy but not saturated mount */
+    *time_ns += 10000 + gen_random() % 20000;
+    rec.time_ns = *time_ns;
+    fwrite(&rec, sizeof(rec), 1, file);
+    fwrite(path, rec.path_len, 1, file);
+}
+
+static int replay_generate(const char *name, unsigned long count)
+{
+    FILE *file = fopen(name, "wb");
+    uint64_t time_ns = 0, handle = 0x1000;
+    unsigned long n = 0;
+    char path[64];
+    int i;
+
+    if (!file)
+        return -errno;
+    fwrite(FUSE3_TRACE_MAGIC, 8, 1, file);
+    while (n < count) {
+        unsigned int dice = gen_random() % 100;
+        snprintf(path, sizeof(path), "/dir%u/file%u", (unsigned)(gen_random() % 8),
+                 (unsigned)(gen_random() % 64));
+        handle += 0x40;
+
+        if (dice < 10) {
+            /* ls -l: list the directory, then stat every entry */
+            char dir[16];
+            snprintf(dir, sizeof(dir), "/dir%u", (unsigned)(gen_random() % 8));
+            gen_record(file, &time_ns, FUSE3_OP_OPENDIR, dir, handle, 0, 0, O_RDONLY, 0);
+            gen_record(file, &time_ns, FUSE3_OP_READDIR, dir, handle, 0, 0, 0, 0);
+            gen_record(file, &time_ns, FUSE3_OP_RELEASEDIR, dir, handle, 0, 0, 0, 0);
+            for (i = 0; i < 6; i++) {
+                char entry[32];
+                snprintf(entry, sizeof(entry), "%s/%c", dir, 'a' + i);
+                gen_record(file, &time_ns, FUSE3_OP_GETATTR, entry, 0, 0, 0, 0, 0);
+            }
+            n += 9;
+        } else if (dice < 50) {
+            gen_record(file, &time_ns, FUSE3_OP_GETATTR, path, 0, 0, 0, 0, 0);
+            n++;
+        } else if (dice < 80) {
+            /* Sequential read of the start of the file */
+            gen_record(file, &time_ns, FUSE3_OP_OPEN, path, handle, 0, 0, O_RDONLY, 0);
+            for (i = 0; i < 4; i++)
+                gen_record(file, &time_ns, FUSE3_OP_READ, path, handle, 131072, i * 131072, 0, 0);
+            gen_record(file, &time_ns, FUSE3_OP_RELEASE, path, handle, 0, 0, O_RDONLY, 0);
+            n += 6;
+        } else if (dice < 95) {
+            gen_record(file, &time_ns, FUSE3_OP_OPEN, path, handle, 0, 0, O_WRONLY, 0);
+            for (i = 0; i < 2; i++)
+                gen_record(file, &time_ns, FUSE3_OP_WRITE, path, handle, 65536, i * 65536, 0, 0);
+            gen_record(file, &time_ns, FUSE3_OP_RELEASE, path, handle, 0, 0, O_WRONLY, 0);
+            n += 4;
+        } else {
+            gen_record(file, &time_ns, FUSE3_OP_CREATE, path, handle, 0, 0, O_WRONLY | O_CREAT, 0644);
+            gen_record(file, &time_ns, FUSE3_OP_RELEASE, path, handle, 0, 0, O_WRONLY, 0);
+            gen_record(file, &time_ns, FUSE3_OP_UNLINK, path, 0, 0, 0, 0, 0);
+            n += 3;
+        }
+    }
+    if (fclose(file) != 0)
+        return -errno;
+    printf("wrote %lu operations spanning %.1f ms to %s\n", n, time_ns / 1e6, name);
+    return 0;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-t] [-n] <trace>\n"
+                    "       %s -g <trace> [operations]\n", progname, progname);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_cost direct[FUSE3_OP_COUNT], wrapped[FUSE3_OP_COUNT];
+    struct fuse3_internal internal;
+    struct replay_state s;
+    struct replay_trace t;
+    double direct_wall, wrapped_wall, direct_total = 0, wrapped_total = 0;
+    int timed = 0, no_readdirplus = 0, opt, res;
+    unsigned long direct_skipped;
+
+    while ((opt = getopt(argc, argv, "tng")) != -1) {
+        switch (opt) {
+        case 't':
+            timed = 1;
+            break;
+        case 'n':
+            no_readdirplus = 1;
+            break;
+        case 'g':
+            if (optind >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            res = replay_generate(argv[optind],
+                                  optind + 1 < argc ? strtoul(argv[optind + 1], NULL, 10) : 100000);
+            if (res < 0) {
+                fprintf(stderr, "%s: %s\n", argv[optind], strerror(-res));
+                return 1;
+            }
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    res = replay_load(argv[optind], &t);
+    if (res < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], res == -EINVAL ? "not a trace file" : strerror(-res));
+        return 1;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.op = bench_replay_operations();
+    s.fi3 = calloc(t.handles ? t.handles : 1, sizeof(struct fuse3_file_info));
+    s.fi2 = calloc(t.handles ? t.handles : 1, sizeof(struct fuse_file_info));
+    s.buf = calloc(1, t.max_size ? t.max_size : 1);
+    if (!s.fi3 || !s.fi2 || !s.buf) {
+        fprintf(stderr, "failed to allocate replay state\n");
+        return 1;
+    }
+
+    /* Set up the wrappers the way fuse3_new() would, minus the mount */
+    memset(&internal, 0, sizeof(internal));
+    internal.ops3 = s.op;
+    internal.no_readdirplus = no_readdirplus;
+    if (fuse3_stats_init(&internal) != 0) {
+        fprintf(stderr, "failed to allocate statistics\n");
+        return 1;
+    }
+    if (s.op->readdir && fuse3_cache_init(&internal.cache) != 0) {
+        fprintf(stderr, "failed to allocate attribute cache\n");
+        return 1;
+    }
+    pthread_mutex_init(&internal.auto_cache_lock, NULL);
+    fuse3_stats_thread_enter(&internal);
+    bench_context.private_data = &internal;
+    fuse3_fill_operations(s.op, &s.ops2);
+
+    direct_wall = replay_run(&s, &t, timed, direct);
+    direct_skipped = s.skipped;
+    s.wrapped = 1;
+    wrapped_wall = replay_run(&s, &t, timed, wrapped);
+
+    printf("%-12s %10s %12s %12s %12s\n", "op", "count", "direct ns", "wrapped ns", "overhead ns");
+    for (int op = 0; op < FUSE3_OP_COUNT; op++) {
+        if (!direct[op].count && !wrapped[op].count)
+            continue;
+        double d = direct[op].count ? direct[op].ns / direct[op].count : 0;
+        double w = wrapped[op].count ? wrapped[op].ns / wrapped[op].count : 0;
+        printf("%-12s %10lu %12.1f %12.1f %12.1f\n", fuse3_op_name(op), wrapped[op].count, d, w, w - d);
+        direct_total += direct[op].ns;
+        wrapped_total += wrapped[op].ns;
+    }
+    unsigned long replayed = t.count - s.skipped;
+    if (replayed) {
+        printf("%-12s %10lu %12.1f %12.1f %12.1f\n", "all", replayed, direct_total / replayed,
+               wrapped_total / replayed, (wrapped_total - direct_total) / replayed);
+    }
+    printf("\nreplayed %zu records in %.1f ms direct, %.1f ms wrapped", t.count,
+           direct_wall / 1e6, wrapped_wall / 1e6);
+    if (t.count)
+        printf(" (recorded span %.1f ms)", t.ops[t.count - 1].rec.time_ns / 1e6);
+    printf("\n");
+    if (direct_skipped || s.skipped) {
+        printf("skipped %lu direct, %lu wrapped (not implemented, or handle opened before recording: %lu)\n",
+               direct_skipped, s.skipped, t.orphans);
+    }
+
+    fuse3_stats_thread_leave(&internal);
+    fuse3_cache_destroy(&internal.cache);
+    fuse3_stats_destroy(&internal);
+    free(s.fi3);
+    free(s.fi2);
+    free(s.buf);
+    free(t.ops);
+    free(t.paths);
+    return 0;
+}
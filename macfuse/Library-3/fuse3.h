@@ -4,18 +4,24 @@
 /*
  * FUSE API version 3 compatibility layer for macFUSE
  * This provides FUSE v3 API support on top of macFUSE
+ *
+ * Built with -DFUSE3_NATIVE (make BACKEND=fuse3) the same API maps straight
+ * onto a system libfuse3 instead, see fuse3_native.h.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifndef FUSE3_NATIVE
+
 /* FUSE version 3 major version */
 #define FUSE_MAJOR_VERSION 3
 #define FUSE_MINOR_VERSION 0
@@ -45,6 +51,14 @@ enum fuse3_buf_flags {
     FUSE3_BUF_FD_RETRY = (1 << 3),
 };
 
+/* Flags for fuse3_buf_copy() */
+enum fuse3_buf_copy_flags {
+    FUSE3_BUF_NO_SPLICE = (1 << 1),
+    FUSE3_BUF_FORCE_SPLICE = (1 << 2),
+    FUSE3_BUF_SPLICE_MOVE = (1 << 3),
+    FUSE3_BUF_SPLICE_NONBLOCK = (1 << 4),
+};
+
 /* File information structure for FUSE v3 */
 struct fuse3_file_info {
     int flags;
@@ -64,6 +78,7 @@ struct fuse3_file_info {
 
 /* Command line options structure */
 struct fuse3_cmdline_opts {
+    int singlethread;
     int foreground;
     int debug;
     int nodefault_subtype;
@@ -74,6 +89,24 @@ struct fuse3_cmdline_opts {
     unsigned int max_idle_threads;
 };
 
+/* Multithreaded loop configuration */
+struct fuse3_loop_config {
+    int clone_fd;
+    unsigned int max_idle_threads;
+};
+
+/* Capability flags for fuse3_conn_info.capable and .want */
+#define FUSE3_CAP_ASYNC_READ        (1 << 0)
+#define FUSE3_CAP_POSIX_LOCKS       (1 << 1)
+#define FUSE3_CAP_ATOMIC_O_TRUNC    (1 << 3)
+#define FUSE3_CAP_EXPORT_SUPPORT    (1 << 4)
+#define FUSE3_CAP_DONT_MASK         (1 << 6)
+#define FUSE3_CAP_SPLICE_WRITE      (1 << 7)
+#define FUSE3_CAP_SPLICE_MOVE       (1 << 8)
+#define FUSE3_CAP_SPLICE_READ       (1 << 9)
+#define FUSE3_CAP_FLOCK_LOCKS       (1 << 10)
+#define FUSE3_CAP_IOCTL_DIR         (1 << 11)
+
 /* Connection information structure for FUSE v3 */
 struct fuse3_conn_info {
     unsigned proto_major;
@@ -117,6 +150,16 @@ struct fuse3_config {
     int debug;
 };
 
+/* Context of the request currently being processed */
+struct fuse3_context {
+    struct fuse3 *fuse;
+    uid_t uid;
+    gid_t gid;
+    pid_t pid;
+    void *private_data;
+    mode_t umask;
+};
+
 /* Arguments structure */
 struct fuse3_args {
     int argc;
@@ -189,19 +232,192 @@ struct fuse3_operations {
     off_t (*lseek)(const char *path, off_t off, int whence, struct fuse3_file_info *fi);
 };
 
+#endif /* !FUSE3_NATIVE */
+
+/*
+ * SEEK_DATA and SEEK_HOLE on an open file of a mount, answered by the
+ * filesystem's lseek(); see fuse3_lseek()
+ */
+struct fuse3_lseek_arg {
+    int64_t offset;  /* in: where to start looking, out: the result */
+    int32_t whence;
+    int32_t padding;
+};
+
+#define FUSE3_IOC_LSEEK _IOWR('F', 0x3e, struct fuse3_lseek_arg)
+
+/* Single buffer vectors: size_ bytes unset, in memory, or in a file at pos_ */
+#define FUSE3_BUFVEC_INIT(size_) \
+    ((struct fuse3_bufvec) { .count = 1, .idx = 0, .off = 0, \
+        .buf = { { .size = (size_), .flags = 0, .mem = NULL, .fd = -1, .pos = 0 } } })
+#define FUSE3_BUFVEC_INIT_MEM(mem_, size_) \
+    ((struct fuse3_bufvec) { .count = 1, .idx = 0, .off = 0, \
+        .buf = { { .size = (size_), .flags = 0, .mem = (mem_), .fd = -1, .pos = 0 } } })
+#define FUSE3_BUFVEC_INIT_FD(fd_, pos_, size_) \
+    ((struct fuse3_bufvec) { .count = 1, .idx = 0, .off = 0, \
+        .buf = { { .size = (size_), .flags = FUSE3_BUF_IS_FD | FUSE3_BUF_FD_SEEK, \
+                   .mem = NULL, .fd = (fd_), .pos = (pos_) } } })
+
+/* Operations counted by fuse3_get_stats() */
+enum fuse3_op {
+    FUSE3_OP_GETATTR,
+    FUSE3_OP_READLINK,
+    FUSE3_OP_MKNOD,
+    FUSE3_OP_MKDIR,
+    FUSE3_OP_UNLINK,
+    FUSE3_OP_RMDIR,
+    FUSE3_OP_SYMLINK,
+    FUSE3_OP_RENAME,
+    FUSE3_OP_LINK,
+    FUSE3_OP_CHMOD,
+    FUSE3_OP_CHOWN,
+    FUSE3_OP_TRUNCATE,
+    FUSE3_OP_OPEN,
+    FUSE3_OP_READ,
+    FUSE3_OP_WRITE,
+    FUSE3_OP_STATFS,
+    FUSE3_OP_FLUSH,
+    FUSE3_OP_RELEASE,
+    FUSE3_OP_FSYNC,
+    FUSE3_OP_SETXATTR,
+    FUSE3_OP_GETXATTR,
+    FUSE3_OP_LISTXATTR,
+    FUSE3_OP_REMOVEXATTR,
+    FUSE3_OP_OPENDIR,
+    FUSE3_OP_READDIR,
+    FUSE3_OP_RELEASEDIR,
+    FUSE3_OP_FSYNCDIR,
+    FUSE3_OP_ACCESS,
+    FUSE3_OP_CREATE,
+    FUSE3_OP_LOCK,
+    FUSE3_OP_UTIMENS,
+    FUSE3_OP_BMAP,
+    FUSE3_OP_IOCTL,
+    FUSE3_OP_POLL,
+    FUSE3_OP_FLOCK,
+    FUSE3_OP_FALLOCATE,
+    FUSE3_OP_COPY_FILE_RANGE,
+    FUSE3_OP_LSEEK,
+    FUSE3_OP_COUNT
+};
+
+/* Latency histogram bucket i counts calls that took [2^i, 2^(i+1)) ns */
+#define FUSE3_STATS_BUCKETS 32
+
+struct fuse3_op_stats {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t latency[FUSE3_STATS_BUCKETS];
+};
+
+/*
+ * ops[] is the time spent in the filesystem's own callbacks. requests is
+ * every request the multithreaded loop processed, from receipt to reply;
+ * the difference is the time taken by the library itself.
+ */
+struct fuse3_stats {
+    struct fuse3_op_stats ops[FUSE3_OP_COUNT];
+    struct fuse3_op_stats requests;
+    uint64_t log_dropped;     /* log messages lost because the buffer was full */
+    uint64_t log_suppressed;  /* errors held back by the per-message rate limit */
+    uint32_t max_write;       /* largest write the kernel sends, 0 before init() */
+    uint32_t max_readahead;   /* largest readahead, 0 before init() */
+};
+
+#ifdef FUSE3_NATIVE
+#include "fuse3_native.h"
+#else
+
 /* FUSE v3 API functions */
 struct fuse3 *fuse3_new(struct fuse3_args *args, const struct fuse3_operations *op, size_t op_size, void *private_data);
 int fuse3_mount(struct fuse3 *f, const char *mountpoint);
 void fuse3_unmount(struct fuse3 *f);
+/* One request at a time on the calling thread */
 int fuse3_loop(struct fuse3 *f);
+/* A worker pool; NULL config takes -o clone_fd/max_idle_threads from fuse3_new() */
+int fuse3_loop_mt(struct fuse3 *f, struct fuse3_loop_config *config);
 void fuse3_destroy(struct fuse3 *f);
 
+/* Request context, only valid inside a filesystem operation */
+struct fuse3_context *fuse3_get_context(void);
+
+/*
+ * Whether the process waiting for the current request gave up on it, so a
+ * long operation can stop early and return -EINTR. Only valid inside a
+ * filesystem operation.
+ */
+int fuse3_interrupted(void);
+
+/*
+ * Wake pollers of the handle poll() was given, from any thread. The handle
+ * belongs to the filesystem until it is destroyed.
+ */
+int fuse3_notify_poll(struct fuse3_pollhandle *ph);
+void fuse3_pollhandle_destroy(struct fuse3_pollhandle *ph);
+
+/* Statistics, summed over all threads since the filesystem was created */
+int fuse3_get_stats(struct fuse3 *f, struct fuse3_stats *stats);
+const char *fuse3_op_name(enum fuse3_op op);
+
+/* Switch the library's debug tracing on or off at runtime; -d turns it on */
+void fuse3_set_trace(int enable);
+
+/*
+ * Tell the kernel a path changed behind its back, so long attr_timeout and
+ * entry_timeout values stay safe. Callable from any thread. Return 0,
+ * -ENOENT if the kernel has nothing cached for the path, -ENOSYS on libfuse 2
+ * (Linux), which can't, or -errno.
+ */
+int fuse3_invalidate_path(struct fuse3 *f, const char *path);
+int fuse3_invalidate_range(struct fuse3 *f, const char *path, off_t off, off_t len);
+int fuse3_notify_delete(struct fuse3 *f, const char *path);
+
+/*
+ * Total size of a buffer vector, and a copy of as much of src as fits in dst.
+ * The copy advances both vectors and returns the bytes copied or -errno; it
+ * stops early at end of file, or at a short fd transfer without FD_RETRY.
+ */
+size_t fuse3_buf_size(const struct fuse3_bufvec *bufv);
+ssize_t fuse3_buf_copy(struct fuse3_bufvec *dst, struct fuse3_bufvec *src, enum fuse3_buf_copy_flags flags);
+
+/*
+ * lseek(2) for clients of a mount: SEEK_DATA and SEEK_HOLE reach the
+ * filesystem's lseek() through FUSE3_IOC_LSEEK, which the v2 protocol
+ * otherwise can't. Falls back to lseek(2) on other files.
+ */
+off_t fuse3_lseek(int fd, off_t offset, int whence);
+
 /* Session management */
 struct fuse3_session *fuse3_get_session(struct fuse3 *f);
 int fuse3_session_loop(struct fuse3_session *se);
 
-/* Command line parsing */
+/*
+ * Driving the session from an application's own event loop: wait for
+ * fuse3_session_fd() to become readable, then receive and process one
+ * request. A buffer with mem == NULL is allocated on first use and may be
+ * reused; the caller frees buf->mem when done.
+ */
+int fuse3_session_fd(struct fuse3_session *se);
+int fuse3_session_receive_buf(struct fuse3_session *se, struct fuse3_buf *buf);
+void fuse3_session_process_buf(struct fuse3_session *se, const struct fuse3_buf *buf);
+void fuse3_session_exit(struct fuse3_session *se);
+int fuse3_session_exited(struct fuse3_session *se);
+void fuse3_session_reset(struct fuse3_session *se);
+int fuse3_set_signal_handlers(struct fuse3_session *se);
+void fuse3_remove_signal_handlers(struct fuse3_session *se);
+
+/*
+ * Command line parsing: takes the mount point and the event loop options
+ * out of args, leaving the rest for fuse3_new(). opts->mountpoint is the
+ * caller's to free, and so are args once parsing changed them.
+ */
 int fuse3_parse_cmdline(struct fuse3_args *args, struct fuse3_cmdline_opts *opts);
+void fuse3_opt_free_args(struct fuse3_args *args);
+
+#endif /* !FUSE3_NATIVE */
 
 #ifdef __cplusplus
 }
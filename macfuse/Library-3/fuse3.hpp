@@ -0,0 +1,170 @@
+/*
+ * C++ binding for the FUSE v3 API
+ *
+ * Header-only. A filesystem derives from fuse3cpp::Filesystem<Derived> and
+ * defines the operations it implements as public members with the
+ * signatures of struct fuse3_operations, static or not:
+ *
+ *     class HelloFs : public fuse3cpp::Filesystem<HelloFs> {
+ *     public:
+ *         int getattr(const char *path, struct stat *st, fuse3_file_info *fi);
+ *         int read(const char *path, char *buf, size_t size, off_t off, fuse3_file_info *fi);
+ *     };
+ *
+ *     int main(int argc, char *argv[]) {
+ *         HelloFs fs;
+ *         return fs.main(argc, argv);
+ *     }
+ *
+ * Which operations exist is worked out at compile time and only those go in
+ * the table, so the library tells the kernel about the rest up front rather
+ * than answering ENOSYS. Each table entry is a static thunk that calls the
+ * member directly: no virtual calls, and no fuse3_get_context() to find the
+ * object. There is one object per Derived type at a time. init() and
+ * destroy() take no private data: init(conn, cfg) returns void, and
+ * fuse3_get_context()->private_data stays the object. An exception escaping
+ * an operation becomes -ENOMEM or -EIO.
+ *
+ * Needs C++17.
+ */
+
+#ifndef FUSE3_HPP
+#define FUSE3_HPP
+
+#include "fuse3.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <new>
+#include <type_traits>
+
+namespace fuse3cpp {
+
+/* Every entry of struct fuse3_operations except init and destroy */
+#define FUSE3_HPP_OPERATIONS(X) \
+    X(getattr) X(readlink) X(mknod) X(mkdir) X(unlink) X(rmdir) X(symlink) \
+    X(rename) X(link) X(chmod) X(chown) X(truncate) X(open) X(read) X(write) \
+    X(statfs) X(flush) X(release) X(fsync) X(setxattr) X(getxattr) \
+    X(listxattr) X(removexattr) X(opendir) X(readdir) X(releasedir) \
+    X(fsyncdir) X(access) X(create) X(lock) X(utimens) X(bmap) X(ioctl) \
+    X(poll) X(write_buf) X(read_buf) X(flock) X(fallocate) \
+    X(copy_file_range) X(lseek)
+
+namespace detail {
+
+/* has_<op><T>::value is true when T has a member named <op> */
+#define FUSE3_HPP_DETECT(op) \
+    template <class T, class = void> struct has_##op : std::false_type {}; \
+    template <class T> struct has_##op<T, std::void_t<decltype(&T::op)>> : std::true_type {};
+FUSE3_HPP_OPERATIONS(FUSE3_HPP_DETECT)
+FUSE3_HPP_DETECT(init)
+FUSE3_HPP_DETECT(destroy)
+#undef FUSE3_HPP_DETECT
+
+} // namespace detail
+
+template <class Derived>
+class Filesystem {
+public:
+    Filesystem(const Filesystem &) = delete;
+    Filesystem &operator=(const Filesystem &) = delete;
+
+    /* The table holding only the operations Derived defines */
+    static const struct fuse3_operations &operations() {
+        static const struct fuse3_operations ops = make_operations();
+        return ops;
+    }
+
+    /*
+     * fuse3_parse_cmdline(), fuse3_new(), fuse3_mount(), then fuse3_loop()
+     * with -s or fuse3_loop_mt() without; returns 1 if the mount fails
+     */
+    int main(int argc, char *argv[]) {
+        struct fuse3_args args = { argc, argv, 0 };
+        struct fuse3_cmdline_opts opts;
+        if (fuse3_parse_cmdline(&args, &opts) != 0 || !opts.mountpoint) {
+            fuse3_opt_free_args(&args);
+            return 1;
+        }
+        struct fuse3 *fuse = fuse3_new(&args, &operations(), sizeof(struct fuse3_operations),
+                                       static_cast<Derived *>(this));
+        if (!fuse || fuse3_mount(fuse, opts.mountpoint) != 0) {
+            if (fuse)
+                fuse3_destroy(fuse);
+            free(opts.mountpoint);
+            fuse3_opt_free_args(&args);
+            return 1;
+        }
+        int ret;
+        if (opts.singlethread) {
+            ret = fuse3_loop(fuse);
+        } else {
+            struct fuse3_loop_config config = {};
+            config.clone_fd = opts.clone_fd;
+            config.max_idle_threads = opts.max_idle_threads;
+            ret = fuse3_loop_mt(fuse, &config);
+        }
+        fuse3_unmount(fuse);
+        fuse3_destroy(fuse);
+        free(opts.mountpoint);
+        fuse3_opt_free_args(&args);
+        return ret;
+    }
+
+protected:
+    Filesystem() { instance_ = static_cast<Derived *>(this); }
+    ~Filesystem() { instance_ = nullptr; }
+
+private:
+    static inline Derived *instance_ = nullptr;
+
+    template <class Fn> struct Thunk;
+
+    template <class R, class... Args>
+    struct Thunk<R (*)(Args...)> {
+        template <auto Member>
+        static R call(Args... args) {
+            try {
+                if constexpr (std::is_member_function_pointer_v<decltype(Member)>)
+                    return (instance_->*Member)(args...);
+                else
+                    return Member(args...);
+            } catch (const std::bad_alloc &) {
+                return -ENOMEM;
+            } catch (...) {
+                return -EIO;
+            }
+        }
+    };
+
+    static void *init_thunk(struct fuse3_conn_info *conn, struct fuse3_config *cfg) {
+        instance_->init(conn, cfg);
+        return instance_;
+    }
+
+    static void destroy_thunk(void *private_data) {
+        (void) private_data;
+        instance_->destroy();
+    }
+
+    static struct fuse3_operations make_operations() {
+        struct fuse3_operations ops = {};
+
+#define FUSE3_HPP_BIND(op) \
+        if constexpr (detail::has_##op<Derived>::value) \
+            ops.op = &Thunk<decltype(ops.op)>::template call<&Derived::op>;
+        FUSE3_HPP_OPERATIONS(FUSE3_HPP_BIND)
+#undef FUSE3_HPP_BIND
+
+        if constexpr (detail::has_init<Derived>::value)
+            ops.init = &init_thunk;
+        if constexpr (detail::has_destroy<Derived>::value)
+            ops.destroy = &destroy_thunk;
+        return ops;
+    }
+};
+
+#undef FUSE3_HPP_OPERATIONS
+
+} // namespace fuse3cpp
+
+#endif /* FUSE3_HPP */
@@ -0,0 +1,237 @@
+/*
+ * Buffer copies for the FUSE v3 compatibility layer
+ *
+ * fuse3_buf_copy() moves data between memory and fd buffers by the cheapest
+ * route the host has: memcpy between memory buffers, a single read or write
+ * between memory and an fd, and between two fds copy_file_range() for two
+ * files or splice() when one side is a pipe, both on Linux only. Copying
+ * through a bounce buffer is the last resort.
+ */
+
+#define _GNU_SOURCE
+#include "fuse3_i.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Largest bounce buffer used for fd to fd copies the kernel can't do itself */
+#define FUSE3_BUF_BOUNCE_MAX (1 << 20)
+
+size_t fuse3_buf_size(const struct fuse3_bufvec *bufv) {
+    size_t size = 0;
+
+    for (size_t i = 0; i < bufv->count; i++) {
+        if (bufv->buf[i].size > SIZE_MAX - size)
+            return SIZE_MAX;
+        size += bufv->buf[i].size;
+    }
+    return size;
+}
+
+/* Reads into or writes from mem at off into an fd buffer; retries short transfers with FD_RETRY */
+static ssize_t fuse3_buf_fd_io(const struct fuse3_buf *fdbuf, size_t off, void *mem, size_t len, int writing) {
+    size_t done = 0;
+
+    while (done < len) {
+        char *p = (char *)mem + done;
+        ssize_t res;
+
+        if (fdbuf->flags & FUSE3_BUF_FD_SEEK) {
+            off_t pos = fdbuf->pos + (off_t)(off + done);
+            res = writing ? pwrite(fdbuf->fd, p, len - done, pos) : pread(fdbuf->fd, p, len - done, pos);
+        } else {
+            res = writing ? write(fdbuf->fd, p, len - done) : read(fdbuf->fd, p, len - done);
+        }
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return done ? (ssize_t)done : -errno;
+        }
+        if (res == 0)
+            break;
+        done += res;
+        if (!(fdbuf->flags & FUSE3_BUF_FD_RETRY))
+            break;
+    }
+    return done;
+}
+
+static ssize_t fuse3_buf_bounce(const struct fuse3_buf *dst, size_t dst_off,
+                                const struct fuse3_buf *src, size_t src_off, size_t len) {
+    size_t chunk = len < FUSE3_BUF_BOUNCE_MAX ? len : FUSE3_BUF_BOUNCE_MAX;
+    size_t done = 0;
+    ssize_t res = 0;
+    char *bounce = malloc(chunk);
+
+    if (!bounce)
+        return -ENOMEM;
+    while (done < len) {
+        size_t n = len - done < chunk ? len - done : chunk;
+        ssize_t got = fuse3_buf_fd_io(src, src_off + done, bounce, n, 0);
+        if (got <= 0) {
+            res = got;
+            break;
+        }
+        res = fuse3_buf_fd_io(dst, dst_off + done, bounce, got, 1);
+        if (res <= 0)
+            break;
+        done += res;
+        if (res < got || (size_t)got < n)
+            break;
+    }
+    free(bounce);
+    return done ? (ssize_t)done : res;
+}
+
+#ifdef __linux__
+/* Both sides are files: the kernel copies, or reflinks where the filesystem can */
+static ssize_t fuse3_buf_copy_range(const struct fuse3_buf *dst, size_t dst_off,
+                                    const struct fuse3_buf *src, size_t src_off, size_t len) {
+    loff_t in = src->pos + (off_t)src_off;
+    loff_t out = dst->pos + (off_t)dst_off;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t res = copy_file_range(src->fd, &in, dst->fd, &out, len - done, 0);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return done ? (ssize_t)done : -errno;
+        }
+        if (res == 0)
+            break;
+        done += res;
+    }
+    return done;
+}
+
+/* One side is a pipe: move the pages between it and the other fd */
+static ssize_t fuse3_buf_splice(const struct fuse3_buf *dst, size_t dst_off,
+                                const struct fuse3_buf *src, size_t src_off, size_t len,
+                                enum fuse3_buf_copy_flags flags) {
+    unsigned int splice_flags = 0;
+    size_t done = 0;
+
+    if (flags & FUSE3_BUF_SPLICE_MOVE)
+        splice_flags |= SPLICE_F_MOVE;
+    if (flags & FUSE3_BUF_SPLICE_NONBLOCK)
+        splice_flags |= SPLICE_F_NONBLOCK;
+
+    while (done < len) {
+        loff_t in = src->pos + (off_t)(src_off + done);
+        loff_t out = dst->pos + (off_t)(dst_off + done);
+        ssize_t res = splice(src->fd, (src->flags & FUSE3_BUF_FD_SEEK) ? &in : NULL,
+                             dst->fd, (dst->flags & FUSE3_BUF_FD_SEEK) ? &out : NULL,
+                             len - done, splice_flags);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            if (done)
+                break;
+            /* Neither side was a pipe after all, or this fd type can't splice */
+            if (errno == EINVAL && !(flags & FUSE3_BUF_FORCE_SPLICE))
+                return fuse3_buf_bounce(dst, dst_off, src, src_off, len);
+            return -errno;
+        }
+        if (res == 0)
+            break;
+        done += res;
+        if (!((src->flags | dst->flags) & FUSE3_BUF_FD_RETRY))
+            break;
+    }
+    return done;
+}
+#endif
+
+static ssize_t fuse3_buf_fd_to_fd(const struct fuse3_buf *dst, size_t dst_off,
+                                  const struct fuse3_buf *src, size_t src_off, size_t len,
+                                  enum fuse3_buf_copy_flags flags) {
+#ifdef __linux__
+    int both_seek = (src->flags & dst->flags & FUSE3_BUF_FD_SEEK) != 0;
+
+    if (both_seek) {
+        ssize_t res = fuse3_buf_copy_range(dst, dst_off, src, src_off, len);
+        if (res >= 0 || (res != -ENOSYS && res != -EXDEV && res != -EOPNOTSUPP && res != -EINVAL))
+            return res;
+    }
+    if (!(flags & FUSE3_BUF_NO_SPLICE) && (!both_seek || (flags & FUSE3_BUF_FORCE_SPLICE)))
+        return fuse3_buf_splice(dst, dst_off, src, src_off, len, flags);
+#else
+    if (flags & FUSE3_BUF_FORCE_SPLICE)
+        return -ENOSYS;
+#endif
+    return fuse3_buf_bounce(dst, dst_off, src, src_off, len);
+}
+
+static ssize_t fuse3_buf_copy_one(const struct fuse3_buf *dst, size_t dst_off,
+                                  const struct fuse3_buf *src, size_t src_off, size_t len,
+                                  enum fuse3_buf_copy_flags flags) {
+    int src_is_fd = (src->flags & FUSE3_BUF_IS_FD) != 0;
+    int dst_is_fd = (dst->flags & FUSE3_BUF_IS_FD) != 0;
+
+    if (!src_is_fd && !dst_is_fd) {
+        char *d = (char *)dst->mem + dst_off;
+        const char *s = (const char *)src->mem + src_off;
+        if (d != s)
+            memmove(d, s, len);
+        return len;
+    }
+    if (!src_is_fd)
+        return fuse3_buf_fd_io(dst, dst_off, (char *)src->mem + src_off, len, 1);
+    if (!dst_is_fd)
+        return fuse3_buf_fd_io(src, src_off, (char *)dst->mem + dst_off, len, 0);
+    return fuse3_buf_fd_to_fd(dst, dst_off, src, src_off, len, flags);
+}
+
+static const struct fuse3_buf *fuse3_bufvec_current(const struct fuse3_bufvec *bufv) {
+    return bufv->idx < bufv->count ? &bufv->buf[bufv->idx] : NULL;
+}
+
+/* Returns 0 once the vector is used up */
+static int fuse3_bufvec_advance(struct fuse3_bufvec *bufv, size_t len) {
+    const struct fuse3_buf *buf = fuse3_bufvec_current(bufv);
+
+    if (!buf)
+        return 0;
+    bufv->off += len;
+    if (bufv->off == buf->size) {
+        bufv->idx++;
+        if (bufv->idx == bufv->count)
+            return 0;
+        bufv->off = 0;
+    }
+    return 1;
+}
+
+ssize_t fuse3_buf_copy(struct fuse3_bufvec *dstv, struct fuse3_bufvec *srcv,
+                       enum fuse3_buf_copy_flags flags) {
+    size_t copied = 0;
+
+    if (dstv == srcv)
+        return fuse3_buf_size(dstv);
+
+    for (;;) {
+        const struct fuse3_buf *src = fuse3_bufvec_current(srcv);
+        const struct fuse3_buf *dst = fuse3_bufvec_current(dstv);
+        size_t src_len, dst_len, len;
+        ssize_t res;
+
+        if (!src || !dst)
+            break;
+        src_len = src->size - srcv->off;
+        dst_len = dst->size - dstv->off;
+        len = src_len < dst_len ? src_len : dst_len;
+
+        res = fuse3_buf_copy_one(dst, dstv->off, src, srcv->off, len, flags);
+        if (res < 0)
+            return copied ? (ssize_t)copied : res;
+        copied += res;
+        if (!fuse3_bufvec_advance(srcv, res) || !fuse3_bufvec_advance(dstv, res))
+            break;
+        if ((size_t)res < len)
+            break;
+    }
+    return copied;
+}
@@ -0,0 +1,325 @@
+/*
+ * Attribute and directory caches for the FUSE v3 compatibility layer
+ *
+ * The attribute cache holds the stat data a filesystem hands out with
+ * FUSE3_FILL_DIR_PLUS, so the lookups and getattrs the kernel sends for each
+ * entry right after a readdir don't call back into the filesystem. Entries
+ * are used once, expire after attr_timeout and are dropped when the layer
+ * sees the path change.
+ *
+ * The directory cache stands in for the kernel's readdir cache, which the v2
+ * protocol can't turn on: listings of directories opened with cache_readdir
+ * are kept until something in the directory changes or it is reopened
+ * without keep_cache.
+ */
+
+#include "fuse3_i.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static double fuse3_cache_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* FNV-1a, for the cache slots and the auto_cache table */
+uint64_t fuse3_cache_hash(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int fuse3_cache_init(struct fuse3_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    cache->attr_shards = calloc(FUSE3_ATTR_CACHE_SHARDS, sizeof(struct fuse3_attr_shard));
+    cache->dir_slots = calloc(FUSE3_DIR_CACHE_SLOTS, sizeof(struct fuse3_dir_slot));
+    if (!cache->attr_shards || !cache->dir_slots) {
+        free(cache->attr_shards);
+        free(cache->dir_slots);
+        return -ENOMEM;
+    }
+    for (int i = 0; i < FUSE3_ATTR_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->attr_shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&cache->dir_lock, NULL);
+    return 0;
+}
+
+void fuse3_cache_destroy(struct fuse3_cache *cache) {
+    if (cache->attr_shards) {
+        for (int i = 0; i < FUSE3_ATTR_CACHE_SHARDS; i++) {
+            struct fuse3_attr_shard *shard = &cache->attr_shards[i];
+            for (int j = 0; j < FUSE3_ATTR_CACHE_SHARD_SLOTS; j++) {
+                free(shard->slots[j].path);
+            }
+            pthread_mutex_destroy(&shard->lock);
+        }
+        free(cache->attr_shards);
+    }
+    if (cache->dir_slots) {
+        for (int i = 0; i < FUSE3_DIR_CACHE_SLOTS; i++) {
+            free(cache->dir_slots[i].path);
+            fuse3_dirlist_release(cache->dir_slots[i].list);
+        }
+        free(cache->dir_slots);
+        pthread_mutex_destroy(&cache->dir_lock);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+static struct fuse3_attr_slot *fuse3_attr_slot(struct fuse3_cache *cache, uint64_t hash, struct fuse3_attr_shard **shardp) {
+    struct fuse3_attr_shard *shard = &cache->attr_shards[hash % FUSE3_ATTR_CACHE_SHARDS];
+    *shardp = shard;
+    return &shard->slots[(hash / FUSE3_ATTR_CACHE_SHARDS) % FUSE3_ATTR_CACHE_SHARD_SLOTS];
+}
+
+void fuse3_attr_cache_put(struct fuse3_cache *cache, const char *path, const struct stat *st, double ttl) {
+    struct fuse3_attr_shard *shard;
+    uint64_t hash = fuse3_cache_hash(path);
+    struct fuse3_attr_slot *slot = fuse3_attr_slot(cache, hash, &shard);
+    char *copy = strdup(path);
+    char *old;
+    if (!copy) {
+        return;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    old = slot->path;
+    slot->hash = hash;
+    slot->path = copy;
+    slot->st = *st;
+    slot->expires = fuse3_cache_now() + ttl;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&cache->gen, 1, __ATOMIC_RELEASE);
+    free(old);
+}
+
+/* Returns 0 and fills in st if fresh attributes were cached for path */
+int fuse3_attr_cache_take(struct fuse3_cache *cache, const char *path, struct stat *st) {
+    struct fuse3_attr_shard *shard;
+    uint64_t hash = fuse3_cache_hash(path);
+    struct fuse3_attr_slot *slot = fuse3_attr_slot(cache, hash, &shard);
+    char *old = NULL;
+    int ret = -ENOENT;
+
+    pthread_mutex_lock(&shard->lock);
+    if (slot->path && slot->hash == hash && strcmp(slot->path, path) == 0) {
+        if (slot->expires > fuse3_cache_now()) {
+            *st = slot->st;
+            ret = 0;
+        }
+        old = slot->path;
+        slot->path = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    free(old);
+    return ret;
+}
+
+static void fuse3_attr_cache_drop(struct fuse3_cache *cache, const char *path) {
+    struct stat st;
+    fuse3_attr_cache_take(cache, path, &st);
+}
+
+struct fuse3_dirlist *fuse3_dirlist_new(void) {
+    struct fuse3_dirlist *list = calloc(1, sizeof(struct fuse3_dirlist));
+    if (list) {
+        list->refcount = 1;
+    }
+    return list;
+}
+
+int fuse3_dirlist_add(struct fuse3_dirlist *list, const char *name, const struct stat *st, int plus) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        if (capacity > FUSE3_DIR_CACHE_MAX_ENTRIES) {
+            return -EFBIG;
+        }
+        struct fuse3_dirent *entries = realloc(list->entries, capacity * sizeof(struct fuse3_dirent));
+        if (!entries) {
+            return -ENOMEM;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    struct fuse3_dirent *e = &list->entries[list->count];
+    e->name = strdup(name);
+    if (!e->name) {
+        return -ENOMEM;
+    }
+    if (st) {
+        e->st = *st;
+    } else {
+        memset(&e->st, 0, sizeof(e->st));
+    }
+    e->has_st = st != NULL;
+    e->plus = plus;
+    list->count++;
+    return 0;
+}
+
+struct fuse3_dirlist *fuse3_dirlist_ref(struct fuse3_dirlist *list) {
+    __atomic_add_fetch(&list->refcount, 1, __ATOMIC_RELAXED);
+    return list;
+}
+
+void fuse3_dirlist_release(struct fuse3_dirlist *list) {
+    if (!list || __atomic_sub_fetch(&list->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].name);
+    }
+    free(list->entries);
+    free(list);
+}
+
+static struct fuse3_dir_slot *fuse3_dir_slot(struct fuse3_cache *cache, uint64_t hash) {
+    return &cache->dir_slots[hash % FUSE3_DIR_CACHE_SLOTS];
+}
+
+/* Returns a reference to the cached listing of path, or NULL */
+struct fuse3_dirlist *fuse3_dir_cache_get(struct fuse3_cache *cache, const char *path) {
+    uint64_t hash = fuse3_cache_hash(path);
+    struct fuse3_dir_slot *slot = fuse3_dir_slot(cache, hash);
+    struct fuse3_dirlist *list = NULL;
+
+    pthread_mutex_lock(&cache->dir_lock);
+    if (slot->path && slot->hash == hash && strcmp(slot->path, path) == 0) {
+        list = fuse3_dirlist_ref(slot->list);
+    }
+    pthread_mutex_unlock(&cache->dir_lock);
+    return list;
+}
+
+/* Takes over the caller's reference to list */
+void fuse3_dir_cache_set(struct fuse3_cache *cache, const char *path, struct fuse3_dirlist *list) {
+    uint64_t hash = fuse3_cache_hash(path);
+    struct fuse3_dir_slot *slot = fuse3_dir_slot(cache, hash);
+    char *copy = strdup(path);
+    char *old_path;
+    struct fuse3_dirlist *old_list;
+    if (!copy) {
+        fuse3_dirlist_release(list);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->dir_lock);
+    old_path = slot->path;
+    old_list = slot->list;
+    slot->hash = hash;
+    slot->path = copy;
+    slot->list = list;
+    pthread_mutex_unlock(&cache->dir_lock);
+    __atomic_add_fetch(&cache->gen, 1, __ATOMIC_RELEASE);
+    free(old_path);
+    fuse3_dirlist_release(old_list);
+}
+
+void fuse3_dir_cache_drop(struct fuse3_cache *cache, const char *path) {
+    uint64_t hash = fuse3_cache_hash(path);
+    struct fuse3_dir_slot *slot = fuse3_dir_slot(cache, hash);
+    char *old_path = NULL;
+    struct fuse3_dirlist *old_list = NULL;
+
+    pthread_mutex_lock(&cache->dir_lock);
+    if (slot->path && slot->hash == hash && strcmp(slot->path, path) == 0) {
+        old_path = slot->path;
+        old_list = slot->list;
+        slot->path = NULL;
+        slot->list = NULL;
+    }
+    pthread_mutex_unlock(&cache->dir_lock);
+    free(old_path);
+    fuse3_dirlist_release(old_list);
+}
+
+static int fuse3_cache_under(const char *path, const char *dir, size_t len) {
+    return path && strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
+/*
+ * Directory dir was renamed or removed: forget everything cached below it.
+ * Walks every slot, so callers skip it when dir is known not to be one.
+ */
+void fuse3_cache_invalidate_tree(struct fuse3_cache *cache, const char *dir) {
+    if (!cache->attr_shards || !dir) {
+        return;
+    }
+    size_t len = strlen(dir);
+    if (len == 1) {
+        len = 0;  /* everything is below "/" */
+    }
+
+    for (int i = 0; i < FUSE3_ATTR_CACHE_SHARDS; i++) {
+        struct fuse3_attr_shard *shard = &cache->attr_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (int j = 0; j < FUSE3_ATTR_CACHE_SHARD_SLOTS; j++) {
+            struct fuse3_attr_slot *slot = &shard->slots[j];
+            if (fuse3_cache_under(slot->path, dir, len)) {
+                free(slot->path);
+                slot->path = NULL;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    struct fuse3_dirlist *lists[FUSE3_DIR_CACHE_SLOTS];
+    int count = 0;
+    pthread_mutex_lock(&cache->dir_lock);
+    for (int i = 0; i < FUSE3_DIR_CACHE_SLOTS; i++) {
+        struct fuse3_dir_slot *slot = &cache->dir_slots[i];
+        if (fuse3_cache_under(slot->path, dir, len)) {
+            free(slot->path);
+            slot->path = NULL;
+            lists[count++] = slot->list;
+            slot->list = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache->dir_lock);
+    for (int i = 0; i < count; i++) {
+        fuse3_dirlist_release(lists[i]);
+    }
+}
+
+/* path changed: forget its attributes, its listing and its parent's listing */
+void fuse3_cache_invalidate(struct fuse3_cache *cache, const char *path) {
+    if (!cache->attr_shards || !path) {
+        return;
+    }
+    fuse3_attr_cache_drop(cache, path);
+    fuse3_dir_cache_drop(cache, path);
+
+    const char *slash = strrchr(path, '/');
+    if (slash) {
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+        char parent[len + 1];
+        memcpy(parent, path, len);
+        parent[len] = '\0';
+        fuse3_dir_cache_drop(cache, parent);
+    }
+}
+
+uint64_t fuse3_cache_gen(struct fuse3_cache *cache) {
+    return __atomic_load_n(&cache->gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * fuse3_cache_invalidate() for the write path: does nothing, and takes no
+ * lock, unless something was stored since *seen, the generation the caller
+ * last dropped path at, which it then moves on to
+ */
+void fuse3_cache_invalidate_since(struct fuse3_cache *cache, const char *path, uint64_t *seen) {
+    uint64_t gen = fuse3_cache_gen(cache);
+    if (gen == __atomic_load_n(seen, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_store_n(seen, gen, __ATOMIC_RELAXED);
+    fuse3_cache_invalidate(cache, path);
+}
@@ -3,37 +3,26 @@
  * This provides FUSE v3 API support on top of macFUSE v2
  */
 
-#include "fuse3.h"
-#undef FUSE_MAJOR_VERSION
-#undef FUSE_MINOR_VERSION
-#include <fuse/fuse.h>  // macFUSE v2 API
+#include "fuse3_i.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
-#include <stdio.h>
-#include <syslog.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 
-/* Debug logging */
-#ifdef FUSE3_DEBUG
-#define fuse3_debug(fmt, ...) fprintf(stderr, "FUSE3_COMPAT: " fmt "\n", ##__VA_ARGS__)
+#ifdef __APPLE__
+#define FUSE3_ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
 #else
-#define fuse3_debug(fmt, ...)
+#define FUSE3_ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
 #endif
 
-#define fuse3_error(fmt, ...) do { \
-    fprintf(stderr, "FUSE3_COMPAT ERROR: " fmt "\n", ##__VA_ARGS__); \
-    syslog(LOG_ERR, "FUSE3_COMPAT ERROR: " fmt, ##__VA_ARGS__); \
-} while(0)
-
-/* Internal mapping structure */
-struct fuse3_internal {
-    struct fuse *fuse2_handle;
-    const struct fuse3_operations *ops3;
-    void *user_data;
-};
-
 /* Convert FUSE v2 file_info to v3 */
-static void convert_file_info_2_to_3(const struct fuse_file_info *fi2, struct fuse3_file_info *fi3) {
+void convert_file_info_2_to_3(const struct fuse_file_info *fi2, struct fuse3_file_info *fi3) {
     if (!fi2 || !fi3) {
         fuse3_error("Invalid file_info pointer in conversion");
         return;
@@ -47,25 +36,233 @@ static void convert_file_info_2_to_3(const struct fuse_file_info *fi2, struct fu
     fi3->flush = fi2->flush;
     fi3->nonseekable = fi2->nonseekable;
     fi3->lock_owner = fi2->lock_owner;
-    fuse3_debug("Converted file_info v2->v3: fh=%llu, flags=0x%x", fi3->fh, fi3->flags);
+    fuse3_debug("Converted file_info v2->v3: fh=%llu, flags=0x%x", (unsigned long long)fi3->fh, fi3->flags);
 }
 
-/* Convert FUSE v3 file_info to v2 */
-static void convert_file_info_3_to_2(const struct fuse3_file_info *fi3, struct fuse_file_info *fi2) {
-    if (!fi3 || !fi2) {
-        fuse3_error("Invalid file_info pointer in conversion");
-        return;
+/*
+ * Open files and directories carry a persistent v3 file_info for their whole
+ * lifetime: it is allocated on open, its address is kept in the v2 fh, and
+ * the filesystem's own fh lives inside it. The read/write hot path then
+ * passes it on without converting anything.
+ */
+struct fuse3_filehandle {
+    struct fuse3_file_info fi;  /* first, so fuse3_file_info_get() works on it */
+    char *path;                 /* kept for the caches when writes get no path (nullpath_ok) */
+    uint64_t cache_seen;        /* cache generation the file's entries were last dropped at */
+};
+
+static struct fuse3_file_info *fuse3_file_info_new(struct fuse3_internal *internal, const char *path,
+                                                   const struct fuse_file_info *fi2) {
+    struct fuse3_filehandle *fh = calloc(1, sizeof(struct fuse3_filehandle));
+    if (!fh) {
+        fuse3_error("Failed to allocate file_info");
+        return NULL;
     }
-    
-    memset(fi2, 0, sizeof(*fi2));
-    fi2->flags = fi3->flags;
-    fi2->fh = fi3->fh;
+    convert_file_info_2_to_3(fi2, &fh->fi);
+    fh->fi.fh = 0;
+    if (internal->config.nullpath_ok && internal->cache.attr_shards) {
+        fh->path = strdup(path);
+    }
+    /* Taken before open() drops the file's entries, so none stored since are missed */
+    if (internal->cache.attr_shards) {
+        fh->cache_seen = fuse3_cache_gen(&internal->cache);
+    }
+    return &fh->fi;
+}
+
+static void fuse3_file_info_free(struct fuse3_file_info *fi3) {
+    struct fuse3_filehandle *fh = (struct fuse3_filehandle *)fi3;
+    free(fh->path);
+    free(fh);
+}
+
+/* Hand the flags the filesystem set on open back to the kernel and attach the shadow */
+static void fuse3_file_info_attach(struct fuse3_file_info *fi3, struct fuse_file_info *fi2) {
     fi2->direct_io = fi3->direct_io;
     fi2->keep_cache = fi3->keep_cache;
-    fi2->flush = fi3->flush;
     fi2->nonseekable = fi3->nonseekable;
-    fi2->lock_owner = fi3->lock_owner;
-    fuse3_debug("Converted file_info v3->v2: fh=%llu, flags=0x%x", fi2->fh, fi2->flags);
+    fi2->fh = (uint64_t)(uintptr_t)fi3;
+}
+
+static inline struct fuse3_file_info *fuse3_file_info_get(const struct fuse_file_info *fi2) {
+    return (struct fuse3_file_info *)(uintptr_t)fi2->fh;
+}
+
+static inline struct fuse3_filehandle *fuse3_filehandle_get(const struct fuse_file_info *fi2) {
+    return (struct fuse3_filehandle *)(uintptr_t)fi2->fh;
+}
+
+/* The file changed through fi: drop what was cached about it since the last time */
+static void fuse3_cache_written(struct fuse3_internal *internal, const char *path, const struct fuse_file_info *fi) {
+    struct fuse3_filehandle *fh = fuse3_filehandle_get(fi);
+    if (!internal->cache.attr_shards) {
+        return;
+    }
+    fuse3_cache_invalidate_since(&internal->cache, path ? path : fh->path, &fh->cache_seen);
+}
+
+/* Capabilities both APIs know about; v2 has no v3-only ones and v3 always does big writes */
+static const struct {
+    unsigned cap3;
+    unsigned cap2;
+} fuse3_cap_map[] = {
+    { FUSE3_CAP_ASYNC_READ, FUSE_CAP_ASYNC_READ },
+    { FUSE3_CAP_POSIX_LOCKS, FUSE_CAP_POSIX_LOCKS },
+    { FUSE3_CAP_ATOMIC_O_TRUNC, FUSE_CAP_ATOMIC_O_TRUNC },
+    { FUSE3_CAP_EXPORT_SUPPORT, FUSE_CAP_EXPORT_SUPPORT },
+    { FUSE3_CAP_DONT_MASK, FUSE_CAP_DONT_MASK },
+#ifdef FUSE_CAP_SPLICE_READ
+    { FUSE3_CAP_SPLICE_WRITE, FUSE_CAP_SPLICE_WRITE },
+    { FUSE3_CAP_SPLICE_MOVE, FUSE_CAP_SPLICE_MOVE },
+    { FUSE3_CAP_SPLICE_READ, FUSE_CAP_SPLICE_READ },
+#endif
+#ifdef FUSE_CAP_FLOCK_LOCKS
+    { FUSE3_CAP_FLOCK_LOCKS, FUSE_CAP_FLOCK_LOCKS },
+#endif
+#ifdef FUSE_CAP_IOCTL_DIR
+    { FUSE3_CAP_IOCTL_DIR, FUSE_CAP_IOCTL_DIR },
+#endif
+};
+
+#define FUSE3_CAP_MAP_SIZE (sizeof(fuse3_cap_map) / sizeof(fuse3_cap_map[0]))
+
+static unsigned convert_caps_2_to_3(unsigned caps2) {
+    unsigned caps3 = 0;
+    for (size_t i = 0; i < FUSE3_CAP_MAP_SIZE; i++) {
+        if (caps2 & fuse3_cap_map[i].cap2) caps3 |= fuse3_cap_map[i].cap3;
+    }
+    return caps3;
+}
+
+static unsigned convert_caps_3_to_2(unsigned caps3) {
+    unsigned caps2 = 0;
+    for (size_t i = 0; i < FUSE3_CAP_MAP_SIZE; i++) {
+        if (caps3 & fuse3_cap_map[i].cap3) caps2 |= fuse3_cap_map[i].cap2;
+    }
+    return caps2;
+}
+
+/* Fill in the v3 connection info from what the v2 library negotiated */
+void convert_conn_info_2_to_3(const struct fuse_conn_info *conn2, unsigned int max_read, struct fuse3_conn_info *conn3) {
+    memset(conn3, 0, sizeof(*conn3));
+    conn3->proto_major = conn2->proto_major;
+    conn3->proto_minor = conn2->proto_minor;
+    conn3->max_write = conn2->max_write;
+    conn3->max_read = max_read;
+    conn3->max_readahead = conn2->max_readahead;
+    conn3->capable = convert_caps_2_to_3(conn2->capable);
+    conn3->want = convert_caps_2_to_3(conn2->want);
+    if (conn2->async_read) {
+        conn3->want |= FUSE3_CAP_ASYNC_READ;
+    }
+    conn3->max_background = conn2->max_background;
+    conn3->congestion_threshold = conn2->congestion_threshold;
+}
+
+/* Hand what the filesystem asked for in init() back to the v2 library */
+void convert_conn_info_3_to_2(const struct fuse3_conn_info *conn3, unsigned int max_read, struct fuse_conn_info *conn2) {
+    unsigned want3 = conn3->want & conn3->capable;
+    if (want3 != conn3->want) {
+        fuse3_error("init() wants unsupported capabilities 0x%x, ignoring them", conn3->want & ~conn3->capable);
+    }
+    
+    conn2->want = (conn2->want & ~convert_caps_3_to_2(~0u)) | convert_caps_3_to_2(want3);
+    conn2->async_read = (want3 & FUSE3_CAP_ASYNC_READ) ? 1 : 0;
+    /* The v2 library sized its request buffer before init() and takes no more */
+    if (conn3->max_write > conn2->max_write) {
+        fuse3_error("init() asked for max_write %u, the backend allows at most %u", conn3->max_write, conn2->max_write);
+    } else {
+        conn2->max_write = conn3->max_write;
+    }
+    /* The kernel never reads ahead further than it offered */
+    if (conn3->max_readahead < conn2->max_readahead) {
+        conn2->max_readahead = conn3->max_readahead;
+    }
+    conn2->max_background = conn3->max_background;
+    conn2->congestion_threshold = conn3->congestion_threshold;
+    if (conn3->max_read != max_read) {
+        fuse3_error("init() changed max_read, which is a mount option; use -o max_read=%u instead", conn3->max_read);
+    }
+}
+
+/*
+ * Ask for transfers of FUSE3_MAX_IO_SIZE where the backend takes the size as
+ * a mount option, unless the command line sets it. Goes before the mount.
+ */
+int fuse3_add_io_size_arg(struct fuse_args *args) {
+#ifdef __APPLE__
+    char opt[32];
+    for (int i = 0; i < args->argc; i++) {
+        if (strstr(args->argv[i], "iosize=")) {
+            return 0;
+        }
+    }
+    if (args->argc == 0) {
+        return 0;
+    }
+    snprintf(opt, sizeof(opt), "-oiosize=%d", FUSE3_MAX_IO_SIZE);
+    return fuse_opt_insert_arg(args, 1, opt);
+#else
+    (void)args;
+    return 0;
+#endif
+}
+
+/*
+ * struct fuse3_buf/fuse3_bufvec mirror the v2 fuse_buf/fuse_bufvec, so
+ * buffer vectors are handed across as-is instead of being copied.
+ */
+#define FUSE3_BUF_FIELD_MATCHES(field) \
+    (offsetof(struct fuse3_buf, field) == offsetof(struct fuse_buf, field) && \
+     sizeof(((struct fuse3_buf *)0)->field) == sizeof(((struct fuse_buf *)0)->field))
+
+_Static_assert(sizeof(struct fuse3_buf) == sizeof(struct fuse_buf) &&
+               FUSE3_BUF_FIELD_MATCHES(size) && FUSE3_BUF_FIELD_MATCHES(flags) &&
+               FUSE3_BUF_FIELD_MATCHES(mem) && FUSE3_BUF_FIELD_MATCHES(fd) &&
+               FUSE3_BUF_FIELD_MATCHES(pos),
+               "struct fuse3_buf must match struct fuse_buf");
+_Static_assert(sizeof(struct fuse3_bufvec) == sizeof(struct fuse_bufvec) &&
+               offsetof(struct fuse3_bufvec, count) == offsetof(struct fuse_bufvec, count) &&
+               offsetof(struct fuse3_bufvec, idx) == offsetof(struct fuse_bufvec, idx) &&
+               offsetof(struct fuse3_bufvec, off) == offsetof(struct fuse_bufvec, off) &&
+               offsetof(struct fuse3_bufvec, buf) == offsetof(struct fuse_bufvec, buf),
+               "struct fuse3_bufvec must match struct fuse_bufvec");
+_Static_assert((int)FUSE3_BUF_IS_FD == (int)FUSE_BUF_IS_FD &&
+               (int)FUSE3_BUF_FD_SEEK == (int)FUSE_BUF_FD_SEEK &&
+               (int)FUSE3_BUF_FD_RETRY == (int)FUSE_BUF_FD_RETRY,
+               "fuse3_buf_flags must match fuse_buf_flags");
+
+/* Apply uid/gid/umask overrides init() set that the v2 library doesn't know about */
+static void fuse3_config_stat(const struct fuse3_config *cfg, struct stat *stbuf) {
+    if (cfg->set_mode) stbuf->st_mode = (stbuf->st_mode & S_IFMT) | (0777 & ~cfg->umask);
+    if (cfg->set_uid) stbuf->st_uid = cfg->uid;
+    if (cfg->set_gid) stbuf->st_gid = cfg->gid;
+}
+
+/*
+ * auto_cache turned on by init() rather than on the command line: keep the
+ * page cache across opens as long as mtime and size are unchanged, which is
+ * what the v2 library does for the option.
+ */
+static void fuse3_auto_cache_open(struct fuse3_internal *internal, const char *path, struct fuse3_file_info *fi3) {
+    struct stat st;
+    if (!internal->ops3->getattr || internal->ops3->getattr(path, &st, fi3) != 0) {
+        return;
+    }
+    
+    uint64_t hash = fuse3_cache_hash(path);
+    struct fuse3_auto_cache_slot *slot = &internal->auto_cache[hash % FUSE3_AUTO_CACHE_SLOTS];
+    pthread_mutex_lock(&internal->auto_cache_lock);
+    if (slot->hash == hash && slot->mtime == st.st_mtime &&
+        slot->mtime_nsec == FUSE3_ST_MTIME_NSEC(&st) && slot->size == st.st_size) {
+        fi3->keep_cache = 1;
+    } else {
+        slot->hash = hash;
+        slot->mtime = st.st_mtime;
+        slot->mtime_nsec = FUSE3_ST_MTIME_NSEC(&st);
+        slot->size = st.st_size;
+    }
+    pthread_mutex_unlock(&internal->auto_cache_lock);
 }
 
 /* Wrapper functions that convert between FUSE v2 and v3 APIs */
@@ -76,21 +273,51 @@ static int fuse3_getattr_wrapper(const char *path, struct stat *stbuf) {
         fuse3_error("No internal context in getattr for path: %s", path);
         return -EINVAL;
     }
+    if (fuse3_stats_file_path(internal, path)) {
+        return fuse3_stats_file_getattr(stbuf);
+    }
     if (internal->ops3->getattr) {
         fuse3_debug("getattr called for path: %s", path);
-        int ret = internal->ops3->getattr(path, stbuf, NULL);
+        fuse3_trace(internal, FUSE3_OP_GETATTR, path, NULL, 0, 0, 0);
+        int ret = 0;
+        if (!internal->cache.attr_shards || fuse3_attr_cache_take(&internal->cache, path, stbuf) != 0) {
+            uint64_t start = fuse3_stats_now();
+            ret = internal->ops3->getattr(path, stbuf, NULL);
+            fuse3_stats_record(internal, FUSE3_OP_GETATTR, start, ret, 0);
+        }
         if (ret < 0) {
             fuse3_debug("getattr failed for path %s: %s", path, strerror(-ret));
+        } else if (internal->emulate_attr) {
+            fuse3_config_stat(&internal->config, stbuf);
         }
         return ret;
     }
     return -ENOSYS;
 }
 
+static int fuse3_fgetattr_wrapper(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        return fuse3_stats_file_getattr(stbuf);
+    }
+    fuse3_trace(internal, FUSE3_OP_GETATTR, path, fi, 0, 0, 0);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->getattr(path, stbuf, fuse3_file_info_get(fi));
+    fuse3_stats_record(internal, FUSE3_OP_GETATTR, start, ret, 0);
+    if (ret == 0 && internal->emulate_attr) {
+        fuse3_config_stat(&internal->config, stbuf);
+    }
+    return ret;
+}
+
 static int fuse3_readlink_wrapper(const char *path, char *buf, size_t size) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
     if (internal->ops3->readlink) {
-        return internal->ops3->readlink(path, buf, size);
+        fuse3_trace(internal, FUSE3_OP_READLINK, path, NULL, size, 0, 0);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->readlink(path, buf, size);
+        fuse3_stats_record(internal, FUSE3_OP_READLINK, start, ret, 0);
+        return ret;
     }
     return -ENOSYS;
 }
@@ -98,7 +325,12 @@ static int fuse3_readlink_wrapper(const char *path, char *buf, size_t size) {
 static int fuse3_mknod_wrapper(const char *path, mode_t mode, dev_t rdev) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
     if (internal->ops3->mknod) {
-        return internal->ops3->mknod(path, mode, rdev);
+        fuse3_trace(internal, FUSE3_OP_MKNOD, path, NULL, 0, 0, mode);
+        fuse3_cache_invalidate(&internal->cache, path);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->mknod(path, mode, rdev);
+        fuse3_stats_record(internal, FUSE3_OP_MKNOD, start, ret, 0);
+        return ret;
     }
     return -ENOSYS;
 }
@@ -106,7 +338,12 @@ static int fuse3_mknod_wrapper(const char *path, mode_t mode, dev_t rdev) {
 static int fuse3_mkdir_wrapper(const char *path, mode_t mode) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
     if (internal->ops3->mkdir) {
-        return internal->ops3->mkdir(path, mode);
+        fuse3_trace(internal, FUSE3_OP_MKDIR, path, NULL, 0, 0, mode);
+        fuse3_cache_invalidate(&internal->cache, path);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->mkdir(path, mode);
+        fuse3_stats_record(internal, FUSE3_OP_MKDIR, start, ret, 0);
+        return ret;
     }
     return -ENOSYS;
 }
@@ -114,7 +351,12 @@ static int fuse3_mkdir_wrapper(const char *path, mode_t mode) {
 static int fuse3_unlink_wrapper(const char *path) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
     if (internal->ops3->unlink) {
-        return internal->ops3->unlink(path);
+        fuse3_trace(internal, FUSE3_OP_UNLINK, path, NULL, 0, 0, 0);
+        fuse3_cache_invalidate(&internal->cache, path);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->unlink(path);
+        fuse3_stats_record(internal, FUSE3_OP_UNLINK, start, ret, 0);
+        return ret;
     }
     return -ENOSYS;
 }
@@ -122,29 +364,200 @@ static int fuse3_unlink_wrapper(const char *path) {
 static int fuse3_rmdir_wrapper(const char *path) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
     if (internal->ops3->rmdir) {
-        return internal->ops3->rmdir(path);
+        fuse3_trace(internal, FUSE3_OP_RMDIR, path, NULL, 0, 0, 0);
+        fuse3_cache_invalidate(&internal->cache, path);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->rmdir(path);
+        fuse3_stats_record(internal, FUSE3_OP_RMDIR, start, ret, 0);
+        return ret;
     }
     return -ENOSYS;
 }
 
+static int fuse3_symlink_wrapper(const char *from, const char *to) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_SYMLINK, to, NULL, 0, 0, 0);
+    fuse3_cache_invalidate(&internal->cache, to);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->symlink(from, to);
+    fuse3_stats_record(internal, FUSE3_OP_SYMLINK, start, ret, 0);
+    return ret;
+}
+
+/*
+ * The v2 protocol has no rename flags, so RENAME_NOREPLACE and RENAME_EXCHANGE
+ * never arrive. Unless from is known to be a file, it may be a directory
+ * whose children are cached under their old paths.
+ */
+static int fuse3_rename_wrapper(const char *from, const char *to) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    struct stat st;
+    fuse3_trace(internal, FUSE3_OP_RENAME, from, NULL, 0, 0, 0);
+    int is_file = internal->cache.attr_shards &&
+                  fuse3_attr_cache_take(&internal->cache, from, &st) == 0 && !S_ISDIR(st.st_mode);
+    fuse3_cache_invalidate(&internal->cache, from);
+    fuse3_cache_invalidate(&internal->cache, to);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->rename(from, to, 0);
+    fuse3_stats_record(internal, FUSE3_OP_RENAME, start, ret, 0);
+    if (ret == 0 && !is_file) {
+        fuse3_cache_invalidate_tree(&internal->cache, from);
+    }
+    return ret;
+}
+
+static int fuse3_link_wrapper(const char *from, const char *to) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_LINK, from, NULL, 0, 0, 0);
+    fuse3_cache_invalidate(&internal->cache, from);
+    fuse3_cache_invalidate(&internal->cache, to);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->link(from, to);
+    fuse3_stats_record(internal, FUSE3_OP_LINK, start, ret, 0);
+    return ret;
+}
+
+/* The v2 chmod, chown and utimens carry no file handle, so fi is always NULL */
+static int fuse3_chmod_wrapper(const char *path, mode_t mode) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_CHMOD, path, NULL, 0, 0, mode);
+    fuse3_cache_invalidate(&internal->cache, path);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->chmod(path, mode, NULL);
+    fuse3_stats_record(internal, FUSE3_OP_CHMOD, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_chown_wrapper(const char *path, uid_t uid, gid_t gid) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_CHOWN, path, NULL, 0, 0, 0);
+    fuse3_cache_invalidate(&internal->cache, path);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->chown(path, uid, gid, NULL);
+    fuse3_stats_record(internal, FUSE3_OP_CHOWN, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_utimens_wrapper(const char *path, const struct timespec tv[2]) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_UTIMENS, path, NULL, 0, 0, 0);
+    fuse3_cache_invalidate(&internal->cache, path);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->utimens(path, tv, NULL);
+    fuse3_stats_record(internal, FUSE3_OP_UTIMENS, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_access_wrapper(const char *path, int mask) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_path(internal, path)) {
+        return (mask & W_OK) ? -EACCES : 0;
+    }
+    fuse3_trace(internal, FUSE3_OP_ACCESS, path, NULL, 0, 0, mask);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->access(path, mask);
+    fuse3_stats_record(internal, FUSE3_OP_ACCESS, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_statfs_wrapper(const char *path, struct statvfs *stbuf) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_STATFS, path, NULL, 0, 0, 0);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->statfs(path, stbuf);
+    fuse3_stats_record(internal, FUSE3_OP_STATFS, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_truncate_wrapper(const char *path, off_t size) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_TRUNCATE, path, NULL, 0, size, 0);
+    fuse3_cache_invalidate(&internal->cache, path);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->truncate(path, size, NULL);
+    fuse3_stats_record(internal, FUSE3_OP_TRUNCATE, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_ftruncate_wrapper(const char *path, off_t size, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_TRUNCATE, path, fi, 0, size, 0);
+    fuse3_cache_invalidate(&internal->cache, path);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->truncate(path, size, fuse3_file_info_get(fi));
+    fuse3_stats_record(internal, FUSE3_OP_TRUNCATE, start, ret, 0);
+    return ret;
+}
+
+/* Apply the config to a file the filesystem just opened and hand it to the v2 library */
+static void fuse3_open_finish(struct fuse3_internal *internal, const char *path, struct fuse3_file_info *fi3, struct fuse_file_info *fi) {
+    if (internal->config.direct_io) fi3->direct_io = 1;
+    if (internal->config.kernel_cache) fi3->keep_cache = 1;
+    if (internal->auto_cache) fuse3_auto_cache_open(internal, path, fi3);
+    fuse3_file_info_attach(fi3, fi);
+}
+
+static int fuse3_create_wrapper(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    struct fuse3_file_info *fi3 = fuse3_file_info_new(internal, path, fi);
+    if (!fi3) {
+        return -ENOMEM;
+    }
+    
+    fuse3_cache_invalidate(&internal->cache, path);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->create(path, mode, fi3);
+    fuse3_stats_record(internal, FUSE3_OP_CREATE, start, ret, 0);
+    if (ret < 0) {
+        fuse3_file_info_free(fi3);
+        return ret;
+    }
+    fuse3_open_finish(internal, path, fi3, fi);
+    fuse3_trace(internal, FUSE3_OP_CREATE, path, fi, 0, 0, mode);
+    return ret;
+}
+
 static int fuse3_open_wrapper(const char *path, struct fuse_file_info *fi) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_path(internal, path)) {
+        return fuse3_stats_file_open(internal, fi);
+    }
+    struct fuse3_file_info *fi3 = fuse3_file_info_new(internal, path, fi);
+    if (!fi3) {
+        return -ENOMEM;
+    }
+    
+    /* Cached attributes and listings go stale once the file is written to */
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+        fuse3_cache_invalidate(&internal->cache, path);
+    }
+    
+    int ret = 0;
     if (internal->ops3->open) {
-        struct fuse3_file_info fi3;
-        convert_file_info_2_to_3(fi, &fi3);
-        int ret = internal->ops3->open(path, &fi3);
-        convert_file_info_3_to_2(&fi3, fi);
+        uint64_t start = fuse3_stats_now();
+        ret = internal->ops3->open(path, fi3);
+        fuse3_stats_record(internal, FUSE3_OP_OPEN, start, ret, 0);
+    }
+    if (ret < 0) {
+        fuse3_file_info_free(fi3);
         return ret;
     }
-    return -ENOSYS;
+    fuse3_open_finish(internal, path, fi3, fi);
+    fuse3_trace(internal, FUSE3_OP_OPEN, path, fi, 0, 0, 0);
+    return ret;
 }
 
 static int fuse3_read_wrapper(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        return fuse3_stats_file_read(fi, buf, size, offset);
+    }
     if (internal->ops3->read) {
-        struct fuse3_file_info fi3;
-        convert_file_info_2_to_3(fi, &fi3);
-        return internal->ops3->read(path, buf, size, offset, &fi3);
+        fuse3_trace(internal, FUSE3_OP_READ, path, fi, size, offset, 0);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->read(path, buf, size, offset, fuse3_file_info_get(fi));
+        fuse3_stats_record(internal, FUSE3_OP_READ, start, ret, ret > 0 ? ret : 0);
+        return ret;
     }
     return -ENOSYS;
 }
@@ -152,25 +565,594 @@ static int fuse3_read_wrapper(const char *path, char *buf, size_t size, off_t of
 static int fuse3_write_wrapper(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
     if (internal->ops3->write) {
-        struct fuse3_file_info fi3;
-        convert_file_info_2_to_3(fi, &fi3);
-        return internal->ops3->write(path, buf, size, offset, &fi3);
+        fuse3_trace(internal, FUSE3_OP_WRITE, path, fi, size, offset, 0);
+        struct fuse3_file_info *fi3 = fuse3_file_info_get(fi);
+        fi3->writepage = fi->writepage;
+        /* A readdir since open() or the last write may have cached the size this changes */
+        fuse3_cache_written(internal, path, fi);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->write(path, buf, size, offset, fi3);
+        fuse3_stats_record(internal, FUSE3_OP_WRITE, start, ret, ret > 0 ? ret : 0);
+        return ret;
     }
     return -ENOSYS;
 }
 
 static int fuse3_release_wrapper(const char *path, struct fuse_file_info *fi) {
     struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        fuse3_stats_file_release(fi);
+        return 0;
+    }
+    struct fuse3_file_info *fi3 = fuse3_file_info_get(fi);
+    int ret = 0;
+    
+    fuse3_trace(internal, FUSE3_OP_RELEASE, path, fi, 0, 0, 0);
+    fi3->flags = fi->flags;
+    fi3->flush = fi->flush;
+    fi3->flock_release = fi->flock_release;
+    fi3->lock_owner = fi->lock_owner;
     if (internal->ops3->release) {
-        struct fuse3_file_info fi3;
-        convert_file_info_2_to_3(fi, &fi3);
-        return internal->ops3->release(path, &fi3);
+        uint64_t start = fuse3_stats_now();
+        ret = internal->ops3->release(path, fi3);
+        fuse3_stats_record(internal, FUSE3_OP_RELEASE, start, ret, 0);
+    }
+    if ((fi3->flags & O_ACCMODE) != O_RDONLY) {
+        fuse3_cache_invalidate(&internal->cache, path ? path : fuse3_filehandle_get(fi)->path);
+    }
+    fuse3_file_info_free(fi3);
+    return ret;
+}
+
+static int fuse3_flush_wrapper(const char *path, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        return 0;
+    }
+    struct fuse3_file_info *fi3 = fuse3_file_info_get(fi);
+    
+    fuse3_trace(internal, FUSE3_OP_FLUSH, path, fi, 0, 0, 0);
+    fi3->lock_owner = fi->lock_owner;
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->flush(path, fi3);
+    fuse3_stats_record(internal, FUSE3_OP_FLUSH, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_fsync_wrapper(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        return 0;
+    }
+    fuse3_trace(internal, FUSE3_OP_FSYNC, path, fi, 0, 0, 0);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->fsync(path, isdatasync, fuse3_file_info_get(fi));
+    fuse3_stats_record(internal, FUSE3_OP_FSYNC, start, ret, 0);
+    return ret;
+}
+
+/*
+ * The v2 protocol doesn't pass the events being polled for, so poll_events
+ * stays 0; ph is the v2 handle under the v3 name.
+ */
+static int fuse3_poll_wrapper(const char *path, struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *reventsp) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        if (ph) fuse_pollhandle_destroy(ph);
+        *reventsp = POLLIN | POLLRDNORM;
+        return 0;
+    }
+    struct fuse3_file_info *fi3 = fuse3_file_info_get(fi);
+    
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->poll(path, fi3, (struct fuse3_pollhandle *)ph, reventsp);
+    fuse3_stats_record(internal, FUSE3_OP_POLL, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_fallocate_wrapper(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        return -EBADF;
+    }
+    fuse3_trace(internal, FUSE3_OP_FALLOCATE, path, fi, length, offset, mode);
+    fuse3_cache_invalidate(&internal->cache, path);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->fallocate(path, mode, offset, length, fuse3_file_info_get(fi));
+    fuse3_stats_record(internal, FUSE3_OP_FALLOCATE, start, ret, 0);
+    return ret;
+}
+
+/*
+ * The v2 protocol has no lseek request: the kernel answers SEEK_DATA and
+ * SEEK_HOLE itself as if the file had no holes. FUSE3_IOC_LSEEK carries
+ * them to the filesystem's lseek() instead; other commands go to its ioctl().
+ */
+static int fuse3_ioctl_wrapper(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        return -ENOTTY;
+    }
+    struct fuse3_file_info *fi3 = fuse3_file_info_get(fi);
+    
+    if ((unsigned int)cmd == (unsigned int)FUSE3_IOC_LSEEK && internal->ops3->lseek) {
+        struct fuse3_lseek_arg *seek = data;
+#ifdef FUSE_IOCTL_DIR
+        if (flags & FUSE_IOCTL_DIR) {
+            return -ENOTTY;
+        }
+#endif
+        fuse3_trace(internal, FUSE3_OP_LSEEK, path, fi, 0, seek->offset, seek->whence);
+        uint64_t start = fuse3_stats_now();
+        off_t res = internal->ops3->lseek(path, seek->offset, seek->whence, fi3);
+        fuse3_stats_record(internal, FUSE3_OP_LSEEK, start, res < 0 ? (int)res : 0, 0);
+        if (res < 0) {
+            return (int)res;
+        }
+        seek->offset = res;
+        return 0;
+    }
+    if (!internal->ops3->ioctl) {
+        return -ENOTTY;
+    }
+    fuse3_trace(internal, FUSE3_OP_IOCTL, path, fi, 0, 0, 0);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->ioctl(path, cmd, arg, fi3, flags, data);
+    fuse3_stats_record(internal, FUSE3_OP_IOCTL, start, ret, 0);
+    return ret;
+}
+
+off_t fuse3_lseek(int fd, off_t offset, int whence) {
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+        struct fuse3_lseek_arg seek = { .offset = offset, .whence = whence };
+        if (ioctl(fd, FUSE3_IOC_LSEEK, &seek) == 0) {
+            return lseek(fd, seek.offset, SEEK_SET);
+        }
+        /* Not a mount of this library, or a filesystem without lseek() */
+        if (errno != ENOTTY && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+    }
+    return lseek(fd, offset, whence);
+}
+
+/* Open directory: the v3 file_info, and the cached listing being served or built */
+struct fuse3_dirhandle {
+    struct fuse3_file_info fi;  /* first, so fuse3_file_info_get() works on it */
+    struct fuse3_dirlist *cached;
+    struct fuse3_dirlist *building;
+    off_t build_offset;
+    char *path;  /* kept for the caches when readdir gets no path (nullpath_ok) */
+};
+
+static inline struct fuse3_dirhandle *fuse3_dirhandle_get(const struct fuse_file_info *fi2) {
+    return (struct fuse3_dirhandle *)(uintptr_t)fi2->fh;
+}
+
+struct fuse3_readdir_ctx {
+    struct fuse3_internal *internal;
+    const char *path;
+    void *buf;
+    fuse_fill_dir_t filler;
+    struct fuse3_dirhandle *dh;
+    int full;
+};
+
+/* Remember attributes handed out with a directory entry for the getattr that follows */
+static void fuse3_readdir_cache_attr(struct fuse3_internal *internal, const char *dir, const char *name, const struct stat *st) {
+    char path[PATH_MAX];
+    
+    if (!dir || internal->config.attr_timeout <= 0 ||
+        strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return;
+    }
+    int len = snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    if (len < 0 || len >= (int)sizeof(path)) {
+        return;
+    }
+    fuse3_attr_cache_put(&internal->cache, path, st, internal->config.attr_timeout);
+}
+
+static void fuse3_readdir_stop_building(struct fuse3_dirhandle *dh) {
+    fuse3_dirlist_release(dh->building);
+    dh->building = NULL;
+}
+
+/*
+ * v3 filler: entries go straight into the v2 reply, so a filesystem that
+ * passes offsets is paged by the kernel and nothing is buffered here.
+ */
+static int fuse3_fill_dir_wrapper(void *buf, const char *name, const struct stat *stbuf, off_t off, enum fuse3_fill_dir_flags flags) {
+    struct fuse3_readdir_ctx *ctx = buf;
+    struct fuse3_dirhandle *dh = ctx->dh;
+    int plus = (flags & FUSE3_FILL_DIR_PLUS) && stbuf;
+    
+    if (ctx->filler(ctx->buf, name, stbuf, off)) {
+        ctx->full = 1;
+        return 1;
+    }
+    if (plus) {
+        fuse3_readdir_cache_attr(ctx->internal, ctx->path, name, stbuf);
+    }
+    if (dh->building) {
+        if (fuse3_dirlist_add(dh->building, name, stbuf, plus) != 0) {
+            fuse3_readdir_stop_building(dh);
+        } else {
+            dh->build_offset = off;
+        }
+    }
+    return 0;
+}
+
+/* Serve a listing from the directory cache, with our own offsets */
+static int fuse3_readdir_cached(struct fuse3_internal *internal, const char *path, const struct fuse3_dirlist *list, void *buf, fuse_fill_dir_t filler, off_t offset) {
+    for (size_t i = (size_t)offset; i < list->count; i++) {
+        const struct fuse3_dirent *e = &list->entries[i];
+        if (filler(buf, e->name, e->has_st ? &e->st : NULL, (off_t)(i + 1))) {
+            break;
+        }
+        if (e->plus) {
+            fuse3_readdir_cache_attr(internal, path, e->name, &e->st);
+        }
+    }
+    return 0;
+}
+
+static int fuse3_opendir_wrapper(const char *path, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    struct fuse3_dirhandle *dh = calloc(1, sizeof(struct fuse3_dirhandle));
+    if (!dh) {
+        fuse3_error("Failed to allocate directory handle");
+        return -ENOMEM;
+    }
+    convert_file_info_2_to_3(fi, &dh->fi);
+    dh->fi.fh = 0;
+    
+    int ret = 0;
+    if (internal->ops3->opendir) {
+        uint64_t start = fuse3_stats_now();
+        ret = internal->ops3->opendir(path, &dh->fi);
+        fuse3_stats_record(internal, FUSE3_OP_OPENDIR, start, ret, 0);
+    }
+    if (ret < 0) {
+        free(dh);
+        return ret;
+    }
+    if (internal->config.nullpath_ok && internal->cache.attr_shards) {
+        dh->path = strdup(path);
+    }
+    
+    /* Reopening without keep_cache throws the cached listing away, as the kernel would */
+    if (dh->fi.cache_readdir && internal->cache.attr_shards) {
+        if (dh->fi.keep_cache) {
+            dh->cached = fuse3_dir_cache_get(&internal->cache, path);
+        } else {
+            fuse3_dir_cache_drop(&internal->cache, path);
+        }
+        if (!dh->cached) {
+            dh->building = fuse3_dirlist_new();
+        }
+    }
+    fi->fh = (uint64_t)(uintptr_t)dh;
+    fuse3_trace(internal, FUSE3_OP_OPENDIR, path, fi, 0, 0, 0);
+    return ret;
+}
+
+static int fuse3_readdir_wrapper(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    struct fuse3_dirhandle *dh = fuse3_dirhandle_get(fi);
+    const char *cache_path = path ? path : dh->path;
+    
+    fuse3_trace(internal, FUSE3_OP_READDIR, path, fi, 0, offset, 0);
+    if (dh->cached) {
+        return fuse3_readdir_cached(internal, cache_path, dh->cached, buf, filler, offset);
+    }
+    if (!internal->ops3->readdir) {
+        return -ENOSYS;
+    }
+    
+    /* Only a listing read in one go from the start, or continued where it left off, is cached */
+    if (dh->building && (offset != dh->build_offset || !cache_path)) {
+        fuse3_readdir_stop_building(dh);
+    }
+    
+    struct fuse3_readdir_ctx ctx = {
+        .internal = internal,
+        .path = cache_path,
+        .buf = buf,
+        .filler = filler,
+        .dh = dh,
+        .full = 0,
+    };
+    enum fuse3_readdir_flags flags = 0;
+    if (!internal->no_readdirplus && internal->cache.attr_shards) {
+        flags |= FUSE3_READDIR_PLUS;
+    }
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->readdir(path, &ctx, fuse3_fill_dir_wrapper, offset, &dh->fi, flags);
+    fuse3_stats_record(internal, FUSE3_OP_READDIR, start, ret, 0);
+    if (ret < 0) {
+        fuse3_readdir_stop_building(dh);
+    } else if (dh->building && !ctx.full) {
+        fuse3_dir_cache_set(&internal->cache, cache_path, dh->building);
+        dh->building = NULL;
+    }
+    return ret;
+}
+
+static int fuse3_releasedir_wrapper(const char *path, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    struct fuse3_dirhandle *dh = fuse3_dirhandle_get(fi);
+    int ret = 0;
+    
+    fuse3_trace(internal, FUSE3_OP_RELEASEDIR, path, fi, 0, 0, 0);
+    if (internal->ops3->releasedir) {
+        uint64_t start = fuse3_stats_now();
+        ret = internal->ops3->releasedir(path, &dh->fi);
+        fuse3_stats_record(internal, FUSE3_OP_RELEASEDIR, start, ret, 0);
+    }
+    fuse3_dirlist_release(dh->cached);
+    fuse3_dirlist_release(dh->building);
+    free(dh->path);
+    free(dh);
+    return ret;
+}
+
+static int fuse3_fsyncdir_wrapper(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    fuse3_trace(internal, FUSE3_OP_FSYNCDIR, path, fi, 0, 0, 0);
+    uint64_t start = fuse3_stats_now();
+    int ret = internal->ops3->fsyncdir(path, isdatasync, &fuse3_dirhandle_get(fi)->fi);
+    fuse3_stats_record(internal, FUSE3_OP_FSYNCDIR, start, ret, 0);
+    return ret;
+}
+
+static int fuse3_read_buf_wrapper(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (fuse3_stats_file_handle(fi)) {
+        return fuse3_stats_file_read_buf(fi, bufp, size, offset);
+    }
+    if (internal->ops3->read_buf) {
+        fuse3_trace(internal, FUSE3_OP_READ, path, fi, size, offset, 0);
+        /* The v2 library replies from (and frees) the filesystem's bufvec directly */
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->read_buf(path, (struct fuse3_bufvec **)bufp, size, offset, fuse3_file_info_get(fi));
+        fuse3_stats_record(internal, FUSE3_OP_READ, start, ret, ret == 0 ? fuse_buf_size(*bufp) : 0);
+        return ret;
+    }
+    return -ENOSYS;
+}
+
+static int fuse3_write_buf_wrapper(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    if (internal->ops3->write_buf) {
+        fuse3_trace(internal, FUSE3_OP_WRITE, path, fi, fuse_buf_size(buf), offset, 0);
+        struct fuse3_file_info *fi3 = fuse3_file_info_get(fi);
+        fi3->writepage = fi->writepage;
+        fuse3_cache_written(internal, path, fi);
+        uint64_t start = fuse3_stats_now();
+        int ret = internal->ops3->write_buf(path, (struct fuse3_bufvec *)buf, offset, fi3);
+        fuse3_stats_record(internal, FUSE3_OP_WRITE, start, ret, ret > 0 ? ret : 0);
+        return ret;
     }
     return -ENOSYS;
 }
 
+/* Report init() changes to options the v2 library fixed when the handle was created */
+#define FUSE3_CHECK_FIXED_OPTION(internal, field) do { \
+    if ((internal)->config.field != (internal)->cmdline_config.field) \
+        fuse3_error("init() changed " #field ", which this backend only takes as -o " #field); \
+} while (0)
+
+/* Take over what init() changed in the configuration */
+static void fuse3_apply_config(struct fuse3_internal *internal) {
+    const struct fuse3_config *cfg = &internal->config;
+    const struct fuse3_config *cmdline = &internal->cmdline_config;
+    
+    FUSE3_CHECK_FIXED_OPTION(internal, entry_timeout);
+    FUSE3_CHECK_FIXED_OPTION(internal, negative_timeout);
+    FUSE3_CHECK_FIXED_OPTION(internal, attr_timeout);
+    FUSE3_CHECK_FIXED_OPTION(internal, ac_attr_timeout);
+    FUSE3_CHECK_FIXED_OPTION(internal, intr);
+    FUSE3_CHECK_FIXED_OPTION(internal, intr_signal);
+    FUSE3_CHECK_FIXED_OPTION(internal, remember);
+    FUSE3_CHECK_FIXED_OPTION(internal, hard_remove);
+    FUSE3_CHECK_FIXED_OPTION(internal, use_ino);
+    FUSE3_CHECK_FIXED_OPTION(internal, readdir_ino);
+    FUSE3_CHECK_FIXED_OPTION(internal, nullpath_ok);
+    
+    /* Attribute overrides, direct_io and kernel_cache are applied by the wrappers */
+    internal->emulate_attr =
+        cfg->set_mode != cmdline->set_mode || cfg->umask != cmdline->umask ||
+        cfg->set_uid != cmdline->set_uid || cfg->uid != cmdline->uid ||
+        cfg->set_gid != cmdline->set_gid || cfg->gid != cmdline->gid;
+    if (cfg->auto_cache && !cmdline->auto_cache) {
+        internal->auto_cache = calloc(FUSE3_AUTO_CACHE_SLOTS, sizeof(struct fuse3_auto_cache_slot));
+        if (!internal->auto_cache) {
+            fuse3_error("Failed to allocate auto_cache table, auto_cache disabled");
+        }
+    } else if (!cfg->auto_cache && cmdline->auto_cache) {
+        fuse3_error("init() cleared auto_cache, which this backend only takes as -o noauto_cache");
+    }
+}
+
+static void *fuse3_init_wrapper(struct fuse_conn_info *conn) {
+    struct fuse3_internal *internal = fuse_get_context()->private_data;
+    
+#ifdef FUSE_CAP_BIG_WRITES
+    /* Writes larger than a page are always enabled in the v3 API */
+    conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_SPLICE_READ
+    /* Let fd-backed buffers move between the device and the filesystem via splice */
+    if (internal->ops3->read_buf) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    }
+    if (internal->ops3->write_buf) {
+        conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+    }
+#endif
+    
+    if (internal->ops3->init) {
+        struct fuse3_conn_info conn3;
+        convert_conn_info_2_to_3(conn, internal->max_read, &conn3);
+        internal->user_data = internal->ops3->init(&conn3, &internal->config);
+        convert_conn_info_3_to_2(&conn3, internal->max_read, conn);
+        fuse3_apply_config(internal);
+    }
+    convert_conn_info_2_to_3(conn, internal->max_read, &internal->conn);
+    fuse3_debug("Negotiated max_write %u, max_readahead %u", internal->conn.max_write, internal->conn.max_readahead);
+    
+    /* Becomes fuse_get_context()->private_data for every other operation */
+    return internal;
+}
+
+static void fuse3_destroy_wrapper(void *private_data) {
+    struct fuse3_internal *internal = private_data;
+    if (internal->ops3->destroy) {
+        internal->ops3->destroy(internal->user_data);
+    }
+}
+
+/* Map FUSE v3 operations to their v2 wrappers */
+void fuse3_fill_operations(const struct fuse3_operations *op, struct fuse_operations *ops2) {
+    memset(ops2, 0, sizeof(*ops2));
+    
+    if (op->getattr) ops2->getattr = fuse3_getattr_wrapper;
+    if (op->getattr) ops2->fgetattr = fuse3_fgetattr_wrapper;
+    if (op->readlink) ops2->readlink = fuse3_readlink_wrapper;
+    if (op->mknod) ops2->mknod = fuse3_mknod_wrapper;
+    if (op->mkdir) ops2->mkdir = fuse3_mkdir_wrapper;
+    if (op->unlink) ops2->unlink = fuse3_unlink_wrapper;
+    if (op->rmdir) ops2->rmdir = fuse3_rmdir_wrapper;
+    if (op->truncate) ops2->truncate = fuse3_truncate_wrapper;
+    if (op->truncate) ops2->ftruncate = fuse3_ftruncate_wrapper;
+    if (op->symlink) ops2->symlink = fuse3_symlink_wrapper;
+    if (op->rename) ops2->rename = fuse3_rename_wrapper;
+    if (op->link) ops2->link = fuse3_link_wrapper;
+    if (op->chmod) ops2->chmod = fuse3_chmod_wrapper;
+    if (op->chown) ops2->chown = fuse3_chown_wrapper;
+    if (op->utimens) ops2->utimens = fuse3_utimens_wrapper;
+    if (op->access) ops2->access = fuse3_access_wrapper;
+    if (op->statfs) ops2->statfs = fuse3_statfs_wrapper;
+    if (op->create) ops2->create = fuse3_create_wrapper;
+    if (op->read) ops2->read = fuse3_read_wrapper;
+    if (op->write) ops2->write = fuse3_write_wrapper;
+    if (op->read_buf) ops2->read_buf = fuse3_read_buf_wrapper;
+    if (op->write_buf) ops2->write_buf = fuse3_write_buf_wrapper;
+    if (op->flush) ops2->flush = fuse3_flush_wrapper;
+    if (op->fsync) ops2->fsync = fuse3_fsync_wrapper;
+    if (op->fsyncdir) ops2->fsyncdir = fuse3_fsyncdir_wrapper;
+    if (op->readdir) ops2->readdir = fuse3_readdir_wrapper;
+    if (op->poll) ops2->poll = fuse3_poll_wrapper;
+    if (op->fallocate) ops2->fallocate = fuse3_fallocate_wrapper;
+    if (op->ioctl || op->lseek) ops2->ioctl = fuse3_ioctl_wrapper;
+    /* Always installed: they own the per-handle file_info */
+    ops2->open = fuse3_open_wrapper;
+    ops2->release = fuse3_release_wrapper;
+    ops2->opendir = fuse3_opendir_wrapper;
+    ops2->releasedir = fuse3_releasedir_wrapper;
+    ops2->init = fuse3_init_wrapper;
+    ops2->destroy = fuse3_destroy_wrapper;
+}
+
 /* FUSE v3 API implementation */
 
+#define FUSE3_LIB_OPT(t, p, v) { t, offsetof(struct fuse3_internal, p), v }
+
+static const struct fuse_opt fuse3_lib_opts[] = {
+    /*
+     * Event loop options, taken out since the v2 library would reject them.
+     * fuse3_loop() is always single-threaded, so -s changes nothing; the
+     * others are the defaults for fuse3_loop_mt(f, NULL).
+     */
+    FUSE_OPT_KEY("-s", FUSE_OPT_KEY_DISCARD),
+    FUSE3_LIB_OPT("clone_fd", loop_config.clone_fd, 1),
+    FUSE3_LIB_OPT("max_idle_threads=%u", loop_config.max_idle_threads, 0),
+    FUSE3_LIB_OPT("no_readdirplus", no_readdirplus, 1),
+    /* Handled here through the v2 operation flags */
+    FUSE3_LIB_OPT("nullpath_ok", cmdline_config.nullpath_ok, 1),
+    FUSE3_LIB_OPT("stats_file", stats_file, 1),
+    FUSE3_LIB_OPT("trace_record=%s", trace_path, 0),
+    /* Library options, recorded for init() and passed on to the v2 library */
+    FUSE3_LIB_OPT("-d", cmdline_config.debug, 1),
+    FUSE3_LIB_OPT("debug", cmdline_config.debug, 1),
+    FUSE3_LIB_OPT("umask=", cmdline_config.set_mode, 1),
+    FUSE3_LIB_OPT("umask=%o", cmdline_config.umask, 0),
+    FUSE3_LIB_OPT("uid=", cmdline_config.set_uid, 1),
+    FUSE3_LIB_OPT("uid=%d", cmdline_config.uid, 0),
+    FUSE3_LIB_OPT("gid=", cmdline_config.set_gid, 1),
+    FUSE3_LIB_OPT("gid=%d", cmdline_config.gid, 0),
+    FUSE3_LIB_OPT("entry_timeout=%lf", cmdline_config.entry_timeout, 0),
+    FUSE3_LIB_OPT("attr_timeout=%lf", cmdline_config.attr_timeout, 0),
+    FUSE3_LIB_OPT("ac_attr_timeout=%lf", cmdline_config.ac_attr_timeout, 0),
+    FUSE3_LIB_OPT("ac_attr_timeout=", cmdline_config.ac_attr_timeout_set, 1),
+    FUSE3_LIB_OPT("negative_timeout=%lf", cmdline_config.negative_timeout, 0),
+    FUSE3_LIB_OPT("noforget", cmdline_config.remember, -1),
+    FUSE3_LIB_OPT("remember=%u", cmdline_config.remember, 0),
+    FUSE3_LIB_OPT("intr", cmdline_config.intr, 1),
+    FUSE3_LIB_OPT("intr_signal=%d", cmdline_config.intr_signal, 0),
+    FUSE3_LIB_OPT("hard_remove", cmdline_config.hard_remove, 1),
+    FUSE3_LIB_OPT("use_ino", cmdline_config.use_ino, 1),
+    FUSE3_LIB_OPT("readdir_ino", cmdline_config.readdir_ino, 1),
+    FUSE3_LIB_OPT("direct_io", cmdline_config.direct_io, 1),
+    FUSE3_LIB_OPT("kernel_cache", cmdline_config.kernel_cache, 1),
+    FUSE3_LIB_OPT("auto_cache", cmdline_config.auto_cache, 1),
+    FUSE3_LIB_OPT("noauto_cache", cmdline_config.auto_cache, 0),
+    FUSE3_LIB_OPT("max_read=%u", max_read, 0),
+    FUSE_OPT_KEY("-d", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("debug", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("umask=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("uid=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("gid=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("entry_timeout=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("attr_timeout=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("ac_attr_timeout=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("negative_timeout=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("noforget", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("remember=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("intr", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("intr_signal=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("hard_remove", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("use_ino", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("readdir_ino", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("direct_io", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("kernel_cache", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("auto_cache", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("noauto_cache", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_END
+};
+
+/* Everything else goes to the v2 library, except the mount point of a v2-style command line */
+static int fuse3_lib_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    struct fuse3_internal *internal = data;
+    (void)outargs;
+    
+    if (key != FUSE_OPT_KEY_NONOPT) {
+        return 1;
+    }
+    if (internal->mountpoint) {
+        fuse3_error("Unexpected argument: %s", arg);
+        return -1;
+    }
+    internal->mountpoint = strdup(arg);
+    return internal->mountpoint ? 0 : -1;
+}
+
+/* Gives back what fuse3_new() set up, once no v2 handle refers to it */
+static void fuse3_internal_free(struct fuse3_internal *internal) {
+    free(internal->auto_cache);
+    pthread_mutex_destroy(&internal->auto_cache_lock);
+    fuse3_trace_close(internal);
+    pthread_mutex_destroy(&internal->trace_lock);
+    fuse3_cache_destroy(&internal->cache);
+    fuse3_stats_destroy(internal);
+    fuse_opt_free_args(&internal->args);
+    free(internal->mountpoint);
+    free(internal);
+}
+
 struct fuse3 *fuse3_new(struct fuse3_args *args, const struct fuse3_operations *op, size_t op_size __attribute__((unused)), void *private_data) {
     if (!args || !op) {
         fuse3_error("Invalid arguments to fuse3_new");
@@ -180,7 +1162,7 @@ struct fuse3 *fuse3_new(struct fuse3_args *args, const struct fuse3_operations *
     openlog("fuse3_compat", LOG_PID | LOG_CONS, LOG_USER);
     fuse3_debug("Initializing FUSE3 compatibility layer");
     
-    struct fuse3_internal *internal = malloc(sizeof(struct fuse3_internal));
+    struct fuse3_internal *internal = calloc(1, sizeof(struct fuse3_internal));
     if (!internal) {
         fuse3_error("Failed to allocate memory for internal structure");
         return NULL;
@@ -190,67 +1172,141 @@ struct fuse3 *fuse3_new(struct fuse3_args *args, const struct fuse3_operations *
     internal->user_data = private_data;
     
     /* Create FUSE v2 operations structure */
-    struct fuse_operations ops2;
-    memset(&ops2, 0, sizeof(ops2));
-    
-    /* Map FUSE v3 operations to v2 equivalents */
-    if (op->getattr) ops2.getattr = fuse3_getattr_wrapper;
-    if (op->readlink) ops2.readlink = fuse3_readlink_wrapper;
-    if (op->mknod) ops2.mknod = fuse3_mknod_wrapper;
-    if (op->mkdir) ops2.mkdir = fuse3_mkdir_wrapper;
-    if (op->unlink) ops2.unlink = fuse3_unlink_wrapper;
-    if (op->rmdir) ops2.rmdir = fuse3_rmdir_wrapper;
-    if (op->open) ops2.open = fuse3_open_wrapper;
-    if (op->read) ops2.read = fuse3_read_wrapper;
-    if (op->write) ops2.write = fuse3_write_wrapper;
-    if (op->release) ops2.release = fuse3_release_wrapper;
-    
-    /* Convert args structure */
-    struct fuse_args args2 = { args->argc, args->argv, args->allocated };
+    struct fuse_operations *ops2 = &internal->ops2;
+    fuse3_fill_operations(op, ops2);
     
-    /* Extract mount point from arguments */
-    char *mountpoint = NULL;
-    if (args->argc > 1) {
-        mountpoint = args->argv[args->argc - 1];
+    /* Work on a private copy of the arguments so the caller's stay untouched */
+    struct fuse_args args2 = FUSE_ARGS_INIT(0, NULL);
+    for (int i = 0; i < args->argc; i++) {
+        if (fuse_opt_add_arg(&args2, args->argv[i]) == -1) {
+            fuse3_error("Failed to copy arguments");
+            fuse_opt_free_args(&args2);
+            free(internal);
+            return NULL;
+        }
     }
-    if (!mountpoint) {
-        fuse3_error("No mount point specified");
+    
+    /* Pick out the event loop options and record the library options, with v2 defaults */
+    internal->loop_config.max_idle_threads = FUSE3_DEFAULT_MAX_IDLE_THREADS;
+    internal->cmdline_config.entry_timeout = 1.0;
+    internal->cmdline_config.attr_timeout = 1.0;
+    internal->cmdline_config.negative_timeout = 0.0;
+    internal->cmdline_config.intr_signal = SIGUSR1;
+    if (fuse_opt_parse(&args2, internal, fuse3_lib_opts, fuse3_lib_opt_proc) == -1) {
+        fuse3_error("Failed to parse options");
+        fuse_opt_free_args(&args2);
+        free(internal->trace_path);
+        free(internal->mountpoint);
         free(internal);
         return NULL;
     }
+    internal->args = args2;
+    if (!internal->cmdline_config.ac_attr_timeout_set) {
+        internal->cmdline_config.ac_attr_timeout = internal->cmdline_config.attr_timeout;
+    }
+    internal->config = internal->cmdline_config;
+    if (internal->cmdline_config.debug) {
+        fuse3_set_trace(1);
+    }
+    
+    /* Operations on an open handle get no path at all, rather than one the library builds */
+    if (internal->cmdline_config.nullpath_ok) {
+        ops2->flag_nullpath_ok = 1;
+        ops2->flag_nopath = 1;
+    }
+    
+    /* The stats file needs these even if the filesystem doesn't implement them */
+    if (internal->stats_file) {
+        ops2->getattr = fuse3_getattr_wrapper;
+        if (!ops2->read_buf) ops2->read = fuse3_read_wrapper;
+    }
+    pthread_mutex_init(&internal->auto_cache_lock, NULL);
+    pthread_mutex_init(&internal->trace_lock, NULL);
+    if (internal->trace_path && fuse3_trace_open(internal) != 0) {
+        fuse3_error("Trace recording disabled");
+    }
+    if (op->readdir && fuse3_cache_init(&internal->cache) != 0) {
+        fuse3_error("Failed to allocate attribute cache, readdirplus disabled");
+    }
+    if (fuse3_stats_init(internal) != 0) {
+        fuse3_error("Failed to allocate statistics, fuse3_get_stats() disabled");
+    }
     
+    /*
+     * A mount point among the arguments mounts right away, as this layer
+     * used to; otherwise fuse3_mount() does, as with libfuse 3.
+     */
+    if (internal->mountpoint) {
+        char *mountpoint = internal->mountpoint;
+        internal->mountpoint = NULL;
+        int res = fuse3_mount((struct fuse3 *)internal, mountpoint);
+        free(mountpoint);
+        if (res != 0) {
+            fuse3_internal_free(internal);
+            return NULL;
+        }
+    }
+    
+    return (struct fuse3 *)internal;
+}
+
+int fuse3_mount(struct fuse3 *f, const char *mountpoint) {
+    struct fuse3_internal *internal = (struct fuse3_internal *)f;
+    if (!internal || !mountpoint) {
+        fuse3_error("Invalid arguments to fuse3_mount");
+        return -1;
+    }
+    if (internal->fuse2_handle) {
+        /* Already mounted by fuse3_new() */
+        if (strcmp(mountpoint, internal->mountpoint) != 0) {
+            fuse3_error("Already mounted at %s", internal->mountpoint);
+            return -1;
+        }
+        return 0;
+    }
+    
+    internal->mountpoint = strdup(mountpoint);
+    if (!internal->mountpoint) {
+        fuse3_error("Failed to allocate mount point");
+        return -1;
+    }
+    
+    if (fuse3_add_io_size_arg(&internal->args) == -1) {
+        fuse3_error("Failed to add the I/O size option, using the backend's default");
+    }
     fuse3_debug("Mounting filesystem at: %s", mountpoint);
     
     /* Create FUSE channel first (required for macFUSE) */
-    struct fuse_chan *ch = fuse_mount(mountpoint, &args2);
+    struct fuse_chan *ch = fuse_mount(mountpoint, &internal->args);
     if (!ch) {
         fuse3_error("Failed to mount filesystem at %s: %s", mountpoint, strerror(errno));
-        free(internal);
-        return NULL;
+        free(internal->mountpoint);
+        internal->mountpoint = NULL;
+        return -1;
     }
     
     /* Create FUSE v2 handle */
-    internal->fuse2_handle = fuse_new(ch, &args2, &ops2, sizeof(ops2), internal);
+    internal->fuse2_handle = fuse_new(ch, &internal->args, &internal->ops2, sizeof(internal->ops2), internal);
     if (!internal->fuse2_handle) {
         fuse3_error("Failed to create FUSE handle: %s", strerror(errno));
-        fuse_unmount(mountpoint, ch);
-        free(internal);
-        return NULL;
+        fuse_unmount(internal->mountpoint, ch);
+        free(internal->mountpoint);
+        internal->mountpoint = NULL;
+        return -1;
     }
     
-    return (struct fuse3 *)internal;
-}
-
-int fuse3_mount(struct fuse3 *f, const char *mountpoint) {
-    /* Mount functionality is handled during fuse3_new() in macFUSE */
-    (void)f;
-    (void)mountpoint;
+    fuse3_session_init(internal);
     return 0;
 }
 
 void fuse3_unmount(struct fuse3 *f) {
-    /* Unmount will be handled when destroying the handle */
-    (void)f;
+    struct fuse3_internal *internal = (struct fuse3_internal *)f;
+    if (!internal || !internal->session.ch) {
+        return;
+    }
+    fuse_session_remove_chan(internal->session.ch);
+    fuse_unmount(internal->mountpoint, internal->session.ch);
+    internal->session.ch = NULL;
 }
 
 int fuse3_loop(struct fuse3 *f) {
@@ -260,8 +1316,11 @@ int fuse3_loop(struct fuse3 *f) {
         return -1;
     }
     
+    /* One request at a time on this thread, as with libfuse 3 */
     fuse3_debug("Starting FUSE event loop");
+    fuse3_stats_thread_enter(internal);
     int ret = fuse_loop(internal->fuse2_handle);
+    fuse3_stats_thread_leave(internal);
     if (ret < 0) {
         fuse3_error("FUSE loop failed: %s", strerror(-ret));
     }
@@ -274,41 +1333,166 @@ void fuse3_destroy(struct fuse3 *f) {
     
     fuse3_debug("Destroying FUSE3 handle");
     
+    fuse3_unmount(f);
     if (internal->fuse2_handle) {
         fuse_destroy(internal->fuse2_handle);
     }
-    free(internal);
+    fuse3_internal_free(internal);
+    /* Give queued messages a chance to reach syslog before it is closed */
+    fuse3_log_flush(1000);
     closelog();
 }
 
-struct fuse3_session *fuse3_get_session(struct fuse3 *f) {
-    /* Return a dummy session for compatibility */
-    return (struct fuse3_session *)f;
+/* Drop what the layer itself remembers about a path */
+static void fuse3_forget_path(struct fuse3_internal *internal, const char *path) {
+    fuse3_cache_invalidate(&internal->cache, path);
+    if (internal->auto_cache) {
+        uint64_t hash = fuse3_cache_hash(path);
+        struct fuse3_auto_cache_slot *slot = &internal->auto_cache[hash % FUSE3_AUTO_CACHE_SLOTS];
+        pthread_mutex_lock(&internal->auto_cache_lock);
+        if (slot->hash == hash) {
+            slot->hash = 0;
+        }
+        pthread_mutex_unlock(&internal->auto_cache_lock);
+    }
+}
+
+/*
+ * The v2 library owns the table of nodes the kernel knows, so it does the
+ * path lookup and sends the inval_inode notification. Only macFUSE does:
+ * libfuse 2's fuse_invalidate() is a stub that fails with -EINVAL, and the
+ * node table the low-level notifications need is private to the library.
+ */
+int fuse3_invalidate_path(struct fuse3 *f, const char *path) {
+    struct fuse3_internal *internal = (struct fuse3_internal *)f;
+    if (!internal || !internal->fuse2_handle || !path) {
+        return -EINVAL;
+    }
+    
+    fuse3_forget_path(internal, path);
+#ifdef __APPLE__
+    int res = fuse_invalidate(internal->fuse2_handle, path);
+#else
+    int res = -ENOSYS;
+#endif
+    fuse3_debug("invalidate %s: %d", path, res);
+    return res;
+}
+
+/* The v2 library can only invalidate whole files, which covers any range */
+int fuse3_invalidate_range(struct fuse3 *f, const char *path, off_t off, off_t len) {
+    if (off < 0 || len < 0) {
+        return -EINVAL;
+    }
+    return fuse3_invalidate_path(f, path);
+}
+
+/*
+ * The kernel drops the node once revalidating it fails with ENOENT, and
+ * rereads the parent directory's listing.
+ */
+int fuse3_notify_delete(struct fuse3 *f, const char *path) {
+    int res = fuse3_invalidate_path(f, path);
+    if (res < 0 && res != -ENOENT) {
+        return res;
+    }
+    
+    const char *slash = path ? strrchr(path, '/') : NULL;
+    if (!slash) {
+        return 0;
+    }
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    char parent[len + 1];
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    res = fuse3_invalidate_path(f, parent);
+    return res == -ENOENT ? 0 : res;
 }
 
-int fuse3_session_loop(struct fuse3_session *se) {
-    /* Use fuse3_loop instead */
-    return fuse3_loop((struct fuse3 *)se);
+int fuse3_notify_poll(struct fuse3_pollhandle *ph) {
+    return fuse_notify_poll((struct fuse_pollhandle *)ph);
 }
 
+void fuse3_pollhandle_destroy(struct fuse3_pollhandle *ph) {
+    fuse_pollhandle_destroy((struct fuse_pollhandle *)ph);
+}
+
+/*
+ * The kernel sends an interrupt when the process waiting on the request is
+ * signalled; the v2 library marks the request, and with -o intr also sends
+ * intr_signal to the thread running it.
+ */
+int fuse3_interrupted(void) {
+    return fuse_interrupted();
+}
+
+struct fuse3_context *fuse3_get_context(void) {
+    static __thread struct fuse3_context context;
+    struct fuse_context *context2 = fuse_get_context();
+    struct fuse3_internal *internal = context2->private_data;
+    
+    context.fuse = (struct fuse3 *)internal;
+    context.uid = context2->uid;
+    context.gid = context2->gid;
+    context.pid = context2->pid;
+    context.private_data = internal ? internal->user_data : NULL;
+    context.umask = context2->umask;
+    return &context;
+}
+
+#define FUSE3_CMDLINE_OPT(t, p, v) { t, offsetof(struct fuse3_cmdline_opts, p), v }
+
+static const struct fuse_opt fuse3_cmdline_spec[] = {
+    FUSE3_CMDLINE_OPT("-h", show_help, 1),
+    FUSE3_CMDLINE_OPT("--help", show_help, 1),
+    FUSE3_CMDLINE_OPT("-V", show_version, 1),
+    FUSE3_CMDLINE_OPT("--version", show_version, 1),
+    FUSE3_CMDLINE_OPT("-d", debug, 1),
+    FUSE3_CMDLINE_OPT("debug", debug, 1),
+    FUSE3_CMDLINE_OPT("clone_fd", clone_fd, 1),
+    FUSE3_CMDLINE_OPT("max_idle_threads=%u", max_idle_threads, 0),
+    /* Left in place for fuse_parse_cmdline() */
+    FUSE_OPT_KEY("-h", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("--help", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("-V", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("--version", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("-d", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("debug", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_END
+};
+
 int fuse3_parse_cmdline(struct fuse3_args *args, struct fuse3_cmdline_opts *opts) {
     /* Convert to FUSE v2 args and parse */
     struct fuse_args args2 = { args->argc, args->argv, args->allocated };
+    struct fuse3_cmdline_opts local_opts;
     
     char *mountpoint = NULL;
     int multithreaded = 0;
     int foreground = 0;
     
-    int ret = fuse_parse_cmdline(&args2, &mountpoint, &multithreaded, &foreground);
+    if (!opts) {
+        opts = &local_opts;
+    }
+    memset(opts, 0, sizeof(*opts));
+    opts->max_idle_threads = FUSE3_DEFAULT_MAX_IDLE_THREADS;
+    
+    /* Take out the v3-only options first, the v2 parser doesn't know them */
+    int ret = fuse_opt_parse(&args2, opts, fuse3_cmdline_spec, NULL);
+    if (ret == 0) {
+        ret = fuse_parse_cmdline(&args2, &mountpoint, &multithreaded, &foreground);
+    }
     
     /* Update original args */
     args->argc = args2.argc;
     args->argv = args2.argv;
     args->allocated = args2.allocated;
     
-    if (opts && ret == 0) {
-        memset(opts, 0, sizeof(*opts));
-        /* Set basic options - extend as needed */
+    if (ret == 0 && opts != &local_opts) {
+        opts->singlethread = !multithreaded;
+        opts->foreground = foreground;
+        /* Owned by the caller from here on, as with libfuse 3 */
+        opts->mountpoint = mountpoint;
+        mountpoint = NULL;
     }
     
     if (mountpoint) {
@@ -316,4 +1500,12 @@ int fuse3_parse_cmdline(struct fuse3_args *args, struct fuse3_cmdline_opts *opts
     }
     
     return ret;
-}
\ No newline at end of file
+}
+
+void fuse3_opt_free_args(struct fuse3_args *args) {
+    struct fuse_args args2 = { args->argc, args->argv, args->allocated };
+    fuse_opt_free_args(&args2);
+    args->argc = 0;
+    args->argv = NULL;
+    args->allocated = 0;
+}
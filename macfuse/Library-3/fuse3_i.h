@@ -0,0 +1,273 @@
+#ifndef FUSE3_I_H
+#define FUSE3_I_H
+
+/*
+ * Internal definitions shared by the FUSE v3 compatibility layer sources.
+ * Not installed; applications only ever see fuse3.h.
+ */
+
+#include "fuse3.h"
+#undef FUSE_MAJOR_VERSION
+#undef FUSE_MINOR_VERSION
+#include <fuse/fuse.h>  // macFUSE v2 API
+#include <fuse/fuse_lowlevel.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Logging, see fuse3_log.c. fuse3_debug is a tracepoint: unless tracing has
+ * been switched on its arguments aren't even evaluated.
+ */
+extern int fuse3_trace_enabled;
+
+void fuse3_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void fuse3_log_flush(int timeout_ms);
+void fuse3_log_counters(uint64_t *dropped, uint64_t *suppressed);
+
+#define fuse3_debug(fmt, ...) do { \
+    if (__builtin_expect(__atomic_load_n(&fuse3_trace_enabled, __ATOMIC_RELAXED), 0)) \
+        fuse3_log(LOG_DEBUG, fmt, ##__VA_ARGS__); \
+} while (0)
+
+#define fuse3_error(fmt, ...) fuse3_log(LOG_ERR, fmt, ##__VA_ARGS__)
+
+/* Default for fuse3_loop_config.max_idle_threads, same as libfuse 3 */
+#define FUSE3_DEFAULT_MAX_IDLE_THREADS 10
+
+/*
+ * Largest transfer asked of the kernel, as in libfuse 3. macFUSE takes it
+ * as the iosize mount option; libfuse 2 on Linux is held to 128 KiB by its
+ * own request buffer.
+ */
+#define FUSE3_MAX_IO_SIZE (1 << 20)
+
+/* Slots in the table that emulates auto_cache when init() turns it on */
+#define FUSE3_AUTO_CACHE_SLOTS 1024
+
+struct fuse3_auto_cache_slot {
+    uint64_t hash;
+    time_t mtime;
+    long mtime_nsec;
+    off_t size;
+};
+
+/* Attribute cache fed by FUSE3_FILL_DIR_PLUS: 64 shards of 128 slots */
+#define FUSE3_ATTR_CACHE_SHARDS 64
+#define FUSE3_ATTR_CACHE_SHARD_SLOTS 128
+
+/* Directory listings kept for cache_readdir; larger directories are only streamed */
+#define FUSE3_DIR_CACHE_SLOTS 64
+#define FUSE3_DIR_CACHE_MAX_ENTRIES 65536
+
+struct fuse3_attr_slot {
+    uint64_t hash;
+    char *path;
+    struct stat st;
+    double expires;
+};
+
+struct fuse3_attr_shard {
+    pthread_mutex_t lock;
+    struct fuse3_attr_slot slots[FUSE3_ATTR_CACHE_SHARD_SLOTS];
+};
+
+struct fuse3_dirent {
+    char *name;
+    struct stat st;
+    int has_st;
+    int plus;
+};
+
+/* Immutable once complete; shared between the cache and open directory handles */
+struct fuse3_dirlist {
+    int refcount;
+    size_t count;
+    size_t capacity;
+    struct fuse3_dirent *entries;
+};
+
+struct fuse3_dir_slot {
+    uint64_t hash;
+    char *path;
+    struct fuse3_dirlist *list;
+};
+
+struct fuse3_cache {
+    struct fuse3_attr_shard *attr_shards;
+    struct fuse3_dir_slot *dir_slots;
+    pthread_mutex_t dir_lock;
+    uint64_t gen;  /* bumped after anything is stored; atomic */
+};
+
+/*
+ * Statistics shards: each event loop thread owns one while it runs and
+ * updates it without atomic read-modify-write. Threads beyond this many, and
+ * threads outside the event loops, share one updated with atomics.
+ */
+#define FUSE3_STATS_SHARDS 64
+
+/* Name of the hidden file that shows the statistics with -o stats_file */
+#define FUSE3_STATS_FILE "/.fuse3_stats"
+
+struct fuse3_stats_shard {
+    struct fuse3_op_stats ops[FUSE3_OP_COUNT];
+    struct fuse3_op_stats requests;
+    int owned;
+} __attribute__((aligned(64)));
+
+/*
+ * The v2 session and its one channel. Embedded in fuse3_internal for
+ * fuse3_get_session(), or first in a low-level filesystem's own state.
+ */
+struct fuse3_session {
+    struct fuse3_internal *internal;  /* NULL for low-level sessions */
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    size_t bufsize;
+};
+
+/*
+ * Trace files written by -o trace_record=FILE and read by bench/bench_replay:
+ * the magic, then one record per operation followed by path_len bytes of
+ * path (no NUL). Fields are in host byte order.
+ */
+#define FUSE3_TRACE_MAGIC "FUSE3TR1"
+
+struct fuse3_trace_record {
+    uint64_t time_ns;   /* since recording started */
+    uint64_t handle;    /* open file or directory, 0 for path operations */
+    uint64_t size;      /* read/write/readlink size */
+    int64_t offset;     /* read/write/readdir offset, new length for truncate */
+    uint32_t op;        /* enum fuse3_op */
+    uint32_t flags;     /* open flags */
+    uint32_t mode;      /* create/mkdir/mknod mode */
+    uint32_t path_len;
+};
+
+/* Internal mapping structure */
+struct fuse3_internal {
+    struct fuse *fuse2_handle;
+    struct fuse3_session session;
+    const struct fuse3_operations *ops3;
+    void *user_data;  /* replaced by the return value of init() */
+
+    /* Kept from fuse3_new() for fuse3_mount(), which creates the v2 handle */
+    struct fuse_args args;
+    struct fuse_operations ops2;
+    char *mountpoint;
+
+    /* Loop options picked out of the fuse3_new() arguments */
+    struct fuse3_loop_config loop_config;
+
+    /*
+     * Library options as given on the command line, and as left by init().
+     * The v2 library only sees the former, so the wrappers apply whatever
+     * init() changed on top.
+     */
+    struct fuse3_config cmdline_config;
+    struct fuse3_config config;
+    unsigned int max_read;
+    struct fuse3_conn_info conn;  /* as negotiated, once init() has run */
+    int emulate_attr;
+    struct fuse3_auto_cache_slot *auto_cache;
+    pthread_mutex_t auto_cache_lock;
+
+    /* readdir: ask for attributes with every entry unless -o no_readdirplus */
+    int no_readdirplus;
+    struct fuse3_cache cache;
+
+    /* Always on unless the shared shard couldn't be allocated */
+    struct fuse3_stats_shard *stats;
+    struct fuse3_stats_shard *stats_shards[FUSE3_STATS_SHARDS];
+    pthread_mutex_t stats_lock;
+    uint64_t stats_id;  /* tells the shard a thread owns for this handle from one for another */
+    int stats_file;
+
+    /* NULL unless -o trace_record was given */
+    char *trace_path;
+    FILE *trace;
+    uint64_t trace_start;
+    pthread_mutex_t trace_lock;
+};
+
+/* fuse3_compat.c */
+void fuse3_fill_operations(const struct fuse3_operations *op, struct fuse_operations *ops2);
+void convert_file_info_2_to_3(const struct fuse_file_info *fi2, struct fuse3_file_info *fi3);
+void convert_conn_info_2_to_3(const struct fuse_conn_info *conn2, unsigned int max_read, struct fuse3_conn_info *conn3);
+void convert_conn_info_3_to_2(const struct fuse3_conn_info *conn3, unsigned int max_read, struct fuse_conn_info *conn2);
+int fuse3_add_io_size_arg(struct fuse_args *args);
+
+/* fuse3_session.c */
+void fuse3_session_init(struct fuse3_internal *internal);
+
+/* fuse3_loop_mt.c */
+int fuse3_run_loop_mt(struct fuse3_internal *internal, struct fuse_session *se, unsigned int max_idle);
+
+/* fuse3_cache.c */
+uint64_t fuse3_cache_hash(const char *path);
+int fuse3_cache_init(struct fuse3_cache *cache);
+void fuse3_cache_destroy(struct fuse3_cache *cache);
+void fuse3_cache_invalidate(struct fuse3_cache *cache, const char *path);
+void fuse3_cache_invalidate_tree(struct fuse3_cache *cache, const char *dir);
+uint64_t fuse3_cache_gen(struct fuse3_cache *cache);
+void fuse3_cache_invalidate_since(struct fuse3_cache *cache, const char *path, uint64_t *seen);
+void fuse3_attr_cache_put(struct fuse3_cache *cache, const char *path, const struct stat *st, double ttl);
+int fuse3_attr_cache_take(struct fuse3_cache *cache, const char *path, struct stat *st);
+struct fuse3_dirlist *fuse3_dirlist_new(void);
+int fuse3_dirlist_add(struct fuse3_dirlist *list, const char *name, const struct stat *st, int plus);
+struct fuse3_dirlist *fuse3_dirlist_ref(struct fuse3_dirlist *list);
+void fuse3_dirlist_release(struct fuse3_dirlist *list);
+struct fuse3_dirlist *fuse3_dir_cache_get(struct fuse3_cache *cache, const char *path);
+void fuse3_dir_cache_set(struct fuse3_cache *cache, const char *path, struct fuse3_dirlist *list);
+void fuse3_dir_cache_drop(struct fuse3_cache *cache, const char *path);
+
+/* fuse3_stats.c */
+int fuse3_stats_init(struct fuse3_internal *internal);
+void fuse3_stats_destroy(struct fuse3_internal *internal);
+void fuse3_stats_thread_enter(struct fuse3_internal *internal);
+void fuse3_stats_thread_leave(struct fuse3_internal *internal);
+void fuse3_stats_record(struct fuse3_internal *internal, enum fuse3_op op, uint64_t start, int ret, uint64_t bytes);
+void fuse3_stats_record_request(struct fuse3_internal *internal, uint64_t start);
+int fuse3_stats_file_getattr(struct stat *stbuf);
+int fuse3_stats_file_open(struct fuse3_internal *internal, struct fuse_file_info *fi);
+int fuse3_stats_file_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset);
+int fuse3_stats_file_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t size, off_t offset);
+void fuse3_stats_file_release(struct fuse_file_info *fi);
+
+/* fuse3_trace.c */
+int fuse3_trace_open(struct fuse3_internal *internal);
+void fuse3_trace_close(struct fuse3_internal *internal);
+void fuse3_trace_write(struct fuse3_internal *internal, enum fuse3_op op, const char *path, const struct fuse_file_info *fi, uint64_t size, off_t offset, mode_t mode);
+
+static inline uint64_t fuse3_stats_now(void) {
+#ifdef __APPLE__
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Open handles of the stats file are tagged in the low bit of fh */
+#define FUSE3_STATS_FH_TAG 1
+
+static inline int fuse3_stats_file_handle(const struct fuse_file_info *fi) {
+    return (fi->fh & FUSE3_STATS_FH_TAG) != 0;
+}
+
+static inline int fuse3_stats_file_path(const struct fuse3_internal *internal, const char *path) {
+    return internal->stats_file && path && strcmp(path, FUSE3_STATS_FILE) == 0;
+}
+
+/* Records the operation if a trace is being recorded; fi gives the handle and open flags */
+static inline void fuse3_trace(struct fuse3_internal *internal, enum fuse3_op op, const char *path, const struct fuse_file_info *fi, uint64_t size, off_t offset, mode_t mode) {
+    if (__builtin_expect(internal->trace != NULL, 0)) {
+        fuse3_trace_write(internal, op, path, fi, size, offset, mode);
+    }
+}
+
+#endif /* FUSE3_I_H */
@@ -0,0 +1,230 @@
+/*
+ * Logging for the FUSE v3 compatibility layer
+ *
+ * Messages are formatted on the calling thread into a bounded ring and
+ * written to stderr and syslog by a background thread, so a slow terminal or
+ * a stuck syslogd never holds up a request. Errors are rate limited per call
+ * site; messages that don't fit in the ring are dropped and counted.
+ */
+
+#include "fuse3_i.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#define FUSE3_LOG_RING 256
+#define FUSE3_LOG_MSG_MAX 256
+
+/* Each call site may log this many errors per interval, the rest are suppressed */
+#define FUSE3_LOG_BURST 10
+#define FUSE3_LOG_INTERVAL_NS 1000000000ULL
+#define FUSE3_LOG_SITES 64
+
+struct fuse3_log_entry {
+    int level;
+    char msg[FUSE3_LOG_MSG_MAX];
+};
+
+struct fuse3_log_site {
+    const char *fmt;
+    uint64_t window_start;
+    unsigned int count;
+    unsigned int suppressed;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_cond_t drained;
+    struct fuse3_log_entry ring[FUSE3_LOG_RING];
+    unsigned int head;
+    unsigned int count;
+    int writing;
+    int started;
+    uint64_t dropped;
+    uint64_t dropped_reported;
+    uint64_t suppressed;
+    struct fuse3_log_site sites[FUSE3_LOG_SITES];
+} fuse3_log_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+    .drained = PTHREAD_COND_INITIALIZER,
+};
+
+#ifdef FUSE3_DEBUG
+int fuse3_trace_enabled = 1;
+#else
+int fuse3_trace_enabled = 0;
+#endif
+
+void fuse3_set_trace(int enable) {
+    __atomic_store_n(&fuse3_trace_enabled, enable != 0, __ATOMIC_RELAXED);
+}
+
+static void fuse3_log_write(int level, const char *msg) {
+    if (level == LOG_DEBUG) {
+        fprintf(stderr, "FUSE3_COMPAT: %s\n", msg);
+    } else {
+        fprintf(stderr, "FUSE3_COMPAT ERROR: %s\n", msg);
+        syslog(level, "FUSE3_COMPAT ERROR: %s", msg);
+    }
+}
+
+static void *fuse3_log_thread(void *data) {
+    struct fuse3_log_entry entry;
+    (void) data;
+
+    pthread_mutex_lock(&fuse3_log_state.lock);
+    for (;;) {
+        while (fuse3_log_state.count == 0 &&
+               fuse3_log_state.dropped == fuse3_log_state.dropped_reported) {
+            pthread_cond_broadcast(&fuse3_log_state.drained);
+            pthread_cond_wait(&fuse3_log_state.wakeup, &fuse3_log_state.lock);
+        }
+
+        if (fuse3_log_state.count == 0) {
+            uint64_t dropped = fuse3_log_state.dropped - fuse3_log_state.dropped_reported;
+            fuse3_log_state.dropped_reported = fuse3_log_state.dropped;
+            entry.level = LOG_WARNING;
+            snprintf(entry.msg, sizeof(entry.msg), "log buffer full, %llu messages dropped",
+                     (unsigned long long)dropped);
+        } else {
+            entry = fuse3_log_state.ring[fuse3_log_state.head];
+            fuse3_log_state.head = (fuse3_log_state.head + 1) % FUSE3_LOG_RING;
+            fuse3_log_state.count--;
+        }
+        fuse3_log_state.writing = 1;
+        pthread_mutex_unlock(&fuse3_log_state.lock);
+
+        fuse3_log_write(entry.level, entry.msg);
+
+        pthread_mutex_lock(&fuse3_log_state.lock);
+        fuse3_log_state.writing = 0;
+    }
+    return NULL;
+}
+
+/* Called with the lock held */
+static void fuse3_log_start(void) {
+    sigset_t oldset;
+    sigset_t newset;
+    pthread_t thread_id;
+
+    fuse3_log_state.started = -1;
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    if (pthread_create(&thread_id, NULL, fuse3_log_thread, NULL) == 0) {
+        pthread_detach(thread_id);
+        fuse3_log_state.started = 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+static void fuse3_log_push(int level, const char *msg) {
+    pthread_mutex_lock(&fuse3_log_state.lock);
+    if (!fuse3_log_state.started) {
+        fuse3_log_start();
+    }
+    if (fuse3_log_state.started < 0) {
+        /* No thread to hand the message to: write it here */
+        pthread_mutex_unlock(&fuse3_log_state.lock);
+        fuse3_log_write(level, msg);
+        return;
+    }
+    if (fuse3_log_state.count == FUSE3_LOG_RING) {
+        fuse3_log_state.dropped++;
+    } else {
+        unsigned int tail = (fuse3_log_state.head + fuse3_log_state.count) % FUSE3_LOG_RING;
+        struct fuse3_log_entry *entry = &fuse3_log_state.ring[tail];
+        entry->level = level;
+        strncpy(entry->msg, msg, sizeof(entry->msg) - 1);
+        entry->msg[sizeof(entry->msg) - 1] = '\0';
+        fuse3_log_state.count++;
+    }
+    pthread_cond_signal(&fuse3_log_state.wakeup);
+    pthread_mutex_unlock(&fuse3_log_state.lock);
+}
+
+/*
+ * Returns how many messages from this call site were suppressed before this
+ * one is let through, or -1 if it is to be suppressed as well.
+ */
+static int fuse3_log_ratelimit(const char *fmt) {
+    struct fuse3_log_site *site = &fuse3_log_state.sites[((uintptr_t)fmt >> 3) % FUSE3_LOG_SITES];
+    uint64_t now = fuse3_stats_now();
+    int ret;
+
+    pthread_mutex_lock(&fuse3_log_state.lock);
+    if (site->fmt != fmt || now - site->window_start >= FUSE3_LOG_INTERVAL_NS) {
+        ret = site->fmt == fmt ? (int)site->suppressed : 0;
+        site->fmt = fmt;
+        site->window_start = now;
+        site->count = 1;
+        site->suppressed = 0;
+    } else if (site->count < FUSE3_LOG_BURST) {
+        site->count++;
+        ret = 0;
+    } else {
+        site->suppressed++;
+        fuse3_log_state.suppressed++;
+        ret = -1;
+    }
+    pthread_mutex_unlock(&fuse3_log_state.lock);
+    return ret;
+}
+
+void fuse3_log(int level, const char *fmt, ...) {
+    char msg[FUSE3_LOG_MSG_MAX];
+    va_list ap;
+    int suppressed = 0;
+
+    if (level != LOG_DEBUG) {
+        suppressed = fuse3_log_ratelimit(fmt);
+        if (suppressed < 0) {
+            return;
+        }
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    fuse3_log_push(level, msg);
+
+    if (suppressed > 0) {
+        snprintf(msg, sizeof(msg), "%d similar messages suppressed", suppressed);
+        fuse3_log_push(level, msg);
+    }
+}
+
+/* Wait up to timeout_ms for queued messages to be written */
+void fuse3_log_flush(int timeout_ms) {
+    struct timeval now;
+    struct timespec deadline;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&fuse3_log_state.lock);
+    while (fuse3_log_state.started > 0 &&
+           (fuse3_log_state.count || fuse3_log_state.writing ||
+            fuse3_log_state.dropped != fuse3_log_state.dropped_reported)) {
+        if (pthread_cond_timedwait(&fuse3_log_state.drained, &fuse3_log_state.lock, &deadline) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fuse3_log_state.lock);
+}
+
+void fuse3_log_counters(uint64_t *dropped, uint64_t *suppressed) {
+    pthread_mutex_lock(&fuse3_log_state.lock);
+    *dropped = fuse3_log_state.dropped;
+    *suppressed = fuse3_log_state.suppressed;
+    pthread_mutex_unlock(&fuse3_log_state.lock);
+}
@@ -0,0 +1,301 @@
+/*
+ * Multithreaded event loop for the FUSE v3 compatibility layer
+ *
+ * A worker pool over the v2 session/channel API, modelled on libfuse 3's
+ * fuse_loop_mt.c: each worker reads one request from the channel and
+ * processes it. When the last idle worker picks up a request a new worker is
+ * started, so there is always a thread waiting on the device. Workers beyond
+ * max_idle_threads exit as soon as they become idle again.
+ */
+
+#include "fuse3_i.h"
+#include "fuse3_lowlevel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+struct fuse3_mt;
+
+struct fuse3_worker {
+    struct fuse3_worker *prev;
+    struct fuse3_worker *next;
+    pthread_t thread_id;
+    size_t bufsize;
+    char *buf;
+    struct fuse3_mt *mt;
+};
+
+struct fuse3_mt {
+    pthread_mutex_t lock;
+    pthread_cond_t finish;
+    int numworker;
+    int numavail;
+    struct fuse3_internal *internal;
+    struct fuse_session *se;
+    struct fuse_chan *prevch;
+    struct fuse3_worker main;
+    unsigned int max_idle;
+    int exit;
+    int error;
+};
+
+static void list_add_worker(struct fuse3_worker *w, struct fuse3_worker *next) {
+    struct fuse3_worker *prev = next->prev;
+    w->next = next;
+    w->prev = prev;
+    prev->next = w;
+    next->prev = w;
+}
+
+static void list_del_worker(struct fuse3_worker *w) {
+    struct fuse3_worker *prev = w->prev;
+    struct fuse3_worker *next = w->next;
+    prev->next = next;
+    next->prev = prev;
+}
+
+static int fuse3_loop_start_worker(struct fuse3_mt *mt);
+
+static void *fuse3_do_work(void *data) {
+    struct fuse3_worker *w = (struct fuse3_worker *)data;
+    struct fuse3_mt *mt = w->mt;
+
+    while (!fuse_session_exited(mt->se)) {
+        struct fuse_chan *ch = mt->prevch;
+        struct fuse_buf fbuf = {
+            .mem = w->buf,
+            .size = w->bufsize,
+        };
+        int res;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(mt->se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(mt->se);
+                mt->error = -1;
+            }
+            break;
+        }
+        uint64_t start = fuse3_stats_now();
+
+        pthread_mutex_lock(&mt->lock);
+        if (mt->exit) {
+            pthread_mutex_unlock(&mt->lock);
+            return NULL;
+        }
+
+        /*
+         * This was the last idle worker: start another one so that the
+         * next request doesn't wait for this one to finish.
+         */
+        mt->numavail--;
+        if (mt->numavail == 0)
+            fuse3_loop_start_worker(mt);
+        pthread_mutex_unlock(&mt->lock);
+
+        fuse_session_process_buf(mt->se, &fbuf, ch);
+        fuse3_stats_record_request(mt->internal, start);
+
+        pthread_mutex_lock(&mt->lock);
+        mt->numavail++;
+        if ((unsigned int)mt->numavail > mt->max_idle) {
+            if (mt->exit) {
+                pthread_mutex_unlock(&mt->lock);
+                return NULL;
+            }
+            /* Once off the list the loop may return without waiting for us */
+            fuse3_stats_thread_leave(mt->internal);
+            list_del_worker(w);
+            mt->numavail--;
+            mt->numworker--;
+            pthread_mutex_unlock(&mt->lock);
+
+            pthread_detach(w->thread_id);
+            free(w->buf);
+            free(w);
+            return NULL;
+        }
+        pthread_mutex_unlock(&mt->lock);
+    }
+
+    pthread_mutex_lock(&mt->lock);
+    pthread_cond_broadcast(&mt->finish);
+    pthread_mutex_unlock(&mt->lock);
+    return NULL;
+}
+
+/* Start a thread with all signals blocked, so they are delivered to the main thread */
+static void *fuse3_worker_main(void *data) {
+    struct fuse3_worker *w = (struct fuse3_worker *)data;
+    struct fuse3_internal *internal = w->mt->internal;
+
+    fuse3_stats_thread_enter(internal);
+    fuse3_do_work(w);
+    fuse3_stats_thread_leave(internal);
+    return NULL;
+}
+
+static int fuse3_start_thread(pthread_t *thread_id, void *(*func)(void *), void *arg) {
+    sigset_t oldset;
+    sigset_t newset;
+    int res;
+
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    res = pthread_create(thread_id, NULL, func, arg);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (res != 0) {
+        fuse3_error("Failed to create worker thread: %s", strerror(res));
+        return -1;
+    }
+    return 0;
+}
+
+/* Called with mt->lock held */
+static int fuse3_loop_start_worker(struct fuse3_mt *mt) {
+    struct fuse3_worker *w = calloc(1, sizeof(struct fuse3_worker));
+    if (!w) {
+        fuse3_error("Failed to allocate worker");
+        return -1;
+    }
+
+    w->bufsize = fuse_chan_bufsize(mt->prevch);
+    w->buf = malloc(w->bufsize);
+    w->mt = mt;
+    if (!w->buf) {
+        fuse3_error("Failed to allocate worker buffer");
+        free(w);
+        return -1;
+    }
+
+    if (fuse3_start_thread(&w->thread_id, fuse3_worker_main, w) != 0) {
+        free(w->buf);
+        free(w);
+        return -1;
+    }
+    list_add_worker(w, &mt->main);
+    mt->numavail++;
+    mt->numworker++;
+
+    return 0;
+}
+
+static void fuse3_loop_join_worker(struct fuse3_mt *mt, struct fuse3_worker *w) {
+    pthread_join(w->thread_id, NULL);
+    pthread_mutex_lock(&mt->lock);
+    list_del_worker(w);
+    pthread_mutex_unlock(&mt->lock);
+    free(w->buf);
+    free(w);
+}
+
+/* internal is NULL for low-level sessions, which keep no statistics */
+int fuse3_run_loop_mt(struct fuse3_internal *internal, struct fuse_session *se, unsigned int max_idle) {
+    struct fuse3_mt mt;
+    struct fuse3_worker *w;
+    int err;
+
+    memset(&mt, 0, sizeof(struct fuse3_mt));
+    mt.internal = internal;
+    mt.se = se;
+    mt.prevch = fuse_session_next_chan(se, NULL);
+    mt.max_idle = max_idle;
+    mt.main.thread_id = pthread_self();
+    mt.main.prev = mt.main.next = &mt.main;
+    pthread_mutex_init(&mt.lock, NULL);
+    pthread_cond_init(&mt.finish, NULL);
+
+    pthread_mutex_lock(&mt.lock);
+    err = fuse3_loop_start_worker(&mt);
+    if (!err) {
+        /*
+         * fuse_session_exit() may be called from a signal handler, which
+         * can't signal the condition variable, so poll for it as well.
+         */
+        while (!fuse_session_exited(se)) {
+            struct timeval now;
+            struct timespec timeout;
+
+            gettimeofday(&now, NULL);
+            timeout.tv_sec = now.tv_sec + 1;
+            timeout.tv_nsec = now.tv_usec * 1000;
+            pthread_cond_timedwait(&mt.finish, &mt.lock, &timeout);
+        }
+
+        for (w = mt.main.next; w != &mt.main; w = w->next)
+            pthread_cancel(w->thread_id);
+        mt.exit = 1;
+    }
+    pthread_mutex_unlock(&mt.lock);
+
+    while (mt.main.next != &mt.main)
+        fuse3_loop_join_worker(&mt, mt.main.next);
+
+    if (!err)
+        err = mt.error;
+
+    pthread_cond_destroy(&mt.finish);
+    pthread_mutex_destroy(&mt.lock);
+    fuse_session_reset(se);
+    return err;
+}
+
+int fuse3_loop_mt(struct fuse3 *f, struct fuse3_loop_config *config) {
+    struct fuse3_internal *internal = (struct fuse3_internal *)f;
+    if (!internal || !internal->fuse2_handle) {
+        fuse3_error("Invalid handle passed to fuse3_loop_mt");
+        return -1;
+    }
+    if (!config) {
+        config = &internal->loop_config;
+    }
+
+    /*
+     * The v2 channel API has no way to clone the device fd, so clone_fd
+     * is accepted but all workers read from the one shared channel.
+     */
+    if (config->clone_fd) {
+        fuse3_debug("clone_fd not supported by the v2 channel, sharing one fd");
+    }
+
+    fuse3_debug("Starting multithreaded FUSE event loop (max_idle_threads=%u)",
+                config->max_idle_threads);
+
+    int ret = fuse_start_cleanup_thread(internal->fuse2_handle);
+    if (ret) {
+        fuse3_error("Failed to start cleanup thread");
+        return -1;
+    }
+    ret = fuse3_run_loop_mt(internal, fuse_get_session(internal->fuse2_handle),
+                            config->max_idle_threads);
+    fuse_stop_cleanup_thread(internal->fuse2_handle);
+    if (ret < 0) {
+        fuse3_error("Multithreaded FUSE loop failed");
+    }
+    return ret;
+}
+
+int fuse3_session_loop_mt(struct fuse3_session *se, struct fuse3_loop_config *config) {
+    if (!se || !se->se) {
+        fuse3_error("Invalid session passed to fuse3_session_loop_mt");
+        return -1;
+    }
+    if (se->internal) {
+        return fuse3_loop_mt((struct fuse3 *)se->internal, config);
+    }
+
+    unsigned int max_idle = config ? config->max_idle_threads : FUSE3_DEFAULT_MAX_IDLE_THREADS;
+    int ret = fuse3_run_loop_mt(NULL, se->se, max_idle);
+    if (ret < 0) {
+        fuse3_error("Multithreaded FUSE loop failed");
+    }
+    return ret;
+}
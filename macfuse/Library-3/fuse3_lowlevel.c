@@ -0,0 +1,805 @@
+/*
+ * Low-level (inode based) API for the FUSE v3 compatibility layer
+ *
+ * A fuse3_lowlevel_ops filesystem is driven by the v2 low-level library:
+ * requests, replies and directory buffers are the v2 ones under v3 names,
+ * and only file_info and conn_info are converted on the way through. No
+ * paths are built and the library keeps no inode table of its own.
+ *
+ * The v2 protocol has no readdirplus. Its readdir calls the filesystem's
+ * readdirplus instead, and each entry handed out with a lookup count is
+ * parked until the kernel looks the name up, which is then answered without
+ * calling the filesystem. Entries nobody asks for are forgotten again.
+ */
+
+#include "fuse3_i.h"
+#include "fuse3_lowlevel.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+
+_Static_assert(sizeof(fuse_ino_t) == sizeof(fuse3_ino_t), "fuse3_ino_t must match fuse_ino_t");
+_Static_assert(sizeof(struct fuse3_entry_param) == sizeof(struct fuse_entry_param) &&
+               offsetof(struct fuse3_entry_param, attr) == offsetof(struct fuse_entry_param, attr) &&
+               offsetof(struct fuse3_entry_param, entry_timeout) == offsetof(struct fuse_entry_param, entry_timeout),
+               "struct fuse3_entry_param must match struct fuse_entry_param");
+_Static_assert(sizeof(struct fuse3_ctx) == sizeof(struct fuse_ctx) &&
+               offsetof(struct fuse3_ctx, umask) == offsetof(struct fuse_ctx, umask),
+               "struct fuse3_ctx must match struct fuse_ctx");
+_Static_assert(sizeof(struct fuse3_forget_data) == sizeof(struct fuse_forget_data),
+               "struct fuse3_forget_data must match struct fuse_forget_data");
+
+/* Entries parked by readdirplus until their lookup: 4096 slots under 64 locks */
+#define FUSE3_LL_ENTRY_SLOTS 4096
+#define FUSE3_LL_ENTRY_LOCKS 64
+
+struct fuse3_ll_entry {
+    uint64_t hash;
+    fuse3_ino_t parent;
+    char *name;
+    struct fuse3_entry_param e;
+    uint64_t expires;
+};
+
+struct fuse3_ll_forget {
+    struct fuse3_ll_forget *next;
+    fuse3_ino_t ino;
+};
+
+struct fuse3_ll {
+    struct fuse3_session session;  /* first, so a session pointer is the ll */
+    struct fuse3_lowlevel_ops op;
+    void *userdata;
+    struct fuse_args args;
+    char *mountpoint;
+    unsigned int max_read;
+    int no_readdirplus;
+
+    struct fuse3_ll_entry *entries;
+    pthread_mutex_t entry_locks[FUSE3_LL_ENTRY_LOCKS];
+
+    /* Lookup counts to give back, called outside the filesystem's own callbacks */
+    pthread_mutex_t forget_lock;
+    struct fuse3_ll_forget *forgets;
+};
+
+/*
+ * Forgets the layer issues itself carry a tagged request the filesystem
+ * answers with fuse3_reply_none() like any other; v2 requests are pointers
+ * and never have the low bit set.
+ */
+#define FUSE3_LL_REQ_TAG 1
+
+static inline fuse3_req_t fuse3_ll_internal_req(struct fuse3_ll *ll) {
+    return (fuse3_req_t)((uintptr_t)ll | FUSE3_LL_REQ_TAG);
+}
+
+static inline int fuse3_ll_req_internal(fuse3_req_t req) {
+    return ((uintptr_t)req & FUSE3_LL_REQ_TAG) != 0;
+}
+
+static inline struct fuse3_ll *fuse3_ll_from_req(fuse3_req_t req) {
+    if (fuse3_ll_req_internal(req)) {
+        return (struct fuse3_ll *)((uintptr_t)req & ~(uintptr_t)FUSE3_LL_REQ_TAG);
+    }
+    return fuse_req_userdata((fuse_req_t)req);
+}
+
+/* The readdir this thread is running the filesystem's readdirplus for */
+static __thread struct {
+    fuse3_req_t req;
+    fuse3_ino_t parent;
+} fuse3_ll_current;
+
+static void fuse3_ll_convert_fi(const struct fuse3_file_info *fi3, struct fuse_file_info *fi2) {
+    memset(fi2, 0, sizeof(*fi2));
+    fi2->flags = fi3->flags;
+    fi2->fh = fi3->fh;
+    fi2->direct_io = fi3->direct_io;
+    fi2->keep_cache = fi3->keep_cache;
+    fi2->nonseekable = fi3->nonseekable;
+}
+
+/* Entry cache */
+
+static uint64_t fuse3_ll_hash(fuse3_ino_t parent, const char *name) {
+    uint64_t hash = 14695981039346656037ULL ^ parent;
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static inline pthread_mutex_t *fuse3_ll_entry_lock(struct fuse3_ll *ll, size_t slot) {
+    return &ll->entry_locks[slot / (FUSE3_LL_ENTRY_SLOTS / FUSE3_LL_ENTRY_LOCKS)];
+}
+
+static void fuse3_ll_queue_forget(struct fuse3_ll *ll, fuse3_ino_t ino) {
+    struct fuse3_ll_forget *f = malloc(sizeof(*f));
+    if (!f) {
+        fuse3_error("Failed to queue forget for inode %llu", (unsigned long long)ino);
+        return;
+    }
+    f->ino = ino;
+    pthread_mutex_lock(&ll->forget_lock);
+    f->next = ll->forgets;
+    ll->forgets = f;
+    pthread_mutex_unlock(&ll->forget_lock);
+}
+
+static void fuse3_ll_forget_one(struct fuse3_ll *ll, fuse3_ino_t ino) {
+    if (ll->op.forget) {
+        ll->op.forget(fuse3_ll_internal_req(ll), ino, 1);
+    } else if (ll->op.forget_multi) {
+        struct fuse3_forget_data data = { .ino = ino, .nlookup = 1 };
+        ll->op.forget_multi(fuse3_ll_internal_req(ll), 1, &data);
+    }
+}
+
+/* Called from the wrappers once the filesystem's callback has returned */
+static void fuse3_ll_run_forgets(struct fuse3_ll *ll) {
+    if (!__atomic_load_n(&ll->forgets, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&ll->forget_lock);
+    struct fuse3_ll_forget *f = ll->forgets;
+    ll->forgets = NULL;
+    pthread_mutex_unlock(&ll->forget_lock);
+
+    while (f) {
+        struct fuse3_ll_forget *next = f->next;
+        fuse3_ll_forget_one(ll, f->ino);
+        free(f);
+        f = next;
+    }
+}
+
+/* Called with the slot's lock held */
+static void fuse3_ll_entry_clear(struct fuse3_ll *ll, struct fuse3_ll_entry *entry) {
+    fuse3_ll_queue_forget(ll, entry->e.ino);
+    free(entry->name);
+    entry->name = NULL;
+    entry->hash = 0;
+}
+
+static void fuse3_ll_entry_put(struct fuse3_ll *ll, fuse3_ino_t parent, const char *name, const struct fuse3_entry_param *e) {
+    double ttl = e->entry_timeout < e->attr_timeout ? e->entry_timeout : e->attr_timeout;
+    char *copy = ttl > 0 ? strdup(name) : NULL;
+    if (!copy) {
+        fuse3_ll_queue_forget(ll, e->ino);
+        return;
+    }
+
+    uint64_t hash = fuse3_ll_hash(parent, name);
+    size_t slot = hash % FUSE3_LL_ENTRY_SLOTS;
+    struct fuse3_ll_entry *entry = &ll->entries[slot];
+    pthread_mutex_lock(fuse3_ll_entry_lock(ll, slot));
+    if (entry->name) {
+        fuse3_ll_entry_clear(ll, entry);
+    }
+    entry->hash = hash;
+    entry->parent = parent;
+    entry->name = copy;
+    entry->e = *e;
+    entry->expires = fuse3_stats_now() + (uint64_t)(ttl * 1e9);
+    pthread_mutex_unlock(fuse3_ll_entry_lock(ll, slot));
+}
+
+/* Takes the parked entry and with it the lookup count readdirplus handed out */
+static int fuse3_ll_entry_take(struct fuse3_ll *ll, fuse3_ino_t parent, const char *name, struct fuse3_entry_param *e) {
+    uint64_t hash = fuse3_ll_hash(parent, name);
+    size_t slot = hash % FUSE3_LL_ENTRY_SLOTS;
+    struct fuse3_ll_entry *entry = &ll->entries[slot];
+    int found = 0;
+
+    pthread_mutex_lock(fuse3_ll_entry_lock(ll, slot));
+    if (entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0) {
+        if (fuse3_stats_now() < entry->expires) {
+            *e = entry->e;
+            free(entry->name);
+            entry->name = NULL;
+            entry->hash = 0;
+            found = 1;
+        } else {
+            fuse3_ll_entry_clear(ll, entry);
+        }
+    }
+    pthread_mutex_unlock(fuse3_ll_entry_lock(ll, slot));
+    return found;
+}
+
+static void fuse3_ll_entry_drop(struct fuse3_ll *ll, fuse3_ino_t parent, const char *name) {
+    uint64_t hash = fuse3_ll_hash(parent, name);
+    size_t slot = hash % FUSE3_LL_ENTRY_SLOTS;
+    struct fuse3_ll_entry *entry = &ll->entries[slot];
+
+    pthread_mutex_lock(fuse3_ll_entry_lock(ll, slot));
+    if (entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0) {
+        fuse3_ll_entry_clear(ll, entry);
+    }
+    pthread_mutex_unlock(fuse3_ll_entry_lock(ll, slot));
+}
+
+static void fuse3_ll_entry_purge(struct fuse3_ll *ll) {
+    for (size_t i = 0; i < FUSE3_LL_ENTRY_SLOTS; i++) {
+        if (ll->entries[i].name) {
+            fuse3_ll_entry_clear(ll, &ll->entries[i]);
+        }
+    }
+    fuse3_ll_run_forgets(ll);
+}
+
+/* v2 low-level wrappers */
+
+static void fuse3_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    struct fuse3_ll *ll = userdata;
+
+#ifdef FUSE_CAP_BIG_WRITES
+    /* Writes larger than a page are always enabled in the v3 API */
+    conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+#endif
+    if (ll->op.init) {
+        struct fuse3_conn_info conn3;
+        convert_conn_info_2_to_3(conn, ll->max_read, &conn3);
+        ll->op.init(ll->userdata, &conn3);
+        convert_conn_info_3_to_2(&conn3, ll->max_read, conn);
+    }
+}
+
+static void fuse3_ll_destroy(void *userdata) {
+    struct fuse3_ll *ll = userdata;
+
+    /* Give back what readdirplus handed out while the filesystem can still take it */
+    fuse3_ll_entry_purge(ll);
+    if (ll->op.destroy) {
+        ll->op.destroy(ll->userdata);
+    }
+}
+
+static void fuse3_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_entry_param e;
+
+    if (fuse3_ll_entry_take(ll, parent, name, &e)) {
+        fuse3_debug("lookup %lu/%s answered from readdirplus", (unsigned long)parent, name);
+        fuse_reply_entry(req, (const struct fuse_entry_param *)&e);
+    } else {
+        ll->op.lookup((fuse3_req_t)req, parent, name);
+    }
+    fuse3_ll_run_forgets(ll);
+}
+
+static void fuse3_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+
+    if (ll->op.forget) {
+        ll->op.forget((fuse3_req_t)req, ino, nlookup);
+    } else {
+        struct fuse3_forget_data data = { .ino = ino, .nlookup = nlookup };
+        ll->op.forget_multi((fuse3_req_t)req, 1, &data);
+    }
+    fuse3_ll_run_forgets(ll);
+}
+
+static void fuse3_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+
+    if (ll->op.forget_multi) {
+        ll->op.forget_multi((fuse3_req_t)req, count, (struct fuse3_forget_data *)forgets);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            ll->op.forget(fuse3_ll_internal_req(ll), forgets[i].ino, forgets[i].nlookup);
+        }
+        fuse_reply_none(req);
+    }
+    fuse3_ll_run_forgets(ll);
+}
+
+static void fuse3_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    if (fi) convert_file_info_2_to_3(fi, &fi3);
+    ll->op.getattr((fuse3_req_t)req, ino, fi ? &fi3 : NULL);
+}
+
+static void fuse3_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    if (fi) convert_file_info_2_to_3(fi, &fi3);
+    ll->op.setattr((fuse3_req_t)req, ino, attr, to_set, fi ? &fi3 : NULL);
+}
+
+static void fuse3_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    ll->op.readlink((fuse3_req_t)req, ino);
+}
+
+static void fuse3_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    ll->op.mknod((fuse3_req_t)req, parent, name, mode, rdev);
+}
+
+static void fuse3_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    ll->op.mkdir((fuse3_req_t)req, parent, name, mode);
+}
+
+static void fuse3_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    fuse3_ll_entry_drop(ll, parent, name);
+    ll->op.unlink((fuse3_req_t)req, parent, name);
+    fuse3_ll_run_forgets(ll);
+}
+
+static void fuse3_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    fuse3_ll_entry_drop(ll, parent, name);
+    ll->op.rmdir((fuse3_req_t)req, parent, name);
+    fuse3_ll_run_forgets(ll);
+}
+
+static void fuse3_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    ll->op.symlink((fuse3_req_t)req, link, parent, name);
+}
+
+static void fuse3_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    fuse3_ll_entry_drop(ll, parent, name);
+    fuse3_ll_entry_drop(ll, newparent, newname);
+    ll->op.rename((fuse3_req_t)req, parent, name, newparent, newname, 0);
+    fuse3_ll_run_forgets(ll);
+}
+
+static void fuse3_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    ll->op.link((fuse3_req_t)req, ino, newparent, newname);
+}
+
+static void fuse3_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.open((fuse3_req_t)req, ino, &fi3);
+}
+
+static void fuse3_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.read((fuse3_req_t)req, ino, size, off, &fi3);
+}
+
+static void fuse3_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.write((fuse3_req_t)req, ino, buf, size, off, &fi3);
+}
+
+static void fuse3_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.write_buf((fuse3_req_t)req, ino, (struct fuse3_bufvec *)bufv, off, &fi3);
+}
+
+static void fuse3_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.flush((fuse3_req_t)req, ino, &fi3);
+}
+
+static void fuse3_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.release((fuse3_req_t)req, ino, &fi3);
+}
+
+static void fuse3_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.fsync((fuse3_req_t)req, ino, datasync, &fi3);
+}
+
+static void fuse3_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.opendir((fuse3_req_t)req, ino, &fi3);
+}
+
+static void fuse3_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    if (ll->op.readdirplus && (!ll->op.readdir || !ll->no_readdirplus)) {
+        fuse3_ll_current.req = (fuse3_req_t)req;
+        fuse3_ll_current.parent = ino;
+        ll->op.readdirplus((fuse3_req_t)req, ino, size, off, &fi3);
+        fuse3_ll_current.req = NULL;
+        fuse3_ll_run_forgets(ll);
+    } else {
+        ll->op.readdir((fuse3_req_t)req, ino, size, off, &fi3);
+    }
+}
+
+static void fuse3_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.releasedir((fuse3_req_t)req, ino, &fi3);
+}
+
+static void fuse3_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.fsyncdir((fuse3_req_t)req, ino, datasync, &fi3);
+}
+
+static void fuse3_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    ll->op.statfs((fuse3_req_t)req, ino);
+}
+
+static void fuse3_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    ll->op.access((fuse3_req_t)req, ino, mask);
+}
+
+static void fuse3_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.create((fuse3_req_t)req, parent, name, mode, &fi3);
+}
+
+static void fuse3_ll_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct fuse_pollhandle *ph) {
+    struct fuse3_ll *ll = fuse_req_userdata(req);
+    struct fuse3_file_info fi3;
+
+    convert_file_info_2_to_3(fi, &fi3);
+    ll->op.poll((fuse3_req_t)req, ino, &fi3, (struct fuse3_pollhandle *)ph);
+}
+
+static void fuse3_ll_fill_operations(const struct fuse3_lowlevel_ops *op, struct fuse_lowlevel_ops *ops2) {
+    memset(ops2, 0, sizeof(*ops2));
+
+    ops2->init = fuse3_ll_init;
+    ops2->destroy = fuse3_ll_destroy;
+    if (op->lookup) ops2->lookup = fuse3_ll_lookup;
+    if (op->forget || op->forget_multi) ops2->forget = fuse3_ll_forget;
+    if (op->forget || op->forget_multi) ops2->forget_multi = fuse3_ll_forget_multi;
+    if (op->getattr) ops2->getattr = fuse3_ll_getattr;
+    if (op->setattr) ops2->setattr = fuse3_ll_setattr;
+    if (op->readlink) ops2->readlink = fuse3_ll_readlink;
+    if (op->mknod) ops2->mknod = fuse3_ll_mknod;
+    if (op->mkdir) ops2->mkdir = fuse3_ll_mkdir;
+    if (op->unlink) ops2->unlink = fuse3_ll_unlink;
+    if (op->rmdir) ops2->rmdir = fuse3_ll_rmdir;
+    if (op->symlink) ops2->symlink = fuse3_ll_symlink;
+    if (op->rename) ops2->rename = fuse3_ll_rename;
+    if (op->link) ops2->link = fuse3_ll_link;
+    if (op->open) ops2->open = fuse3_ll_open;
+    if (op->read) ops2->read = fuse3_ll_read;
+    if (op->write) ops2->write = fuse3_ll_write;
+    if (op->write_buf) ops2->write_buf = fuse3_ll_write_buf;
+    if (op->flush) ops2->flush = fuse3_ll_flush;
+    if (op->release) ops2->release = fuse3_ll_release;
+    if (op->fsync) ops2->fsync = fuse3_ll_fsync;
+    if (op->opendir) ops2->opendir = fuse3_ll_opendir;
+    if (op->readdir || op->readdirplus) ops2->readdir = fuse3_ll_readdir;
+    if (op->releasedir) ops2->releasedir = fuse3_ll_releasedir;
+    if (op->fsyncdir) ops2->fsyncdir = fuse3_ll_fsyncdir;
+    if (op->statfs) ops2->statfs = fuse3_ll_statfs;
+    if (op->access) ops2->access = fuse3_ll_access;
+    if (op->create) ops2->create = fuse3_ll_create;
+    if (op->poll) ops2->poll = fuse3_ll_poll;
+}
+
+/* Replies; forgets the layer issued itself are the only requests that aren't v2 ones */
+
+int fuse3_reply_err(fuse3_req_t req, int err) {
+    if (fuse3_ll_req_internal(req)) return 0;
+    return fuse_reply_err((fuse_req_t)req, err);
+}
+
+void fuse3_reply_none(fuse3_req_t req) {
+    if (fuse3_ll_req_internal(req)) return;
+    fuse_reply_none((fuse_req_t)req);
+}
+
+int fuse3_reply_entry(fuse3_req_t req, const struct fuse3_entry_param *e) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_entry((fuse_req_t)req, (const struct fuse_entry_param *)e);
+}
+
+int fuse3_reply_create(fuse3_req_t req, const struct fuse3_entry_param *e, const struct fuse3_file_info *fi) {
+    struct fuse_file_info fi2;
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    fuse3_ll_convert_fi(fi, &fi2);
+    return fuse_reply_create((fuse_req_t)req, (const struct fuse_entry_param *)e, &fi2);
+}
+
+int fuse3_reply_attr(fuse3_req_t req, const struct stat *attr, double attr_timeout) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_attr((fuse_req_t)req, attr, attr_timeout);
+}
+
+int fuse3_reply_readlink(fuse3_req_t req, const char *link) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_readlink((fuse_req_t)req, link);
+}
+
+int fuse3_reply_open(fuse3_req_t req, const struct fuse3_file_info *fi) {
+    struct fuse_file_info fi2;
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    fuse3_ll_convert_fi(fi, &fi2);
+    return fuse_reply_open((fuse_req_t)req, &fi2);
+}
+
+int fuse3_reply_write(fuse3_req_t req, size_t count) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_write((fuse_req_t)req, count);
+}
+
+int fuse3_reply_buf(fuse3_req_t req, const char *buf, size_t size) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_buf((fuse_req_t)req, buf, size);
+}
+
+int fuse3_reply_data(fuse3_req_t req, struct fuse3_bufvec *bufv, int flags) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_data((fuse_req_t)req, (struct fuse_bufvec *)bufv, (enum fuse_buf_copy_flags)flags);
+}
+
+int fuse3_reply_iov(fuse3_req_t req, const struct iovec *iov, int count) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_iov((fuse_req_t)req, iov, count);
+}
+
+int fuse3_reply_statfs(fuse3_req_t req, const struct statvfs *stbuf) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_statfs((fuse_req_t)req, stbuf);
+}
+
+int fuse3_reply_poll(fuse3_req_t req, unsigned revents) {
+    if (fuse3_ll_req_internal(req)) return -EINVAL;
+    return fuse_reply_poll((fuse_req_t)req, revents);
+}
+
+size_t fuse3_add_direntry(fuse3_req_t req, char *buf, size_t bufsize, const char *name, const struct stat *stbuf, off_t off) {
+    return fuse_add_direntry((fuse_req_t)req, buf, bufsize, name, stbuf, off);
+}
+
+/*
+ * Only the name and type reach the kernel. An entry that fit carries a
+ * lookup count (except "." and ".."), which is parked for the lookup that
+ * normally follows, or given back if the reply isn't for this thread's
+ * readdir.
+ */
+size_t fuse3_add_direntry_plus(fuse3_req_t req, char *buf, size_t bufsize, const char *name, const struct fuse3_entry_param *e, off_t off) {
+    size_t len = fuse_add_direntry((fuse_req_t)req, buf, bufsize, name, &e->attr, off);
+    if (!buf || len > bufsize || e->ino == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return len;
+    }
+
+    struct fuse3_ll *ll = fuse3_ll_from_req(req);
+    if (fuse3_ll_current.req == req) {
+        fuse3_ll_entry_put(ll, fuse3_ll_current.parent, name, e);
+    } else {
+        fuse3_ll_queue_forget(ll, e->ino);
+    }
+    return len;
+}
+
+void *fuse3_req_userdata(fuse3_req_t req) {
+    return fuse3_ll_from_req(req)->userdata;
+}
+
+const struct fuse3_ctx *fuse3_req_ctx(fuse3_req_t req) {
+    static const struct fuse3_ctx internal_ctx;
+    if (fuse3_ll_req_internal(req)) return &internal_ctx;
+    return (const struct fuse3_ctx *)fuse_req_ctx((fuse_req_t)req);
+}
+
+int fuse3_req_interrupted(fuse3_req_t req) {
+    if (fuse3_ll_req_internal(req)) return 0;
+    return fuse_req_interrupted((fuse_req_t)req);
+}
+
+/* Notifications */
+
+int fuse3_lowlevel_notify_inval_inode(struct fuse3_session *se, fuse3_ino_t ino, off_t off, off_t len) {
+    if (!se || !se->ch) {
+        return -EINVAL;
+    }
+    return fuse_lowlevel_notify_inval_inode(se->ch, ino, off, len);
+}
+
+/* A parked readdirplus entry for the name would answer the next lookup with stale data */
+static void fuse3_ll_notify_drop(struct fuse3_session *se, fuse3_ino_t parent, const char *name, size_t namelen) {
+    if (se->internal) {
+        return;
+    }
+    char copy[namelen + 1];
+    memcpy(copy, name, namelen);
+    copy[namelen] = '\0';
+    fuse3_ll_entry_drop((struct fuse3_ll *)se, parent, copy);
+}
+
+int fuse3_lowlevel_notify_inval_entry(struct fuse3_session *se, fuse3_ino_t parent, const char *name, size_t namelen) {
+    if (!se || !se->ch || !name) {
+        return -EINVAL;
+    }
+    fuse3_ll_notify_drop(se, parent, name, namelen);
+    return fuse_lowlevel_notify_inval_entry(se->ch, parent, name, namelen);
+}
+
+int fuse3_lowlevel_notify_delete(struct fuse3_session *se, fuse3_ino_t parent, fuse3_ino_t child, const char *name, size_t namelen) {
+    if (!se || !se->ch || !name) {
+        return -EINVAL;
+    }
+    fuse3_ll_notify_drop(se, parent, name, namelen);
+    return fuse_lowlevel_notify_delete(se->ch, parent, child, name, namelen);
+}
+
+/* Sessions */
+
+#define FUSE3_LL_OPT(t, p, v) { t, offsetof(struct fuse3_ll, p), v }
+
+static const struct fuse_opt fuse3_ll_opts[] = {
+    FUSE3_LL_OPT("no_readdirplus", no_readdirplus, 1),
+    FUSE3_LL_OPT("max_read=%u", max_read, 0),
+    FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_END
+};
+
+struct fuse3_session *fuse3_session_new(struct fuse3_args *args, const struct fuse3_lowlevel_ops *op, size_t op_size, void *userdata) {
+    if (!args || !op) {
+        fuse3_error("Invalid arguments to fuse3_session_new");
+        return NULL;
+    }
+
+    struct fuse3_ll *ll = calloc(1, sizeof(struct fuse3_ll));
+    if (!ll) {
+        fuse3_error("Failed to allocate memory for low-level session");
+        return NULL;
+    }
+    /* Ops from an older header are shorter; the rest stay NULL */
+    memcpy(&ll->op, op, op_size < sizeof(ll->op) ? op_size : sizeof(ll->op));
+    ll->userdata = userdata;
+
+    ll->entries = calloc(FUSE3_LL_ENTRY_SLOTS, sizeof(struct fuse3_ll_entry));
+    if (!ll->entries) {
+        fuse3_error("Failed to allocate entry cache");
+        free(ll);
+        return NULL;
+    }
+    for (int i = 0; i < FUSE3_LL_ENTRY_LOCKS; i++) {
+        pthread_mutex_init(&ll->entry_locks[i], NULL);
+    }
+    pthread_mutex_init(&ll->forget_lock, NULL);
+
+    /* Work on a private copy of the arguments so the caller's stay untouched */
+    for (int i = 0; i < args->argc; i++) {
+        if (fuse_opt_add_arg(&ll->args, args->argv[i]) == -1) {
+            fuse3_error("Failed to copy arguments");
+            fuse3_session_destroy(&ll->session);
+            return NULL;
+        }
+    }
+    if (fuse_opt_parse(&ll->args, ll, fuse3_ll_opts, NULL) == -1) {
+        fuse3_error("Failed to parse options");
+        fuse3_session_destroy(&ll->session);
+        return NULL;
+    }
+    if (!ll->op.lookup && ll->op.readdirplus) {
+        fuse3_error("readdirplus without lookup, entries will be forgotten right away");
+    }
+    return &ll->session;
+}
+
+int fuse3_session_mount(struct fuse3_session *se, const char *mountpoint) {
+    struct fuse3_ll *ll = (struct fuse3_ll *)se;
+    if (!ll || se->internal || se->se || !mountpoint) {
+        fuse3_error("Invalid arguments to fuse3_session_mount");
+        return -1;
+    }
+
+    ll->mountpoint = strdup(mountpoint);
+    if (!ll->mountpoint) {
+        fuse3_error("Failed to allocate mount point");
+        return -1;
+    }
+
+    if (fuse3_add_io_size_arg(&ll->args) == -1) {
+        fuse3_error("Failed to add the I/O size option, using the backend's default");
+    }
+    fuse3_debug("Mounting low-level filesystem at: %s", mountpoint);
+    struct fuse_chan *ch = fuse_mount(mountpoint, &ll->args);
+    if (!ch) {
+        fuse3_error("Failed to mount filesystem at %s: %s", mountpoint, strerror(errno));
+        free(ll->mountpoint);
+        ll->mountpoint = NULL;
+        return -1;
+    }
+
+    struct fuse_lowlevel_ops ops2;
+    fuse3_ll_fill_operations(&ll->op, &ops2);
+    struct fuse_session *se2 = fuse_lowlevel_new(&ll->args, &ops2, sizeof(ops2), ll);
+    if (!se2) {
+        fuse3_error("Failed to create FUSE session: %s", strerror(errno));
+        fuse_unmount(ll->mountpoint, ch);
+        free(ll->mountpoint);
+        ll->mountpoint = NULL;
+        return -1;
+    }
+    fuse_session_add_chan(se2, ch);
+
+    se->se = se2;
+    se->ch = ch;
+    se->bufsize = fuse_chan_bufsize(ch);
+    return 0;
+}
+
+void fuse3_session_unmount(struct fuse3_session *se) {
+    struct fuse3_ll *ll = (struct fuse3_ll *)se;
+    if (!ll || se->internal || !se->ch) {
+        return;
+    }
+    fuse_session_remove_chan(se->ch);
+    fuse_unmount(ll->mountpoint, se->ch);
+    se->ch = NULL;
+}
+
+void fuse3_session_destroy(struct fuse3_session *se) {
+    struct fuse3_ll *ll = (struct fuse3_ll *)se;
+    if (!ll || se->internal) {
+        return;
+    }
+
+    fuse3_debug("Destroying low-level session");
+    fuse3_session_unmount(se);
+    if (se->se) {
+        /* Calls destroy(), which gives back the parked entries */
+        fuse_session_destroy(se->se);
+    }
+    /* Never mounted or never initialized: nothing was handed out, nothing to give back */
+    for (size_t i = 0; i < FUSE3_LL_ENTRY_SLOTS; i++) {
+        free(ll->entries[i].name);
+    }
+    while (ll->forgets) {
+        struct fuse3_ll_forget *next = ll->forgets->next;
+        free(ll->forgets);
+        ll->forgets = next;
+    }
+    for (int i = 0; i < FUSE3_LL_ENTRY_LOCKS; i++) {
+        pthread_mutex_destroy(&ll->entry_locks[i]);
+    }
+    pthread_mutex_destroy(&ll->forget_lock);
+    free(ll->entries);
+    fuse_opt_free_args(&ll->args);
+    free(ll->mountpoint);
+    free(ll);
+    /* Give queued messages a chance to reach stderr */
+    fuse3_log_flush(1000);
+}
@@ -0,0 +1,135 @@
+#ifndef FUSE3_LOWLEVEL_H
+#define FUSE3_LOWLEVEL_H
+
+/*
+ * FUSE API version 3 low-level (inode based) interface for macFUSE
+ *
+ * Requests are addressed by inode number and answered with the
+ * fuse3_reply_*() functions, possibly from another thread after the
+ * operation has returned. No paths are built and no inode tables are kept
+ * by the library; the filesystem owns both.
+ */
+
+#include "fuse3.h"
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* With FUSE3_NATIVE these are libfuse3's, mapped by fuse3_native.h */
+#ifndef FUSE3_NATIVE
+
+#define FUSE3_ROOT_ID 1
+
+typedef uint64_t fuse3_ino_t;
+typedef struct fuse3_req *fuse3_req_t;
+
+struct fuse3_entry_param {
+    fuse3_ino_t ino;
+    unsigned long generation;
+    struct stat attr;
+    double attr_timeout;
+    double entry_timeout;
+};
+
+struct fuse3_ctx {
+    uid_t uid;
+    gid_t gid;
+    pid_t pid;
+    mode_t umask;
+};
+
+struct fuse3_forget_data {
+    uint64_t ino;
+    uint64_t nlookup;
+};
+
+/* to_set bits for setattr */
+#define FUSE3_SET_ATTR_MODE      (1 << 0)
+#define FUSE3_SET_ATTR_UID       (1 << 1)
+#define FUSE3_SET_ATTR_GID       (1 << 2)
+#define FUSE3_SET_ATTR_SIZE      (1 << 3)
+#define FUSE3_SET_ATTR_ATIME     (1 << 4)
+#define FUSE3_SET_ATTR_MTIME     (1 << 5)
+#define FUSE3_SET_ATTR_ATIME_NOW (1 << 7)
+#define FUSE3_SET_ATTR_MTIME_NOW (1 << 8)
+
+struct fuse3_lowlevel_ops {
+    void (*init)(void *userdata, struct fuse3_conn_info *conn);
+    void (*destroy)(void *userdata);
+    void (*lookup)(fuse3_req_t req, fuse3_ino_t parent, const char *name);
+    void (*forget)(fuse3_req_t req, fuse3_ino_t ino, uint64_t nlookup);
+    void (*getattr)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_file_info *fi);
+    void (*setattr)(fuse3_req_t req, fuse3_ino_t ino, struct stat *attr, int to_set, struct fuse3_file_info *fi);
+    void (*readlink)(fuse3_req_t req, fuse3_ino_t ino);
+    void (*mknod)(fuse3_req_t req, fuse3_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+    void (*mkdir)(fuse3_req_t req, fuse3_ino_t parent, const char *name, mode_t mode);
+    void (*unlink)(fuse3_req_t req, fuse3_ino_t parent, const char *name);
+    void (*rmdir)(fuse3_req_t req, fuse3_ino_t parent, const char *name);
+    void (*symlink)(fuse3_req_t req, const char *link, fuse3_ino_t parent, const char *name);
+    void (*rename)(fuse3_req_t req, fuse3_ino_t parent, const char *name, fuse3_ino_t newparent, const char *newname, unsigned int flags);
+    void (*link)(fuse3_req_t req, fuse3_ino_t ino, fuse3_ino_t newparent, const char *newname);
+    void (*open)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_file_info *fi);
+    void (*read)(fuse3_req_t req, fuse3_ino_t ino, size_t size, off_t off, struct fuse3_file_info *fi);
+    void (*write)(fuse3_req_t req, fuse3_ino_t ino, const char *buf, size_t size, off_t off, struct fuse3_file_info *fi);
+    void (*flush)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_file_info *fi);
+    void (*release)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_file_info *fi);
+    void (*fsync)(fuse3_req_t req, fuse3_ino_t ino, int datasync, struct fuse3_file_info *fi);
+    void (*opendir)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_file_info *fi);
+    void (*readdir)(fuse3_req_t req, fuse3_ino_t ino, size_t size, off_t off, struct fuse3_file_info *fi);
+    void (*releasedir)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_file_info *fi);
+    void (*fsyncdir)(fuse3_req_t req, fuse3_ino_t ino, int datasync, struct fuse3_file_info *fi);
+    void (*statfs)(fuse3_req_t req, fuse3_ino_t ino);
+    void (*access)(fuse3_req_t req, fuse3_ino_t ino, int mask);
+    void (*create)(fuse3_req_t req, fuse3_ino_t parent, const char *name, mode_t mode, struct fuse3_file_info *fi);
+    void (*write_buf)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_bufvec *bufv, off_t off, struct fuse3_file_info *fi);
+    void (*forget_multi)(fuse3_req_t req, size_t count, struct fuse3_forget_data *forgets);
+    void (*readdirplus)(fuse3_req_t req, fuse3_ino_t ino, size_t size, off_t off, struct fuse3_file_info *fi);
+    void (*poll)(fuse3_req_t req, fuse3_ino_t ino, struct fuse3_file_info *fi, struct fuse3_pollhandle *ph);
+};
+
+/* Replies: exactly one per request, forget and forget_multi take fuse3_reply_none() */
+int fuse3_reply_err(fuse3_req_t req, int err);
+void fuse3_reply_none(fuse3_req_t req);
+int fuse3_reply_entry(fuse3_req_t req, const struct fuse3_entry_param *e);
+int fuse3_reply_create(fuse3_req_t req, const struct fuse3_entry_param *e, const struct fuse3_file_info *fi);
+int fuse3_reply_attr(fuse3_req_t req, const struct stat *attr, double attr_timeout);
+int fuse3_reply_readlink(fuse3_req_t req, const char *link);
+int fuse3_reply_open(fuse3_req_t req, const struct fuse3_file_info *fi);
+int fuse3_reply_write(fuse3_req_t req, size_t count);
+int fuse3_reply_buf(fuse3_req_t req, const char *buf, size_t size);
+int fuse3_reply_data(fuse3_req_t req, struct fuse3_bufvec *bufv, int flags);
+int fuse3_reply_iov(fuse3_req_t req, const struct iovec *iov, int count);
+int fuse3_reply_statfs(fuse3_req_t req, const struct statvfs *stbuf);
+int fuse3_reply_poll(fuse3_req_t req, unsigned revents);
+
+/* Directory entries for readdir and readdirplus replies */
+size_t fuse3_add_direntry(fuse3_req_t req, char *buf, size_t bufsize, const char *name, const struct stat *stbuf, off_t off);
+size_t fuse3_add_direntry_plus(fuse3_req_t req, char *buf, size_t bufsize, const char *name, const struct fuse3_entry_param *e, off_t off);
+
+/* Request information */
+void *fuse3_req_userdata(fuse3_req_t req);
+const struct fuse3_ctx *fuse3_req_ctx(fuse3_req_t req);
+int fuse3_req_interrupted(fuse3_req_t req);
+
+/* Kernel cache invalidation, callable from any thread once mounted */
+int fuse3_lowlevel_notify_inval_inode(struct fuse3_session *se, fuse3_ino_t ino, off_t off, off_t len);
+int fuse3_lowlevel_notify_inval_entry(struct fuse3_session *se, fuse3_ino_t parent, const char *name, size_t namelen);
+int fuse3_lowlevel_notify_delete(struct fuse3_session *se, fuse3_ino_t parent, fuse3_ino_t child, const char *name, size_t namelen);
+
+/* Low-level sessions; options are checked when the session is mounted */
+struct fuse3_session *fuse3_session_new(struct fuse3_args *args, const struct fuse3_lowlevel_ops *op, size_t op_size, void *userdata);
+int fuse3_session_mount(struct fuse3_session *se, const char *mountpoint);
+void fuse3_session_unmount(struct fuse3_session *se);
+void fuse3_session_destroy(struct fuse3_session *se);
+int fuse3_session_loop_mt(struct fuse3_session *se, struct fuse3_loop_config *config);
+
+#endif /* !FUSE3_NATIVE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FUSE3_LOWLEVEL_H */
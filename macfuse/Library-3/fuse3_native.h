@@ -0,0 +1,164 @@
+#ifndef FUSE3_NATIVE_H
+#define FUSE3_NATIVE_H
+
+/*
+ * Native libfuse3 backend, selected with -DFUSE3_NATIVE (make BACKEND=fuse3)
+ *
+ * The fuse3_ names are mapped onto libfuse3's own at compile time, so no
+ * wrapper runs and no structure is converted: a filesystem built this way
+ * is a plain libfuse3 filesystem, and fuse3_operations is libfuse3's
+ * fuse_operations. The API of fuse3.h is that of libfuse 3.4 (fuse3_loop_mt
+ * takes a config, ioctl an int cmd); lseek needs libfuse 3.8.
+ *
+ * Only included by fuse3.h.
+ */
+
+#undef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 34
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Types */
+#define fuse3 fuse
+#define fuse3_session fuse_session
+#define fuse3_pollhandle fuse_pollhandle
+#define fuse3_file_info fuse_file_info
+#define fuse3_cmdline_opts fuse_cmdline_opts
+#define fuse3_loop_config fuse_loop_config
+#define fuse3_conn_info fuse_conn_info
+#define fuse3_config fuse_config
+#define fuse3_context fuse_context
+#define fuse3_args fuse_args
+#define fuse3_buf fuse_buf
+#define fuse3_bufvec fuse_bufvec
+#define fuse3_fill_dir_t fuse_fill_dir_t
+#define fuse3_operations fuse_operations
+#define fuse3_readdir_flags fuse_readdir_flags
+#define fuse3_fill_dir_flags fuse_fill_dir_flags
+#define fuse3_buf_flags fuse_buf_flags
+#define fuse3_buf_copy_flags fuse_buf_copy_flags
+#define fuse3_ino_t fuse_ino_t
+#define fuse3_req fuse_req
+#define fuse3_req_t fuse_req_t
+#define fuse3_entry_param fuse_entry_param
+#define fuse3_ctx fuse_ctx
+#define fuse3_forget_data fuse_forget_data
+#define fuse3_lowlevel_ops fuse_lowlevel_ops
+
+/* Constants */
+#define FUSE3_READDIR_PLUS FUSE_READDIR_PLUS
+#define FUSE3_FILL_DIR_PLUS FUSE_FILL_DIR_PLUS
+#define FUSE3_BUF_IS_FD FUSE_BUF_IS_FD
+#define FUSE3_BUF_FD_SEEK FUSE_BUF_FD_SEEK
+#define FUSE3_BUF_FD_RETRY FUSE_BUF_FD_RETRY
+#define FUSE3_BUF_NO_SPLICE FUSE_BUF_NO_SPLICE
+#define FUSE3_BUF_FORCE_SPLICE FUSE_BUF_FORCE_SPLICE
+#define FUSE3_BUF_SPLICE_MOVE FUSE_BUF_SPLICE_MOVE
+#define FUSE3_BUF_SPLICE_NONBLOCK FUSE_BUF_SPLICE_NONBLOCK
+#define FUSE3_CAP_ASYNC_READ FUSE_CAP_ASYNC_READ
+#define FUSE3_CAP_POSIX_LOCKS FUSE_CAP_POSIX_LOCKS
+#define FUSE3_CAP_ATOMIC_O_TRUNC FUSE_CAP_ATOMIC_O_TRUNC
+#define FUSE3_CAP_EXPORT_SUPPORT FUSE_CAP_EXPORT_SUPPORT
+#define FUSE3_CAP_DONT_MASK FUSE_CAP_DONT_MASK
+#define FUSE3_CAP_SPLICE_WRITE FUSE_CAP_SPLICE_WRITE
+#define FUSE3_CAP_SPLICE_MOVE FUSE_CAP_SPLICE_MOVE
+#define FUSE3_CAP_SPLICE_READ FUSE_CAP_SPLICE_READ
+#define FUSE3_CAP_FLOCK_LOCKS FUSE_CAP_FLOCK_LOCKS
+#define FUSE3_CAP_IOCTL_DIR FUSE_CAP_IOCTL_DIR
+#define FUSE3_ROOT_ID FUSE_ROOT_ID
+
+/* High-level API */
+#define fuse3_new fuse_new
+#define fuse3_mount fuse_mount
+#define fuse3_unmount fuse_unmount
+#define fuse3_loop fuse_loop
+#define fuse3_loop_mt fuse_loop_mt
+#define fuse3_destroy fuse_destroy
+#define fuse3_get_context fuse_get_context
+#define fuse3_interrupted fuse_interrupted
+#define fuse3_notify_poll fuse_notify_poll
+#define fuse3_pollhandle_destroy fuse_pollhandle_destroy
+#define fuse3_invalidate_path fuse_invalidate_path
+#define fuse3_buf_size fuse_buf_size
+#define fuse3_buf_copy fuse_buf_copy
+#define fuse3_get_session fuse_get_session
+#define fuse3_parse_cmdline fuse_parse_cmdline
+#define fuse3_opt_free_args fuse_opt_free_args
+
+/* Sessions */
+#define fuse3_session_new fuse_session_new
+#define fuse3_session_mount fuse_session_mount
+#define fuse3_session_unmount fuse_session_unmount
+#define fuse3_session_destroy fuse_session_destroy
+#define fuse3_session_loop fuse_session_loop
+#define fuse3_session_loop_mt fuse_session_loop_mt
+#define fuse3_session_fd fuse_session_fd
+#define fuse3_session_receive_buf fuse_session_receive_buf
+#define fuse3_session_process_buf fuse_session_process_buf
+#define fuse3_session_exit fuse_session_exit
+#define fuse3_session_exited fuse_session_exited
+#define fuse3_session_reset fuse_session_reset
+#define fuse3_set_signal_handlers fuse_set_signal_handlers
+#define fuse3_remove_signal_handlers fuse_remove_signal_handlers
+
+/* Low-level API */
+#define fuse3_reply_err fuse_reply_err
+#define fuse3_reply_none fuse_reply_none
+#define fuse3_reply_entry fuse_reply_entry
+#define fuse3_reply_create fuse_reply_create
+#define fuse3_reply_attr fuse_reply_attr
+#define fuse3_reply_readlink fuse_reply_readlink
+#define fuse3_reply_open fuse_reply_open
+#define fuse3_reply_write fuse_reply_write
+#define fuse3_reply_buf fuse_reply_buf
+#define fuse3_reply_data fuse_reply_data
+#define fuse3_reply_iov fuse_reply_iov
+#define fuse3_reply_statfs fuse_reply_statfs
+#define fuse3_reply_poll fuse_reply_poll
+#define fuse3_add_direntry fuse_add_direntry
+#define fuse3_add_direntry_plus fuse_add_direntry_plus
+#define fuse3_req_userdata fuse_req_userdata
+#define fuse3_req_ctx fuse_req_ctx
+#define fuse3_req_interrupted fuse_req_interrupted
+#define fuse3_lowlevel_notify_inval_inode fuse_lowlevel_notify_inval_inode
+#define fuse3_lowlevel_notify_inval_entry fuse_lowlevel_notify_inval_entry
+#define fuse3_lowlevel_notify_delete fuse_lowlevel_notify_delete
+
+/*
+ * What only the compatibility layer has. The high-level libfuse3 API
+ * invalidates whole paths, and the kernel passes lseek to the filesystem
+ * itself.
+ */
+static inline int fuse3_get_stats(struct fuse3 *f, struct fuse3_stats *stats) {
+    (void) f;
+    (void) stats;
+    return -ENOSYS;
+}
+
+static inline const char *fuse3_op_name(enum fuse3_op op) {
+    (void) op;
+    return "unknown";
+}
+
+static inline void fuse3_set_trace(int enable) {
+    (void) enable;
+}
+
+static inline int fuse3_invalidate_range(struct fuse3 *f, const char *path, off_t off, off_t len) {
+    (void) off;
+    (void) len;
+    return fuse_invalidate_path(f, path);
+}
+
+static inline int fuse3_notify_delete(struct fuse3 *f, const char *path) {
+    return fuse_invalidate_path(f, path);
+}
+
+static inline off_t fuse3_lseek(int fd, off_t offset, int whence) {
+    return lseek(fd, offset, whence);
+}
+
+#endif /* FUSE3_NATIVE_H */
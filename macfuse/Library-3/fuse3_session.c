@@ -0,0 +1,127 @@
+/*
+ * Session API for the FUSE v3 compatibility layer
+ *
+ * Wraps the v2 session of the mounted filesystem and its single channel so
+ * that an application can wait for requests on the device fd in its own
+ * event loop and process them one at a time on its own threads.
+ */
+
+#include "fuse3_i.h"
+#include "fuse3_lowlevel.h"
+#include <stdlib.h>
+#include <errno.h>
+
+void fuse3_session_init(struct fuse3_internal *internal) {
+    struct fuse3_session *se = &internal->session;
+    se->internal = internal;
+    se->se = fuse_get_session(internal->fuse2_handle);
+    se->ch = fuse_session_next_chan(se->se, NULL);
+    se->bufsize = fuse_chan_bufsize(se->ch);
+}
+
+struct fuse3_session *fuse3_get_session(struct fuse3 *f) {
+    struct fuse3_internal *internal = (struct fuse3_internal *)f;
+    if (!internal || !internal->session.se) {
+        return NULL;
+    }
+    return &internal->session;
+}
+
+int fuse3_session_loop(struct fuse3_session *se) {
+    if (!se || !se->se) {
+        return -1;
+    }
+    if (se->internal) {
+        return fuse3_loop((struct fuse3 *)se->internal);
+    }
+    
+    /* Low-level session: one request at a time on this thread */
+    struct fuse3_buf buf = { .mem = NULL };
+    int res = 0;
+    while (!fuse3_session_exited(se)) {
+        res = fuse3_session_receive_buf(se, &buf);
+        if (res == -EINTR || res == -EAGAIN) {
+            continue;
+        }
+        if (res <= 0) {
+            break;
+        }
+        fuse3_session_process_buf(se, &buf);
+    }
+    free(buf.mem);
+    fuse3_session_reset(se);
+    return res < 0 ? res : 0;
+}
+
+int fuse3_session_fd(struct fuse3_session *se) {
+    return fuse_chan_fd(se->ch);
+}
+
+/*
+ * Returns the size of the request, 0 once the filesystem is unmounted, or
+ * -errno; -EINTR and -EAGAIN mean there was nothing to read after all.
+ *
+ * With splice-read the v2 library may hand back the request in this
+ * thread's pipe instead of in buf. That pipe is reused by the next receive
+ * on the thread, and the caller may process the request elsewhere, so the
+ * request is always copied out into the caller's memory.
+ */
+int fuse3_session_receive_buf(struct fuse3_session *se, struct fuse3_buf *buf) {
+    struct fuse_chan *ch = se->ch;
+    struct fuse_buf tmp;
+    int res;
+
+    if (!buf->mem) {
+        buf->mem = malloc(se->bufsize);
+        if (!buf->mem) {
+            fuse3_error("Failed to allocate %zu byte request buffer", se->bufsize);
+            return -ENOMEM;
+        }
+    }
+
+    /* The buffer always has room for a full request; size is what was read */
+    tmp = (struct fuse_buf) { .size = se->bufsize, .mem = buf->mem };
+    res = fuse_session_receive_buf(se->se, &tmp, &ch);
+    if (res > 0 && (tmp.flags & FUSE_BUF_IS_FD)) {
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT(res);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(res);
+        src.buf[0] = tmp;
+        src.buf[0].size = res;
+        dst.buf[0].mem = buf->mem;
+        ssize_t copied = fuse_buf_copy(&dst, &src, 0);
+        if (copied != res) {
+            fuse3_error("Failed to copy a %d byte request out of the splice pipe", res);
+            return copied < 0 ? (int)copied : -EIO;
+        }
+    }
+    buf->size = res > 0 ? (size_t)res : se->bufsize;
+    buf->flags = 0;
+    return res;
+}
+
+void fuse3_session_process_buf(struct fuse3_session *se, const struct fuse3_buf *buf) {
+    uint64_t start = fuse3_stats_now();
+    fuse_session_process_buf(se->se, (const struct fuse_buf *)buf, se->ch);
+    fuse3_stats_record_request(se->internal, start);
+}
+
+void fuse3_session_exit(struct fuse3_session *se) {
+    fuse_session_exit(se->se);
+}
+
+int fuse3_session_exited(struct fuse3_session *se) {
+    return fuse_session_exited(se->se);
+}
+
+void fuse3_session_reset(struct fuse3_session *se) {
+    fuse_session_reset(se->se);
+}
+
+/* SIGHUP, SIGINT and SIGTERM end the session's loop */
+int fuse3_set_signal_handlers(struct fuse3_session *se) {
+    return fuse_set_signal_handlers(se->se);
+}
+
+void fuse3_remove_signal_handlers(struct fuse3_session *se) {
+    fuse_remove_signal_handlers(se->se);
+}
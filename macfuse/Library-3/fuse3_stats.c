@@ -0,0 +1,354 @@
+/*
+ * Per-operation statistics for the FUSE v3 compatibility layer
+ *
+ * Every wrapper records its call count, errors, bytes moved and a log2
+ * latency histogram. Each event loop thread writes to a cache-line aligned
+ * shard of its own, so recording neither contends nor needs locked
+ * instructions; fuse3_get_stats() sums the shards.
+ */
+
+#include "fuse3_i.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char *const fuse3_op_names[FUSE3_OP_COUNT] = {
+    [FUSE3_OP_GETATTR] = "getattr",
+    [FUSE3_OP_READLINK] = "readlink",
+    [FUSE3_OP_MKNOD] = "mknod",
+    [FUSE3_OP_MKDIR] = "mkdir",
+    [FUSE3_OP_UNLINK] = "unlink",
+    [FUSE3_OP_RMDIR] = "rmdir",
+    [FUSE3_OP_SYMLINK] = "symlink",
+    [FUSE3_OP_RENAME] = "rename",
+    [FUSE3_OP_LINK] = "link",
+    [FUSE3_OP_CHMOD] = "chmod",
+    [FUSE3_OP_CHOWN] = "chown",
+    [FUSE3_OP_TRUNCATE] = "truncate",
+    [FUSE3_OP_OPEN] = "open",
+    [FUSE3_OP_READ] = "read",
+    [FUSE3_OP_WRITE] = "write",
+    [FUSE3_OP_STATFS] = "statfs",
+    [FUSE3_OP_FLUSH] = "flush",
+    [FUSE3_OP_RELEASE] = "release",
+    [FUSE3_OP_FSYNC] = "fsync",
+    [FUSE3_OP_SETXATTR] = "setxattr",
+    [FUSE3_OP_GETXATTR] = "getxattr",
+    [FUSE3_OP_LISTXATTR] = "listxattr",
+    [FUSE3_OP_REMOVEXATTR] = "removexattr",
+    [FUSE3_OP_OPENDIR] = "opendir",
+    [FUSE3_OP_READDIR] = "readdir",
+    [FUSE3_OP_RELEASEDIR] = "releasedir",
+    [FUSE3_OP_FSYNCDIR] = "fsyncdir",
+    [FUSE3_OP_ACCESS] = "access",
+    [FUSE3_OP_CREATE] = "create",
+    [FUSE3_OP_LOCK] = "lock",
+    [FUSE3_OP_UTIMENS] = "utimens",
+    [FUSE3_OP_BMAP] = "bmap",
+    [FUSE3_OP_IOCTL] = "ioctl",
+    [FUSE3_OP_POLL] = "poll",
+    [FUSE3_OP_FLOCK] = "flock",
+    [FUSE3_OP_FALLOCATE] = "fallocate",
+    [FUSE3_OP_COPY_FILE_RANGE] = "copy_file_range",
+    [FUSE3_OP_LSEEK] = "lseek",
+};
+
+const char *fuse3_op_name(enum fuse3_op op) {
+    if ((unsigned int)op >= FUSE3_OP_COUNT) {
+        return NULL;
+    }
+    return fuse3_op_names[op];
+}
+
+/* The shard this thread owns and the handle it belongs to; none outside an event loop */
+static __thread struct {
+    uint64_t id;
+    struct fuse3_stats_shard *shard;
+} fuse3_stats_thread;
+
+/* Never reused, so a handle allocated where a destroyed one was can't match its shards */
+static uint64_t fuse3_stats_next_id;
+
+int fuse3_stats_init(struct fuse3_internal *internal) {
+    void *shared = NULL;
+    if (posix_memalign(&shared, 64, sizeof(struct fuse3_stats_shard)) != 0) {
+        return -ENOMEM;
+    }
+    memset(shared, 0, sizeof(struct fuse3_stats_shard));
+    memset(internal->stats_shards, 0, sizeof(internal->stats_shards));
+    pthread_mutex_init(&internal->stats_lock, NULL);
+    internal->stats_id = __atomic_add_fetch(&fuse3_stats_next_id, 1, __ATOMIC_RELAXED);
+    internal->stats = shared;
+    return 0;
+}
+
+void fuse3_stats_destroy(struct fuse3_internal *internal) {
+    if (!internal->stats) {
+        return;
+    }
+    for (int i = 0; i < FUSE3_STATS_SHARDS; i++) {
+        free(internal->stats_shards[i]);
+    }
+    free(internal->stats);
+    internal->stats = NULL;
+    pthread_mutex_destroy(&internal->stats_lock);
+}
+
+/* The shard of internal's statistics this thread owns, or NULL */
+static inline struct fuse3_stats_shard *fuse3_stats_thread_shard(const struct fuse3_internal *internal) {
+    if (!internal || fuse3_stats_thread.id != internal->stats_id) {
+        return NULL;
+    }
+    return fuse3_stats_thread.shard;
+}
+
+/*
+ * Claim a shard for the calling thread. Shards are allocated on first use
+ * and kept when their thread leaves, so counts of exited workers remain.
+ * A thread owns one shard at a time; while it does, what it records for
+ * another handle goes to that handle's shared shard.
+ */
+void fuse3_stats_thread_enter(struct fuse3_internal *internal) {
+    if (!internal || !internal->stats || fuse3_stats_thread.shard) {
+        return;
+    }
+    pthread_mutex_lock(&internal->stats_lock);
+    for (int i = 0; i < FUSE3_STATS_SHARDS; i++) {
+        struct fuse3_stats_shard *shard = internal->stats_shards[i];
+        if (!shard) {
+            void *mem = NULL;
+            if (posix_memalign(&mem, 64, sizeof(struct fuse3_stats_shard)) != 0) {
+                break;
+            }
+            shard = memset(mem, 0, sizeof(struct fuse3_stats_shard));
+            __atomic_store_n(&internal->stats_shards[i], shard, __ATOMIC_RELEASE);
+        }
+        if (!shard->owned) {
+            shard->owned = 1;
+            fuse3_stats_thread.id = internal->stats_id;
+            fuse3_stats_thread.shard = shard;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&internal->stats_lock);
+}
+
+void fuse3_stats_thread_leave(struct fuse3_internal *internal) {
+    struct fuse3_stats_shard *shard = fuse3_stats_thread_shard(internal);
+    if (!shard) {
+        return;
+    }
+    pthread_mutex_lock(&internal->stats_lock);
+    shard->owned = 0;
+    pthread_mutex_unlock(&internal->stats_lock);
+    fuse3_stats_thread.id = 0;
+    fuse3_stats_thread.shard = NULL;
+}
+
+/* Owned shards are written by one thread, so a plain load and store suffice */
+#define FUSE3_STATS_ADD(shared, p, v) do { \
+    if (shared) \
+        __atomic_fetch_add((p), (v), __ATOMIC_RELAXED); \
+    else \
+        __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED); \
+} while (0)
+
+static inline void fuse3_stats_add(struct fuse3_op_stats *s, int shared, uint64_t ns, int ret, uint64_t bytes) {
+    unsigned int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= FUSE3_STATS_BUCKETS) {
+        bucket = FUSE3_STATS_BUCKETS - 1;
+    }
+
+    FUSE3_STATS_ADD(shared, &s->calls, 1);
+    if (ret < 0) {
+        FUSE3_STATS_ADD(shared, &s->errors, 1);
+    }
+    if (bytes) {
+        FUSE3_STATS_ADD(shared, &s->bytes, bytes);
+    }
+    FUSE3_STATS_ADD(shared, &s->total_ns, ns);
+    FUSE3_STATS_ADD(shared, &s->latency[bucket], 1);
+
+    uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    if (ns > max) {
+        if (shared) {
+            while (ns > max &&
+                   !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+        } else {
+            __atomic_store_n(&s->max_ns, ns, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void fuse3_stats_record(struct fuse3_internal *internal, enum fuse3_op op, uint64_t start, int ret, uint64_t bytes) {
+    uint64_t ns = fuse3_stats_now() - start;
+    struct fuse3_stats_shard *shard = fuse3_stats_thread_shard(internal);
+    if (shard) {
+        fuse3_stats_add(&shard->ops[op], 0, ns, ret, bytes);
+    } else if (internal->stats) {
+        fuse3_stats_add(&internal->stats->ops[op], 1, ns, ret, bytes);
+    }
+}
+
+void fuse3_stats_record_request(struct fuse3_internal *internal, uint64_t start) {
+    uint64_t ns = fuse3_stats_now() - start;
+    struct fuse3_stats_shard *shard = fuse3_stats_thread_shard(internal);
+    if (shard) {
+        fuse3_stats_add(&shard->requests, 0, ns, 0, 0);
+    } else if (internal && internal->stats) {
+        fuse3_stats_add(&internal->stats->requests, 1, ns, 0, 0);
+    }
+}
+
+static void fuse3_stats_sum(struct fuse3_op_stats *sum, const struct fuse3_op_stats *s) {
+    sum->calls += __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+    sum->errors += __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+    sum->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    sum->total_ns += __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    if (max > sum->max_ns) {
+        sum->max_ns = max;
+    }
+    for (int i = 0; i < FUSE3_STATS_BUCKETS; i++) {
+        sum->latency[i] += __atomic_load_n(&s->latency[i], __ATOMIC_RELAXED);
+    }
+}
+
+int fuse3_get_stats(struct fuse3 *f, struct fuse3_stats *stats) {
+    struct fuse3_internal *internal = (struct fuse3_internal *)f;
+    if (!internal || !stats) {
+        return -EINVAL;
+    }
+    if (!internal->stats) {
+        return -ENOMEM;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = -1; i < FUSE3_STATS_SHARDS; i++) {
+        const struct fuse3_stats_shard *shard = i < 0 ? internal->stats :
+            __atomic_load_n(&internal->stats_shards[i], __ATOMIC_ACQUIRE);
+        if (!shard) {
+            break;
+        }
+        for (int op = 0; op < FUSE3_OP_COUNT; op++) {
+            fuse3_stats_sum(&stats->ops[op], &shard->ops[op]);
+        }
+        fuse3_stats_sum(&stats->requests, &shard->requests);
+    }
+    fuse3_log_counters(&stats->log_dropped, &stats->log_suppressed);
+    stats->max_write = internal->conn.max_write;
+    stats->max_readahead = internal->conn.max_readahead;
+    return 0;
+}
+
+/* Upper bound in ns of the bucket holding the given fraction of calls, at most the max */
+static uint64_t fuse3_stats_percentile(const struct fuse3_op_stats *s, double fraction) {
+    uint64_t want = (uint64_t)(s->calls * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < FUSE3_STATS_BUCKETS; i++) {
+        seen += s->latency[i];
+        if (seen > want) {
+            uint64_t bound = (uint64_t)2 << i;
+            return bound < s->max_ns ? bound : s->max_ns;
+        }
+    }
+    return s->max_ns;
+}
+
+static int fuse3_stats_format_line(char *buf, size_t size, const char *name, const struct fuse3_op_stats *s) {
+    return snprintf(buf, size, "%-16s %12llu %10llu %14llu %10llu %10llu %10llu %12llu\n", name,
+                    (unsigned long long)s->calls, (unsigned long long)s->errors,
+                    (unsigned long long)s->bytes,
+                    (unsigned long long)(s->calls ? s->total_ns / s->calls : 0),
+                    (unsigned long long)fuse3_stats_percentile(s, 0.5),
+                    (unsigned long long)fuse3_stats_percentile(s, 0.99),
+                    (unsigned long long)s->max_ns);
+}
+
+/* The stats file: a snapshot taken at open, served with direct_io */
+
+struct fuse3_stats_file {
+    size_t size;
+    char data[];
+};
+
+int fuse3_stats_file_getattr(struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    return 0;
+}
+
+int fuse3_stats_file_open(struct fuse3_internal *internal, struct fuse_file_info *fi) {
+    struct fuse3_stats stats;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    if (fuse3_get_stats((struct fuse3 *)internal, &stats) != 0) {
+        return -ENOMEM;
+    }
+
+    /* Header, one line per operation called so far, requests, the log counters and sizes */
+    size_t capacity = (FUSE3_OP_COUNT + 4) * 256;
+    struct fuse3_stats_file *sf = malloc(sizeof(struct fuse3_stats_file) + capacity);
+    if (!sf) {
+        return -ENOMEM;
+    }
+    size_t len = snprintf(sf->data, capacity, "%-16s %12s %10s %14s %10s %10s %10s %12s\n", "op",
+                          "calls", "errors", "bytes", "avg_ns", "p50_ns", "p99_ns", "max_ns");
+    for (int op = 0; op < FUSE3_OP_COUNT; op++) {
+        if (stats.ops[op].calls) {
+            len += fuse3_stats_format_line(sf->data + len, capacity - len, fuse3_op_names[op], &stats.ops[op]);
+        }
+    }
+    len += fuse3_stats_format_line(sf->data + len, capacity - len, "(requests)", &stats.requests);
+    len += snprintf(sf->data + len, capacity - len, "log_dropped %llu log_suppressed %llu\n",
+                    (unsigned long long)stats.log_dropped, (unsigned long long)stats.log_suppressed);
+    len += snprintf(sf->data + len, capacity - len, "max_write %u max_readahead %u\n",
+                    stats.max_write, stats.max_readahead);
+    sf->size = len;
+
+    fi->direct_io = 1;
+    fi->fh = (uint64_t)(uintptr_t)sf | FUSE3_STATS_FH_TAG;
+    return 0;
+}
+
+static struct fuse3_stats_file *fuse3_stats_file_get(const struct fuse_file_info *fi) {
+    return (struct fuse3_stats_file *)(uintptr_t)(fi->fh & ~(uint64_t)FUSE3_STATS_FH_TAG);
+}
+
+int fuse3_stats_file_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) {
+    struct fuse3_stats_file *sf = fuse3_stats_file_get(fi);
+    if (offset < 0 || (size_t)offset >= sf->size) {
+        return 0;
+    }
+    if (size > sf->size - offset) {
+        size = sf->size - offset;
+    }
+    memcpy(buf, sf->data + offset, size);
+    return size;
+}
+
+int fuse3_stats_file_read_buf(struct fuse_file_info *fi, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+    struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+    char *mem = malloc(size ? size : 1);
+    if (!bv || !mem) {
+        free(bv);
+        free(mem);
+        return -ENOMEM;
+    }
+    *bv = FUSE_BUFVEC_INIT(0);
+    bv->buf[0].mem = mem;
+    bv->buf[0].size = fuse3_stats_file_read(fi, mem, size, offset);
+    *bufp = bv;
+    return 0;
+}
+
+void fuse3_stats_file_release(struct fuse_file_info *fi) {
+    free(fuse3_stats_file_get(fi));
+}
@@ -7,6 +7,7 @@
 
 #include "fuse3.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -102,27 +103,48 @@ int main(int argc, char *argv[])
     }
     
     struct fuse3_args args = { argc, argv, 0 };
+    struct fuse3_cmdline_opts opts;
+    if (fuse3_parse_cmdline(&args, &opts) != 0 || !opts.mountpoint) {
+        fprintf(stderr, "Usage: %s [options] <mountpoint>\n", argv[0]);
+        fuse3_opt_free_args(&args);
+        return 1;
+    }
     
     struct fuse3 *fuse = fuse3_new(&args, &hello_oper, sizeof(hello_oper), NULL);
     if (!fuse) {
         fprintf(stderr, "Failed to create FUSE v3 handle\n");
+        free(opts.mountpoint);
+        fuse3_opt_free_args(&args);
         return 1;
     }
     
-    printf("Mounting FUSE v3 filesystem at: %s\n", argv[1]);
-    printf("Try: cat %s/hello\n", argv[1]);
+    printf("Mounting FUSE v3 filesystem at: %s\n", opts.mountpoint);
+    printf("Try: cat %s/hello\n", opts.mountpoint);
     printf("Press Ctrl+C to unmount\n\n");
     
-    if (fuse3_mount(fuse, argv[1]) != 0) {
+    if (fuse3_mount(fuse, opts.mountpoint) != 0) {
         fprintf(stderr, "Failed to mount filesystem\n");
         fuse3_destroy(fuse);
+        free(opts.mountpoint);
+        fuse3_opt_free_args(&args);
         return 1;
     }
     
-    int ret = fuse3_loop(fuse);
+    int ret;
+    if (opts.singlethread) {
+        ret = fuse3_loop(fuse);
+    } else {
+        struct fuse3_loop_config config = {
+            .clone_fd = opts.clone_fd,
+            .max_idle_threads = opts.max_idle_threads,
+        };
+        ret = fuse3_loop_mt(fuse, &config);
+    }
     
     fuse3_unmount(fuse);
     fuse3_destroy(fuse);
+    free(opts.mountpoint);
+    fuse3_opt_free_args(&args);
     
     printf("Filesystem unmounted\n");
     return ret;
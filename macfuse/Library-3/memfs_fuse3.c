@@ -0,0 +1,1412 @@
+/*
+ * In-memory read-write filesystem using the FUSE v3 API
+ *
+ * A reference filesystem for benchmarking the compatibility layer: every
+ * operation is served from memory with as little work as possible, so
+ * what a benchmark measures is the kernel, macFUSE and libfuse3_compat.
+ *
+ * - Each path component is found with one hash lookup keyed on the parent
+ *   directory and the name, so renaming a directory moves one entry.
+ * - Inodes are carved out of slabs and recycled through a free list.
+ * - File data is a map of 64 KiB extents; holes take no memory.
+ * - The namespace has one reader-writer lock and every inode its own, so
+ *   lookups, and reads and writes to different files, run in parallel
+ *   under the multithreaded loop. Operations on an open file reach the
+ *   inode through fi->fh and never take the namespace lock, which also
+ *   makes the filesystem safe to run with -o nullpath_ok.
+ *
+ * Holes are reported through lseek(SEEK_DATA/SEEK_HOLE) at extent
+ * granularity, and fallocate() allocates zeroed extents up front.
+ *
+ * Access times are only changed by utimens, so reads never write to the
+ * inode.
+ */
+
+#define FUSE_USE_VERSION 30
+#define _GNU_SOURCE
+
+#include "fuse3.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MEMFS_EXTENT_SHIFT 16
+#define MEMFS_EXTENT_SIZE ((size_t)1 << MEMFS_EXTENT_SHIFT)
+#define MEMFS_MAX_FILE_SIZE ((off_t)1 << 40)
+#define MEMFS_NAME_MAX 255
+#define MEMFS_SLAB_NODES 1024
+#define MEMFS_MIN_BUCKETS 1024
+/* readdir offsets: 1 is ".", 2 is "..", names count down from here by age */
+#define MEMFS_DIR_OFF_MAX INT64_MAX
+
+/* fallocate() modes are Linux's, whatever the host */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+#ifdef __APPLE__
+#define MEMFS_ST_TIME(st, t) ((st)->st_##t##timespec)
+#else
+#define MEMFS_ST_TIME(st, t) ((st)->st_##t##tim)
+#endif
+
+struct memfs_dentry;
+
+struct memfs_node {
+    pthread_rwlock_t lock;          /* attributes and contents */
+    unsigned long refs;             /* names plus open handles */
+    uint64_t ino;
+    mode_t mode;                    /* 0 while on the free list */
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    dev_t rdev;
+    off_t size;
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+    union {
+        struct {
+            char **extents;         /* NULL entries are holes */
+            size_t capacity;
+            size_t allocated;
+        } file;
+        struct {
+            struct memfs_dentry *children;  /* newest first */
+            struct memfs_dentry *dentry;    /* own name, NULL for the root */
+            uint64_t next_seq;
+            uint64_t gen;                   /* bumped when a name goes */
+        } dir;
+        char *target;               /* symlink */
+    };
+    struct memfs_node *next_free;
+};
+
+/* A name in a directory; the namespace lock covers all of these */
+struct memfs_dentry {
+    struct memfs_node *parent;
+    struct memfs_node *node;
+    struct memfs_dentry *hash_next;
+    struct memfs_dentry *sibling_next;
+    struct memfs_dentry **sibling_prev;
+    uint64_t seq;                   /* order of insertion into the parent */
+    uint64_t hash;
+    size_t len;
+    char name[];
+};
+
+/* An open directory: readdir picks up where the last page ended */
+struct memfs_dirhandle {
+    struct memfs_node *node;
+    pthread_mutex_t lock;
+    off_t off;                      /* offset the last page ended at, -1 for none */
+    struct memfs_dentry *next;      /* first entry past it, NULL at the end */
+    uint64_t gen;                   /* node->dir.gen then; next may be gone once it moves */
+};
+
+struct memfs_slab {
+    struct memfs_slab *next;
+    struct memfs_node nodes[MEMFS_SLAB_NODES];
+};
+
+static struct {
+    pthread_rwlock_t lock;
+    struct memfs_dentry **buckets;
+    size_t nbuckets;                /* power of two */
+    size_t ndentries;
+    struct memfs_node *root;
+
+    pthread_mutex_t arena_lock;
+    struct memfs_slab *slabs;
+    struct memfs_node *free_nodes;
+
+    uint64_t next_ino;
+    uint64_t nodes;
+    uint64_t extents;
+} memfs = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .arena_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct timespec memfs_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts;
+}
+
+/* Inodes */
+
+static struct memfs_node *memfs_node_new(mode_t mode, uid_t uid, gid_t gid)
+{
+    struct memfs_node *node;
+
+    pthread_mutex_lock(&memfs.arena_lock);
+    if (!memfs.free_nodes) {
+        struct memfs_slab *slab = calloc(1, sizeof(*slab));
+        if (!slab) {
+            pthread_mutex_unlock(&memfs.arena_lock);
+            return NULL;
+        }
+        slab->next = memfs.slabs;
+        memfs.slabs = slab;
+        for (size_t i = MEMFS_SLAB_NODES; i-- > 0; ) {
+            slab->nodes[i].next_free = memfs.free_nodes;
+            memfs.free_nodes = &slab->nodes[i];
+        }
+    }
+    node = memfs.free_nodes;
+    memfs.free_nodes = node->next_free;
+    pthread_mutex_unlock(&memfs.arena_lock);
+
+    memset(node, 0, sizeof(*node));
+    pthread_rwlock_init(&node->lock, NULL);
+    node->ino = __atomic_add_fetch(&memfs.next_ino, 1, __ATOMIC_RELAXED);
+    node->mode = mode;
+    node->uid = uid;
+    node->gid = gid;
+    node->atime = node->mtime = node->ctime = memfs_now();
+    __atomic_add_fetch(&memfs.nodes, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+static void memfs_node_release_data(struct memfs_node *node)
+{
+    if (S_ISREG(node->mode)) {
+        for (size_t i = 0; i < node->file.capacity; i++)
+            free(node->file.extents[i]);
+        free(node->file.extents);
+        __atomic_sub_fetch(&memfs.extents, node->file.allocated, __ATOMIC_RELAXED);
+    } else if (S_ISLNK(node->mode)) {
+        free(node->target);
+    }
+}
+
+static void memfs_node_put(struct memfs_node *node)
+{
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    memfs_node_release_data(node);
+    pthread_rwlock_destroy(&node->lock);
+    node->mode = 0;
+    __atomic_sub_fetch(&memfs.nodes, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&memfs.arena_lock);
+    node->next_free = memfs.free_nodes;
+    memfs.free_nodes = node;
+    pthread_mutex_unlock(&memfs.arena_lock);
+}
+
+static void memfs_stat(const struct memfs_node *node, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = node->ino;
+    stbuf->st_mode = node->mode;
+    stbuf->st_nlink = node->nlink;
+    stbuf->st_uid = node->uid;
+    stbuf->st_gid = node->gid;
+    stbuf->st_rdev = node->rdev;
+    stbuf->st_size = node->size;
+    stbuf->st_blksize = MEMFS_EXTENT_SIZE;
+    if (S_ISREG(node->mode))
+        stbuf->st_blocks = node->file.allocated * (MEMFS_EXTENT_SIZE / 512);
+    MEMFS_ST_TIME(stbuf, a) = node->atime;
+    MEMFS_ST_TIME(stbuf, m) = node->mtime;
+    MEMFS_ST_TIME(stbuf, c) = node->ctime;
+}
+
+/* Names: one hash table for the whole tree, keyed on (parent, name) */
+
+static uint64_t memfs_hash(const struct memfs_node *parent, const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL ^ (parent->ino * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static struct memfs_dentry *memfs_find(const struct memfs_node *dir, const char *name, size_t len)
+{
+    uint64_t hash = memfs_hash(dir, name, len);
+    struct memfs_dentry *d;
+
+    for (d = memfs.buckets[hash & (memfs.nbuckets - 1)]; d; d = d->hash_next) {
+        if (d->hash == hash && d->parent == dir && d->len == len &&
+            memcmp(d->name, name, len) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+static void memfs_hash_insert(struct memfs_dentry *d)
+{
+    struct memfs_dentry **bucket = &memfs.buckets[d->hash & (memfs.nbuckets - 1)];
+    d->hash_next = *bucket;
+    *bucket = d;
+}
+
+static void memfs_hash_remove(struct memfs_dentry *d)
+{
+    struct memfs_dentry **pp = &memfs.buckets[d->hash & (memfs.nbuckets - 1)];
+    while (*pp != d)
+        pp = &(*pp)->hash_next;
+    *pp = d->hash_next;
+}
+
+/* Keeps the table at most one entry per bucket; stays as it is if memory is short */
+static void memfs_hash_grow(void)
+{
+    size_t nbuckets = memfs.nbuckets * 2;
+    struct memfs_dentry **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets)
+        return;
+
+    for (size_t i = 0; i < memfs.nbuckets; i++) {
+        struct memfs_dentry *d = memfs.buckets[i];
+        while (d) {
+            struct memfs_dentry *next = d->hash_next;
+            d->hash_next = buckets[d->hash & (nbuckets - 1)];
+            buckets[d->hash & (nbuckets - 1)] = d;
+            d = next;
+        }
+    }
+    free(memfs.buckets);
+    memfs.buckets = buckets;
+    memfs.nbuckets = nbuckets;
+}
+
+static void memfs_sibling_insert(struct memfs_node *dir, struct memfs_dentry *d)
+{
+    d->seq = ++dir->dir.next_seq;
+    d->sibling_next = dir->dir.children;
+    if (d->sibling_next)
+        d->sibling_next->sibling_prev = &d->sibling_next;
+    d->sibling_prev = &dir->dir.children;
+    dir->dir.children = d;
+}
+
+static void memfs_sibling_remove(struct memfs_dentry *d)
+{
+    d->parent->dir.gen++;
+    *d->sibling_prev = d->sibling_next;
+    if (d->sibling_next)
+        d->sibling_next->sibling_prev = d->sibling_prev;
+}
+
+static struct memfs_dentry *memfs_dentry_new(struct memfs_node *dir, const char *name, size_t len,
+                                             struct memfs_node *node)
+{
+    struct memfs_dentry *d = malloc(sizeof(*d) + len + 1);
+    if (!d)
+        return NULL;
+    d->parent = dir;
+    d->node = node;
+    d->len = len;
+    memcpy(d->name, name, len);
+    d->name[len] = '\0';
+    d->hash = memfs_hash(dir, name, len);
+    return d;
+}
+
+/* Directory change: new mtime and ctime, and one subdirectory more or less */
+static void memfs_dir_changed(struct memfs_node *dir, int subdirs, struct timespec now)
+{
+    pthread_rwlock_wrlock(&dir->lock);
+    dir->nlink += subdirs;
+    dir->mtime = dir->ctime = now;
+    pthread_rwlock_unlock(&dir->lock);
+}
+
+/* Gives node a name in dir; namespace lock held for writing */
+static int memfs_add_name(struct memfs_node *dir, const char *name, size_t len, struct memfs_node *node)
+{
+    struct timespec now = memfs_now();
+    struct memfs_dentry *d = memfs_dentry_new(dir, name, len, node);
+    if (!d)
+        return -ENOMEM;
+
+    if (memfs.ndentries >= memfs.nbuckets)
+        memfs_hash_grow();
+    memfs_hash_insert(d);
+    memfs_sibling_insert(dir, d);
+    memfs.ndentries++;
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_rwlock_wrlock(&node->lock);
+    if (S_ISDIR(node->mode)) {
+        node->nlink = 2;
+        node->dir.dentry = d;
+    } else {
+        node->nlink++;
+    }
+    node->ctime = now;
+    pthread_rwlock_unlock(&node->lock);
+    memfs_dir_changed(dir, S_ISDIR(node->mode) ? 1 : 0, now);
+    return 0;
+}
+
+/* Removes a name, and the inode with it unless it has others or is open */
+static void memfs_remove_name(struct memfs_dentry *d)
+{
+    struct memfs_node *node = d->node;
+    struct timespec now = memfs_now();
+
+    memfs_hash_remove(d);
+    memfs_sibling_remove(d);
+    memfs.ndentries--;
+
+    pthread_rwlock_wrlock(&node->lock);
+    if (S_ISDIR(node->mode)) {
+        node->nlink = 0;
+        node->dir.dentry = NULL;
+    } else {
+        node->nlink--;
+    }
+    node->ctime = now;
+    pthread_rwlock_unlock(&node->lock);
+    memfs_dir_changed(d->parent, S_ISDIR(node->mode) ? -1 : 0, now);
+
+    free(d);
+    memfs_node_put(node);
+}
+
+/* Looks up the first len bytes of path; namespace lock held */
+static int memfs_resolve(const char *path, size_t len, struct memfs_node **nodep)
+{
+    struct memfs_node *node = memfs.root;
+    const char *end = path + len;
+
+    while (path < end) {
+        const char *name;
+        struct memfs_dentry *d;
+
+        while (path < end && *path == '/')
+            path++;
+        if (path == end)
+            break;
+        name = path;
+        while (path < end && *path != '/')
+            path++;
+        if (!S_ISDIR(node->mode))
+            return -ENOTDIR;
+        d = memfs_find(node, name, path - name);
+        if (!d)
+            return -ENOENT;
+        node = d->node;
+    }
+    *nodep = node;
+    return 0;
+}
+
+static int memfs_lookup(const char *path, struct memfs_node **nodep)
+{
+    return memfs_resolve(path, strlen(path), nodep);
+}
+
+/* Finds the directory that holds, or is to hold, the last component of path */
+static int memfs_lookup_parent(const char *path, struct memfs_node **dirp,
+                               const char **name, size_t *len)
+{
+    const char *slash = strrchr(path, '/');
+    int res;
+
+    if (!slash)
+        return -EINVAL;
+    *name = slash + 1;
+    *len = strlen(*name);
+    if (*len == 0)
+        return -EEXIST;
+    if (*len > MEMFS_NAME_MAX)
+        return -ENAMETOOLONG;
+    res = memfs_resolve(path, slash - path, dirp);
+    if (res == 0 && !S_ISDIR((*dirp)->mode))
+        res = -ENOTDIR;
+    return res;
+}
+
+/* File contents */
+
+static struct memfs_node *memfs_handle(const struct fuse3_file_info *fi)
+{
+    return (struct memfs_node *)(uintptr_t)fi->fh;
+}
+
+/* The extent holding byte idx << MEMFS_EXTENT_SHIFT, allocated if needed */
+static char *memfs_extent(struct memfs_node *node, size_t idx, int overwrite)
+{
+    if (idx >= node->file.capacity) {
+        size_t capacity = node->file.capacity ? node->file.capacity : 1;
+        while (capacity <= idx)
+            capacity *= 2;
+        char **extents = realloc(node->file.extents, capacity * sizeof(char *));
+        if (!extents)
+            return NULL;
+        memset(extents + node->file.capacity, 0, (capacity - node->file.capacity) * sizeof(char *));
+        node->file.extents = extents;
+        node->file.capacity = capacity;
+    }
+    if (!node->file.extents[idx]) {
+        /* Bytes outside what is written must read back as zeros */
+        node->file.extents[idx] = overwrite ? malloc(MEMFS_EXTENT_SIZE) : calloc(1, MEMFS_EXTENT_SIZE);
+        if (!node->file.extents[idx])
+            return NULL;
+        node->file.allocated++;
+        __atomic_add_fetch(&memfs.extents, 1, __ATOMIC_RELAXED);
+    }
+    return node->file.extents[idx];
+}
+
+static size_t memfs_read_data(const struct memfs_node *node, char *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    if (offset >= node->size)
+        return 0;
+    if (size > (size_t)(node->size - offset))
+        size = node->size - offset;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t idx = pos >> MEMFS_EXTENT_SHIFT;
+        size_t in = pos & (MEMFS_EXTENT_SIZE - 1);
+        size_t n = MEMFS_EXTENT_SIZE - in;
+        if (n > size - done)
+            n = size - done;
+        if (idx < node->file.capacity && node->file.extents[idx])
+            memcpy(buf + done, node->file.extents[idx] + in, n);
+        else
+            memset(buf + done, 0, n);
+        done += n;
+    }
+    return size;
+}
+
+/* Where data being written comes from: memory, or a file descriptor from write_buf */
+struct memfs_source {
+    const char *mem;
+    int fd;
+    off_t pos;                      /* -1 to read from the fd's current position */
+};
+
+static ssize_t memfs_source_copy(struct memfs_source *src, char *dst, size_t size)
+{
+    size_t done = 0;
+
+    if (src->mem) {
+        memcpy(dst, src->mem, size);
+        src->mem += size;
+        return size;
+    }
+    while (done < size) {
+        ssize_t res = src->pos >= 0 ? pread(src->fd, dst + done, size - done, src->pos) :
+                                      read(src->fd, dst + done, size - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return done ? (ssize_t)done : -errno;
+        if (res == 0)
+            break;
+        done += res;
+        if (src->pos >= 0)
+            src->pos += res;
+    }
+    return done;
+}
+
+/* Inode lock held for writing */
+static ssize_t memfs_write_data(struct memfs_node *node, struct memfs_source *src, size_t size, off_t offset)
+{
+    size_t done = 0;
+    ssize_t res = 0;
+
+    if (offset < 0)
+        return -EINVAL;
+    if (offset > MEMFS_MAX_FILE_SIZE || size > (size_t)(MEMFS_MAX_FILE_SIZE - offset))
+        return -EFBIG;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t in = pos & (MEMFS_EXTENT_SIZE - 1);
+        size_t n = MEMFS_EXTENT_SIZE - in;
+        if (n > size - done)
+            n = size - done;
+        /* A read from an fd may come up short and leave the rest of a fresh extent unset */
+        char *extent = memfs_extent(node, pos >> MEMFS_EXTENT_SHIFT,
+                                    n == MEMFS_EXTENT_SIZE && src->mem);
+        if (!extent) {
+            res = -ENOMEM;
+            break;
+        }
+        res = memfs_source_copy(src, extent + in, n);
+        if (res <= 0)
+            break;
+        done += res;
+        if ((size_t)res < n)
+            break;
+    }
+    if (done) {
+        if (offset + (off_t)done > node->size)
+            node->size = offset + done;
+        node->mtime = node->ctime = memfs_now();
+        return done;
+    }
+    return res;
+}
+
+/* Inode lock held for writing */
+static int memfs_truncate_data(struct memfs_node *node, off_t size)
+{
+    if (size < 0)
+        return -EINVAL;
+    if (size > MEMFS_MAX_FILE_SIZE)
+        return -EFBIG;
+    if (size < node->size) {
+        size_t keep = (size + MEMFS_EXTENT_SIZE - 1) >> MEMFS_EXTENT_SHIFT;
+        for (size_t i = keep; i < node->file.capacity; i++) {
+            if (node->file.extents[i]) {
+                free(node->file.extents[i]);
+                node->file.extents[i] = NULL;
+                node->file.allocated--;
+                __atomic_sub_fetch(&memfs.extents, 1, __ATOMIC_RELAXED);
+            }
+        }
+        /* Keep the tail of the last extent zero for when the file grows again */
+        size_t in = size & (MEMFS_EXTENT_SIZE - 1);
+        if (in && keep - 1 < node->file.capacity && node->file.extents[keep - 1])
+            memset(node->file.extents[keep - 1] + in, 0, MEMFS_EXTENT_SIZE - in);
+    }
+    node->size = size;
+    node->mtime = node->ctime = memfs_now();
+    return 0;
+}
+
+/* Operations */
+
+static int memfs_getattr(const char *path, struct stat *stbuf, struct fuse3_file_info *fi)
+{
+    struct memfs_node *node;
+    int res = 0;
+
+    if (fi) {
+        node = memfs_handle(fi);
+        pthread_rwlock_rdlock(&node->lock);
+        memfs_stat(node, stbuf);
+        pthread_rwlock_unlock(&node->lock);
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&memfs.lock);
+    res = memfs_lookup(path, &node);
+    if (res == 0) {
+        pthread_rwlock_rdlock(&node->lock);
+        memfs_stat(node, stbuf);
+        pthread_rwlock_unlock(&node->lock);
+    }
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+static int memfs_readlink(const char *path, char *buf, size_t size)
+{
+    struct memfs_node *node;
+    int res;
+
+    if (size == 0)
+        return -EINVAL;
+    pthread_rwlock_rdlock(&memfs.lock);
+    res = memfs_lookup(path, &node);
+    if (res == 0 && !S_ISLNK(node->mode))
+        res = -EINVAL;
+    if (res == 0) {
+        strncpy(buf, node->target, size - 1);
+        buf[size - 1] = '\0';
+    }
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+/* Creates an inode under a new name; namespace lock held for writing */
+static int memfs_make(const char *path, mode_t mode, struct memfs_node **nodep)
+{
+    struct fuse3_context *ctx = fuse3_get_context();
+    struct memfs_node *dir, *node;
+    const char *name;
+    size_t len;
+    int res;
+
+    res = memfs_lookup_parent(path, &dir, &name, &len);
+    if (res < 0)
+        return res;
+    if (memfs_find(dir, name, len))
+        return -EEXIST;
+
+    node = memfs_node_new(mode, ctx->uid, ctx->gid);
+    if (!node)
+        return -ENOMEM;
+    /* Held until the name is added, so a failure frees the inode */
+    node->refs = 1;
+    res = memfs_add_name(dir, name, len, node);
+    if (res == 0)
+        *nodep = node;
+    else
+        memfs_node_put(node);
+    return res;
+}
+
+static int memfs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    struct memfs_node *node;
+    int res;
+
+    if (S_ISDIR(mode) || S_ISLNK(mode))
+        return -EINVAL;
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_make(path, mode, &node);
+    if (res == 0) {
+        node->rdev = rdev;
+        memfs_node_put(node);
+    }
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+static int memfs_mkdir(const char *path, mode_t mode)
+{
+    struct memfs_node *node;
+    int res;
+
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_make(path, S_IFDIR | (mode & 07777), &node);
+    if (res == 0)
+        memfs_node_put(node);
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+static int memfs_symlink(const char *from, const char *to)
+{
+    struct memfs_node *node;
+    char *target = strdup(from);
+    int res;
+
+    if (!target)
+        return -ENOMEM;
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_make(to, S_IFLNK | 0777, &node);
+    if (res == 0) {
+        node->target = target;
+        node->size = strlen(target);
+        memfs_node_put(node);
+    } else {
+        free(target);
+    }
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+/* Finds the entry for the last component of path; namespace lock held */
+static int memfs_lookup_dentry(const char *path, struct memfs_dentry **dp)
+{
+    struct memfs_node *dir;
+    const char *name;
+    size_t len;
+    int res = memfs_lookup_parent(path, &dir, &name, &len);
+
+    if (res == -EEXIST)
+        return -EBUSY;
+    if (res < 0)
+        return res;
+    *dp = memfs_find(dir, name, len);
+    return *dp ? 0 : -ENOENT;
+}
+
+static int memfs_unlink(const char *path)
+{
+    struct memfs_dentry *d;
+    int res;
+
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_lookup_dentry(path, &d);
+    if (res == 0 && S_ISDIR(d->node->mode))
+        res = -EISDIR;
+    if (res == 0)
+        memfs_remove_name(d);
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+static int memfs_rmdir(const char *path)
+{
+    struct memfs_dentry *d;
+    int res;
+
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_lookup_dentry(path, &d);
+    if (res == 0 && !S_ISDIR(d->node->mode))
+        res = -ENOTDIR;
+    else if (res == 0 && d->node->dir.children)
+        res = -ENOTEMPTY;
+    if (res == 0)
+        memfs_remove_name(d);
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+/* RENAME_NOREPLACE on Linux; the compatibility layer passes 0 on macOS */
+#define MEMFS_RENAME_NOREPLACE (1 << 0)
+
+static int memfs_rename(const char *from, const char *to, unsigned int flags)
+{
+    struct memfs_dentry *src, *dst, *moved;
+    struct memfs_node *dir, *node;
+    const char *name;
+    size_t len;
+    int res;
+
+    if (flags & ~MEMFS_RENAME_NOREPLACE)
+        return -EINVAL;
+
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_lookup_dentry(from, &src);
+    if (res == 0)
+        res = memfs_lookup_parent(to, &dir, &name, &len);
+    if (res < 0)
+        goto out;
+    node = src->node;
+    dst = memfs_find(dir, name, len);
+    if (dst == src || (dst && dst->node == node))
+        goto out;
+    if (dst && (flags & MEMFS_RENAME_NOREPLACE)) {
+        res = -EEXIST;
+        goto out;
+    }
+    if (S_ISDIR(node->mode)) {
+        /* A directory can't move below itself */
+        for (struct memfs_node *n = dir; n->dir.dentry; n = n->dir.dentry->parent) {
+            if (n == node) {
+                res = -EINVAL;
+                goto out;
+            }
+        }
+        if (dst && !S_ISDIR(dst->node->mode)) {
+            res = -ENOTDIR;
+            goto out;
+        }
+        if (dst && dst->node->dir.children) {
+            res = -ENOTEMPTY;
+            goto out;
+        }
+    } else if (dst && S_ISDIR(dst->node->mode)) {
+        res = -EISDIR;
+        goto out;
+    }
+
+    moved = memfs_dentry_new(dir, name, len, node);
+    if (!moved) {
+        res = -ENOMEM;
+        goto out;
+    }
+    if (dst)
+        memfs_remove_name(dst);
+
+    /* Move the name without touching the inode's link count */
+    struct timespec now = memfs_now();
+    int subdirs = S_ISDIR(node->mode) ? 1 : 0;
+    memfs_hash_remove(src);
+    memfs_sibling_remove(src);
+    memfs_hash_insert(moved);
+    memfs_sibling_insert(dir, moved);
+    memfs_dir_changed(src->parent, -subdirs, now);
+    memfs_dir_changed(dir, subdirs, now);
+    pthread_rwlock_wrlock(&node->lock);
+    if (S_ISDIR(node->mode))
+        node->dir.dentry = moved;
+    node->ctime = now;
+    pthread_rwlock_unlock(&node->lock);
+    free(src);
+out:
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+static int memfs_link(const char *from, const char *to)
+{
+    struct memfs_node *node, *dir;
+    const char *name;
+    size_t len;
+    int res;
+
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_lookup(from, &node);
+    if (res == 0 && S_ISDIR(node->mode))
+        res = -EPERM;
+    if (res == 0)
+        res = memfs_lookup_parent(to, &dir, &name, &len);
+    if (res == 0 && memfs_find(dir, name, len))
+        res = -EEXIST;
+    if (res == 0)
+        res = memfs_add_name(dir, name, len, node);
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+/*
+ * Runs fn on the inode of fi, or of path, with the inode locked for
+ * writing; the namespace lock keeps the inode alive when going by path.
+ */
+static int memfs_modify(const char *path, struct fuse3_file_info *fi,
+                        int (*fn)(struct memfs_node *node, const void *arg), const void *arg)
+{
+    struct memfs_node *node;
+    int res;
+
+    if (fi) {
+        node = memfs_handle(fi);
+        pthread_rwlock_wrlock(&node->lock);
+        res = fn(node, arg);
+        pthread_rwlock_unlock(&node->lock);
+        return res;
+    }
+
+    pthread_rwlock_rdlock(&memfs.lock);
+    res = memfs_lookup(path, &node);
+    if (res == 0) {
+        pthread_rwlock_wrlock(&node->lock);
+        res = fn(node, arg);
+        pthread_rwlock_unlock(&node->lock);
+    }
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+static int memfs_do_chmod(struct memfs_node *node, const void *arg)
+{
+    node->mode = (node->mode & S_IFMT) | (*(const mode_t *)arg & 07777);
+    node->ctime = memfs_now();
+    return 0;
+}
+
+static int memfs_chmod(const char *path, mode_t mode, struct fuse3_file_info *fi)
+{
+    return memfs_modify(path, fi, memfs_do_chmod, &mode);
+}
+
+struct memfs_owner {
+    uid_t uid;
+    gid_t gid;
+};
+
+static int memfs_do_chown(struct memfs_node *node, const void *arg)
+{
+    const struct memfs_owner *owner = arg;
+    if (owner->uid != (uid_t)-1)
+        node->uid = owner->uid;
+    if (owner->gid != (gid_t)-1)
+        node->gid = owner->gid;
+    node->ctime = memfs_now();
+    return 0;
+}
+
+static int memfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse3_file_info *fi)
+{
+    struct memfs_owner owner = { uid, gid };
+    return memfs_modify(path, fi, memfs_do_chown, &owner);
+}
+
+static int memfs_do_truncate(struct memfs_node *node, const void *arg)
+{
+    if (S_ISDIR(node->mode))
+        return -EISDIR;
+    if (!S_ISREG(node->mode))
+        return -EINVAL;
+    return memfs_truncate_data(node, *(const off_t *)arg);
+}
+
+static int memfs_truncate(const char *path, off_t size, struct fuse3_file_info *fi)
+{
+    return memfs_modify(path, fi, memfs_do_truncate, &size);
+}
+
+static int memfs_do_utimens(struct memfs_node *node, const void *arg)
+{
+    const struct timespec *tv = arg;
+    struct timespec now = memfs_now();
+
+    if (!tv || tv[0].tv_nsec != UTIME_OMIT)
+        node->atime = !tv || tv[0].tv_nsec == UTIME_NOW ? now : tv[0];
+    if (!tv || tv[1].tv_nsec != UTIME_OMIT)
+        node->mtime = !tv || tv[1].tv_nsec == UTIME_NOW ? now : tv[1];
+    node->ctime = now;
+    return 0;
+}
+
+static int memfs_utimens(const char *path, const struct timespec tv[2], struct fuse3_file_info *fi)
+{
+    return memfs_modify(path, fi, memfs_do_utimens, tv);
+}
+
+/* Takes a reference on the inode at path for an open handle */
+static int memfs_open_node(const char *path, struct fuse3_file_info *fi, int want_dir)
+{
+    struct memfs_node *node;
+    int res;
+
+    pthread_rwlock_rdlock(&memfs.lock);
+    res = memfs_lookup(path, &node);
+    if (res == 0 && want_dir && !S_ISDIR(node->mode))
+        res = -ENOTDIR;
+    else if (res == 0 && !want_dir && S_ISDIR(node->mode))
+        res = -EISDIR;
+    if (res == 0) {
+        __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+        fi->fh = (uintptr_t)node;
+    }
+    pthread_rwlock_unlock(&memfs.lock);
+    return res;
+}
+
+static int memfs_open(const char *path, struct fuse3_file_info *fi)
+{
+    int res = memfs_open_node(path, fi, 0);
+    if (res < 0)
+        return res;
+
+    if ((fi->flags & O_TRUNC) && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        off_t zero = 0;
+        memfs_modify(NULL, fi, memfs_do_truncate, &zero);
+    }
+    /* Contents only change through this mount, so the page cache stays valid */
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int memfs_create(const char *path, mode_t mode, struct fuse3_file_info *fi)
+{
+    struct memfs_node *node;
+    int res;
+
+    pthread_rwlock_wrlock(&memfs.lock);
+    res = memfs_make(path, S_IFREG | (mode & 07777), &node);
+    pthread_rwlock_unlock(&memfs.lock);
+    if (res == -EEXIST && !(fi->flags & O_EXCL))
+        return memfs_open(path, fi);
+    if (res < 0)
+        return res;
+
+    /* The reference memfs_make() returned becomes the handle's */
+    fi->fh = (uintptr_t)node;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int memfs_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse3_file_info *fi)
+{
+    struct memfs_node *node = memfs_handle(fi);
+    size_t res;
+
+    (void) path;
+    pthread_rwlock_rdlock(&node->lock);
+    res = memfs_read_data(node, buf, size, offset);
+    pthread_rwlock_unlock(&node->lock);
+    return (int)res;
+}
+
+/* The library frees the bufvec and its memory once the reply is sent */
+static int memfs_read_buf(const char *path, struct fuse3_bufvec **bufp, size_t size,
+                          off_t offset, struct fuse3_file_info *fi)
+{
+    struct memfs_node *node = memfs_handle(fi);
+    struct fuse3_bufvec *bufv = malloc(sizeof(*bufv));
+    char *mem;
+
+    (void) path;
+    if (!bufv)
+        return -ENOMEM;
+    pthread_rwlock_rdlock(&node->lock);
+    if (offset >= node->size)
+        size = 0;
+    else if (size > (size_t)(node->size - offset))
+        size = node->size - offset;
+    mem = malloc(size ? size : 1);
+    if (!mem) {
+        pthread_rwlock_unlock(&node->lock);
+        free(bufv);
+        return -ENOMEM;
+    }
+    size = memfs_read_data(node, mem, size, offset);
+    pthread_rwlock_unlock(&node->lock);
+
+    memset(bufv, 0, sizeof(*bufv));
+    bufv->count = 1;
+    bufv->buf[0].size = size;
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+}
+
+static int memfs_write(const char *path, const char *buf, size_t size, off_t offset,
+                       struct fuse3_file_info *fi)
+{
+    struct memfs_node *node = memfs_handle(fi);
+    struct memfs_source src = { .mem = buf };
+    ssize_t res;
+
+    (void) path;
+    pthread_rwlock_wrlock(&node->lock);
+    res = memfs_write_data(node, &src, size, offset);
+    pthread_rwlock_unlock(&node->lock);
+    return (int)res;
+}
+
+/* Copies straight from the request's buffers, or its fd where the backend splices */
+static int memfs_write_buf(const char *path, struct fuse3_bufvec *bufv, off_t offset,
+                           struct fuse3_file_info *fi)
+{
+    struct memfs_node *node = memfs_handle(fi);
+    ssize_t total = 0;
+
+    (void) path;
+    pthread_rwlock_wrlock(&node->lock);
+    for (size_t i = bufv->idx; i < bufv->count; i++) {
+        const struct fuse3_buf *buf = &bufv->buf[i];
+        size_t skip = i == bufv->idx ? bufv->off : 0;
+        struct memfs_source src = { .fd = buf->fd, .pos = -1 };
+        ssize_t res;
+
+        if (skip >= buf->size)
+            continue;
+        if (!(buf->flags & FUSE3_BUF_IS_FD))
+            src.mem = (const char *)buf->mem + skip;
+        else if (buf->flags & FUSE3_BUF_FD_SEEK)
+            src.pos = buf->pos + skip;
+        res = memfs_write_data(node, &src, buf->size - skip, offset + total);
+        if (res < 0) {
+            if (total == 0)
+                total = res;
+            break;
+        }
+        total += res;
+        if ((size_t)res < buf->size - skip)
+            break;
+    }
+    pthread_rwlock_unlock(&node->lock);
+    return (int)total;
+}
+
+/* Allocates zeroed extents over the range; only plain and KEEP_SIZE preallocation */
+static int memfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                           struct fuse3_file_info *fi)
+{
+    struct memfs_node *node = memfs_handle(fi);
+    int res = 0;
+
+    (void) path;
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+        return -EOPNOTSUPP;
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+    if (offset > MEMFS_MAX_FILE_SIZE || length > MEMFS_MAX_FILE_SIZE - offset)
+        return -EFBIG;
+    pthread_rwlock_wrlock(&node->lock);
+    size_t last = (offset + length - 1) >> MEMFS_EXTENT_SHIFT;
+    for (size_t idx = offset >> MEMFS_EXTENT_SHIFT; idx <= last; idx++) {
+        if (!memfs_extent(node, idx, 0)) {
+            res = -ENOMEM;
+            break;
+        }
+    }
+    if (res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > node->size) {
+        node->size = offset + length;
+        node->mtime = node->ctime = memfs_now();
+    }
+    pthread_rwlock_unlock(&node->lock);
+    return res;
+}
+
+/* Data is any allocated extent, so a partly written extent counts as data throughout */
+static off_t memfs_lseek(const char *path, off_t off, int whence, struct fuse3_file_info *fi)
+{
+    struct memfs_node *node = memfs_handle(fi);
+    off_t res;
+
+    (void) path;
+    pthread_rwlock_rdlock(&node->lock);
+    switch (whence) {
+    case SEEK_SET:
+        res = off < 0 ? -EINVAL : off;
+        break;
+    case SEEK_END:
+        res = node->size + off < 0 ? -EINVAL : node->size + off;
+        break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+        if (off < 0 || off >= node->size) {
+            res = -ENXIO;
+            break;
+        }
+        res = whence == SEEK_DATA ? -ENXIO : node->size;
+        for (size_t idx = off >> MEMFS_EXTENT_SHIFT; (off_t)(idx << MEMFS_EXTENT_SHIFT) < node->size; idx++) {
+            int data = idx < node->file.capacity && node->file.extents[idx];
+            if (data == (whence == SEEK_DATA)) {
+                off_t start = (off_t)(idx << MEMFS_EXTENT_SHIFT);
+                res = start > off ? start : off;
+                break;
+            }
+        }
+        break;
+    default:
+        res = -EINVAL;
+    }
+    pthread_rwlock_unlock(&node->lock);
+    return res;
+}
+
+static int memfs_statfs(const char *path, struct statvfs *stbuf)
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t used = __atomic_load_n(&memfs.extents, __ATOMIC_RELAXED) * (MEMFS_EXTENT_SIZE / 4096);
+    uint64_t total = pages > 0 && page_size > 0 ? (uint64_t)pages * (page_size / 4096) : used;
+
+    (void) path;
+    if (total < used)
+        total = used;
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = MEMFS_EXTENT_SIZE;
+    stbuf->f_frsize = 4096;
+    stbuf->f_blocks = total;
+    stbuf->f_bfree = stbuf->f_bavail = total - used;
+    stbuf->f_files = __atomic_load_n(&memfs.nodes, __ATOMIC_RELAXED) + (1 << 20);
+    stbuf->f_ffree = stbuf->f_favail = 1 << 20;
+    stbuf->f_namemax = MEMFS_NAME_MAX;
+    return 0;
+}
+
+static int memfs_release(const char *path, struct fuse3_file_info *fi)
+{
+    (void) path;
+    memfs_node_put(memfs_handle(fi));
+    return 0;
+}
+
+static int memfs_opendir(const char *path, struct fuse3_file_info *fi)
+{
+    struct memfs_dirhandle *dh = malloc(sizeof(*dh));
+    int res;
+
+    if (!dh)
+        return -ENOMEM;
+    res = memfs_open_node(path, fi, 1);
+    if (res != 0) {
+        free(dh);
+        return res;
+    }
+    dh->node = memfs_handle(fi);
+    pthread_mutex_init(&dh->lock, NULL);
+    dh->off = -1;
+    dh->next = NULL;
+    dh->gen = 0;
+    fi->fh = (uintptr_t)dh;
+    return 0;
+}
+
+static struct memfs_dirhandle *memfs_dirhandle(const struct fuse3_file_info *fi)
+{
+    return (struct memfs_dirhandle *)(uintptr_t)fi->fh;
+}
+
+/*
+ * Hands out attributes with every entry, so ls -l needs no getattr round
+ * trips. Each entry's offset stays valid while the directory changes, so a
+ * large listing is paged instead of buffered; names added since the listing
+ * started come first and are skipped. A page that follows on from the last
+ * one through the same handle starts where it ended, unless a name has gone
+ * from the directory since.
+ */
+static int memfs_readdir(const char *path, void *buf, fuse3_fill_dir_t filler,
+                         off_t offset, struct fuse3_file_info *fi,
+                         enum fuse3_readdir_flags flags)
+{
+    struct memfs_dirhandle *dh = memfs_dirhandle(fi);
+    struct memfs_node *dir = dh->node;
+    int plus = (flags & FUSE3_READDIR_PLUS) != 0;
+    struct memfs_dentry *d;
+    struct stat st;
+
+    (void) path;
+    pthread_rwlock_rdlock(&memfs.lock);
+    if (offset < 1) {
+        pthread_rwlock_rdlock(&dir->lock);
+        memfs_stat(dir, &st);
+        pthread_rwlock_unlock(&dir->lock);
+        if (filler(buf, ".", &st, 1, 0))
+            goto out;
+    }
+    if (offset < 2 && filler(buf, "..", NULL, 2, 0))
+        goto out;
+
+    pthread_mutex_lock(&dh->lock);
+    d = dir->dir.children;
+    if (offset >= 2 && offset == dh->off && dh->gen == dir->dir.gen)
+        d = dh->next;
+    dh->off = offset;
+    for (; d; d = d->sibling_next) {
+        off_t off = MEMFS_DIR_OFF_MAX - (off_t)d->seq;
+        if (off <= offset)
+            continue;
+        if (plus) {
+            pthread_rwlock_rdlock(&d->node->lock);
+            memfs_stat(d->node, &st);
+            pthread_rwlock_unlock(&d->node->lock);
+        }
+        if (filler(buf, d->name, plus ? &st : NULL, off, plus ? FUSE3_FILL_DIR_PLUS : 0))
+            break;
+        dh->off = off;
+    }
+    dh->next = d;
+    dh->gen = dir->dir.gen;
+    pthread_mutex_unlock(&dh->lock);
+out:
+    pthread_rwlock_unlock(&memfs.lock);
+    return 0;
+}
+
+static int memfs_releasedir(const char *path, struct fuse3_file_info *fi)
+{
+    struct memfs_dirhandle *dh = memfs_dirhandle(fi);
+
+    (void) path;
+    memfs_node_put(dh->node);
+    pthread_mutex_destroy(&dh->lock);
+    free(dh);
+    return 0;
+}
+
+static int memfs_init_tree(void)
+{
+    memfs.nbuckets = MEMFS_MIN_BUCKETS;
+    memfs.buckets = calloc(memfs.nbuckets, sizeof(*memfs.buckets));
+    if (!memfs.buckets)
+        return -ENOMEM;
+    memfs.root = memfs_node_new(S_IFDIR | 0755, getuid(), getgid());
+    if (!memfs.root)
+        return -ENOMEM;
+    memfs.root->refs = 1;
+    memfs.root->nlink = 2;
+    return 0;
+}
+
+static void memfs_destroy(void *private_data)
+{
+    (void) private_data;
+    for (size_t i = 0; i < memfs.nbuckets; i++) {
+        while (memfs.buckets[i]) {
+            struct memfs_dentry *d = memfs.buckets[i];
+            memfs.buckets[i] = d->hash_next;
+            free(d);
+        }
+    }
+    free(memfs.buckets);
+    memfs.buckets = NULL;
+    while (memfs.slabs) {
+        struct memfs_slab *slab = memfs.slabs;
+        memfs.slabs = slab->next;
+        for (size_t i = 0; i < MEMFS_SLAB_NODES; i++) {
+            if (slab->nodes[i].mode) {
+                memfs_node_release_data(&slab->nodes[i]);
+                pthread_rwlock_destroy(&slab->nodes[i].lock);
+            }
+        }
+        free(slab);
+    }
+    memfs.free_nodes = NULL;
+    memfs.root = NULL;
+}
+
+static const struct fuse3_operations memfs_oper = {
+    .getattr    = memfs_getattr,
+    .readlink   = memfs_readlink,
+    .mknod      = memfs_mknod,
+    .mkdir      = memfs_mkdir,
+    .unlink     = memfs_unlink,
+    .rmdir      = memfs_rmdir,
+    .symlink    = memfs_symlink,
+    .rename     = memfs_rename,
+    .link       = memfs_link,
+    .chmod      = memfs_chmod,
+    .chown      = memfs_chown,
+    .truncate   = memfs_truncate,
+    .open       = memfs_open,
+    .read       = memfs_read,
+    .write      = memfs_write,
+    .statfs     = memfs_statfs,
+    .release    = memfs_release,
+    .opendir    = memfs_opendir,
+    .readdir    = memfs_readdir,
+    .releasedir = memfs_releasedir,
+    .destroy    = memfs_destroy,
+    .create     = memfs_create,
+    .utimens    = memfs_utimens,
+    .read_buf   = memfs_read_buf,
+    .write_buf  = memfs_write_buf,
+    .fallocate  = memfs_fallocate,
+    .lseek      = memfs_lseek,
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: %s [options] <mountpoint>\n", argv[0]);
+        printf("Example: %s /tmp/memfs_mount\n", argv[0]);
+        return 1;
+    }
+
+    if (memfs_init_tree() != 0) {
+        fprintf(stderr, "Failed to allocate the root directory\n");
+        return 1;
+    }
+
+    struct fuse3_args args = { argc, argv, 0 };
+    struct fuse3_cmdline_opts opts;
+    if (fuse3_parse_cmdline(&args, &opts) != 0 || !opts.mountpoint) {
+        fprintf(stderr, "Usage: %s [options] <mountpoint>\n", argv[0]);
+        fuse3_opt_free_args(&args);
+        memfs_destroy(NULL);
+        return 1;
+    }
+
+    struct fuse3 *fuse = fuse3_new(&args, &memfs_oper, sizeof(memfs_oper), NULL);
+    if (!fuse || fuse3_mount(fuse, opts.mountpoint) != 0) {
+        fprintf(stderr, "Failed to mount %s\n", opts.mountpoint);
+        /* destroy() only runs once the kernel has sent init */
+        if (fuse)
+            fuse3_destroy(fuse);
+        memfs_destroy(NULL);
+        free(opts.mountpoint);
+        fuse3_opt_free_args(&args);
+        return 1;
+    }
+
+    int ret;
+    if (opts.singlethread) {
+        ret = fuse3_loop(fuse);
+    } else {
+        struct fuse3_loop_config config = {
+            .clone_fd = opts.clone_fd,
+            .max_idle_threads = opts.max_idle_threads,
+        };
+        ret = fuse3_loop_mt(fuse, &config);
+    }
+
+    fuse3_unmount(fuse);
+    fuse3_destroy(fuse);
+    free(opts.mountpoint);
+    fuse3_opt_free_args(&args);
+    return ret;
+}
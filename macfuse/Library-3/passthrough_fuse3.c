@@ -0,0 +1,482 @@
+/*
+ * Passthrough filesystem using the FUSE v3 API
+ *
+ * Mirrors a local directory at the mount point. It is the baseline for
+ * comparing the compatibility layer with native disk access, so it does as
+ * little as it can on the data path:
+ *
+ * - Paths are resolved relative to an fd for the source directory with the
+ *   *at() calls, never by building absolute paths.
+ * - Every open file keeps its own fd in fi->fh; operations on an open file
+ *   use it and ignore the path, so -o nullpath_ok works.
+ * - read_buf hands the library an FUSE3_BUF_IS_FD | FUSE3_BUF_FD_SEEK buffer
+ *   instead of data, so where the backend can splice (libfuse on Linux) the
+ *   file goes to the FUSE device without being copied through user space.
+ * - write_buf and copy_file_range go through fuse3_buf_copy(), which splices
+ *   or copies in the kernel where the host can; fallocate goes to the
+ *   matching system call.
+ *
+ * Usage: passthrough_fuse3 [options] <source> <mountpoint>
+ */
+
+#define FUSE_USE_VERSION 30
+#define _GNU_SOURCE
+
+#include "fuse3.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/statvfs.h>
+
+static int source_fd = -1;
+
+/* Path relative to the source directory, as the *at() calls want it */
+static const char *pt_rel(const char *path)
+{
+    while (*path == '/')
+        path++;
+    return *path ? path : ".";
+}
+
+static int pt_fd(const struct fuse3_file_info *fi)
+{
+    return (int)fi->fh;
+}
+
+static int pt_getattr(const char *path, struct stat *stbuf, struct fuse3_file_info *fi)
+{
+    int res = fi ? fstat(pt_fd(fi), stbuf) : fstatat(source_fd, pt_rel(path), stbuf, AT_SYMLINK_NOFOLLOW);
+    return res == -1 ? -errno : 0;
+}
+
+static int pt_access(const char *path, int mask)
+{
+    return faccessat(source_fd, pt_rel(path), mask, 0) == -1 ? -errno : 0;
+}
+
+static int pt_readlink(const char *path, char *buf, size_t size)
+{
+    ssize_t res = readlinkat(source_fd, pt_rel(path), buf, size - 1);
+    if (res == -1)
+        return -errno;
+    buf[res] = '\0';
+    return 0;
+}
+
+static int pt_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    int res;
+
+    if (S_ISFIFO(mode))
+        res = mkfifoat(source_fd, pt_rel(path), mode);
+    else
+        res = mknodat(source_fd, pt_rel(path), mode, rdev);
+    return res == -1 ? -errno : 0;
+}
+
+static int pt_mkdir(const char *path, mode_t mode)
+{
+    return mkdirat(source_fd, pt_rel(path), mode) == -1 ? -errno : 0;
+}
+
+static int pt_unlink(const char *path)
+{
+    return unlinkat(source_fd, pt_rel(path), 0) == -1 ? -errno : 0;
+}
+
+static int pt_rmdir(const char *path)
+{
+    return unlinkat(source_fd, pt_rel(path), AT_REMOVEDIR) == -1 ? -errno : 0;
+}
+
+static int pt_symlink(const char *from, const char *to)
+{
+    return symlinkat(from, source_fd, pt_rel(to)) == -1 ? -errno : 0;
+}
+
+static int pt_rename(const char *from, const char *to, unsigned int flags)
+{
+    int res;
+
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+    res = renameat2(source_fd, pt_rel(from), source_fd, pt_rel(to), flags);
+#else
+    if (flags)
+        return -EINVAL;
+    res = renameat(source_fd, pt_rel(from), source_fd, pt_rel(to));
+#endif
+    return res == -1 ? -errno : 0;
+}
+
+static int pt_link(const char *from, const char *to)
+{
+    return linkat(source_fd, pt_rel(from), source_fd, pt_rel(to), 0) == -1 ? -errno : 0;
+}
+
+static int pt_chmod(const char *path, mode_t mode, struct fuse3_file_info *fi)
+{
+    int res = fi ? fchmod(pt_fd(fi), mode) : fchmodat(source_fd, pt_rel(path), mode, 0);
+    return res == -1 ? -errno : 0;
+}
+
+static int pt_chown(const char *path, uid_t uid, gid_t gid, struct fuse3_file_info *fi)
+{
+    int res = fi ? fchown(pt_fd(fi), uid, gid) :
+                   fchownat(source_fd, pt_rel(path), uid, gid, AT_SYMLINK_NOFOLLOW);
+    return res == -1 ? -errno : 0;
+}
+
+static int pt_truncate(const char *path, off_t size, struct fuse3_file_info *fi)
+{
+    int fd, res;
+
+    if (fi)
+        return ftruncate(pt_fd(fi), size) == -1 ? -errno : 0;
+
+    fd = openat(source_fd, pt_rel(path), O_WRONLY);
+    if (fd == -1)
+        return -errno;
+    res = ftruncate(fd, size) == -1 ? -errno : 0;
+    close(fd);
+    return res;
+}
+
+static int pt_utimens(const char *path, const struct timespec tv[2], struct fuse3_file_info *fi)
+{
+    int res = fi ? futimens(pt_fd(fi), tv) :
+                   utimensat(source_fd, pt_rel(path), tv, AT_SYMLINK_NOFOLLOW);
+    return res == -1 ? -errno : 0;
+}
+
+static int pt_create(const char *path, mode_t mode, struct fuse3_file_info *fi)
+{
+    int fd = openat(source_fd, pt_rel(path), fi->flags | O_CREAT, mode);
+    if (fd == -1)
+        return -errno;
+    fi->fh = fd;
+    return 0;
+}
+
+static int pt_open(const char *path, struct fuse3_file_info *fi)
+{
+    int fd = openat(source_fd, pt_rel(path), fi->flags & ~O_CREAT);
+    if (fd == -1)
+        return -errno;
+    fi->fh = fd;
+    return 0;
+}
+
+static int pt_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse3_file_info *fi)
+{
+    ssize_t res;
+
+    (void) path;
+    res = pread(pt_fd(fi), buf, size, offset);
+    return res == -1 ? -errno : (int)res;
+}
+
+/* The library reads the data from the fd itself, spliced where it can be */
+static int pt_read_buf(const char *path, struct fuse3_bufvec **bufp, size_t size,
+                       off_t offset, struct fuse3_file_info *fi)
+{
+    struct fuse3_bufvec *bufv = malloc(sizeof(*bufv));
+
+    (void) path;
+    if (!bufv)
+        return -ENOMEM;
+    memset(bufv, 0, sizeof(*bufv));
+    bufv->count = 1;
+    bufv->buf[0].size = size;
+    bufv->buf[0].flags = FUSE3_BUF_IS_FD | FUSE3_BUF_FD_SEEK;
+    bufv->buf[0].fd = pt_fd(fi);
+    bufv->buf[0].pos = offset;
+    *bufp = bufv;
+    return 0;
+}
+
+static int pt_write(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse3_file_info *fi)
+{
+    ssize_t res;
+
+    (void) path;
+    res = pwrite(pt_fd(fi), buf, size, offset);
+    return res == -1 ? -errno : (int)res;
+}
+
+/* fuse3_buf_copy() splices request data that arrives in a pipe straight into the file */
+static int pt_write_buf(const char *path, struct fuse3_bufvec *bufv, off_t offset,
+                        struct fuse3_file_info *fi)
+{
+    struct fuse3_bufvec dst = FUSE3_BUFVEC_INIT_FD(pt_fd(fi), offset, fuse3_buf_size(bufv));
+
+    (void) path;
+    return (int)fuse3_buf_copy(&dst, bufv, FUSE3_BUF_SPLICE_NONBLOCK);
+}
+
+static int pt_statfs(const char *path, struct statvfs *stbuf)
+{
+    (void) path;
+    return fstatvfs(source_fd, stbuf) == -1 ? -errno : 0;
+}
+
+/* Called on every close() of a descriptor for the file; report errors the way close would */
+static int pt_flush(const char *path, struct fuse3_file_info *fi)
+{
+    int fd = dup(pt_fd(fi));
+
+    (void) path;
+    if (fd == -1)
+        return -errno;
+    return close(fd) == -1 ? -errno : 0;
+}
+
+static int pt_release(const char *path, struct fuse3_file_info *fi)
+{
+    (void) path;
+    close(pt_fd(fi));
+    return 0;
+}
+
+static int pt_fsync(const char *path, int isdatasync, struct fuse3_file_info *fi)
+{
+    int res;
+
+    (void) path;
+#ifdef __linux__
+    res = isdatasync ? fdatasync(pt_fd(fi)) : fsync(pt_fd(fi));
+#else
+    (void) isdatasync;
+    res = fsync(pt_fd(fi));
+#endif
+    return res == -1 ? -errno : 0;
+}
+
+static int pt_fallocate(const char *path, int mode, off_t offset, off_t length,
+                        struct fuse3_file_info *fi)
+{
+    (void) path;
+#ifdef __linux__
+    return fallocate(pt_fd(fi), mode, offset, length) == -1 ? -errno : 0;
+#elif defined(F_PREALLOCATE)
+    /* macOS reserves space without changing the size; plain fallocate extends the file */
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, offset + length, 0 };
+    struct stat st;
+
+    if (mode != 0)
+        return -EOPNOTSUPP;
+    if (fstat(pt_fd(fi), &st) == -1)
+        return -errno;
+    if (offset + length <= st.st_size)
+        return 0;
+    store.fst_length = offset + length - st.st_size;
+    if (fcntl(pt_fd(fi), F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(pt_fd(fi), F_PREALLOCATE, &store) == -1)
+            return -errno;
+    }
+    return ftruncate(pt_fd(fi), offset + length) == -1 ? -errno : 0;
+#else
+    (void) fi;
+    (void) mode;
+    (void) offset;
+    (void) length;
+    return -EOPNOTSUPP;
+#endif
+}
+
+/* Done in the kernel where it can be, reflinked where the filesystem supports it */
+static ssize_t pt_copy_file_range(const char *path_in, struct fuse3_file_info *fi_in, off_t offset_in,
+                                  const char *path_out, struct fuse3_file_info *fi_out, off_t offset_out,
+                                  size_t size, int flags)
+{
+    struct fuse3_bufvec src = FUSE3_BUFVEC_INIT_FD(pt_fd(fi_in), offset_in, size);
+    struct fuse3_bufvec dst = FUSE3_BUFVEC_INIT_FD(pt_fd(fi_out), offset_out, size);
+
+    (void) path_in;
+    (void) path_out;
+    if (flags)
+        return -EINVAL;
+    return fuse3_buf_copy(&dst, &src, 0);
+}
+
+static off_t pt_lseek(const char *path, off_t off, int whence, struct fuse3_file_info *fi)
+{
+    off_t res;
+
+    (void) path;
+    res = lseek(pt_fd(fi), off, whence);
+    return res == -1 ? -errno : res;
+}
+
+/* Open directory: the stream, and the entry read last but not yet passed on */
+struct pt_dirp {
+    DIR *dp;
+    struct dirent *entry;
+    off_t offset;
+};
+
+static int pt_opendir(const char *path, struct fuse3_file_info *fi)
+{
+    struct pt_dirp *d = calloc(1, sizeof(*d));
+    int fd;
+
+    if (!d)
+        return -ENOMEM;
+    fd = openat(source_fd, pt_rel(path), O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || !(d->dp = fdopendir(fd))) {
+        int res = -errno;
+        if (fd != -1)
+            close(fd);
+        free(d);
+        return res;
+    }
+    fi->fh = (uintptr_t)d;
+    return 0;
+}
+
+/* Entries carry telldir() offsets so large directories are paged, not buffered */
+static int pt_readdir(const char *path, void *buf, fuse3_fill_dir_t filler,
+                      off_t offset, struct fuse3_file_info *fi,
+                      enum fuse3_readdir_flags flags)
+{
+    struct pt_dirp *d = (struct pt_dirp *)(uintptr_t)fi->fh;
+    int plus = (flags & FUSE3_READDIR_PLUS) != 0;
+
+    (void) path;
+    if (offset != d->offset) {
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+    while (1) {
+        struct stat st;
+        enum fuse3_fill_dir_flags fill_flags = 0;
+
+        if (!d->entry) {
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if (!d->entry)
+                return errno ? -errno : 0;
+        }
+        memset(&st, 0, sizeof(st));
+        if (plus && fstatat(dirfd(d->dp), d->entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            fill_flags = FUSE3_FILL_DIR_PLUS;
+        } else {
+            st.st_ino = d->entry->d_ino;
+            st.st_mode = DTTOIF(d->entry->d_type);
+        }
+        off_t next = telldir(d->dp);
+        if (filler(buf, d->entry->d_name, &st, next, fill_flags))
+            break;
+        d->entry = NULL;
+        d->offset = next;
+    }
+    return 0;
+}
+
+static int pt_releasedir(const char *path, struct fuse3_file_info *fi)
+{
+    struct pt_dirp *d = (struct pt_dirp *)(uintptr_t)fi->fh;
+
+    (void) path;
+    closedir(d->dp);
+    free(d);
+    return 0;
+}
+
+static const struct fuse3_operations pt_oper = {
+    .getattr         = pt_getattr,
+    .readlink        = pt_readlink,
+    .mknod           = pt_mknod,
+    .mkdir           = pt_mkdir,
+    .unlink          = pt_unlink,
+    .rmdir           = pt_rmdir,
+    .symlink         = pt_symlink,
+    .rename          = pt_rename,
+    .link            = pt_link,
+    .chmod           = pt_chmod,
+    .chown           = pt_chown,
+    .truncate        = pt_truncate,
+    .open            = pt_open,
+    .read            = pt_read,
+    .write           = pt_write,
+    .statfs          = pt_statfs,
+    .flush           = pt_flush,
+    .release         = pt_release,
+    .fsync           = pt_fsync,
+    .opendir         = pt_opendir,
+    .readdir         = pt_readdir,
+    .releasedir      = pt_releasedir,
+    .access          = pt_access,
+    .create          = pt_create,
+    .utimens         = pt_utimens,
+    .write_buf       = pt_write_buf,
+    .read_buf        = pt_read_buf,
+    .fallocate       = pt_fallocate,
+    .copy_file_range = pt_copy_file_range,
+    .lseek           = pt_lseek,
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        printf("Usage: %s [options] <source> <mountpoint>\n", argv[0]);
+        printf("Example: %s /tmp/source /tmp/passthrough_mount\n", argv[0]);
+        return 1;
+    }
+
+    /* The source comes right before the mount point; the library gets everything else */
+    const char *source = argv[argc - 2];
+    source_fd = open(source, O_RDONLY | O_DIRECTORY);
+    if (source_fd == -1) {
+        fprintf(stderr, "%s: %s\n", source, strerror(errno));
+        return 1;
+    }
+    argv[argc - 2] = argv[argc - 1];
+    argv[--argc] = NULL;
+
+    struct fuse3_args args = { argc, argv, 0 };
+    struct fuse3_cmdline_opts opts;
+    if (fuse3_parse_cmdline(&args, &opts) != 0 || !opts.mountpoint) {
+        fprintf(stderr, "Usage: %s [options] <source> <mountpoint>\n", argv[0]);
+        fuse3_opt_free_args(&args);
+        close(source_fd);
+        return 1;
+    }
+
+    struct fuse3 *fuse = fuse3_new(&args, &pt_oper, sizeof(pt_oper), NULL);
+    if (!fuse || fuse3_mount(fuse, opts.mountpoint) != 0) {
+        fprintf(stderr, "Failed to mount %s\n", opts.mountpoint);
+        if (fuse)
+            fuse3_destroy(fuse);
+        free(opts.mountpoint);
+        fuse3_opt_free_args(&args);
+        close(source_fd);
+        return 1;
+    }
+
+    int ret;
+    if (opts.singlethread) {
+        ret = fuse3_loop(fuse);
+    } else {
+        struct fuse3_loop_config config = {
+            .clone_fd = opts.clone_fd,
+            .max_idle_threads = opts.max_idle_threads,
+        };
+        ret = fuse3_loop_mt(fuse, &config);
+    }
+
+    fuse3_unmount(fuse);
+    fuse3_destroy(fuse);
+    free(opts.mountpoint);
+    fuse3_opt_free_args(&args);
+    close(source_fd);
+    return ret;
+}
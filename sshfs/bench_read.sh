@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Sequential read throughput through sshfs_fuse3 without read-ahead
+# (-o readahead=0) and with the default window. Writes a test file to
+# <dir> over ssh, then mounts [user@]host:<dir> at <mountpoint> once per
+# setting and reads the file back with dd. Point it at localhost to test
+# against the local sshd; DELAY=<ms> adds that much latency each way on
+# the loopback interface with netem for the duration (Linux, as root).
+#
+# Usage: ./bench_read.sh [user@]host:dir <mountpoint> [sshfs options]
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 [user@]host:dir <mountpoint> [sshfs options]" >&2
+    exit 1
+fi
+remote=$1
+mountpoint=$(cd "$2" && pwd -P)
+shift 2
+host=${remote%%:*}
+dir=${remote#*:}
+file=${dir:+$dir/}sshfs_bench.data
+size_mb=${SIZE_MB:-64}
+
+pid=
+unmount() {
+    umount "$mountpoint" 2>/dev/null || fusermount -u "$mountpoint" 2>/dev/null ||
+        fusermount3 -u "$mountpoint"
+    wait $pid || true
+    pid=
+}
+cleanup() {
+    [ -z "$pid" ] || unmount
+    [ -z "$DELAY" ] || tc qdisc del dev lo root netem 2>/dev/null || true
+    ssh "$host" rm -f "$file"
+}
+trap cleanup EXIT
+
+ssh "$host" dd if=/dev/urandom of="$file" bs=1048576 count="$size_mb" 2>/dev/null
+if [ -n "$DELAY" ]; then
+    tc qdisc add dev lo root netem delay "${DELAY}ms"
+    echo "== ${DELAY} ms added each way on lo"
+fi
+
+for readahead in 0 default; do
+    if [ $readahead = default ]; then
+        opts=
+    else
+        opts="-o readahead=$readahead"
+    fi
+    ./sshfs_fuse3 $opts "$@" "$remote" "$mountpoint" >/dev/null &
+    pid=$!
+    tries=0
+    until mount | grep -q " $mountpoint "; do
+        tries=$((tries + 1))
+        if [ $tries -gt 100 ] || ! kill -0 $pid 2>/dev/null; then
+            echo "$mountpoint did not come up" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+
+    echo "== readahead=$readahead"
+    dd if="$mountpoint/sshfs_bench.data" of=/dev/null bs=1048576 2>&1 | tail -n 1
+    unmount
+done
@@ -1,9 +1,49 @@
 /*
  * SSHFS - Secure Shell File System with FUSE v3 API
  * Modified to use FUSE3 compatibility layer for macOS
- * 
+ *
  * Based on the original SSHFS by Miklos Szeredi
  * FUSE3 adaptation using eleph-tree compatibility layer
+ *
+ * libssh2 carries the SSH transport: host key check, authentication and
+ * the "sftp" subsystem channel. The SFTP packets on that channel are built
+ * and matched to their replies here, by request id, so any number of
+ * requests can be in flight at once. libssh2's own SFTP calls each wait for
+ * their reply before returning, and size their read-ahead themselves.
+ *
+ * Reads keep a window of SSH_FXP_READ requests in flight ahead of a
+ * sequential reader, doubling it on every sequential read up to
+ * -o readahead=BYTES, so a sequential read runs at link bandwidth rather
+ * than at one request per round trip. A read elsewhere in the file drops
+ * the window and starts again from one read's worth.
+ *
+ * Writes are sent without waiting for their status, up to 8 MiB in flight
+ * per open file. A failure is reported by the next write, flush, fsync or
+ * release on the file, and flush and fsync wait for everything in flight;
+ * fsync then asks the server to sync with fsync@openssh.com if it can.
+ *
+ * Before that, writes are buffered per open file, merged with the ones
+ * they overlap or touch, so that small writes go out as 32 KiB requests.
+ * An open file's buffer is sent once it holds 1 MiB, once it is a second
+ * old, on flush, fsync, release, truncate or a stat of the file, and when
+ * the mount has more than -o dirty_max=BYTES buffered. Reads through the
+ * file see its buffer; reads through other files open on the same path
+ * send it first.
+ *
+ * Requests are spread over -o connections=N SFTP sessions, each going to
+ * the one with the fewest requests in flight, and an open file stays on
+ * the session its handle belongs to. Each session has a thread receiving
+ * its replies, so any number of threads can have requests in flight on it.
+ *
+ * Attributes, directory listings and names that don't exist are cached
+ * for -o cache_timeout=SECONDS, in shards each behind a read-write lock.
+ * A listing also fills in the attributes of its names, and tells which
+ * names in the directory don't exist. Creating, removing, renaming and
+ * writing drop exactly the entries they make stale. SIGUSR1 prints the
+ * cache's hit rates to stderr.
+ *
+ * -o directport=PORT speaks SFTP over a plain TCP connection to PORT
+ * instead of SSH, as with "socat tcp-listen:PORT exec:sftp-server".
  */
 
 #define FUSE_USE_VERSION 30
@@ -13,74 +53,2363 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
+#include <netdb.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <dirent.h>
 #include <signal.h>
+#include <time.h>
 #include <pthread.h>
 #include <libssh2.h>
-#include <libssh2_sftp.h>
+
+/* SFTP protocol version 3 (draft-ietf-secsh-filexfer-02), as spoken by OpenSSH */
+#define SSH_FXP_INIT                1
+#define SSH_FXP_VERSION             2
+#define SSH_FXP_OPEN                3
+#define SSH_FXP_CLOSE               4
+#define SSH_FXP_READ                5
+#define SSH_FXP_WRITE               6
+#define SSH_FXP_LSTAT               7
+#define SSH_FXP_FSTAT               8
+#define SSH_FXP_SETSTAT             9
+#define SSH_FXP_FSETSTAT           10
+#define SSH_FXP_OPENDIR            11
+#define SSH_FXP_READDIR            12
+#define SSH_FXP_REMOVE             13
+#define SSH_FXP_MKDIR              14
+#define SSH_FXP_RMDIR              15
+#define SSH_FXP_STAT               17
+#define SSH_FXP_RENAME             18
+#define SSH_FXP_STATUS            101
+#define SSH_FXP_HANDLE            102
+#define SSH_FXP_DATA              103
+#define SSH_FXP_NAME              104
+#define SSH_FXP_ATTRS             105
+#define SSH_FXP_EXTENDED          200
+
+#define SSH_FXF_READ             0x01
+#define SSH_FXF_WRITE            0x02
+#define SSH_FXF_APPEND           0x04
+#define SSH_FXF_CREAT            0x08
+#define SSH_FXF_TRUNC            0x10
+#define SSH_FXF_EXCL             0x20
+
+#define SSH_FILEXFER_ATTR_SIZE          0x00000001
+#define SSH_FILEXFER_ATTR_UIDGID        0x00000002
+#define SSH_FILEXFER_ATTR_PERMISSIONS   0x00000004
+#define SSH_FILEXFER_ATTR_ACMODTIME     0x00000008
+#define SSH_FILEXFER_ATTR_EXTENDED      0x80000000
+
+#define SSH_FX_OK                   0
+#define SSH_FX_EOF                  1
+#define SSH_FX_NO_SUCH_FILE         2
+#define SSH_FX_PERMISSION_DENIED    3
+#define SSH_FX_FAILURE              4
+#define SSH_FX_BAD_MESSAGE          5
+#define SSH_FX_NO_CONNECTION        6
+#define SSH_FX_CONNECTION_LOST      7
+#define SSH_FX_OP_UNSUPPORTED       8
+
+#define SFTP_PROTO_VERSION          3
+#define SFTP_MAX_HANDLE           256
+
+/* Largest packet accepted from the server; OpenSSH sends at most 256 KiB */
+#define SFTP_MAX_PACKET     (1024 * 1024)
+
+/* Bytes asked for by one SSH_FXP_READ; every server takes 32 KiB */
+#define SSHFS_READ_CHUNK    (32 * 1024)
+
+/* Bytes sent by one SSH_FXP_WRITE */
+#define SSHFS_WRITE_CHUNK   (32 * 1024)
+
+/* Most bytes of writes in flight per open file before write() waits */
+#define SSHFS_MAX_WRITE_BEHIND (8 * 1024 * 1024)
+
+/* Default -o readahead, enough for 40 MB/s at 100 ms round trip */
+#define SSHFS_DEFAULT_READAHEAD (4 * 1024 * 1024)
+
+/* Default -o dirty_max: most bytes of writes buffered per mount before they are sent */
+#define SSHFS_DEFAULT_DIRTY_MAX (32 * 1024 * 1024)
+
+/* An open file's buffered writes are sent once they reach this */
+#define SSHFS_WRITEBACK_FLUSH (1024 * 1024)
+
+/* ... or once the oldest of them is this many seconds old */
+#define SSHFS_WRITEBACK_DELAY 1
+
+/* Default -o cache_timeout, in seconds */
+#define SSHFS_DEFAULT_CACHE_TIMEOUT 20
+
+/* Receive window of the SFTP channel, so the read-ahead isn't held back by flow control */
+#define SSHFS_CHANNEL_WINDOW (16 * 1024 * 1024)
+
+#define SFTP_PENDING_BUCKETS 256
+#define SSHFS_FILE_BUCKETS 256
+#define SSHFS_CACHE_SHARDS 64
+#define SSHFS_CACHE_BUCKETS 1024   /* per shard */
+
+/* Default -o connections */
+#define SSHFS_DEFAULT_CONNECTIONS 4
+#define SSHFS_MAX_CONNECTIONS 64
+
+/* A packet being built, or a reply being taken apart */
+struct sftp_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    size_t pos;
+    int error;  /* an allocation failed or a read ran past the end */
+};
+
+struct sftp_handle {
+    uint32_t len;
+    unsigned char data[SFTP_MAX_HANDLE];
+};
+
+struct sftp_request {
+    uint32_t id;
+    uint8_t type;               /* of the reply */
+    int done;                   /* the reply arrived, or the connection failed */
+    int error;                  /* -errno if the connection failed */
+    int abandoned;              /* nobody waits; freed when the reply arrives */
+    /* If set, called instead of waking a waiter, with conn->lock held; frees req */
+    void (*end)(struct sftp_request *req);
+    void *data;
+    struct sftp_buf msg;        /* the request */
+    struct sftp_buf reply;      /* after its id */
+    struct sftp_request *next;  /* in the pending table */
+};
+
+/*
+ * One SFTP session. Any thread sends, under send_lock so that packets
+ * don't interleave, and the threads waiting for replies take turns at
+ * receiving them for everyone. The socket is non-blocking and nobody
+ * sleeps holding io_lock, so a thread waiting for input never holds up
+ * one that sends.
+ */
+struct sftp_conn {
+    /* NULL with -o directport */
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channel;
+    int sock;
+    int wake[2];                /* wakes the receiver out of poll() */
+    
+    pthread_t receiver;
+    int started;
+    
+    pthread_mutex_t send_lock;  /* a packet is being sent */
+    pthread_mutex_t io_lock;    /* the socket, the libssh2 session and the fields below */
+    pthread_cond_t io_cond;     /* the receiver called libssh2 */
+    int polling;                /* the receiver is in poll() */
+    int stopping;               /* the receiver is to stop */
+    int stopped;                /* the receiver has stopped */
+    /*
+     * A libssh2 call returned EAGAIN with part of a packet still to send.
+     * Until the same call is repeated and gets it out, any other call
+     * fails with LIBSSH2_ERROR_BAD_USE, so the other side waits.
+     */
+    int send_pending;           /* in a sender's channel_write() */
+    int recv_pending;           /* in the receiver's channel_read() */
+    
+    /* Everything below */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* a reply arrived, or nobody receives */
+    int receiving;
+    unsigned int outstanding;   /* requests in flight, read without the lock */
+    uint32_t next_id;
+    struct sftp_request *pending[SFTP_PENDING_BUCKETS];
+    int broken;                 /* -errno once the connection failed */
+    
+    /* OpenSSH extensions the server announced */
+    int ext_fsync;
+    int ext_posix_rename;
+};
 
 /* SSHFS configuration and state */
 struct sshfs {
     char *host;
     char *username;
     char *password;
+    char *base_path;
     int port;
+    int directport;
+    size_t max_readahead;
+    
+    /* SFTP connections; an open file stays on the one it was opened on */
+    struct sftp_conn *conns;
+    int num_conns;
+    
+    /* Open files by path, and their buffered writes */
+    pthread_mutex_t files_lock;
+    pthread_cond_t files_cond;   /* a reference dropped, or writes to send */
+    struct sshfs_file *files[SSHFS_FILE_BUCKETS];
+    size_t dirty_max;
+    size_t dirty_bytes;
+    pthread_t flusher;
+    int flusher_started;
+    int flusher_stop;
+    
+    /* Attribute and directory cache */
+    struct sshfs_cache_shard *cache;
+    int cache_timeout;
+    pthread_mutex_t cache_lock;
+    pthread_cond_t cache_cond;
+    pthread_t cleaner;
+    int cleaner_started;
+    int cleaner_stop;
+    unsigned long stat_hits;       /* of them, negative_hits for paths that don't exist */
+    unsigned long stat_misses;
+    unsigned long negative_hits;
+    unsigned long dir_hits;
+    unsigned long dir_misses;
+    
+    /* Options */
+    int use_cache;
+    int reconnect;
+    int follow_symlinks;
+    int no_check_root;
+    int password_stdin;
+    int debug;
+};
+
+/* One SSH_FXP_READ of the read-ahead window */
+struct sshfs_chunk {
+    off_t offset;
+    size_t size;
+    struct sftp_request *req;
+    int parsed;                 /* data and len below are valid */
+    const unsigned char *data;  /* inside req->reply */
+    size_t len;
+    int res;                    /* 0, -ENODATA at end of file, or -errno */
+    struct sshfs_chunk *next;
+};
+
+/* A name in a cached directory listing */
+struct sshfs_dirent {
+    char *name;
+    struct stat st;
+};
+
+/* What is known of a path; each part is good until its deadline */
+struct sshfs_cache_entry {
+    char *path;
+    unsigned int hash;
+    time_t stat_until;
+    int negative;                /* path doesn't exist, rather than st */
+    struct stat st;
+    time_t dir_until;
+    struct sshfs_dirent *dir;    /* by name */
+    size_t dir_count;
+    struct sshfs_cache_entry *next;
+};
+
+/* The invalidations of each shard as of some point */
+struct sshfs_cache_gen {
+    unsigned long shard[SSHFS_CACHE_SHARDS];
+};
+
+struct sshfs_cache_shard {
+    pthread_rwlock_t lock;
+    unsigned long gen;           /* bumped by every invalidation, so no fill outdated by it is kept */
+    struct sshfs_cache_entry *buckets[SSHFS_CACHE_BUCKETS];
+};
+
+/* Buffered writes to [offset, offset + size) of an open file */
+struct sshfs_dirty {
+    off_t offset;
+    size_t size;
+    size_t alloc;
+    char *data;
+    struct sshfs_dirty *next;
+};
+
+/* An open file; fi->fh points here */
+struct sshfs_file {
+    struct sftp_handle handle;
+    struct sftp_conn *conn;
+    
+    /* In sshfs.files, under sshfs.files_lock */
+    char *path;
+    struct sshfs_file *hash_next;
+    unsigned int refs;           /* held by threads other than the opener */
+    int writable;
+    
+    /* Read-ahead state */
+    pthread_mutex_t lock;
+    struct sshfs_chunk *chunks;  /* contiguous, by offset */
+    off_t next_offset;           /* where a sequential reader goes next */
+    size_t window;               /* bytes requested past the current read */
+    int chunks_stale;            /* set when the file changes through another handle; atomic */
+    
+    /* Buffered writes, under lock; dirty_bytes and dirty_since also under sshfs.files_lock */
+    struct sshfs_dirty *dirty;   /* by offset, neither overlapping nor touching */
+    size_t dirty_bytes;
+    time_t dirty_since;
+    
+    /* Writes in flight, under conn->lock */
+    unsigned int writes;
+    size_t write_bytes;
+    int write_error;             /* of the first write that failed, reported from then on */
+};
+
+static struct sshfs sshfs = {
+    .port = 22,
+    .max_readahead = SSHFS_DEFAULT_READAHEAD,
+    .num_conns = SSHFS_DEFAULT_CONNECTIONS,
+    .files_lock = PTHREAD_MUTEX_INITIALIZER,
+    .files_cond = PTHREAD_COND_INITIALIZER,
+    .dirty_max = SSHFS_DEFAULT_DIRTY_MAX,
+    .use_cache = 1,
+    .cache_timeout = SSHFS_DEFAULT_CACHE_TIMEOUT,
+    .cache_lock = PTHREAD_MUTEX_INITIALIZER,
+    .cache_cond = PTHREAD_COND_INITIALIZER,
+    .reconnect = 1,
+    .follow_symlinks = 0,
+    .no_check_root = 0,
+    .debug = 0,
+};
+
+/* Helper functions */
+static void sshfs_log(const char *fmt, ...)
+{
+    if (sshfs.debug) {
+        va_list ap;
+        va_start(ap, fmt);
+        fprintf(stderr, "SSHFS_FUSE3: ");
+        vfprintf(stderr, fmt, ap);
+        fprintf(stderr, "\n");
+        va_end(ap);
+    }
+}
+
+static struct sshfs_file *sshfs_file(const struct fuse3_file_info *fi)
+{
+    return (struct sshfs_file *)(uintptr_t)fi->fh;
+}
+
+/* Buffers */
+
+static unsigned char *buf_reserve(struct sftp_buf *b, size_t n)
+{
+    unsigned char *p;
+    
+    if (b->error)
+        return NULL;
+    if (n > b->size - b->len) {
+        size_t size = b->size ? b->size : 256;
+        while (size - b->len < n)
+            size *= 2;
+        p = realloc(b->data, size);
+        if (!p) {
+            b->error = 1;
+            return NULL;
+        }
+        b->data = p;
+        b->size = size;
+    }
+    p = b->data + b->len;
+    b->len += n;
+    return p;
+}
+
+static void buf_free(struct sftp_buf *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+static void buf_put_uint32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t buf_peek_uint32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void buf_add_uint8(struct sftp_buf *b, uint8_t v)
+{
+    unsigned char *p = buf_reserve(b, 1);
+    if (p)
+        *p = v;
+}
+
+static void buf_add_uint32(struct sftp_buf *b, uint32_t v)
+{
+    unsigned char *p = buf_reserve(b, 4);
+    if (p)
+        buf_put_uint32(p, v);
+}
+
+static void buf_add_uint64(struct sftp_buf *b, uint64_t v)
+{
+    buf_add_uint32(b, v >> 32);
+    buf_add_uint32(b, (uint32_t)v);
+}
+
+static void buf_add_data(struct sftp_buf *b, const void *data, uint32_t len)
+{
+    unsigned char *p;
+    
+    buf_add_uint32(b, len);
+    p = buf_reserve(b, len);
+    if (p)
+        memcpy(p, data, len);
+}
+
+static void buf_add_handle(struct sftp_buf *b, const struct sftp_handle *h)
+{
+    buf_add_data(b, h->data, h->len);
+}
+
+/* The remote path of a path in the mount; with no base path, relative to the login directory */
+static void buf_add_path(struct sftp_buf *b, const char *path)
+{
+    const char *base = sshfs.base_path;
+    size_t base_len = strlen(base);
+    size_t path_len;
+    unsigned char *p;
+    
+    if (!base_len) {
+        if (!path[1])
+            path = "/.";
+        buf_add_data(b, path + 1, strlen(path + 1));
+        return;
+    }
+    if (!path[1])
+        path = "";
+    else if (base[base_len - 1] == '/')
+        path++;
+    path_len = strlen(path);
+    buf_add_uint32(b, base_len + path_len);
+    p = buf_reserve(b, base_len + path_len);
+    if (p) {
+        memcpy(p, base, base_len);
+        memcpy(p + base_len, path, path_len);
+    }
+}
+
+static const unsigned char *buf_take(struct sftp_buf *b, size_t n)
+{
+    const unsigned char *p;
+    
+    if (b->error || n > b->len - b->pos) {
+        b->error = 1;
+        return NULL;
+    }
+    p = b->data + b->pos;
+    b->pos += n;
+    return p;
+}
+
+static int buf_get_uint8(struct sftp_buf *b, uint8_t *v)
+{
+    const unsigned char *p = buf_take(b, 1);
+    if (!p)
+        return -EPROTO;
+    *v = *p;
+    return 0;
+}
+
+static int buf_get_uint32(struct sftp_buf *b, uint32_t *v)
+{
+    const unsigned char *p = buf_take(b, 4);
+    if (!p)
+        return -EPROTO;
+    *v = buf_peek_uint32(p);
+    return 0;
+}
+
+static int buf_get_uint64(struct sftp_buf *b, uint64_t *v)
+{
+    uint32_t hi, lo;
+    
+    if (buf_get_uint32(b, &hi) != 0 || buf_get_uint32(b, &lo) != 0)
+        return -EPROTO;
+    *v = (uint64_t)hi << 32 | lo;
+    return 0;
+}
+
+/* Points into the buffer, not NUL-terminated */
+static int buf_get_data(struct sftp_buf *b, const unsigned char **data, uint32_t *len)
+{
+    if (buf_get_uint32(b, len) != 0)
+        return -EPROTO;
+    *data = buf_take(b, *len);
+    return *data ? 0 : -EPROTO;
+}
+
+static int buf_get_handle(struct sftp_buf *b, struct sftp_handle *h)
+{
+    const unsigned char *data;
+    
+    if (buf_get_data(b, &data, &h->len) != 0 || h->len > SFTP_MAX_HANDLE)
+        return -EPROTO;
+    memcpy(h->data, data, h->len);
+    return 0;
+}
+
+static int buf_get_attrs(struct sftp_buf *b, struct stat *st)
+{
+    uint32_t flags, v, count;
+    uint64_t size;
+    const unsigned char *data;
+    
+    memset(st, 0, sizeof(*st));
+    if (buf_get_uint32(b, &flags) != 0)
+        return -EPROTO;
+    if (flags & SSH_FILEXFER_ATTR_SIZE) {
+        if (buf_get_uint64(b, &size) != 0)
+            return -EPROTO;
+        st->st_size = size;
+    }
+    if (flags & SSH_FILEXFER_ATTR_UIDGID) {
+        if (buf_get_uint32(b, &v) != 0)
+            return -EPROTO;
+        st->st_uid = v;
+        if (buf_get_uint32(b, &v) != 0)
+            return -EPROTO;
+        st->st_gid = v;
+    }
+    if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+        if (buf_get_uint32(b, &v) != 0)
+            return -EPROTO;
+        st->st_mode = v;
+    }
+    if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+        if (buf_get_uint32(b, &v) != 0)
+            return -EPROTO;
+        st->st_atime = v;
+        if (buf_get_uint32(b, &v) != 0)
+            return -EPROTO;
+        st->st_mtime = st->st_ctime = v;
+    }
+    if (flags & SSH_FILEXFER_ATTR_EXTENDED) {
+        if (buf_get_uint32(b, &count) != 0)
+            return -EPROTO;
+        for (uint32_t i = 0; i < 2 * count; i++) {
+            if (buf_get_data(b, &data, &v) != 0)
+                return -EPROTO;
+        }
+    }
+    st->st_nlink = 1;
+    st->st_blksize = SSHFS_READ_CHUNK;
+    st->st_blocks = (st->st_size + 511) / 512;
+    return 0;
+}
+
+/* Connection I/O */
+
+static void sftp_request_free(struct sftp_request *req)
+{
+    if (req) {
+        buf_free(&req->msg);
+        buf_free(&req->reply);
+        free(req);
+    }
+}
+
+/* After a libssh2 call, which may have read input the receiver polls for; with io_lock held */
+static void sftp_conn_wake(struct sftp_conn *conn)
+{
+    char c = 0;
+    
+    if (conn->polling && write(conn->wake[1], &c, 1) < 0 && errno != EAGAIN)
+        sshfs_log("wakeup failed: %s", strerror(errno));
+}
+
+/* Sends all of data; with send_lock held */
+static int sftp_conn_write(struct sftp_conn *conn, const unsigned char *data, size_t len)
+{
+    struct pollfd pfd = { .fd = conn->sock, .events = POLLOUT };
+    
+    while (len) {
+        ssize_t res;
+        int again, dirs;
+        pthread_mutex_lock(&conn->io_lock);
+        if (conn->channel) {
+            while (conn->recv_pending && !conn->stopped)
+                pthread_cond_wait(&conn->io_cond, &conn->io_lock);
+            for (;;) {
+                res = libssh2_channel_write(conn->channel, (const char *)data, len);
+                dirs = res == LIBSSH2_ERROR_EAGAIN ? libssh2_session_block_directions(conn->session) : 0;
+                conn->send_pending = (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND) != 0;
+                sftp_conn_wake(conn);
+                /* The server's window is full: the receiver reads the adjustment */
+                if (conn->stopped || !(dirs & LIBSSH2_SESSION_BLOCK_INBOUND))
+                    break;
+                pthread_cond_wait(&conn->io_cond, &conn->io_lock);
+            }
+            again = res == LIBSSH2_ERROR_EAGAIN && !conn->stopped;
+        } else {
+            res = write(conn->sock, data, len);
+            again = res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+        pthread_mutex_unlock(&conn->io_lock);
+        if (again) {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (res < 0)
+            return -EIO;
+        data += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Receives all of data; in the receiver thread, or before it starts */
+static int sftp_conn_read(struct sftp_conn *conn, unsigned char *data, size_t len)
+{
+    struct pollfd pfd[2];
+    char drain[64];
+    
+    while (len) {
+        ssize_t res;
+        int again, dirs;
+        pthread_mutex_lock(&conn->io_lock);
+        conn->polling = 0;
+        if (conn->stopping) {
+            pthread_mutex_unlock(&conn->io_lock);
+            return -ENOTCONN;
+        }
+        if (conn->send_pending) {
+            /* A sender has a packet partly out: leave libssh2 alone until it wakes us */
+            res = LIBSSH2_ERROR_EAGAIN;
+            dirs = 0;
+            again = 1;
+        } else if (conn->channel) {
+            res = libssh2_channel_read(conn->channel, (char *)data, len);
+            dirs = libssh2_session_block_directions(conn->session);
+            conn->recv_pending = res == LIBSSH2_ERROR_EAGAIN && (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND);
+            /* A sender may be waiting for a window adjustment that was just read */
+            pthread_cond_broadcast(&conn->io_cond);
+            /* 0 without end of file: libssh2 read something other than data */
+            again = res == LIBSSH2_ERROR_EAGAIN || (res == 0 && !libssh2_channel_eof(conn->channel));
+        } else {
+            res = read(conn->sock, data, len);
+            dirs = LIBSSH2_SESSION_BLOCK_INBOUND;
+            again = res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+        conn->polling = again;
+        pthread_mutex_unlock(&conn->io_lock);
+        if (again) {
+            pfd[0].fd = conn->sock;
+            pfd[0].events = (dirs & LIBSSH2_SESSION_BLOCK_INBOUND ? POLLIN : 0) |
+                            (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND ? POLLOUT : 0);
+            pfd[1].fd = conn->wake[0];
+            pfd[1].events = POLLIN;
+            poll(pfd, 2, -1);
+            while (read(conn->wake[0], drain, sizeof(drain)) > 0)
+                ;
+            continue;
+        }
+        if (res < 0)
+            return -EIO;
+        if (res == 0)
+            return -ECONNRESET;
+        data += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Fails every request in flight; the connection is not used again. With conn->lock held */
+static void sftp_conn_fail(struct sftp_conn *conn, int err)
+{
+    if (!conn->broken) {
+        fprintf(stderr, "SFTP connection to %s lost: %s\n", sshfs.host, strerror(-err));
+        __atomic_store_n(&conn->broken, err, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < SFTP_PENDING_BUCKETS; i++) {
+        while (conn->pending[i]) {
+            struct sftp_request *req = conn->pending[i];
+            conn->pending[i] = req->next;
+            req->done = 1;
+            req->error = err;
+            if (req->end)
+                req->end(req);
+            else if (req->abandoned)
+                sftp_request_free(req);
+        }
+    }
+    __atomic_store_n(&conn->outstanding, 0, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&conn->cond);
+}
+
+/* Requests */
+
+static struct sftp_request *sftp_request_new(uint8_t type)
+{
+    struct sftp_request *req = calloc(1, sizeof(struct sftp_request));
+    
+    if (!req)
+        return NULL;
+    buf_add_uint32(&req->msg, 0);  /* length, set by sftp_send() */
+    buf_add_uint8(&req->msg, type);
+    buf_add_uint32(&req->msg, 0);  /* id, set by sftp_send() */
+    return req;
+}
+
+/*
+ * Once this returns, req belongs to whoever waits for it, or to its end
+ * callback. It is never sent on failure, and then only freed if it has
+ * an end callback.
+ */
+static int sftp_send(struct sftp_conn *conn, struct sftp_request *req)
+{
+    struct sftp_request **bucket;
+    int res;
+    
+    pthread_mutex_lock(&conn->lock);
+    res = req->msg.error ? -ENOMEM : conn->broken;
+    if (res == 0) {
+        req->id = conn->next_id++;
+        buf_put_uint32(req->msg.data, req->msg.len - 4);
+        buf_put_uint32(req->msg.data + 5, req->id);
+        bucket = &conn->pending[req->id % SFTP_PENDING_BUCKETS];
+        req->next = *bucket;
+        *bucket = req;
+        __atomic_add_fetch(&conn->outstanding, 1, __ATOMIC_RELAXED);
+    } else if (req->end) {
+        /* Always ends, so that the caller never frees it */
+        req->done = 1;
+        req->error = res;
+        req->end(req);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    if (res != 0)
+        return res;
+    
+    pthread_mutex_lock(&conn->send_lock);
+    res = sftp_conn_write(conn, req->msg.data, req->msg.len);
+    pthread_mutex_unlock(&conn->send_lock);
+    if (res != 0) {
+        pthread_mutex_lock(&conn->lock);
+        sftp_conn_fail(conn, res);
+        pthread_mutex_unlock(&conn->lock);
+    }
+    return res;
+}
+
+/* Reads one reply and hands it to its request; in the receiver thread */
+static int sftp_receive(struct sftp_conn *conn)
+{
+    unsigned char hdr[9];
+    struct sftp_request **p, *req;
+    struct sftp_buf msg = { 0 };
+    uint32_t len, id;
+    unsigned char *data;
+    int res;
+    
+    res = sftp_conn_read(conn, hdr, sizeof(hdr));
+    if (res != 0)
+        return res;
+    len = buf_peek_uint32(hdr);
+    id = buf_peek_uint32(hdr + 5);
+    if (len < 5 || len > SFTP_MAX_PACKET)
+        return -EPROTO;
+    data = buf_reserve(&msg, len - 5);
+    res = data ? sftp_conn_read(conn, data, len - 5) : -ENOMEM;
+    if (res != 0) {
+        buf_free(&msg);
+        return res;
+    }
+    
+    pthread_mutex_lock(&conn->lock);
+    for (p = &conn->pending[id % SFTP_PENDING_BUCKETS]; *p && (*p)->id != id; p = &(*p)->next)
+        ;
+    req = *p;
+    if (req) {
+        *p = req->next;
+        __atomic_sub_fetch(&conn->outstanding, 1, __ATOMIC_RELAXED);
+        req->type = hdr[4];
+        req->reply = msg;
+        req->done = 1;
+        if (req->end)
+            req->end(req);
+        else if (req->abandoned)
+            sftp_request_free(req);
+        pthread_cond_broadcast(&conn->cond);
+    } else {
+        sshfs_log("reply to unknown request %u", id);
+        buf_free(&msg);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+static void *sftp_receiver(void *data)
+{
+    struct sftp_conn *conn = data;
+    int res;
+    
+    do {
+        res = sftp_receive(conn);
+    } while (res == 0);
+    
+    pthread_mutex_lock(&conn->io_lock);
+    conn->stopped = 1;
+    pthread_cond_broadcast(&conn->io_cond);
+    pthread_mutex_unlock(&conn->io_lock);
+    pthread_mutex_lock(&conn->lock);
+    sftp_conn_fail(conn, res);
+    pthread_mutex_unlock(&conn->lock);
+    return NULL;
+}
+
+static int sftp_wait(struct sftp_conn *conn, struct sftp_request *req)
+{
+    int res;
+    
+    pthread_mutex_lock(&conn->lock);
+    while (!req->done)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    res = req->error;
+    pthread_mutex_unlock(&conn->lock);
+    return res;
+}
+
+/* Leaves a sent request to be freed when its reply arrives */
+static void sftp_abandon(struct sftp_conn *conn, struct sftp_request *req)
+{
+    pthread_mutex_lock(&conn->lock);
+    if (req->done)
+        sftp_request_free(req);
+    else
+        req->abandoned = 1;
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/* Sends req and waits for the reply */
+static int sftp_transact(struct sftp_conn *conn, struct sftp_request *req)
+{
+    int res = sftp_send(conn, req);
+    
+    if (res == 0)
+        res = sftp_wait(conn, req);
+    return res;
+}
+
+/* The connection with the fewest requests in flight */
+static struct sftp_conn *sftp_conn_get(void)
+{
+    struct sftp_conn *best = &sshfs.conns[0];
+    unsigned int best_load = UINT_MAX;
+    
+    for (int i = 0; i < sshfs.num_conns; i++) {
+        struct sftp_conn *conn = &sshfs.conns[i];
+        unsigned int load = __atomic_load_n(&conn->outstanding, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&conn->broken, __ATOMIC_RELAXED))
+            continue;
+        if (load < best_load) {
+            best = conn;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static int sftp_errno(uint32_t code)
+{
+    switch (code) {
+    case SSH_FX_OK:                return 0;
+    case SSH_FX_EOF:               return -ENODATA;
+    case SSH_FX_NO_SUCH_FILE:      return -ENOENT;
+    case SSH_FX_PERMISSION_DENIED: return -EACCES;
+    case SSH_FX_FAILURE:           return -EPERM;
+    case SSH_FX_BAD_MESSAGE:       return -EBADMSG;
+    case SSH_FX_NO_CONNECTION:     return -ENOTCONN;
+    case SSH_FX_CONNECTION_LOST:   return -ECONNABORTED;
+    case SSH_FX_OP_UNSUPPORTED:    return -EOPNOTSUPP;
+    default:                       return -EIO;
+    }
+}
+
+/*
+ * 0 if the reply has the expected type, otherwise -errno for the status
+ * it carries; -ENODATA stands for end of file.
+ */
+static int sftp_reply_check(struct sftp_request *req, uint8_t expected)
+{
+    uint32_t code;
+    
+    if (req->type == expected && expected != SSH_FXP_STATUS)
+        return 0;
+    if (req->type != SSH_FXP_STATUS || buf_get_uint32(&req->reply, &code) != 0)
+        return -EPROTO;
+    if (code == SSH_FX_OK && expected != SSH_FXP_STATUS)
+        return -EPROTO;
+    return sftp_errno(code);
+}
+
+/* A request on a path that is answered with a status */
+static int sftp_path_request(uint8_t type, const char *path, const struct stat *attrs)
+{
+    struct sftp_request *req = sftp_request_new(type);
+    int res;
+    
+    if (!req)
+        return -ENOMEM;
+    buf_add_path(&req->msg, path);
+    if (attrs) {
+        buf_add_uint32(&req->msg, SSH_FILEXFER_ATTR_PERMISSIONS);
+        buf_add_uint32(&req->msg, attrs->st_mode & 07777);
+    }
+    res = sftp_transact(sftp_conn_get(), req);
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_STATUS);
+    sftp_request_free(req);
+    return res;
+}
+
+static int sftp_open_handle(struct sftp_conn *conn, uint8_t type, const char *path, uint32_t pflags,
+                            mode_t mode, struct sftp_handle *h)
+{
+    struct sftp_request *req = sftp_request_new(type);
+    int res;
+    
+    if (!req)
+        return -ENOMEM;
+    buf_add_path(&req->msg, path);
+    if (type == SSH_FXP_OPEN) {
+        buf_add_uint32(&req->msg, pflags);
+        if (pflags & SSH_FXF_CREAT) {
+            buf_add_uint32(&req->msg, SSH_FILEXFER_ATTR_PERMISSIONS);
+            buf_add_uint32(&req->msg, mode & 07777);
+        } else {
+            buf_add_uint32(&req->msg, 0);
+        }
+    }
+    res = sftp_transact(conn, req);
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_HANDLE);
+    if (res == 0)
+        res = buf_get_handle(&req->reply, h);
+    sftp_request_free(req);
+    return res;
+}
+
+/* Closes a handle without waiting; what close reports comes too late to matter */
+static void sftp_close_handle(struct sftp_conn *conn, const struct sftp_handle *h)
+{
+    struct sftp_request *req = sftp_request_new(SSH_FXP_CLOSE);
+    
+    if (!req)
+        return;
+    buf_add_handle(&req->msg, h);
+    if (sftp_send(conn, req) == 0)
+        sftp_abandon(conn, req);
+    else
+        sftp_request_free(req);
+}
+
+/* Connection setup */
+
+static int sshfs_tcp_connect(const char *host, int port)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    int sock = -1;
+    int one = 1;
+    int err;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    err = getaddrinfo(host, service, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", host, gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == -1)
+            continue;
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        err = errno;
+        close(sock);
+        sock = -1;
+        errno = err;
+    }
+    freeaddrinfo(res);
+    if (sock == -1) {
+        fprintf(stderr, "Failed to connect to %s:%d: %s\n", host, port, strerror(errno));
+        return -1;
+    }
+    /* Requests are small and latency bound */
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+static void sshfs_ssh_error(LIBSSH2_SESSION *session, const char *what)
+{
+    char *msg = NULL;
+    
+    if (session)
+        libssh2_session_last_error(session, &msg, NULL, 0);
+    fprintf(stderr, "%s: %s\n", what, msg ? msg : "out of memory");
+}
+
+static int sshfs_knownhost_key_type(int type)
+{
+    switch (type) {
+    case LIBSSH2_HOSTKEY_TYPE_RSA:
+        return LIBSSH2_KNOWNHOST_KEY_SSHRSA;
+    case LIBSSH2_HOSTKEY_TYPE_DSS:
+        return LIBSSH2_KNOWNHOST_KEY_SSHDSS;
+#ifdef LIBSSH2_HOSTKEY_TYPE_ECDSA_256
+    case LIBSSH2_HOSTKEY_TYPE_ECDSA_256:
+        return LIBSSH2_KNOWNHOST_KEY_ECDSA_256;
+    case LIBSSH2_HOSTKEY_TYPE_ECDSA_384:
+        return LIBSSH2_KNOWNHOST_KEY_ECDSA_384;
+    case LIBSSH2_HOSTKEY_TYPE_ECDSA_521:
+        return LIBSSH2_KNOWNHOST_KEY_ECDSA_521;
+#endif
+#ifdef LIBSSH2_HOSTKEY_TYPE_ED25519
+    case LIBSSH2_HOSTKEY_TYPE_ED25519:
+        return LIBSSH2_KNOWNHOST_KEY_ED25519;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* The server's key must be in ~/.ssh/known_hosts, as ssh would have it */
+static int sshfs_check_host_key(LIBSSH2_SESSION *session)
+{
+    const char *home = getenv("HOME");
+    LIBSSH2_KNOWNHOSTS *hosts;
+    char path[PATH_MAX];
+    const char *key;
+    size_t len;
+    int type;
+    int check = LIBSSH2_KNOWNHOST_CHECK_FAILURE;
+    
+    key = libssh2_session_hostkey(session, &len, &type);
+    hosts = libssh2_knownhost_init(session);
+    if (key && hosts && home) {
+        snprintf(path, sizeof(path), "%s/.ssh/known_hosts", home);
+        libssh2_knownhost_readfile(hosts, path, LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+        check = libssh2_knownhost_checkp(hosts, sshfs.host, sshfs.port, key, len,
+                                         LIBSSH2_KNOWNHOST_TYPE_PLAIN | LIBSSH2_KNOWNHOST_KEYENC_RAW |
+                                         sshfs_knownhost_key_type(type), NULL);
+    }
+    if (hosts)
+        libssh2_knownhost_free(hosts);
+    
+    switch (check) {
+    case LIBSSH2_KNOWNHOST_CHECK_MATCH:
+        return 0;
+    case LIBSSH2_KNOWNHOST_CHECK_MISMATCH:
+        fprintf(stderr, "Host key of %s does not match ~/.ssh/known_hosts\n", sshfs.host);
+        return -1;
+    case LIBSSH2_KNOWNHOST_CHECK_NOTFOUND:
+        fprintf(stderr, "%s is not in ~/.ssh/known_hosts; connect once with ssh to add it\n", sshfs.host);
+        return -1;
+    default:
+        fprintf(stderr, "Failed to check the host key of %s\n", sshfs.host);
+        return -1;
+    }
+}
+
+/* ssh-agent, then the default key files without a passphrase, then a password */
+static int sshfs_authenticate(LIBSSH2_SESSION *session)
+{
+    static const char *const keys[] = { "id_ed25519", "id_ecdsa", "id_rsa" };
+    const char *home = getenv("HOME");
+    LIBSSH2_AGENT *agent = libssh2_agent_init(session);
+    
+    if (agent && libssh2_agent_connect(agent) == 0) {
+        struct libssh2_agent_publickey *identity, *prev = NULL;
+        if (libssh2_agent_list_identities(agent) == 0) {
+            while (libssh2_agent_get_identity(agent, &identity, prev) == 0) {
+                if (libssh2_agent_userauth(agent, sshfs.username, identity) == 0)
+                    break;
+                prev = identity;
+            }
+        }
+        libssh2_agent_disconnect(agent);
+    }
+    if (agent)
+        libssh2_agent_free(agent);
+    if (libssh2_userauth_authenticated(session))
+        return 0;
+    
+    for (size_t i = 0; home && i < sizeof(keys) / sizeof(keys[0]); i++) {
+        char private_key[PATH_MAX], public_key[PATH_MAX + 4];
+        snprintf(private_key, sizeof(private_key), "%s/.ssh/%s", home, keys[i]);
+        snprintf(public_key, sizeof(public_key), "%s.pub", private_key);
+        if (access(private_key, R_OK) != 0)
+            continue;
+        if (libssh2_userauth_publickey_fromfile(session, sshfs.username,
+                                                access(public_key, R_OK) == 0 ? public_key : NULL,
+                                                private_key, NULL) == 0)
+            return 0;
+    }
+    
+    if (sshfs.password && libssh2_userauth_password(session, sshfs.username, sshfs.password) == 0)
+        return 0;
+    fprintf(stderr, "Authentication failed for %s@%s\n", sshfs.username, sshfs.host);
+    return -1;
+}
+
+/* Exchanges SSH_FXP_INIT and SSH_FXP_VERSION */
+static int sftp_init(struct sftp_conn *conn)
+{
+    struct sftp_buf b = { 0 };
+    unsigned char hdr[4];
+    const unsigned char *name, *value;
+    uint32_t len, version, name_len, value_len;
+    uint8_t type;
+    int res;
+    
+    buf_add_uint32(&b, 5);
+    buf_add_uint8(&b, SSH_FXP_INIT);
+    buf_add_uint32(&b, SFTP_PROTO_VERSION);
+    res = b.error ? -ENOMEM : sftp_conn_write(conn, b.data, b.len);
+    if (res == 0)
+        res = sftp_conn_read(conn, hdr, sizeof(hdr));
+    if (res == 0) {
+        len = buf_peek_uint32(hdr);
+        b.len = 0;
+        if (len < 5 || len > SFTP_MAX_PACKET)
+            res = -EPROTO;
+        else if (!buf_reserve(&b, len))
+            res = -ENOMEM;
+        else
+            res = sftp_conn_read(conn, b.data, len);
+    }
+    if (res == 0 && (buf_get_uint8(&b, &type) != 0 || type != SSH_FXP_VERSION ||
+                     buf_get_uint32(&b, &version) != 0 || version < SFTP_PROTO_VERSION))
+        res = -EPROTO;
+    while (res == 0 && b.pos < b.len) {
+        if (buf_get_data(&b, &name, &name_len) != 0 || buf_get_data(&b, &value, &value_len) != 0) {
+            res = -EPROTO;
+            break;
+        }
+        sshfs_log("server extension %.*s %.*s", (int)name_len, name, (int)value_len, value);
+        if (name_len == 17 && memcmp(name, "fsync@openssh.com", 17) == 0)
+            conn->ext_fsync = 1;
+        else if (name_len == 24 && memcmp(name, "posix-rename@openssh.com", 24) == 0)
+            conn->ext_posix_rename = 1;
+    }
+    buf_free(&b);
+    if (res != 0)
+        fprintf(stderr, "SFTP handshake with %s failed: %s\n", sshfs.host, strerror(-res));
+    return res;
+}
+
+static void sshfs_disconnect(struct sftp_conn *conn)
+{
+    sshfs_log("Disconnecting from %s", sshfs.host);
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->broken)
+        conn->broken = -ENOTCONN;
+    pthread_mutex_unlock(&conn->lock);
+    if (conn->started) {
+        pthread_mutex_lock(&conn->io_lock);
+        conn->stopping = 1;
+        conn->polling = 1;
+        sftp_conn_wake(conn);
+        pthread_mutex_unlock(&conn->io_lock);
+        pthread_join(conn->receiver, NULL);
+        conn->started = 0;
+    }
+    pthread_mutex_lock(&conn->lock);
+    sftp_conn_fail(conn, conn->broken);
+    pthread_mutex_unlock(&conn->lock);
+    
+    if (conn->channel) {
+        libssh2_session_set_blocking(conn->session, 1);
+        libssh2_channel_close(conn->channel);
+        libssh2_channel_free(conn->channel);
+        conn->channel = NULL;
+    }
+    if (conn->session) {
+        libssh2_session_disconnect(conn->session, "sshfs unmounted");
+        libssh2_session_free(conn->session);
+        conn->session = NULL;
+    }
+    if (conn->sock != -1) {
+        close(conn->sock);
+        conn->sock = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (conn->wake[i] != -1)
+            close(conn->wake[i]);
+        conn->wake[i] = -1;
+    }
+    pthread_mutex_destroy(&conn->send_lock);
+    pthread_mutex_destroy(&conn->io_lock);
+    pthread_cond_destroy(&conn->io_cond);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+}
+
+static int sshfs_connect(struct sftp_conn *conn)
+{
+    sshfs_log("Connecting to %s@%s:%d", sshfs.username, sshfs.host,
+              sshfs.directport ? sshfs.directport : sshfs.port);
+    
+    memset(conn, 0, sizeof(*conn));
+    conn->sock = conn->wake[0] = conn->wake[1] = -1;
+    pthread_mutex_init(&conn->send_lock, NULL);
+    pthread_mutex_init(&conn->io_lock, NULL);
+    pthread_cond_init(&conn->io_cond, NULL);
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->cond, NULL);
+    if (pipe(conn->wake) != 0 || fcntl(conn->wake[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(conn->wake[1], F_SETFL, O_NONBLOCK) != 0) {
+        perror("pipe");
+        goto fail;
+    }
+    conn->sock = sshfs_tcp_connect(sshfs.host, sshfs.directport ? sshfs.directport : sshfs.port);
+    if (conn->sock == -1)
+        goto fail;
+    
+    if (!sshfs.directport) {
+        conn->session = libssh2_session_init();
+        if (!conn->session || libssh2_session_handshake(conn->session, conn->sock) != 0) {
+            sshfs_ssh_error(conn->session, "SSH handshake failed");
+            goto fail;
+        }
+        if (sshfs_check_host_key(conn->session) != 0 || sshfs_authenticate(conn->session) != 0)
+            goto fail;
+        conn->channel = libssh2_channel_open_ex(conn->session, "session", sizeof("session") - 1,
+                                                SSHFS_CHANNEL_WINDOW, LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                                                NULL, 0);
+        if (!conn->channel || libssh2_channel_subsystem(conn->channel, "sftp") != 0) {
+            sshfs_ssh_error(conn->session, "Failed to start the sftp subsystem");
+            goto fail;
+        }
+    }
+    
+    /* From here on nobody sleeps inside libssh2; see struct sftp_conn */
+    if (conn->session)
+        libssh2_session_set_blocking(conn->session, 0);
+    if (fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL) | O_NONBLOCK) != 0) {
+        perror("fcntl");
+        goto fail;
+    }
+    if (sftp_init(conn) != 0)
+        goto fail;
+    if (pthread_create(&conn->receiver, NULL, sftp_receiver, conn) != 0) {
+        fprintf(stderr, "Failed to start the SFTP receiver thread\n");
+        goto fail;
+    }
+    conn->started = 1;
+    return 0;
+
+fail:
+    sshfs_disconnect(conn);
+    return -1;
+}
+
+/* Opens the -o connections sessions */
+static int sshfs_connect_all(void)
+{
+    sshfs.conns = calloc(sshfs.num_conns, sizeof(struct sftp_conn));
+    if (!sshfs.conns)
+        return -1;
+    for (int i = 0; i < sshfs.num_conns; i++) {
+        if (sshfs_connect(&sshfs.conns[i]) != 0) {
+            sshfs.num_conns = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void sshfs_disconnect_all(void)
+{
+    for (int i = 0; sshfs.conns && i < sshfs.num_conns; i++)
+        sshfs_disconnect(&sshfs.conns[i]);
+    free(sshfs.conns);
+    sshfs.conns = NULL;
+}
+
+/* Read-ahead, with the file's lock held */
+
+/* Asks for [offset, offset + size) in chunks, inserting them after *link */
+static int sshfs_chunks_request(struct sshfs_file *sf, struct sshfs_chunk **link, off_t offset, size_t size)
+{
+    int res = 0;
+    
+    while (size) {
+        size_t n = size < SSHFS_READ_CHUNK ? size : SSHFS_READ_CHUNK;
+        struct sshfs_chunk *chunk = calloc(1, sizeof(struct sshfs_chunk));
+        if (chunk)
+            chunk->req = sftp_request_new(SSH_FXP_READ);
+        if (!chunk || !chunk->req) {
+            free(chunk);
+            res = -ENOMEM;
+            break;
+        }
+        buf_add_handle(&chunk->req->msg, &sf->handle);
+        buf_add_uint64(&chunk->req->msg, offset);
+        buf_add_uint32(&chunk->req->msg, n);
+        res = sftp_send(sf->conn, chunk->req);
+        if (res != 0) {
+            sftp_request_free(chunk->req);
+            free(chunk);
+            break;
+        }
+        chunk->offset = offset;
+        chunk->size = n;
+        chunk->next = *link;
+        *link = chunk;
+        link = &chunk->next;
+        offset += n;
+        size -= n;
+    }
+    return res;
+}
+
+/* Drops *link and everything after it */
+static void sshfs_chunks_drop(struct sshfs_file *sf, struct sshfs_chunk **link)
+{
+    struct sshfs_chunk *chunk = *link;
+    
+    *link = NULL;
+    if (!chunk)
+        return;
+    /* As sftp_abandon(), under one lock */
+    pthread_mutex_lock(&sf->conn->lock);
+    while (chunk) {
+        struct sshfs_chunk *next = chunk->next;
+        if (chunk->req->done)
+            sftp_request_free(chunk->req);
+        else
+            chunk->req->abandoned = 1;
+        free(chunk);
+        chunk = next;
+    }
+    pthread_mutex_unlock(&sf->conn->lock);
+}
+
+/* The link past the last chunk, and where that chunk ends */
+static struct sshfs_chunk **sshfs_chunks_tail(struct sshfs_file *sf, off_t *end)
+{
+    struct sshfs_chunk **link = &sf->chunks;
+    
+    *end = -1;
+    while (*link) {
+        *end = (*link)->offset + (off_t)(*link)->size;
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/*
+ * Waits for a chunk's reply and takes it apart. A short read is not the
+ * end of the file: the rest of the chunk is asked for again.
+ */
+static int sshfs_chunk_parse(struct sshfs_file *sf, struct sshfs_chunk *chunk)
+{
+    struct sftp_request *req = chunk->req;
+    uint32_t len;
+    int res;
+    
+    res = sftp_wait(sf->conn, req);
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_DATA);
+    if (res == 0) {
+        res = buf_get_data(&req->reply, &chunk->data, &len);
+        if (res == 0 && (len == 0 || len > chunk->size))
+            res = -EPROTO;
+    }
+    chunk->parsed = 1;
+    chunk->res = res;
+    if (res != 0)
+        return res;
+    
+    chunk->len = len;
+    if (len < chunk->size) {
+        res = sshfs_chunks_request(sf, &chunk->next, chunk->offset + len, chunk->size - len);
+        chunk->size = len;
+    }
+    return res;
+}
+
+/* Where the read-ahead goes for a read of [offset, offset + size) */
+static void sshfs_readahead_update(struct sshfs_file *sf, off_t offset, size_t size)
+{
+    struct sshfs_chunk **link = &sf->chunks;
+    off_t end;
+    
+    sshfs_chunks_tail(sf, &end);
+    
+    if (offset == sf->next_offset || (sf->chunks && offset >= sf->chunks->offset && offset < end)) {
+        /* Sequential: read further ahead */
+        size_t window = sf->window ? 2 * sf->window : size;
+        sf->window = window < sshfs.max_readahead ? window : sshfs.max_readahead;
+        /* Keep one read behind, for reads the kernel sent out of order */
+        while (*link && (*link)->offset + (off_t)(*link)->size + (off_t)size <= offset) {
+            struct sshfs_chunk *chunk = *link;
+            *link = chunk->next;
+            chunk->next = NULL;
+            sshfs_chunks_drop(sf, &chunk);
+        }
+    } else {
+        sf->window = 0;
+        sshfs_chunks_drop(sf, &sf->chunks);
+    }
+}
+
+/* Drops what was read ahead from the first chunk that overlaps [offset, offset + size) */
+static void sshfs_chunks_invalidate(struct sshfs_file *sf, off_t offset, size_t size)
+{
+    struct sshfs_chunk **link = &sf->chunks;
+    
+    while (*link && (*link)->offset + (off_t)(*link)->size <= offset)
+        link = &(*link)->next;
+    if (*link && (*link)->offset < offset + (off_t)size)
+        sshfs_chunks_drop(sf, link);
+}
+
+/* Write-behind */
+
+/* Keeps the first error of a write on sf, to be reported from then on; with conn->lock held */
+static void sshfs_write_fail(struct sshfs_file *sf, int res)
+{
+    if (res != 0 && !sf->write_error) {
+        sshfs_log("write failed: %s", strerror(-res));
+        sf->write_error = res;
+    }
+}
+
+/* Collects the status of a write; in the receiver thread, with conn->lock held */
+static void sshfs_write_end(struct sftp_request *req)
+{
+    struct sshfs_file *sf = req->data;
+    int res = req->error;
+    
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_STATUS);
+    sshfs_write_fail(sf, res);
+    sf->writes--;
+    sf->write_bytes -= req->msg.len;
+    sftp_request_free(req);
+}
+
+/* Waits for the writes in flight; 0, or the error of the first that failed */
+static int sshfs_writes_wait(struct sshfs_file *sf)
+{
+    struct sftp_conn *conn = sf->conn;
+    int res;
+    
+    pthread_mutex_lock(&conn->lock);
+    while (sf->writes)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    res = sf->write_error;
+    pthread_mutex_unlock(&conn->lock);
+    return res;
+}
+
+static void sshfs_files_changed(struct sshfs_file *except, const char *path);
+
+/*
+ * Sends [offset, offset + size) and returns; its status is collected when
+ * it arrives, and a failure, here or there, is reported by the next write,
+ * flush, fsync or release on the file. Requests on a handle are carried out
+ * in order, so reads through it see the write; other handles on the file
+ * drop their read-ahead before their next read. With sf->lock held, so that
+ * no read-ahead is sent between dropping what the write makes stale and the
+ * write.
+ */
+static int sshfs_write_send(struct sshfs_file *sf, const char *buf, size_t size, off_t offset)
+{
+    struct sftp_conn *conn = sf->conn;
+    size_t done = 0;
+    int res;
+    
+    pthread_mutex_lock(&conn->lock);
+    while (!sf->write_error && sf->write_bytes > SSHFS_MAX_WRITE_BEHIND)
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    res = sf->write_error;
+    pthread_mutex_unlock(&conn->lock);
+    if (res != 0)
+        return res;
+    
+    sshfs_chunks_invalidate(sf, offset, size);
+    sshfs_files_changed(sf, NULL);
+    while (res == 0 && done < size) {
+        size_t n = size - done < SSHFS_WRITE_CHUNK ? size - done : SSHFS_WRITE_CHUNK;
+        struct sftp_request *req = sftp_request_new(SSH_FXP_WRITE);
+        if (!req) {
+            /* Failures once the request is sent land in sf->write_error on their own */
+            pthread_mutex_lock(&conn->lock);
+            sshfs_write_fail(sf, -ENOMEM);
+            pthread_mutex_unlock(&conn->lock);
+            return -ENOMEM;
+        }
+        buf_add_handle(&req->msg, &sf->handle);
+        buf_add_uint64(&req->msg, offset + done);
+        buf_add_data(&req->msg, buf + done, n);
+        req->end = sshfs_write_end;
+        req->data = sf;
+        pthread_mutex_lock(&conn->lock);
+        sf->writes++;
+        sf->write_bytes += req->msg.len;
+        pthread_mutex_unlock(&conn->lock);
+        res = sftp_send(conn, req);
+        done += n;
+    }
+    return res;
+}
+
+/* Write-back */
+
+static unsigned int sshfs_hash(const char *path)
+{
+    unsigned int h = 5381;
+    
+    while (*path)
+        h = h * 33 + (unsigned char)*path++;
+    return h;
+}
+
+static void sshfs_file_add(struct sshfs_file *sf)
+{
+    struct sshfs_file **bucket = &sshfs.files[sshfs_hash(sf->path) % SSHFS_FILE_BUCKETS];
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    sf->hash_next = *bucket;
+    *bucket = sf;
+    pthread_mutex_unlock(&sshfs.files_lock);
+}
+
+/* Takes sf out of sshfs.files and waits for other threads to let go of it */
+static void sshfs_file_remove(struct sshfs_file *sf)
+{
+    struct sshfs_file **link = &sshfs.files[sshfs_hash(sf->path) % SSHFS_FILE_BUCKETS];
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    while (*link != sf)
+        link = &(*link)->hash_next;
+    *link = sf->hash_next;
+    while (sf->refs)
+        pthread_cond_wait(&sshfs.files_cond, &sshfs.files_lock);
+    pthread_mutex_unlock(&sshfs.files_lock);
+}
+
+static void sshfs_file_put(struct sshfs_file *sf)
+{
+    pthread_mutex_lock(&sshfs.files_lock);
+    if (--sf->refs == 0)
+        pthread_cond_broadcast(&sshfs.files_cond);
+    pthread_mutex_unlock(&sshfs.files_lock);
+}
+
+/* 1 if a file is open for writing on path */
+static int sshfs_file_writing(const char *path)
+{
+    struct sshfs_file *sf;
+    int res = 0;
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    for (sf = sshfs.files[sshfs_hash(path) % SSHFS_FILE_BUCKETS]; sf && !res; sf = sf->hash_next)
+        res = sf->writable && strcmp(sf->path, path) == 0;
+    pthread_mutex_unlock(&sshfs.files_lock);
+    return res;
+}
+
+/* Has the files open on path, or on except's path if NULL, other than except drop their read-ahead */
+static void sshfs_files_changed(struct sshfs_file *except, const char *path)
+{
+    struct sshfs_file *sf;
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    if (!path)
+        path = except->path;
+    for (sf = sshfs.files[sshfs_hash(path) % SSHFS_FILE_BUCKETS]; sf; sf = sf->hash_next) {
+        if (sf != except && strcmp(sf->path, path) == 0)
+            __atomic_store_n(&sf->chunks_stale, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sshfs.files_lock);
+}
+
+/* Open files at from, or below it, are now at to */
+static void sshfs_files_rename(const char *from, const char *to)
+{
+    struct sshfs_file *moved = NULL, *sf;
+    size_t len = strlen(from);
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    for (unsigned int i = 0; i < SSHFS_FILE_BUCKETS; i++) {
+        struct sshfs_file **link = &sshfs.files[i];
+        while ((sf = *link)) {
+            char *path = NULL;
+            if (strncmp(sf->path, from, len) == 0 && (!sf->path[len] || sf->path[len] == '/'))
+                path = malloc(strlen(to) + strlen(sf->path + len) + 1);
+            if (!path) {
+                link = &sf->hash_next;
+                continue;
+            }
+            strcpy(path, to);
+            strcat(path, sf->path + len);
+            free(sf->path);
+            sf->path = path;
+            *link = sf->hash_next;
+            sf->hash_next = moved;
+            moved = sf;
+        }
+    }
+    while ((sf = moved)) {
+        struct sshfs_file **bucket = &sshfs.files[sshfs_hash(sf->path) % SSHFS_FILE_BUCKETS];
+        moved = sf->hash_next;
+        sf->hash_next = *bucket;
+        *bucket = sf;
+    }
+    pthread_mutex_unlock(&sshfs.files_lock);
+}
+
+/* Changes the dirty byte count of sf and of the mount; 1 if the mount is now over -o dirty_max */
+static int sshfs_dirty_account(struct sshfs_file *sf, size_t added, size_t removed)
+{
+    int over;
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    if (!sf->dirty_bytes && added)
+        sf->dirty_since = time(NULL);
+    sf->dirty_bytes = sf->dirty_bytes + added - removed;
+    sshfs.dirty_bytes = sshfs.dirty_bytes + added - removed;
+    over = sshfs.dirty_bytes > sshfs.dirty_max;
+    pthread_mutex_unlock(&sshfs.files_lock);
+    return over;
+}
+
+/*
+ * Buffers a write, merged with the buffered writes it overlaps or touches
+ * into one range; with sf->lock held. *over is set if the mount now has
+ * more than -o dirty_max buffered.
+ */
+static int sshfs_dirty_add(struct sshfs_file *sf, const char *buf, size_t size, off_t offset,
+                           int *over)
+{
+    struct sshfs_dirty **link = &sf->dirty, *d, *next;
+    off_t start = offset, end = offset + size;
+    size_t removed = 0;
+    
+    while (*link && (*link)->offset + (off_t)(*link)->size < offset)
+        link = &(*link)->next;
+    for (d = *link; d && d->offset <= end; d = d->next) {
+        if (d->offset < start)
+            start = d->offset;
+        if (d->offset + (off_t)d->size > end)
+            end = d->offset + d->size;
+    }
+    
+    /* Grows the first range if the merged one starts where it does */
+    d = *link;
+    if (d && d->offset == start) {
+        next = d->next;
+        removed += d->size;
+    } else {
+        next = d;
+        d = calloc(1, sizeof(*d));
+        if (!d)
+            return -ENOMEM;
+        d->offset = start;
+    }
+    if ((size_t)(end - start) > d->alloc) {
+        size_t alloc = d->alloc * 2 > (size_t)(end - start) ? d->alloc * 2 : (size_t)(end - start);
+        char *data = realloc(d->data, alloc);
+        if (!data) {
+            if (d != *link)
+                free(d);
+            return -ENOMEM;
+        }
+        d->data = data;
+        d->alloc = alloc;
+    }
+    while (next && next->offset <= end) {
+        struct sshfs_dirty *merged = next;
+        memcpy(d->data + (merged->offset - start), merged->data, merged->size);
+        removed += merged->size;
+        next = merged->next;
+        free(merged->data);
+        free(merged);
+    }
+    memcpy(d->data + (offset - start), buf, size);
+    d->size = end - start;
+    d->next = next;
+    *link = d;
+    *over = sshfs_dirty_account(sf, d->size, removed);
+    return 0;
+}
+
+/* Sends all of sf's buffered writes, which are dropped even if one fails; with sf->lock held */
+static int sshfs_dirty_send(struct sshfs_file *sf)
+{
+    size_t removed = 0;
+    int res = 0;
+    
+    while (sf->dirty) {
+        struct sshfs_dirty *d = sf->dirty;
+        if (res == 0)
+            res = sshfs_write_send(sf, d->data, d->size, d->offset);
+        removed += d->size;
+        sf->dirty = d->next;
+        free(d->data);
+        free(d);
+    }
+    if (removed)
+        sshfs_dirty_account(sf, 0, removed);
+    return res;
+}
+
+/*
+ * Lays the buffered writes over the len bytes read at offset into buf, of
+ * size bytes; returns the new length. Past the end of what was read, the
+ * file reads as zeros up to the last buffered write. With sf->lock held.
+ */
+static size_t sshfs_dirty_overlay(struct sshfs_file *sf, char *buf, size_t size, off_t offset,
+                                  size_t len)
+{
+    struct sshfs_dirty *d;
+    
+    for (d = sf->dirty; d; d = d->next) {
+        off_t start = d->offset > offset ? d->offset : offset;
+        off_t end = d->offset + (off_t)d->size;
+        if (end > offset + (off_t)size)
+            end = offset + size;
+        if (start >= end)
+            continue;
+        if ((size_t)(end - offset) > len) {
+            memset(buf + len, 0, end - offset - len);
+            len = end - offset;
+        }
+        memcpy(buf + (start - offset), d->data + (start - d->offset), end - start);
+    }
+    return len;
+}
+
+/*
+ * Sends what the files open on path other than except have buffered, and
+ * waits for all their writes, so that a read or stat of path sees them; 0,
+ * or -ENOMEM. A failed write is reported by the file that made it, not here.
+ */
+static int sshfs_dirty_sync_path(const char *path, struct sshfs_file *except)
+{
+    struct sshfs_file **bucket = &sshfs.files[sshfs_hash(path) % SSHFS_FILE_BUCKETS];
+    struct sshfs_file **found = NULL, *sf;
+    unsigned int n = 0, i;
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    for (sf = *bucket; sf; sf = sf->hash_next)
+        n += sf != except && strcmp(sf->path, path) == 0;
+    if (n) {
+        found = malloc(n * sizeof(*found));
+        if (!found) {
+            pthread_mutex_unlock(&sshfs.files_lock);
+            return -ENOMEM;
+        }
+        n = 0;
+        for (sf = *bucket; sf; sf = sf->hash_next) {
+            if (sf != except && strcmp(sf->path, path) == 0) {
+                sf->refs++;
+                found[n++] = sf;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sshfs.files_lock);
+    
+    for (i = 0; i < n; i++) {
+        pthread_mutex_lock(&found[i]->lock);
+        sshfs_dirty_send(found[i]);
+        pthread_mutex_unlock(&found[i]->lock);
+        sshfs_writes_wait(found[i]);
+        sshfs_file_put(found[i]);
+    }
+    free(found);
+    return 0;
+}
+
+/* Sends buffered writes once they are SSHFS_WRITEBACK_DELAY old, or all of them over -o dirty_max */
+static void *sshfs_flusher(void *data)
+{
+    (void) data;
+    
+    pthread_mutex_lock(&sshfs.files_lock);
+    while (!sshfs.flusher_stop) {
+        struct timespec deadline = { time(NULL) + 1, 0 };
+        struct sshfs_file *due = NULL, *sf;
+        time_t now = time(NULL);
+        int all = sshfs.dirty_bytes > sshfs.dirty_max;
+        unsigned int i;
+        
+        for (i = 0; i < SSHFS_FILE_BUCKETS && !due; i++) {
+            for (sf = sshfs.files[i]; sf && !due; sf = sf->hash_next) {
+                if (sf->dirty_bytes && (all || now - sf->dirty_since >= SSHFS_WRITEBACK_DELAY))
+                    due = sf;
+            }
+        }
+        if (!due) {
+            pthread_cond_timedwait(&sshfs.files_cond, &sshfs.files_lock, &deadline);
+            continue;
+        }
+        due->refs++;
+        pthread_mutex_unlock(&sshfs.files_lock);
+        /* A failure lands in due->write_error, for its next write, flush or release */
+        pthread_mutex_lock(&due->lock);
+        sshfs_dirty_send(due);
+        pthread_mutex_unlock(&due->lock);
+        sshfs_file_put(due);
+        pthread_mutex_lock(&sshfs.files_lock);
+    }
+    pthread_mutex_unlock(&sshfs.files_lock);
+    return NULL;
+}
+
+static int sshfs_flusher_start(void)
+{
+    if (!sshfs.dirty_max)
+        return 0;
+    if (pthread_create(&sshfs.flusher, NULL, sshfs_flusher, NULL) != 0) {
+        fprintf(stderr, "Error: Can't start the write-back thread\n");
+        return -1;
+    }
+    sshfs.flusher_started = 1;
+    return 0;
+}
+
+static void sshfs_flusher_stop(void)
+{
+    if (!sshfs.flusher_started)
+        return;
+    pthread_mutex_lock(&sshfs.files_lock);
+    sshfs.flusher_stop = 1;
+    pthread_cond_broadcast(&sshfs.files_cond);
+    pthread_mutex_unlock(&sshfs.files_lock);
+    pthread_join(sshfs.flusher, NULL);
+    sshfs.flusher_started = 0;
+}
+
+static uint32_t sftp_open_flags(int flags)
+{
+    uint32_t pflags;
+    
+    switch (flags & O_ACCMODE) {
+    case O_WRONLY:
+        pflags = SSH_FXF_WRITE;
+        break;
+    case O_RDWR:
+        pflags = SSH_FXF_READ | SSH_FXF_WRITE;
+        break;
+    default:
+        pflags = SSH_FXF_READ;
+        break;
+    }
+    if (flags & O_APPEND)
+        pflags |= SSH_FXF_APPEND;
+    if (flags & O_CREAT)
+        pflags |= SSH_FXF_CREAT;
+    if (flags & O_TRUNC)
+        pflags |= SSH_FXF_TRUNC;
+    if (flags & O_EXCL)
+        pflags |= SSH_FXF_EXCL;
+    return pflags;
+}
+
+/* Attribute and directory cache */
+
+/* Seconds on a clock that doesn't jump, for cache deadlines */
+static time_t sshfs_now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Copies the directory path is in to parent, of PATH_MAX bytes */
+static void sshfs_parent(const char *path, char *parent)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash && slash != path ? (size_t)(slash - path) : 1;
+    
+    if (len >= PATH_MAX)
+        len = PATH_MAX - 1;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+}
+
+static struct sshfs_cache_shard *sshfs_cache_shard(unsigned int hash)
+{
+    return &sshfs.cache[hash % SSHFS_CACHE_SHARDS];
+}
+
+static struct sshfs_cache_entry **sshfs_cache_bucket(struct sshfs_cache_shard *shard,
+                                                     unsigned int hash)
+{
+    return &shard->buckets[hash / SSHFS_CACHE_SHARDS % SSHFS_CACHE_BUCKETS];
+}
+
+/* With the shard locked */
+static struct sshfs_cache_entry *sshfs_cache_find(struct sshfs_cache_shard *shard,
+                                                  const char *path, unsigned int hash)
+{
+    struct sshfs_cache_entry *e;
+    
+    for (e = *sshfs_cache_bucket(shard, hash); e; e = e->next) {
+        if (e->hash == hash && strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/* Finds or adds the entry for path; with the shard write-locked */
+static struct sshfs_cache_entry *sshfs_cache_add(struct sshfs_cache_shard *shard,
+                                                 const char *path, unsigned int hash)
+{
+    struct sshfs_cache_entry *e = sshfs_cache_find(shard, path, hash);
+    struct sshfs_cache_entry **bucket = sshfs_cache_bucket(shard, hash);
+    
+    if (e)
+        return e;
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->path = strdup(path);
+    if (!e->path) {
+        free(e);
+        return NULL;
+    }
+    e->hash = hash;
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+static void sshfs_cache_dir_free(struct sshfs_dirent *dir, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        free(dir[i].name);
+    free(dir);
+}
+
+static void sshfs_cache_entry_free(struct sshfs_cache_entry *e)
+{
+    sshfs_cache_dir_free(e->dir, e->dir_count);
+    free(e->path);
+    free(e);
+}
+
+static int sshfs_cache_init(void)
+{
+    if (!sshfs.use_cache || sshfs.cache_timeout <= 0)
+        return 0;
+    sshfs.cache = calloc(SSHFS_CACHE_SHARDS, sizeof(struct sshfs_cache_shard));
+    if (!sshfs.cache) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    for (int i = 0; i < SSHFS_CACHE_SHARDS; i++)
+        pthread_rwlock_init(&sshfs.cache[i].lock, NULL);
+    return 0;
+}
+
+static void sshfs_cache_destroy(void)
+{
+    if (!sshfs.cache)
+        return;
+    for (int i = 0; i < SSHFS_CACHE_SHARDS; i++) {
+        for (int b = 0; b < SSHFS_CACHE_BUCKETS; b++) {
+            while (sshfs.cache[i].buckets[b]) {
+                struct sshfs_cache_entry *e = sshfs.cache[i].buckets[b];
+                sshfs.cache[i].buckets[b] = e->next;
+                sshfs_cache_entry_free(e);
+            }
+        }
+        pthread_rwlock_destroy(&sshfs.cache[i].lock);
+    }
+    free(sshfs.cache);
+    sshfs.cache = NULL;
+}
+
+static int sshfs_dirent_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct sshfs_dirent *)a)->name, ((const struct sshfs_dirent *)b)->name);
+}
+
+/* Taken before asking the server, and handed to the fill with the answer */
+static void sshfs_cache_gen(struct sshfs_cache_gen *gen)
+{
+    if (!sshfs.cache)
+        return;
+    for (int i = 0; i < SSHFS_CACHE_SHARDS; i++)
+        gen->shard[i] = __atomic_load_n(&sshfs.cache[i].gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * 0 with *st filled in, -ENOENT if path is known not to exist, or 1 if
+ * the cache can't tell. Failing an entry of its own, a fresh listing of
+ * the parent tells either. Not counted in the statistics.
+ */
+static int sshfs_cache_lookup_attr(const char *path, struct stat *st)
+{
+    unsigned int hash = sshfs_hash(path);
+    struct sshfs_cache_shard *shard;
+    struct sshfs_cache_entry *e;
+    char parent[PATH_MAX];
+    time_t now = sshfs_now();
+    int res = 1;
+    
+    if (!sshfs.cache)
+        return 1;
+    shard = sshfs_cache_shard(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    e = sshfs_cache_find(shard, path, hash);
+    if (e && e->stat_until > now) {
+        res = e->negative ? -ENOENT : 0;
+        if (res == 0)
+            *st = e->st;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    
+    if (res == 1 && path[1]) {
+        const char *name = strrchr(path, '/') + 1;
+        sshfs_parent(path, parent);
+        hash = sshfs_hash(parent);
+        shard = sshfs_cache_shard(hash);
+        pthread_rwlock_rdlock(&shard->lock);
+        e = sshfs_cache_find(shard, parent, hash);
+        if (e && e->dir_until > now) {
+            struct sshfs_dirent key = { .name = (char *)name };
+            struct sshfs_dirent *d = bsearch(&key, e->dir, e->dir_count, sizeof(key),
+                                             sshfs_dirent_cmp);
+            if (!d) {
+                res = -ENOENT;
+            } else if (!S_ISLNK(d->st.st_mode) || !sshfs.follow_symlinks) {
+                *st = d->st;
+                res = 0;
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return res;
+}
+
+/* sshfs_cache_lookup_attr(), for a stat: counted in the statistics */
+static int sshfs_cache_get_attr(const char *path, struct stat *st)
+{
+    int res = sshfs_cache_lookup_attr(path, st);
     
-    /* SSH/SFTP session handles */
-    LIBSSH2_SESSION *session;
-    LIBSSH2_SFTP *sftp;
-    int sock;
+    if (res == 1)
+        __atomic_add_fetch(&sshfs.stat_misses, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&sshfs.stat_hits, 1, __ATOMIC_RELAXED);
+    if (res == -ENOENT)
+        __atomic_add_fetch(&sshfs.negative_hits, 1, __ATOMIC_RELAXED);
+    return res;
+}
+
+/* Records the attributes of path, or with st NULL that it doesn't exist, unless invalidated since gen */
+static void sshfs_cache_set_attr(const char *path, const struct stat *st,
+                                 const struct sshfs_cache_gen *gen)
+{
+    unsigned int hash = sshfs_hash(path);
+    struct sshfs_cache_shard *shard;
+    struct sshfs_cache_entry *e;
     
-    /* Threading */
-    pthread_mutex_t lock;
+    if (!sshfs.cache)
+        return;
+    /* With -o follow_symlinks, the attributes of a symlink aren't what a stat returns */
+    if (st && S_ISLNK(st->st_mode) && sshfs.follow_symlinks)
+        return;
+    shard = sshfs_cache_shard(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    if (shard->gen == gen->shard[hash % SSHFS_CACHE_SHARDS] &&
+        (e = sshfs_cache_add(shard, path, hash))) {
+        e->negative = !st;
+        if (st)
+            e->st = *st;
+        e->stat_until = sshfs_now() + sshfs.cache_timeout;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/* Calls filler for each name of a fresh listing of path; 1 if there is none */
+static int sshfs_cache_get_dir(const char *path, void *buf, fuse3_fill_dir_t filler, int plus)
+{
+    unsigned int hash = sshfs_hash(path);
+    struct sshfs_cache_shard *shard;
+    struct sshfs_cache_entry *e;
+    int res = 1;
     
-    /* Options */
-    int reconnect;
-    int follow_symlinks;
-    int no_check_root;
-    int debug;
-};
+    if (!sshfs.cache)
+        return 1;
+    shard = sshfs_cache_shard(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    e = sshfs_cache_find(shard, path, hash);
+    if (e && e->dir_until > sshfs_now()) {
+        res = 0;
+        for (size_t i = 0; i < e->dir_count; i++) {
+            if (filler(buf, e->dir[i].name, plus ? &e->dir[i].st : NULL, 0,
+                       plus ? FUSE3_FILL_DIR_PLUS : 0))
+                break;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    __atomic_add_fetch(res ? &sshfs.dir_misses : &sshfs.dir_hits, 1, __ATOMIC_RELAXED);
+    return res;
+}
 
-static struct sshfs sshfs = {
-    .port = 22,
-    .reconnect = 1,
-    .follow_symlinks = 0,
-    .no_check_root = 0,
-    .debug = 0,
-};
+/* Keeps the whole listing of path, unless invalidated since gen; takes over dir */
+static void sshfs_cache_set_dir(const char *path, struct sshfs_dirent *dir, size_t count,
+                                const struct sshfs_cache_gen *gen)
+{
+    unsigned int hash = sshfs_hash(path);
+    struct sshfs_cache_shard *shard;
+    struct sshfs_cache_entry *e = NULL;
+    
+    if (!sshfs.cache) {
+        sshfs_cache_dir_free(dir, count);
+        return;
+    }
+    qsort(dir, count, sizeof(*dir), sshfs_dirent_cmp);
+    shard = sshfs_cache_shard(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    if (shard->gen == gen->shard[hash % SSHFS_CACHE_SHARDS] &&
+        (e = sshfs_cache_add(shard, path, hash))) {
+        sshfs_cache_dir_free(e->dir, e->dir_count);
+        e->dir = dir;
+        e->dir_count = count;
+        e->dir_until = sshfs_now() + sshfs.cache_timeout;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (!e)
+        sshfs_cache_dir_free(dir, count);
+}
 
-/* Helper functions */
-static void sshfs_log(const char *fmt, ...)
+/* Forgets what is known of path, or with dir_only just its listing */
+static void sshfs_cache_forget(const char *path, int dir_only)
 {
-    if (sshfs.debug) {
-        va_list ap;
-        va_start(ap, fmt);
-        fprintf(stderr, "SSHFS_FUSE3: ");
-        vfprintf(stderr, fmt, ap);
-        fprintf(stderr, "\n");
-        va_end(ap);
+    unsigned int hash = sshfs_hash(path);
+    struct sshfs_cache_shard *shard;
+    struct sshfs_cache_entry **link, *e;
+    
+    if (!sshfs.cache)
+        return;
+    shard = sshfs_cache_shard(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    __atomic_add_fetch(&shard->gen, 1, __ATOMIC_RELEASE);
+    for (link = sshfs_cache_bucket(shard, hash); (e = *link); link = &e->next) {
+        if (e->hash != hash || strcmp(e->path, path) != 0)
+            continue;
+        if (dir_only) {
+            sshfs_cache_dir_free(e->dir, e->dir_count);
+            e->dir = NULL;
+            e->dir_count = 0;
+            e->dir_until = 0;
+        } else {
+            *link = e->next;
+            sshfs_cache_entry_free(e);
+        }
+        break;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+/* The contents of path changed: forgets its attributes, and the listing of its parent */
+static void sshfs_cache_invalidate(const char *path)
+{
+    char parent[PATH_MAX];
+    
+    if (!sshfs.cache)
+        return;
+    sshfs_parent(path, parent);
+    sshfs_cache_forget(path, 0);
+    sshfs_cache_forget(parent, 1);
+}
+
+/* path was created or removed: forgets it, and its parent's attributes and listing */
+static void sshfs_cache_invalidate_name(const char *path)
+{
+    char parent[PATH_MAX];
+    
+    if (!sshfs.cache)
+        return;
+    sshfs_parent(path, parent);
+    sshfs_cache_forget(path, 0);
+    sshfs_cache_forget(parent, 0);
+}
+
+/* Forgets everything below the directory path */
+static void sshfs_cache_forget_tree(const char *path)
+{
+    size_t len = strlen(path);
+    
+    for (int i = 0; i < SSHFS_CACHE_SHARDS; i++) {
+        struct sshfs_cache_shard *shard = &sshfs.cache[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        __atomic_add_fetch(&shard->gen, 1, __ATOMIC_RELEASE);
+        for (int b = 0; b < SSHFS_CACHE_BUCKETS; b++) {
+            struct sshfs_cache_entry **link = &shard->buckets[b], *e;
+            while ((e = *link)) {
+                if (strncmp(e->path, path, len) == 0 && e->path[len] == '/') {
+                    *link = e->next;
+                    sshfs_cache_entry_free(e);
+                } else {
+                    link = &e->next;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+/*
+ * 1 if path may be a directory, going by the cache or, if it can't tell,
+ * the server; 0 without asking if there is no cache to keep right
+ */
+static int sshfs_cache_maybe_dir(const char *path)
+{
+    struct sftp_request *req;
+    struct stat st;
+    int res;
+    
+    if (!sshfs.cache)
+        return 0;
+    res = sshfs_cache_lookup_attr(path, &st);
+    if (res != 1)
+        return res == 0 && S_ISDIR(st.st_mode);
+    
+    req = sftp_request_new(SSH_FXP_LSTAT);
+    if (!req)
+        return 1;
+    buf_add_path(&req->msg, path);
+    res = sftp_transact(sftp_conn_get(), req);
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_ATTRS);
+    if (res == 0)
+        res = buf_get_attrs(&req->reply, &st);
+    sftp_request_free(req);
+    /* Unless the server says otherwise, take it for one */
+    return res == 0 ? S_ISDIR(st.st_mode) : res != -ENOENT;
+}
+
+/* from was renamed to to; a directory takes what was cached below it along */
+static void sshfs_cache_invalidate_rename(const char *from, const char *to, int was_dir)
+{
+    if (!sshfs.cache)
+        return;
+    sshfs_cache_invalidate_name(from);
+    sshfs_cache_invalidate_name(to);
+    if (was_dir) {
+        sshfs_cache_forget_tree(from);
+        sshfs_cache_forget_tree(to);
+    }
+}
+
+static void sshfs_cache_report(void)
+{
+    unsigned long hits = __atomic_load_n(&sshfs.stat_hits, __ATOMIC_RELAXED);
+    unsigned long misses = __atomic_load_n(&sshfs.stat_misses, __ATOMIC_RELAXED);
+    unsigned long negative = __atomic_load_n(&sshfs.negative_hits, __ATOMIC_RELAXED);
+    unsigned long dir_hits = __atomic_load_n(&sshfs.dir_hits, __ATOMIC_RELAXED);
+    unsigned long dir_misses = __atomic_load_n(&sshfs.dir_misses, __ATOMIC_RELAXED);
+    
+    fprintf(stderr, "SSHFS cache: stat %lu hits (%lu negative), %lu misses, %.1f%%; "
+            "readdir %lu hits, %lu misses, %.1f%%\n",
+            hits, negative, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+            dir_hits, dir_misses,
+            dir_hits + dir_misses ? 100.0 * dir_hits / (dir_hits + dir_misses) : 0.0);
+}
+
+static volatile sig_atomic_t sshfs_cache_report_pending;
+
+static void sshfs_cache_report_signal(int sig)
+{
+    (void) sig;
+    sshfs_cache_report_pending = 1;
+}
+
+/* Drops expired entries every -o cache_timeout, and reports hit rates on SIGUSR1 */
+static void *sshfs_cache_cleaner(void *data)
+{
+    time_t next_prune = sshfs_now() + sshfs.cache_timeout;
+    
+    (void) data;
+    pthread_mutex_lock(&sshfs.cache_lock);
+    while (!sshfs.cleaner_stop) {
+        struct timespec deadline = { time(NULL) + 1, 0 };
+        time_t now;
+        
+        pthread_cond_timedwait(&sshfs.cache_cond, &sshfs.cache_lock, &deadline);
+        if (sshfs_cache_report_pending) {
+            sshfs_cache_report_pending = 0;
+            sshfs_cache_report();
+        }
+        now = sshfs_now();
+        if (now < next_prune)
+            continue;
+        next_prune = now + sshfs.cache_timeout;
+        for (int i = 0; i < SSHFS_CACHE_SHARDS; i++) {
+            struct sshfs_cache_shard *shard = &sshfs.cache[i];
+            pthread_rwlock_wrlock(&shard->lock);
+            for (int b = 0; b < SSHFS_CACHE_BUCKETS; b++) {
+                struct sshfs_cache_entry **link = &shard->buckets[b], *e;
+                while ((e = *link)) {
+                    if (e->stat_until <= now && e->dir_until <= now) {
+                        *link = e->next;
+                        sshfs_cache_entry_free(e);
+                    } else {
+                        link = &e->next;
+                    }
+                }
+            }
+            pthread_rwlock_unlock(&shard->lock);
+        }
     }
+    pthread_mutex_unlock(&sshfs.cache_lock);
+    return NULL;
 }
 
-/* Simplified SSH connection (for demo purposes) */
-static int sshfs_connect(void)
+static int sshfs_cleaner_start(void)
 {
-    sshfs_log("Connecting to %s@%s:%d", sshfs.username, sshfs.host, sshfs.port);
-    /* In a real implementation, this would establish SSH connection */
+    if (!sshfs.cache)
+        return 0;
+    signal(SIGUSR1, sshfs_cache_report_signal);
+    if (pthread_create(&sshfs.cleaner, NULL, sshfs_cache_cleaner, NULL) != 0) {
+        fprintf(stderr, "Error: Can't start the cache thread\n");
+        return -1;
+    }
+    sshfs.cleaner_started = 1;
     return 0;
 }
 
-static void sshfs_disconnect(void)
+static void sshfs_cleaner_stop(void)
 {
-    sshfs_log("Disconnecting from SSH");
-    /* In a real implementation, this would close SSH connection */
+    if (!sshfs.cleaner_started)
+        return;
+    pthread_mutex_lock(&sshfs.cache_lock);
+    sshfs.cleaner_stop = 1;
+    pthread_cond_broadcast(&sshfs.cache_cond);
+    pthread_mutex_unlock(&sshfs.cache_lock);
+    pthread_join(sshfs.cleaner, NULL);
+    sshfs.cleaner_started = 0;
+    if (sshfs.debug)
+        sshfs_cache_report();
 }
 
 /* FUSE v3 Operations */
@@ -88,33 +2417,49 @@ static void sshfs_disconnect(void)
 static int sshfs_fuse3_getattr(const char *path, struct stat *stbuf,
                                struct fuse3_file_info *fi)
 {
-    (void) fi;
     sshfs_log("getattr: %s", path);
     
-    memset(stbuf, 0, sizeof(struct stat));
+    struct sshfs_file *sf = fi ? sshfs_file(fi) : NULL;
+    struct sshfs_cache_gen gen;
+    struct sftp_request *req;
+    int res;
     
-    /* Root directory */
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        stbuf->st_uid = getuid();
-        stbuf->st_gid = getgid();
-        stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
-        return 0;
+    if (!sf) {
+        res = sshfs_cache_get_attr(path, stbuf);
+        if (res <= 0)
+            return res;
     }
     
-    /* For demo: simulate a few files */
-    if (strcmp(path, "/README.txt") == 0) {
-        stbuf->st_mode = S_IFREG | 0644;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = 50;
-        stbuf->st_uid = getuid();
-        stbuf->st_gid = getgid();
-        stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
-        return 0;
+    /* Once the size takes in the writes buffered and in flight */
+    sshfs_cache_gen(&gen);
+    res = sshfs_dirty_sync_path(path, sf);
+    if (res != 0)
+        return res;
+    if (sf) {
+        pthread_mutex_lock(&sf->lock);
+        sshfs_dirty_send(sf);
+        pthread_mutex_unlock(&sf->lock);
+        sshfs_writes_wait(sf);
+        req = sftp_request_new(SSH_FXP_FSTAT);
+        if (!req)
+            return -ENOMEM;
+        buf_add_handle(&req->msg, &sf->handle);
+        res = sftp_transact(sf->conn, req);
+    } else {
+        req = sftp_request_new(sshfs.follow_symlinks ? SSH_FXP_STAT : SSH_FXP_LSTAT);
+        if (!req)
+            return -ENOMEM;
+        buf_add_path(&req->msg, path);
+        res = sftp_transact(sftp_conn_get(), req);
     }
-    
-    return -ENOENT;
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_ATTRS);
+    if (res == 0)
+        res = buf_get_attrs(&req->reply, stbuf);
+    sftp_request_free(req);
+    if (res == 0 || res == -ENOENT)
+        sshfs_cache_set_attr(path, res == 0 ? stbuf : NULL, &gen);
+    return res;
 }
 
 static int sshfs_fuse3_readdir(const char *path, void *buf, fuse3_fill_dir_t filler,
@@ -123,97 +2468,432 @@ static int sshfs_fuse3_readdir(const char *path, void *buf, fuse3_fill_dir_t fil
 {
     (void) offset;
     (void) fi;
-    (void) flags;
     
     sshfs_log("readdir: %s", path);
     
-    if (strcmp(path, "/") != 0)
-        return -ENOENT;
+    int plus = (flags & FUSE3_READDIR_PLUS) != 0;
+    if (sshfs_cache_get_dir(path, buf, filler, plus) == 0)
+        return 0;
+    
+    struct sftp_conn *conn = sftp_conn_get();
+    struct sftp_handle handle;
+    struct sshfs_cache_gen gen;
+    struct sshfs_dirent *dir = NULL;
+    size_t dir_count = 0, dir_alloc = 0;
+    int full = 0, writing = 0;
+    int res;
+    
+    sshfs_cache_gen(&gen);
+    res = sftp_open_handle(conn, SSH_FXP_OPENDIR, path, 0, 0, &handle);
+    if (res != 0)
+        return res;
+    
+    /* Each SSH_FXP_NAME carries a batch of entries with their attributes, which go in the cache */
+    while (res == 0) {
+        struct sftp_request *req = sftp_request_new(SSH_FXP_READDIR);
+        uint32_t count;
+        if (!req) {
+            res = -ENOMEM;
+            break;
+        }
+        buf_add_handle(&req->msg, &handle);
+        res = sftp_transact(conn, req);
+        if (res == 0)
+            res = sftp_reply_check(req, SSH_FXP_NAME);
+        if (res == 0)
+            res = buf_get_uint32(&req->reply, &count);
+        for (uint32_t i = 0; res == 0 && i < count; i++) {
+            const unsigned char *name, *longname;
+            uint32_t name_len, longname_len;
+            char entry[NAME_MAX + 1];
+            struct stat st;
+            if (buf_get_data(&req->reply, &name, &name_len) != 0 ||
+                buf_get_data(&req->reply, &longname, &longname_len) != 0 ||
+                buf_get_attrs(&req->reply, &st) != 0) {
+                res = -EPROTO;
+                break;
+            }
+            if (name_len > NAME_MAX)
+                continue;
+            memcpy(entry, name, name_len);
+            entry[name_len] = '\0';
+            /* With the cache, the rest is still read once the kernel's buffer is full */
+            if (!full && filler(buf, entry, plus ? &st : NULL, 0, plus ? FUSE3_FILL_DIR_PLUS : 0))
+                full = 1;
+            if (!sshfs.cache) {
+                if (full)
+                    res = -ENOBUFS;
+                continue;
+            }
+            
+            /* The size of a file open for writing may not take in what it has buffered */
+            if (strcmp(entry, ".") != 0 && strcmp(entry, "..") != 0) {
+                char child[PATH_MAX];
+                if (snprintf(child, sizeof(child), "%s/%s", path[1] ? path : "", entry) >=
+                    (int)sizeof(child))
+                    continue;
+                if (sshfs_file_writing(child))
+                    writing = 1;
+                else
+                    sshfs_cache_set_attr(child, &st, &gen);
+            }
+            if (dir_count == dir_alloc) {
+                size_t alloc = dir_alloc ? dir_alloc * 2 : 64;
+                struct sshfs_dirent *grown = realloc(dir, alloc * sizeof(*dir));
+                if (!grown) {
+                    res = -ENOMEM;
+                    break;
+                }
+                dir = grown;
+                dir_alloc = alloc;
+            }
+            dir[dir_count].name = strdup(entry);
+            if (!dir[dir_count].name) {
+                res = -ENOMEM;
+                break;
+            }
+            dir[dir_count++].st = st;
+        }
+        sftp_request_free(req);
+    }
+    sftp_close_handle(conn, &handle);
     
-    filler(buf, ".", NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
-    filler(buf, "README.txt", NULL, 0, 0);
+    if (res == -ENODATA && !writing) {
+        sshfs_cache_set_dir(path, dir, dir_count, &gen);
+        return 0;
+    }
+    sshfs_cache_dir_free(dir, dir_count);
+    return res == -ENODATA || res == -ENOBUFS ? 0 : res;
+}
+
+static int sshfs_file_open(const char *path, int flags, mode_t mode, struct fuse3_file_info *fi)
+{
+    struct sshfs_file *sf = calloc(1, sizeof(struct sshfs_file));
+    int res;
     
+    if (!sf)
+        return -ENOMEM;
+    sf->conn = sftp_conn_get();
+    res = sftp_open_handle(sf->conn, SSH_FXP_OPEN, path, sftp_open_flags(flags), mode, &sf->handle);
+    if (flags & O_CREAT)
+        sshfs_cache_invalidate_name(path);
+    else if (res == 0 && (flags & O_TRUNC))
+        sshfs_cache_invalidate(path);
+    if (res != 0) {
+        free(sf);
+        return res;
+    }
+    sf->path = strdup(path);
+    if (!sf->path) {
+        sftp_close_handle(sf->conn, &sf->handle);
+        free(sf);
+        return -ENOMEM;
+    }
+    sf->writable = (flags & O_ACCMODE) != O_RDONLY;
+    pthread_mutex_init(&sf->lock, NULL);
+    sshfs_file_add(sf);
+    fi->fh = (uintptr_t)sf;
     return 0;
 }
 
 static int sshfs_fuse3_open(const char *path, struct fuse3_file_info *fi)
 {
     sshfs_log("open: %s, flags=0x%x", path, fi->flags);
-    
-    if (strcmp(path, "/README.txt") == 0) {
-        if ((fi->flags & O_ACCMODE) == O_RDONLY) {
-            return 0;
-        }
-        return -EACCES;
-    }
-    
-    return -ENOENT;
+    return sshfs_file_open(path, fi->flags, 0, fi);
 }
 
 static int sshfs_fuse3_read(const char *path, char *buf, size_t size, off_t offset,
                            struct fuse3_file_info *fi)
 {
-    (void) fi;
-    sshfs_log("read: %s, size=%zu, offset=%lld", path, size, offset);
+    struct sshfs_file *sf = sshfs_file(fi);
+    struct sshfs_chunk **link;
+    size_t done = 0;
+    off_t end, want;
+    int res = 0;
+    
+    sshfs_log("read: %s, size=%zu, offset=%lld", path, size, (long long)offset);
+    
+    /* Not sf->path, which a rename may swap out under sshfs.files_lock */
+    res = sshfs_dirty_sync_path(path, sf);
+    if (res != 0)
+        return res;
+    pthread_mutex_lock(&sf->lock);
+    if (__atomic_exchange_n(&sf->chunks_stale, 0, __ATOMIC_ACQUIRE))
+        sshfs_chunks_drop(sf, &sf->chunks);
+    sshfs_readahead_update(sf, offset, size);
+    link = sshfs_chunks_tail(sf, &end);
+    if (end < offset) {
+        sshfs_chunks_drop(sf, &sf->chunks);
+        link = &sf->chunks;
+        end = offset;
+    }
+    /* Keep the window in flight past the end of this read */
+    want = offset + (off_t)(size + sf->window);
+    if (want > end)
+        res = sshfs_chunks_request(sf, link, end, want - end);
     
-    if (strcmp(path, "/README.txt") == 0) {
-        const char *content = "SSHFS with FUSE3 - Connected via eleph-tree layer\n";
-        size_t len = strlen(content);
+    link = &sf->chunks;
+    while (res == 0 && done < size) {
+        off_t pos = offset + done;
+        struct sshfs_chunk *chunk = *link;
+        size_t skip, n;
         
-        if (offset < (off_t)len) {
-            if (offset + size > len)
-                size = len - offset;
-            memcpy(buf, content + offset, size);
-            return size;
+        /* Chunks wholly before pos stay for reads the kernel sent out of order */
+        if (chunk && chunk->offset + (off_t)chunk->size <= pos) {
+            link = &chunk->next;
+            continue;
+        }
+        if (!chunk || chunk->offset > pos) {
+            res = -EIO;
+            break;
+        }
+        if (!chunk->parsed) {
+            if (fuse3_interrupted()) {
+                res = -EINTR;
+                break;
+            }
+            sshfs_chunk_parse(sf, chunk);
+        }
+        if (chunk->res != 0) {
+            res = chunk->res;
+            /* At end of file, or broken: nothing after this chunk is any use */
+            sshfs_chunks_drop(sf, link);
+            break;
+        }
+        if (chunk->offset + (off_t)chunk->size <= pos)
+            continue;  /* shortened by a short read; the rest follows */
+        
+        skip = pos - chunk->offset;
+        n = chunk->size - skip;
+        if (n > size - done)
+            n = size - done;
+        memcpy(buf + done, chunk->data + skip, n);
+        done += n;
+        if (skip + n == chunk->size) {
+            *link = chunk->next;
+            chunk->next = NULL;
+            sshfs_chunks_drop(sf, &chunk);
         }
-        return 0;
     }
+    if (res == -ENODATA)
+        res = 0;
+    /* A read cut short by an error still gets them over what it has, but no further */
+    if (sf->dirty)
+        done = sshfs_dirty_overlay(sf, buf, res == 0 ? size : done, offset, done);
+    sf->next_offset = offset + done;
+    pthread_mutex_unlock(&sf->lock);
+    
+    return done ? (int)done : res;
+}
+
+/*
+ * Sends what sf has buffered and waits for its writes, even if sending one
+ * failed, since they refer to sf; 0, or the error of the first that failed
+ */
+static int sshfs_file_sync(struct sshfs_file *sf)
+{
+    pthread_mutex_lock(&sf->lock);
+    sshfs_dirty_send(sf);
+    pthread_mutex_unlock(&sf->lock);
+    return sshfs_writes_wait(sf);
+}
+
+static int sshfs_fuse3_flush(const char *path, struct fuse3_file_info *fi)
+{
+    sshfs_log("flush: %s", path);
+    return sshfs_file_sync(sshfs_file(fi));
+}
+
+static int sshfs_fuse3_fsync(const char *path, int isdatasync, struct fuse3_file_info *fi)
+{
+    struct sshfs_file *sf = sshfs_file(fi);
+    struct sftp_request *req;
+    int res;
     
-    return -ENOENT;
+    (void) isdatasync;
+    sshfs_log("fsync: %s", path);
+    
+    res = sshfs_file_sync(sf);
+    if (res != 0 || !sf->conn->ext_fsync)
+        return res;
+    req = sftp_request_new(SSH_FXP_EXTENDED);
+    if (!req)
+        return -ENOMEM;
+    buf_add_data(&req->msg, "fsync@openssh.com", 17);
+    buf_add_handle(&req->msg, &sf->handle);
+    res = sftp_transact(sf->conn, req);
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_STATUS);
+    sftp_request_free(req);
+    return res;
+}
+
+static int sshfs_fuse3_release(const char *path, struct fuse3_file_info *fi)
+{
+    struct sshfs_file *sf = sshfs_file(fi);
+    int res;
+    
+    sshfs_log("release: %s", path);
+    sshfs_file_remove(sf);
+    res = sshfs_file_sync(sf);
+    if (sf->writable)
+        sshfs_cache_invalidate(sf->path);
+    sshfs_chunks_drop(sf, &sf->chunks);
+    sftp_close_handle(sf->conn, &sf->handle);
+    pthread_mutex_destroy(&sf->lock);
+    free(sf->path);
+    free(sf);
+    return res;
 }
 
 static int sshfs_fuse3_create(const char *path, mode_t mode,
                              struct fuse3_file_info *fi)
 {
-    (void) fi;
     sshfs_log("create: %s, mode=0%o", path, mode);
-    /* In real implementation, would create file via SFTP */
-    return -ENOSYS;
+    return sshfs_file_open(path, fi->flags | O_CREAT, mode, fi);
 }
 
+/*
+ * Buffers the write, to go out with those next to it as few large requests,
+ * or sends it at once with -o dirty_max=0. Reads on the mount see it either
+ * way: a read through this file lays the buffered writes over what it got,
+ * and reads and stats of the path through anything else send them first.
+ */
 static int sshfs_fuse3_write(const char *path, const char *buf, size_t size,
                             off_t offset, struct fuse3_file_info *fi)
 {
-    (void) path;
-    (void) buf;
-    (void) size;
-    (void) offset;
-    (void) fi;
-    sshfs_log("write: %s, size=%zu, offset=%lld", path, size, offset);
-    /* In real implementation, would write via SFTP */
-    return -ENOSYS;
+    struct sshfs_file *sf = sshfs_file(fi);
+    int over = 0, res;
+    
+    sshfs_log("write: %s, size=%zu, offset=%lld", path, size, (long long)offset);
+    
+    pthread_mutex_lock(&sf->lock);
+    if (!sshfs.dirty_max) {
+        res = sshfs_write_send(sf, buf, size, offset);
+        pthread_mutex_unlock(&sf->lock);
+        sshfs_cache_invalidate(path);
+        return res ? res : (int)size;
+    }
+    pthread_mutex_lock(&sf->conn->lock);
+    res = sf->write_error;
+    pthread_mutex_unlock(&sf->conn->lock);
+    if (res == 0)
+        res = sshfs_dirty_add(sf, buf, size, offset, &over);
+    if (res == 0 && (over || sf->dirty_bytes >= SSHFS_WRITEBACK_FLUSH))
+        res = sshfs_dirty_send(sf);
+    pthread_mutex_unlock(&sf->lock);
+    sshfs_cache_invalidate(path);
+    
+    /* Past the cap: this file's writes went out above, the flusher sends the rest */
+    if (over)
+        pthread_cond_broadcast(&sshfs.files_cond);
+    return res ? res : (int)size;
+}
+
+static int sshfs_fuse3_truncate(const char *path, off_t size, struct fuse3_file_info *fi)
+{
+    struct sshfs_file *sf = fi ? sshfs_file(fi) : NULL;
+    struct sftp_conn *conn = sf ? sf->conn : sftp_conn_get();
+    struct sftp_request *req;
+    int res;
+    
+    sshfs_log("truncate: %s, size=%lld", path, (long long)size);
+    
+    res = sshfs_dirty_sync_path(path, sf);
+    if (res != 0)
+        return res;
+    if (sf) {
+        res = sshfs_file_sync(sf);
+        if (res != 0)
+            return res;
+        pthread_mutex_lock(&sf->lock);
+        sshfs_chunks_drop(sf, &sf->chunks);
+        pthread_mutex_unlock(&sf->lock);
+    }
+    req = sftp_request_new(sf ? SSH_FXP_FSETSTAT : SSH_FXP_SETSTAT);
+    if (!req)
+        return -ENOMEM;
+    if (sf)
+        buf_add_handle(&req->msg, &sf->handle);
+    else
+        buf_add_path(&req->msg, path);
+    buf_add_uint32(&req->msg, SSH_FILEXFER_ATTR_SIZE);
+    buf_add_uint64(&req->msg, size);
+    res = sftp_transact(conn, req);
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_STATUS);
+    sftp_request_free(req);
+    sshfs_files_changed(sf, path);
+    sshfs_cache_invalidate(path);
+    return res;
 }
 
 static int sshfs_fuse3_mkdir(const char *path, mode_t mode)
 {
+    struct stat attrs = { .st_mode = mode };
+    int res;
+    
     sshfs_log("mkdir: %s, mode=0%o", path, mode);
-    /* In real implementation, would create directory via SFTP */
-    return -ENOSYS;
+    res = sftp_path_request(SSH_FXP_MKDIR, path, &attrs);
+    sshfs_cache_invalidate_name(path);
+    return res;
 }
 
 static int sshfs_fuse3_unlink(const char *path)
 {
+    int res;
+    
     sshfs_log("unlink: %s", path);
-    /* In real implementation, would delete file via SFTP */
-    return -ENOSYS;
+    res = sftp_path_request(SSH_FXP_REMOVE, path, NULL);
+    sshfs_cache_invalidate_name(path);
+    return res;
 }
 
 static int sshfs_fuse3_rmdir(const char *path)
 {
+    int res;
+    
     sshfs_log("rmdir: %s", path);
-    /* In real implementation, would remove directory via SFTP */
-    return -ENOSYS;
+    res = sftp_path_request(SSH_FXP_RMDIR, path, NULL);
+    sshfs_cache_invalidate_name(path);
+    return res;
+}
+
+/*
+ * posix-rename@openssh.com replaces an existing target as rename(2) does;
+ * plain SSH_FXP_RENAME fails on one with OpenSSH
+ */
+static int sshfs_fuse3_rename(const char *from, const char *to, unsigned int flags)
+{
+    struct sftp_conn *conn = sftp_conn_get();
+    struct sftp_request *req;
+    int was_dir, res;
+    
+    sshfs_log("rename: %s -> %s", from, to);
+    
+    if (flags)
+        return -EINVAL;
+    was_dir = sshfs_cache_maybe_dir(from);
+    if (conn->ext_posix_rename) {
+        req = sftp_request_new(SSH_FXP_EXTENDED);
+        if (req)
+            buf_add_data(&req->msg, "posix-rename@openssh.com", 24);
+    } else {
+        req = sftp_request_new(SSH_FXP_RENAME);
+    }
+    if (!req)
+        return -ENOMEM;
+    buf_add_path(&req->msg, from);
+    buf_add_path(&req->msg, to);
+    res = sftp_transact(conn, req);
+    if (res == 0)
+        res = sftp_reply_check(req, SSH_FXP_STATUS);
+    sftp_request_free(req);
+    
+    sshfs_cache_invalidate_rename(from, to, was_dir);
+    if (res == 0)
+        sshfs_files_rename(from, to);
+    return res;
 }
 
 static void *sshfs_fuse3_init(struct fuse3_conn_info *conn,
@@ -224,12 +2904,7 @@ static void *sshfs_fuse3_init(struct fuse3_conn_info *conn,
     
     sshfs_log("FUSE3 init");
     
-    /* Initialize SSH connection */
-    if (sshfs_connect() != 0) {
-        fprintf(stderr, "Failed to connect to SSH server\n");
-        return NULL;
-    }
-    
+    /* The connection is made before mounting, so that failures are reported */
     return &sshfs;
 }
 
@@ -237,7 +2912,7 @@ static void sshfs_fuse3_destroy(void *private_data)
 {
     (void) private_data;
     sshfs_log("FUSE3 destroy");
-    sshfs_disconnect();
+    /* The connections are closed by main() once the loop returns */
 }
 
 /* FUSE v3 operations structure */
@@ -248,65 +2923,197 @@ static const struct fuse3_operations sshfs_fuse3_ops = {
     .readdir    = sshfs_fuse3_readdir,
     .open       = sshfs_fuse3_open,
     .read       = sshfs_fuse3_read,
+    .flush      = sshfs_fuse3_flush,
+    .release    = sshfs_fuse3_release,
+    .fsync      = sshfs_fuse3_fsync,
     .create     = sshfs_fuse3_create,
     .write      = sshfs_fuse3_write,
+    .truncate   = sshfs_fuse3_truncate,
     .mkdir      = sshfs_fuse3_mkdir,
     .unlink     = sshfs_fuse3_unlink,
     .rmdir      = sshfs_fuse3_rmdir,
+    .rename     = sshfs_fuse3_rename,
 };
 
 /* Command line options */
 static void usage(const char *progname)
 {
     fprintf(stderr,
-            "Usage: %s [options] user@host:[dir] mountpoint\n"
+            "Usage: %s [options] [user@]host:[dir] mountpoint\n"
             "\n"
             "SSHFS options:\n"
             "    -p PORT            port to connect to (default: 22)\n"
+            "    -o port=PORT       same as -p PORT\n"
             "    -o reconnect       reconnect to server on failure\n"
             "    -o follow_symlinks follow symlinks on the server\n"
             "    -o no_check_root   don't check for existence of 'dir' on server\n"
+            "    -o password_stdin  read the password from stdin\n"
+            "    -o readahead=BYTES most bytes read ahead per open file (default: %d)\n"
+            "    -o connections=N   SFTP sessions to spread requests over (default: %d)\n"
+            "    -o dirty_max=BYTES most bytes of writes buffered per mount (default: %d)\n"
+            "    -o cache=BOOL      cache attributes, listings and missing names (default: yes)\n"
+            "    -o cache_timeout=N seconds a cached entry is good for (default: %d)\n"
+            "    -o directport=PORT speak SFTP over plain TCP to PORT, without SSH\n"
             "    -o debug           enable debug output\n"
             "\n"
             "FUSE options:\n"
             "    -d                 enable debug output (implies -f)\n"
             "    -f                 foreground operation\n"
             "    -s                 disable multi-threaded operation\n"
-            "\n", progname);
+            "\n", progname, SSHFS_DEFAULT_READAHEAD, SSHFS_DEFAULT_CONNECTIONS,
+            SSHFS_DEFAULT_DIRTY_MAX, SSHFS_DEFAULT_CACHE_TIMEOUT);
 }
 
-/* Parse connection string: user@host:path */
+/* Parse connection string: [user@]host:[path] */
 static int parse_connection(const char *str)
 {
-    char *s = strdup(str);
-    char *p;
+    const char *at = strchr(str, '@');
+    const char *host = at ? at + 1 : str;
+    const char *colon = strchr(host, ':');
     
-    /* Extract username */
-    p = strchr(s, '@');
-    if (!p) {
-        fprintf(stderr, "Error: Invalid connection string (missing @)\n");
-        free(s);
+    if (!colon) {
+        fprintf(stderr, "Error: Invalid connection string (missing :)\n");
         return -1;
     }
-    *p = '\0';
-    sshfs.username = strdup(s);
-    s = p + 1;
-    
-    /* Extract host and optional path */
-    p = strchr(s, ':');
-    if (p) {
-        *p = '\0';
-        /* Path after : would be used in real implementation */
+    if (at) {
+        sshfs.username = strndup(str, at - str);
+    } else {
+        const char *user = getenv("USER");
+        sshfs.username = strdup(user ? user : "");
+    }
+    sshfs.host = strndup(host, colon - host);
+    sshfs.base_path = strdup(colon + 1);
+    if (!sshfs.username || !sshfs.host || !sshfs.base_path) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
     }
-    sshfs.host = strdup(s);
+    return 0;
+}
+
+static int parse_size(const char *value, size_t *size)
+{
+    char *end;
+    unsigned long long v = strtoull(value, &end, 10);
     
-    free(s - strlen(sshfs.username) - 1);
+    if (end == value || *end || v > SIZE_MAX)
+        return -1;
+    *size = v;
     return 0;
 }
 
+/* Takes one -o option if it is ours; returns 1 if taken, -1 if malformed */
+static int parse_sshfs_option(const char *opt)
+{
+    if (strcmp(opt, "debug") == 0) {
+        sshfs.debug = 1;
+    } else if (strcmp(opt, "reconnect") == 0) {
+        sshfs.reconnect = 1;
+    } else if (strcmp(opt, "follow_symlinks") == 0) {
+        sshfs.follow_symlinks = 1;
+    } else if (strcmp(opt, "no_check_root") == 0) {
+        sshfs.no_check_root = 1;
+    } else if (strcmp(opt, "password_stdin") == 0) {
+        sshfs.password_stdin = 1;
+    } else if (strncmp(opt, "port=", 5) == 0) {
+        sshfs.port = atoi(opt + 5);
+    } else if (strncmp(opt, "directport=", 11) == 0) {
+        sshfs.directport = atoi(opt + 11);
+    } else if (strncmp(opt, "connections=", 12) == 0) {
+        sshfs.num_conns = atoi(opt + 12);
+        if (sshfs.num_conns < 1 || sshfs.num_conns > SSHFS_MAX_CONNECTIONS)
+            return -1;
+    } else if (strncmp(opt, "readahead=", 10) == 0) {
+        if (parse_size(opt + 10, &sshfs.max_readahead) != 0)
+            return -1;
+    } else if (strcmp(opt, "cache=yes") == 0) {
+        sshfs.use_cache = 1;
+    } else if (strcmp(opt, "cache=no") == 0) {
+        sshfs.use_cache = 0;
+    } else if (strncmp(opt, "cache_timeout=", 14) == 0) {
+        sshfs.cache_timeout = atoi(opt + 14);
+        if (sshfs.cache_timeout < 0)
+            return -1;
+    } else if (strncmp(opt, "dirty_max=", 10) == 0) {
+        if (parse_size(opt + 10, &sshfs.dirty_max) != 0)
+            return -1;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Splits a -o list into our options and the rest, which is appended to
+ * fuse_opts as one -o argument
+ */
+static int parse_option_list(const char *list, char *fuse_opts, size_t size)
+{
+    char *copy = strdup(list);
+    char *opt, *save;
+    int res = 0;
+    
+    if (!copy)
+        return -1;
+    for (opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        int taken = parse_sshfs_option(opt);
+        if (taken < 0) {
+            fprintf(stderr, "Error: Invalid option %s\n", opt);
+            res = -1;
+            break;
+        }
+        if (taken)
+            continue;
+        if (strlen(fuse_opts) + strlen(opt) + 2 > size) {
+            fprintf(stderr, "Error: Too many options\n");
+            res = -1;
+            break;
+        }
+        if (*fuse_opts)
+            strcat(fuse_opts, ",");
+        strcat(fuse_opts, opt);
+    }
+    free(copy);
+    return res;
+}
+
+static int read_password(void)
+{
+    char line[1024];
+    size_t len;
+    
+    if (!fgets(line, sizeof(line), stdin)) {
+        fprintf(stderr, "Error: No password on stdin\n");
+        return -1;
+    }
+    len = strlen(line);
+    if (len && line[len - 1] == '\n')
+        line[len - 1] = '\0';
+    sshfs.password = strdup(line);
+    memset(line, 0, sizeof(line));
+    return sshfs.password ? 0 : -1;
+}
+
+/* Unless -o no_check_root, the remote directory must exist */
+static int check_root(void)
+{
+    struct stat st;
+    int res;
+    
+    if (sshfs.no_check_root)
+        return 0;
+    res = sshfs_fuse3_getattr("/", &st, NULL);
+    if (res == 0 && !S_ISDIR(st.st_mode))
+        res = -ENOTDIR;
+    if (res != 0)
+        fprintf(stderr, "Error: %s:%s: %s\n", sshfs.host, sshfs.base_path, strerror(-res));
+    return res;
+}
+
 int main(int argc, char *argv[])
 {
     struct fuse3_args args = { 0, NULL, 0 };
+    static char fuse_opts[4096];
+    int singlethread = 0;
     int res;
     
     printf("🐘 SSHFS with FUSE3 API (eleph-tree)\n");
@@ -322,42 +3129,60 @@ int main(int argc, char *argv[])
         return 1;
     }
     
-    /* Setup FUSE arguments */
-    args.argc = argc - 1;  /* Remove connection string */
-    args.argv = malloc(sizeof(char*) * args.argc);
-    args.argv[0] = argv[0];
-    for (int i = 1; i < argc - 2; i++) {
-        args.argv[i] = argv[i];
+    /* Setup FUSE arguments: ours are taken out, the rest passed on */
+    args.argv = malloc(sizeof(char *) * (argc + 1));
+    if (!args.argv) {
+        return 1;
     }
-    args.argv[args.argc - 1] = argv[argc - 1];  /* Mount point */
-    
-    /* Parse options */
-    for (int i = 1; i < args.argc - 1; i++) {
-        if (strcmp(args.argv[i], "-d") == 0) {
+    args.argv[args.argc++] = argv[0];
+    for (int i = 1; i < argc - 2; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
             sshfs.debug = 1;
-        } else if (strcmp(args.argv[i], "-o") == 0 && i + 1 < args.argc - 1) {
-            if (strcmp(args.argv[i + 1], "debug") == 0) {
-                sshfs.debug = 1;
-            } else if (strcmp(args.argv[i + 1], "reconnect") == 0) {
-                sshfs.reconnect = 1;
-            } else if (strcmp(args.argv[i + 1], "follow_symlinks") == 0) {
-                sshfs.follow_symlinks = 1;
-            } else if (strcmp(args.argv[i + 1], "no_check_root") == 0) {
-                sshfs.no_check_root = 1;
-            }
-        } else if (strcmp(args.argv[i], "-p") == 0 && i + 1 < args.argc - 1) {
-            sshfs.port = atoi(args.argv[i + 1]);
+            args.argv[args.argc++] = argv[i];
+        } else if (strcmp(argv[i], "-f") == 0) {
+            /* Always runs in the foreground */
+        } else if (strcmp(argv[i], "-s") == 0) {
+            singlethread = 1;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc - 2) {
+            sshfs.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc - 2) {
+            if (parse_option_list(argv[++i], fuse_opts, sizeof(fuse_opts)) != 0)
+                return 1;
+        } else if (strncmp(argv[i], "-o", 2) == 0 && argv[i][2]) {
+            if (parse_option_list(argv[i] + 2, fuse_opts, sizeof(fuse_opts)) != 0)
+                return 1;
+        } else {
+            args.argv[args.argc++] = argv[i];
         }
     }
+    if (*fuse_opts) {
+        args.argv[args.argc++] = "-o";
+        args.argv[args.argc++] = fuse_opts;
+    }
+    
+    if (sshfs.password_stdin && read_password() != 0) {
+        return 1;
+    }
     
-    printf("Connecting to: %s@%s:%d\n", sshfs.username, sshfs.host, sshfs.port);
-    printf("Mount point: %s\n", args.argv[args.argc - 1]);
+    printf("Connecting to: %s@%s:%d\n", sshfs.username, sshfs.host,
+           sshfs.directport ? sshfs.directport : sshfs.port);
+    printf("Mount point: %s\n", argv[argc - 1]);
     
-    /* Initialize mutex */
-    pthread_mutex_init(&sshfs.lock, NULL);
+    /* A lost connection shows up as an error from write(), not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (libssh2_init(0) != 0) {
+        fprintf(stderr, "Failed to initialize libssh2\n");
+        return 1;
+    }
+    if (sshfs_cache_init() != 0 || sshfs_connect_all() != 0 || check_root() != 0 ||
+        sshfs_flusher_start() != 0 || sshfs_cleaner_start() != 0) {
+        res = 1;
+        goto cleanup;
+    }
     
     /* Create FUSE v3 handle */
-    struct fuse3 *fuse = fuse3_new(&args, &sshfs_fuse3_ops, 
+    struct fuse3 *fuse = fuse3_new(&args, &sshfs_fuse3_ops,
                                    sizeof(sshfs_fuse3_ops), &sshfs);
     if (!fuse) {
         fprintf(stderr, "Failed to create FUSE v3 handle\n");
@@ -366,7 +3191,7 @@ int main(int argc, char *argv[])
     }
     
     /* Mount filesystem */
-    if (fuse3_mount(fuse, args.argv[args.argc - 1]) != 0) {
+    if (fuse3_mount(fuse, argv[argc - 1]) != 0) {
         fprintf(stderr, "Failed to mount filesystem\n");
         fuse3_destroy(fuse);
         res = 1;
@@ -375,18 +3200,27 @@ int main(int argc, char *argv[])
     
     printf("\nSSHFS mounted successfully. Press Ctrl+C to unmount.\n");
     
-    /* Run FUSE loop */
-    res = fuse3_loop(fuse);
+    /* Run FUSE loop; -o max_idle_threads went to fuse3_new() */
+    res = singlethread ? fuse3_loop(fuse) : fuse3_loop_mt(fuse, NULL);
     
     /* Cleanup */
     fuse3_unmount(fuse);
     fuse3_destroy(fuse);
-    
+
 cleanup:
-    pthread_mutex_destroy(&sshfs.lock);
+    sshfs_cleaner_stop();
+    sshfs_flusher_stop();
+    sshfs_disconnect_all();
+    sshfs_cache_destroy();
+    libssh2_exit();
+    if (sshfs.password) {
+        memset(sshfs.password, 0, strlen(sshfs.password));
+        free(sshfs.password);
+    }
     free(sshfs.host);
     free(sshfs.username);
+    free(sshfs.base_path);
     free(args.argv);
     
     return res;
-}
\ No newline at end of file
+}
@@ -146,32 +146,54 @@ int main(int argc, char *argv[])
         return 1;
     }
     
+    /* The mount point goes to fuse3_mount(), the options to fuse3_new() */
     struct fuse3_args args = { argc, argv, 0 };
+    struct fuse3_cmdline_opts opts;
+    if (fuse3_parse_cmdline(&args, &opts) != 0 || !opts.mountpoint) {
+        fprintf(stderr, "Usage: %s [options] <mountpoint>\n", argv[0]);
+        fuse3_opt_free_args(&args);
+        return 1;
+    }
     
     printf("Creating FUSE v3 filesystem handle...\n");
     struct fuse3 *fuse = fuse3_new(&args, &sshfs_v3_ops, sizeof(sshfs_v3_ops), NULL);
     if (!fuse) {
         fprintf(stderr, "Failed to create FUSE v3 handle\n");
+        free(opts.mountpoint);
+        fuse3_opt_free_args(&args);
         return 1;
     }
     
-    printf("Mounting SSHFS v3 filesystem at: %s\n", argv[1]);
+    printf("Mounting SSHFS v3 filesystem at: %s\n", opts.mountpoint);
     printf("Files available:\n");
     for (int i = 0; demo_files[i].name; i++) {
         printf("  - %s (%zu bytes)\n", demo_files[i].name, demo_files[i].size);
     }
     printf("\nPress Ctrl+C to unmount\n\n");
     
-    if (fuse3_mount(fuse, argv[1]) != 0) {
+    if (fuse3_mount(fuse, opts.mountpoint) != 0) {
         fprintf(stderr, "Failed to mount filesystem\n");
         fuse3_destroy(fuse);
+        free(opts.mountpoint);
+        fuse3_opt_free_args(&args);
         return 1;
     }
     
-    int ret = fuse3_loop(fuse);
+    int ret;
+    if (opts.singlethread) {
+        ret = fuse3_loop(fuse);
+    } else {
+        struct fuse3_loop_config config = {
+            .clone_fd = opts.clone_fd,
+            .max_idle_threads = opts.max_idle_threads,
+        };
+        ret = fuse3_loop_mt(fuse, &config);
+    }
     
     fuse3_unmount(fuse);
     fuse3_destroy(fuse);
+    free(opts.mountpoint);
+    fuse3_opt_free_args(&args);
     
     printf("SSHFS v3 filesystem unmounted\n");
     return ret;